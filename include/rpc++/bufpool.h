@@ -0,0 +1,125 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace oncrpc {
+
+/// A thread-caching pool of buffers used for message storage. Requests
+/// are rounded up to a power of two size class between MIN_SIZE and
+/// MAX_SIZE. Freed buffers are kept in a small per-thread cache for
+/// each class, overflowing to a shared cache, so that a steady stream
+/// of messages can be handled without calling malloc. Larger requests
+/// are passed directly to malloc.
+class BufferPool
+{
+public:
+    /// Storage for a pooled buffer, which returns the buffer to the pool
+    /// when destroyed
+    typedef std::unique_ptr<uint8_t, std::function<void(uint8_t*)>> Storage;
+
+    struct Stats
+    {
+        uint64_t hits;          // allocations satisfied from a cache
+        uint64_t misses;        // allocations which needed new memory
+        size_t bytesHeld;       // size of all buffers in the caches
+    };
+
+    static constexpr size_t MIN_SIZE = 256;
+    static constexpr size_t MAX_SIZE = 1024*1024;
+    static constexpr int CLASSES = 13;
+
+    /// Size of the chunks carved into buffers when using huge pages
+    static constexpr size_t SLAB_SIZE = 2*1024*1024;
+
+    /// Return the process-wide pool
+    static BufferPool& instance();
+
+    /// Allocate a buffer of at least size bytes
+    Storage allocate(size_t size);
+
+    /// Allocate memory for a small object, e.g. from a class-specific
+    /// operator new. Must be freed using release with the same size.
+    void* allocateRaw(size_t size);
+
+    /// Free memory allocated by allocateRaw
+    void release(void* p, size_t size);
+
+    /// Return the current pool statistics
+    Stats stats() const;
+
+    /// If enabled, new buffers in size classes of at least 64k are
+    /// carved from SLAB_SIZE chunks backed by huge pages where the
+    /// system supports them. Memory used for huge page slabs is never
+    /// returned to the system.
+    void setHugePages(bool enable) { hugePages_ = enable; }
+    bool hugePages() const { return hugePages_; }
+
+    /// Free all buffers in the shared cache and the calling thread's
+    /// cache
+    void trim();
+
+    /// Return the size class for a request or -1 if it is too large to
+    /// pool
+    static int sizeClass(size_t size);
+
+    /// Return the size of buffers in the given class
+    static size_t classSize(int cls) { return MIN_SIZE << cls; }
+
+private:
+    struct ThreadCache;
+
+    struct SharedCache
+    {
+        std::mutex mutex;
+        std::vector<uintptr_t> free;
+    };
+
+    BufferPool();
+
+    uint8_t* get(int cls, bool& slab);
+    void put(uint8_t* p, int cls, bool slab);
+    uint8_t* newSlab(int cls);
+    static ThreadCache& threadCache();
+
+    std::array<SharedCache, CLASSES> shared_;
+    std::atomic<bool> hugePages_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<size_t> bytesHeld_;
+};
+
+}
@@ -28,18 +28,22 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <deque>
+#include <exception>
 #include <functional>
 #include <future>
 #include <string>
 #include <thread>
+#include <typeinfo>
 #include <unordered_map>
 
 #include <rpc++/client.h>
 #include <rpc++/rec.h>
 #include <rpc++/rpcproto.h>
+#include <rpc++/rtt.h>
 #include <rpc++/socket.h>
 #include <rpc++/timeout.h>
 #include <rpc++/xdr.h>
@@ -53,73 +57,43 @@ class RecordWriter;
 class RestChannel;
 class RestRegistry;
 class ServiceRegistry;
+class SocketManagerGroup;
 
-class Message: public XdrMemory
+/// A message buffer used by the channels. Outgoing messages are encoded
+/// into an XdrChain which grows as needed so that messages of any size
+/// can be sent. Incoming messages are received into the first segment
+/// and decoded from the chain's iovec list.
+class Message: public XdrChain, public XdrSource
 {
 public:
     Message(size_t sz);
 
-    size_t writePos() const
-    {
-        return XdrMemory::writePos() + refBytes_;
-    }
-
     /// Reset the message back to empty
     void rewind()
     {
-        refBytes_ = 0;
+        XdrChain::rewind();
         readIndex_ = 0;
         readCursor_ = readLimit_ = nullptr;
-        writeCursor_ = buf_;
-        writeLimit_ = buf_ + size_;
-        iov_.clear();
-        iov_.emplace_back(iovec{writeCursor_, 0});
-        buffers_.clear();
     }
 
-    /// Advance the write cursor. Typically used after reading into the buffer
-    /// from some other source
-    void advanceWrite(size_t sz)
-    {
-        assert(writeCursor_ + sz <= writeLimit_);
-        writeCursor_ += sz;
-    }
+    /// Return true if getBuffer returns buffers added with putBuffer
+    /// without copying them
+    bool shareBuffers() const { return shareBuffers_; }
 
-    auto iov() const { return iov_; }
-
-    void copyTo(XdrSink* xdrs)
-    {
-        int j = 0;
-        auto iovp = &iov_[0];
-        for (int i = 0; i < int(iov_.size()); i++) {
-            if (j < buffers_.size() && buffers_[j]->data() == iovp->iov_base) {
-                xdrs->putBuffer(buffers_[j]);
-                j++;
-            }
-            else if (iovp->iov_base == pad_) {
-                // Skip - putBuffer above handles this
-            }
-            else {
-                xdrs->putBytes(iovp->iov_base, iovp->iov_len);
-            }
-	    iovp++;
-        }
-    }
-
-    // XdrSink overrides
-    void putBuffer(const std::shared_ptr<Buffer>& buf) override;
-    void flush() override;
+    /// If enabled, getBuffer returns buffers added with putBuffer, such
+    /// as shared memory received by UnixChannel, without copying them.
+    /// Otherwise, the decoded buffer never aliases one which was
+    /// encoded into the message.
+    void setShareBuffers(bool enable) { shareBuffers_ = enable; }
 
     // XdrSource overrides
     size_t readSize() const override;
     void fill() override;
+    void getBuffer(std::shared_ptr<Buffer>& buf, size_t size) override;
 
 private:
-    uint8_t pad_[4] = {0,0,0,0};
-    std::vector<iovec> iov_;
-    std::vector<std::shared_ptr<Buffer>> buffers_;
-    size_t refBytes_ = 0;
     int readIndex_ = 0;
+    bool shareBuffers_ = false;
 };
 
 class Channel: public std::enable_shared_from_this<Channel>
@@ -133,6 +107,9 @@ public:
 
     static constexpr int DEFAULT_BUFFER_SIZE = 1500;
 
+    /// Default limit on the size of a record received from a stream
+    static constexpr size_t DEFAULT_MAX_RECORD_SIZE = 16*1024*1024;
+
     /// Helper function for creating and opening channels
     static std::shared_ptr<Channel> open(const AddressInfo& ai);
     static std::shared_ptr<Channel> open(
@@ -162,6 +139,29 @@ public:
         tman_ = tman;
     }
 
+    /// Start an asynchronous remote procedure call. When the call
+    /// completes, the results are decoded using xresults and done is
+    /// called with a null exception_ptr. If the call fails or times
+    /// out, done is called with the error instead. Replies must be
+    /// read by something other than the caller, typically a
+    /// SocketManager which owns the channel, which also runs done.
+    /// Timeouts and retransmits use the channel's TimeoutManager; if
+    /// there is none, the call waits for a reply indefinitely.
+    /// Returns the call's xid which can be passed to cancelCall.
+    virtual uint32_t startCall(
+        Client* client, uint32_t proc,
+        std::function<void(XdrSink*)> xargs,
+        std::function<void(XdrSource*)> xresults,
+        std::function<void(std::exception_ptr)> done,
+        Protection prot = Protection::DEFAULT,
+        clock_type::duration timeout = std::chrono::seconds(30));
+
+    /// Cancel a call started by startCall, freeing its resources. Any
+    /// reply which arrives later is dropped. Returns false if the call
+    /// has already completed, in which case its done callback has been
+    /// or is being called.
+    virtual bool cancelCall(uint32_t xid);
+
     /// Make an asynchronous remote procedure call
     std::future<void> callAsync(
         Client* client, uint32_t proc,
@@ -171,20 +171,58 @@ public:
         clock_type::duration timeout = std::chrono::seconds(30));
 
     /// Make a remote procedure call
-    void call(
+    virtual void call(
         Client* client, uint32_t proc,
         std::function<void(XdrSink*)> xargs,
         std::function<void(XdrSource*)> xresults,
         Protection prot = Protection::DEFAULT,
         clock_type::duration timeout = std::chrono::seconds(30));
 
+    /// One call in a batch made by callBatch
+    struct BatchCall
+    {
+        uint32_t proc;
+        std::function<void(XdrSink*)> xargs;
+        std::function<void(XdrSource*)> xresults;
+        std::exception_ptr error;       // set if the call failed
+    };
+
+    /// Make a batch of remote procedure calls and wait until all of
+    /// them have completed. The calls are registered together and
+    /// passed to sendMessages as a group so that a stream channel can
+    /// write the whole batch with one system call. Unanswered calls are
+    /// retransmitted by the channel's TimeoutManager or, if it has none,
+    /// by the calling thread. Instead of throwing, the outcome of each
+    /// call is stored in its error field.
+    virtual void callBatch(
+        Client* client, std::vector<BatchCall>& calls,
+        Protection prot = Protection::DEFAULT,
+        clock_type::duration timeout = std::chrono::seconds(30));
+
     /// Send a remote procedure call without waiting for a reply. Any
     /// replies which are received will be dropped.
-    void send(
+    virtual void send(
         Client* client, uint32_t proc,
         std::function<void(XdrSink*)> xargs,
         Protection prot = Protection::DEFAULT);
 
+    /// If the service for prog and vers is in this process and has
+    /// registered an implementation of the interface T, return it so
+    /// that the caller can call it directly without encoding any
+    /// messages. Otherwise return nullptr.
+    template <typename T>
+    T* localService(uint32_t prog, uint32_t vers)
+    {
+        return static_cast<T*>(localService(prog, vers, typeid(T)));
+    }
+
+    /// Type-erased version of localService. The default returns nullptr
+    virtual void* localService(
+        uint32_t, uint32_t, const std::type_info&)
+    {
+        return nullptr;
+    }
+
     /// Return a buffer suitable for encoding an outgoing message. When
     /// the message is complete, call sendMessage to send it to the remote
     /// endpoint.
@@ -198,6 +236,11 @@ public:
     /// as for releaseBuffer.
     virtual void sendMessage(std::unique_ptr<XdrSink>&& msg) = 0;
 
+    /// Send several messages to the remote endpoint, in order. The
+    /// default calls sendMessage for each; channels which can write
+    /// them together override this.
+    virtual void sendMessages(std::vector<std::unique_ptr<XdrSink>>&& msgs);
+
     /// Receive an incoming message from the channel. If a message was
     /// received, a buffer containing the message is returned.
     /// This pointer should be released after processing using releaseBuffer.
@@ -215,6 +258,47 @@ public:
     /// Set the channel buffer size
     void setBufferSize(size_t sz) { bufferSize_ = sz; }
 
+    /// Return the largest record accepted from a stream
+    auto maxRecordSize() const { return maxRecordSize_; }
+
+    /// Set the largest record accepted from a stream. Records are
+    /// received into buffers of their own size so, unlike the buffer
+    /// size, this only bounds how much a peer can make us allocate.
+    void setMaxRecordSize(size_t sz) { maxRecordSize_ = sz; }
+
+    /// Return true if the retransmit timeout adapts to measured round
+    /// trip times
+    bool adaptiveRetransmit() const { return adaptiveRetransmit_; }
+
+    /// If enabled, calls are first retransmitted after a timeout
+    /// estimated from the round trip times of earlier calls instead of
+    /// the fixed retransmit interval. Datagram channels enable this by
+    /// default.
+    void setAdaptiveRetransmit(bool enable) { adaptiveRetransmit_ = enable; }
+
+    /// Return round trip time statistics for calls on this channel
+    RttEstimator::Stats rttStats();
+
+    /// Return true if replies are read by a dedicated thread rather
+    /// than by threads making calls
+    bool replyDispatch() const { return replyDispatch_; }
+
+    /// If enabled, threads making calls never read from the channel.
+    /// Instead, replies are read by some other thread, typically the
+    /// SocketManager which owns the channel, which hands each reply
+    /// directly to the waiting caller. Calls on a channel in this mode
+    /// time out unless something else is reading it.
+    void setReplyDispatch(bool enable) { replyDispatch_ = enable; }
+
+    /// Return how long callers wait for a dispatched reply before
+    /// sleeping
+    auto replySpin() const { return replySpin_; }
+
+    /// Set how long callers poll for a dispatched reply before
+    /// sleeping. Spinning avoids a context switch for each reply if
+    /// replies arrive quickly at the cost of burning CPU while waiting.
+    void setReplySpin(clock_type::duration spin) { replySpin_ = spin; }
+
     /// Return the channel's service registry, if any
     std::shared_ptr<ServiceRegistry> serviceRegistry() const
     {
@@ -240,6 +324,8 @@ public:
     virtual AddressInfo remoteAddress() const { return AddressInfo{}; }
 
 protected:
+    /// Return the timeout manager used for asynchronous calls
+    virtual TimeoutManager* timeoutManager() const { return tman_; }
 
     /// Read a message from the channel. If the message is a reply, try to
     /// match it with a pending call transaction and hand off a suitable
@@ -249,6 +335,15 @@ protected:
         Transaction& tx, std::unique_lock<std::mutex>& lock,
         clock_type::duration timeout);
 
+    /// Dispatch a message received from the channel. If the message is a
+    /// reply, try to match it with a pending call transaction and hand off
+    /// the message body to that transaction. Calls are passed to the
+    /// service registry. Called with mutex_ held.
+    void dispatchMessage(
+        Transaction& tx, std::unique_lock<std::mutex>& lock,
+        std::unique_ptr<XdrSource>&& body,
+        std::shared_ptr<Channel> replyChan);
+
     /// Parse a reply message, possibly decoding the reply body. Returns
     /// true if the call is complete, otherwise false if the message should
     /// be re-sent.
@@ -257,7 +352,7 @@ protected:
         int gen, std::function<void(XdrSource*)> xresults);
 
     struct Transaction {
-        enum {
+        enum State {
             SEND,       // sending message
             AUTH,       // possibly asleep performing authentication
             REPLY,      // waiting for some reply message
@@ -268,23 +363,162 @@ protected:
         uint32_t seq = 0;
         bool sleeping = false;
         std::condition_variable cv; // signalled when ready
+        std::atomic<bool> ready{false}; // set when body is received
         clock_type::time_point timeout;
         rpc_msg reply;
         std::unique_ptr<XdrSource> body;
         TimeoutManager::task_type tid = 0;
-        bool async = false;
-        std::packaged_task<void()> continuation;
+
+        // State for calls made by startCall
+        Client* client = nullptr;
+        uint32_t proc = 0;
+        Protection prot = Protection::DEFAULT;
+        int gen = 0;
+        std::function<void(XdrSink*)> xargs;
+        std::function<void(XdrSource*)> xresults;
+        std::function<void(std::exception_ptr)> done;
+        clock_type::time_point maxTime;
+        clock_type::duration retransmitInterval;
+        clock_type::time_point sent;    // first send of this xid
+        bool retransmitted = false;     // sent more than once
+        int refs = 0;           // references to a pooled transaction
+
+        // Maintained by TransactionTable
+        bool pending = false;   // true if in the table
+        Transaction* prevSleeper = nullptr;
+        Transaction* nextSleeper = nullptr;
+    };
+
+    /// In-flight calls indexed by xid. Each channel allocates xids
+    /// sequentially so their low bits index an open-addressed table
+    /// with few collisions and no allocation per call. The table also
+    /// keeps track of transaction states so that Channel::call can
+    /// find a thread to wake without searching.
+    class TransactionTable
+    {
+    public:
+        TransactionTable();
+
+        /// Return the number of transactions in the table
+        size_t size() const { return size_; }
+
+        /// Add a transaction, indexed by its xid, unless some other
+        /// transaction with the same xid is present
+        void insert(Transaction* tx);
+
+        /// Return the transaction with the given xid or nullptr
+        Transaction* find(uint32_t xid) const;
+
+        /// Remove the transaction with the given xid, if any
+        void erase(uint32_t xid);
+
+        /// Change the state of a transaction which may or may not be
+        /// in the table
+        void setState(Transaction& tx, Transaction::State state);
+
+        /// Return the number of transactions whose threads are awake
+        /// waiting for replies
+        int awake() const { return awake_; }
+
+        /// Return a transaction whose thread is sleeping in
+        /// Channel::call, or nullptr if there are none
+        Transaction* sleeper() const { return sleepers_; }
+
+        /// Call fn for each transaction in the table
+        template <typename F>
+        void forEach(F&& fn)
+        {
+            for (auto& slot: slots_)
+                if (slot.tx)
+                    fn(*slot.tx);
+        }
+
+    private:
+        struct Slot
+        {
+            uint32_t xid;
+            Transaction* tx;
+        };
+
+        /// Return the slot for xid, which is empty if it isn't present
+        size_t lookup(uint32_t xid) const;
+
+        /// Re-index the table with the given number of slots
+        void resize(size_t count);
+
+        /// Add or remove tx from the counts of awake and sleeping
+        /// transactions, depending on its state
+        void track(Transaction& tx);
+        void untrack(Transaction& tx);
+
+        std::vector<Slot> slots_;
+        size_t mask_;
+        size_t size_ = 0;
+        int awake_ = 0;
+        Transaction* sleepers_ = nullptr;
     };
 
+    /// Return a transaction from the pool with one reference. Called
+    /// with mutex_ held.
+    Transaction* allocTransaction();
+
+    /// Drop a reference to a pooled transaction, returning it to the
+    /// pool if it was the last. Called with mutex_ held.
+    void releaseTransaction(Transaction* tx);
+
+    /// Assign a new xid to a transaction started by startCall, add it
+    /// to pending_, set its timer and send it, returning the xid. If
+    /// sending fails before the call completes some other way, the
+    /// transaction is removed from pending_ and the error is thrown.
+    uint32_t sendCall(Transaction* tx);
+
+    /// Encode the call message for tx, ready to send. Called with a
+    /// reference to tx held but without mutex_.
+    std::unique_ptr<XdrSink> encodeCall(Transaction* tx);
+
+    /// Encode and send the call message for tx. Called with a
+    /// reference to tx held but without mutex_.
+    void transmitCall(Transaction* tx);
+
+    /// Start the timer for the next retransmit or timeout of tx. Called
+    /// with mutex_ held.
+    void armCallTimer(Transaction* tx);
+
+    /// Called when a call's timer expires to retransmit or time out
+    void onCallTimer(uint32_t xid);
+
+    /// Finish a transaction started by startCall which has been removed
+    /// from pending_, decoding its reply if any and calling its done
+    /// callback
+    void completeCall(Transaction* tx);
+
+    /// If calls are waiting for replies but no thread is awake to read
+    /// them, wake one of the sleepers. Called with mutex_ held.
+    void wakeReader();
+
+    /// Return the interval before a call is first retransmitted. Called
+    /// with mutex_ held.
+    clock_type::duration initialRetransmit(clock_type::duration timeout);
+
+    /// Add the round trip time of a reply to tx, which must have been
+    /// sent only once, to rtt_. Called with mutex_ held.
+    void sampleRtt(const Transaction& tx);
+
     uint32_t xid_;
     size_t bufferSize_ = DEFAULT_BUFFER_SIZE;
+    size_t maxRecordSize_ = DEFAULT_MAX_RECORD_SIZE;
     clock_type::duration retransmitInterval_;
 
     // The mutex serialises access to running_, pending_ and all
     // transactions contained in pending_
     std::mutex mutex_;
     bool running_ = false;      // true if a thread is reading
-    std::unordered_map<uint32_t, Transaction*> pending_; // in-flight calls
+    bool replyDispatch_ = false; // callers never read
+    clock_type::duration replySpin_ = clock_type::duration::zero();
+    bool adaptiveRetransmit_ = false;
+    RttEstimator rtt_;
+    TransactionTable pending_;  // in-flight calls
+    std::vector<std::unique_ptr<Transaction>> freeTransactions_;
     std::weak_ptr<ServiceRegistry> svcreg_;
     TimeoutManager* tman_ = nullptr;  // XXX: observer_ptr
 };
@@ -296,7 +530,23 @@ class LocalChannel: public Channel
 public:
     LocalChannel(std::shared_ptr<ServiceRegistry> svcreg);
 
+    /// Return true if generated stubs may call local implementations
+    /// directly
+    bool directCalls() const { return directCalls_; }
+
+    /// By default, every call is encoded and dispatched through the
+    /// registry, as it would be for a remote service. If directCalls is
+    /// true, generated client stubs call services which have registered
+    /// a local implementation directly, passing arguments and results
+    /// without encoding them. The service's exceptions then reach the
+    /// caller unchanged, and the call skips the registry's
+    /// authentication, filter and executor.
+    void setDirectCalls(bool directCalls) { directCalls_ = directCalls; }
+
     // Channel overrides
+    using Channel::localService;
+    void* localService(
+        uint32_t prog, uint32_t vers, const std::type_info& type) override;
     std::unique_ptr<XdrSink> acquireSendBuffer() override;
     void releaseSendBuffer(std::unique_ptr<XdrSink>&& msg) override;
     void sendMessage(std::unique_ptr<XdrSink>&& msg) override;
@@ -309,7 +559,8 @@ public:
     void processReply();
 
 private:
-    std::deque<std::unique_ptr<XdrMemory>> queue_;
+    std::deque<std::unique_ptr<Message>> queue_;
+    bool directCalls_ = false;
 };
 
 /// Send or receive RPC messages over a socket. Thread safe.
@@ -327,8 +578,15 @@ public:
 
     // Socket overrides
     bool onReadable(SocketManager* sockman) override;
+
+protected:
+    // Channel overrides - use our SocketManager's timers if no other
+    // TimeoutManager was set
+    TimeoutManager* timeoutManager() const override;
 };
 
+struct DatagramReplyChannel;
+
 /// Send or receive RPC messages over a socket. Thread safe.
 class DatagramChannel: public SocketChannel
 {
@@ -336,10 +594,38 @@ public:
     DatagramChannel(int sock);
     DatagramChannel(int sock, std::shared_ptr<ServiceRegistry>);
 
+    /// Largest useful channel buffer size - a datagram can't be bigger
+    /// than this. Buffers this large are useful for loopback traffic or
+    /// networks with jumbo frames
+    static constexpr size_t MAX_DATAGRAM_SIZE = 65536;
+
+    /// Return the number of datagrams read by each system call when
+    /// the channel is served by a SocketManager
+    size_t batchSize() const { return batchSize_; }
+
+    /// If greater than one, each time the socket is readable, drain up
+    /// to this many datagrams with recvmmsg into pooled buffers,
+    /// dispatch them and send the replies made while dispatching with
+    /// a single sendmmsg. Replies sent later, e.g. from a thread pool,
+    /// join the next batch or are sent directly if the socket is idle.
+    void setBatchSize(size_t n);
+
+    /// Default number of reply channels cached for recent peers
+    static constexpr size_t DEFAULT_REPLY_CACHE_SIZE = 256;
+
+    /// Return the number of reply channels cached for recent peers
+    size_t replyCacheSize() const { return replyCacheSize_; }
+
+    /// Set the number of reply channels cached for recent peers. A
+    /// call from a peer with a cached channel is dispatched without
+    /// allocating a new one. Setting this to zero disables the cache.
+    void setReplyCacheSize(size_t n);
+
     // Socket overrides - we allow the channel to be 'connected' to
     // multiple addresses to emulate multicast in environments which
     // don't support it
     void connect(const Address& addr) override;
+    bool onReadable(SocketManager* sockman) override;
 
     // Channel overrides
     std::unique_ptr<XdrSink> acquireSendBuffer() override;
@@ -352,17 +638,44 @@ public:
     AddressInfo remoteAddress() const override;
 
 protected:
+    struct Batch;
+
+    /// Return the state shared with our reply channels, creating it if
+    /// necessary. Called with mutex_ held
+    std::shared_ptr<Batch> sharedState();
+
+    /// Return a channel for sending replies to the given address,
+    /// reusing a cached one if possible. Called with mutex_ held
+    std::shared_ptr<DatagramReplyChannel> replyChannel(const Address& addr);
+
+    /// Receive and dispatch a batch of datagrams, then send any replies
+    void receiveBatch(Transaction& tx, std::unique_lock<std::mutex>& lock);
+
+    /// Send the replies queued in a batch
+    void sendBatch(Batch& batch);
+
+    /// Release msg and throw EMSGSIZE if it is larger than our buffer
+    /// size, since a peer receiving into buffers of that size would
+    /// silently truncate it
+    void checkMessageSize(std::unique_ptr<Message>& msg);
+
     std::vector<Address> remoteAddrs_;
     std::unique_ptr<Message> xdrs_;
+    size_t batchSize_ = 1;
+    std::shared_ptr<Batch> batch_; // buffer pool and queued replies
+    size_t replyCacheSize_ = DEFAULT_REPLY_CACHE_SIZE;
+    std::vector<std::shared_ptr<DatagramReplyChannel>> replyCache_;
 };
 
 struct DatagramReplyChannel: public DatagramChannel
 {
 public:
-    DatagramReplyChannel(int fd_, const Address& addr)
+    DatagramReplyChannel(
+        int fd_, const Address& addr, std::shared_ptr<Batch> batch = nullptr)
         : DatagramChannel(fd_)
     {
         remoteAddrs_.push_back(addr);
+        batch_ = batch;
     }
 
     ~DatagramReplyChannel()
@@ -370,6 +683,14 @@ public:
         // Don't close the socket
         setFd(-1);
     }
+
+    // Channel overrides - if the call was received as part of a batch,
+    // buffers come from the batch's pool and replies are queued until
+    // the batch is finished
+    std::unique_ptr<XdrSink> acquireSendBuffer() override;
+    void releaseSendBuffer(std::unique_ptr<XdrSink>&& msg) override;
+    void sendMessage(std::unique_ptr<XdrSink>&& msg) override;
+    void releaseReceiveBuffer(std::unique_ptr<XdrSource>&& msg) override;
 };
 
 /// Send RPC messages over a connected stream socket. Thread safe.
@@ -385,29 +706,183 @@ public:
 
     ~StreamChannel();
 
+    /// Size of the read-ahead buffer used when reading from a
+    /// SocketManager
+    static constexpr size_t READ_AHEAD = 65536;
+
+    /// Return the limit on queued output before a channel which serves
+    /// calls stops reading new ones
+    size_t sendQueueLimit() const { return sendQueueLimit_; }
+
+    /// Set the limit on queued output. Once more than this many bytes
+    /// of replies are waiting to be written, the channel stops reading
+    /// calls until the backlog falls to half the limit.
+    void setSendQueueLimit(size_t limit) { sendQueueLimit_ = limit; }
+
+    struct WriteStats
+    {
+        uint64_t writes;        // system calls used to write messages
+        uint64_t messages;      // messages written
+    };
+
+    /// Return counts of messages written and the system calls used to
+    /// write them
+    WriteStats writeStats();
+
+    /// Return true if concurrent senders share system calls
+    bool coalesceWrites() const { return coalesceWrites_; }
+
+    /// If enabled, messages sent while an earlier write is still in
+    /// progress are gathered and written together with a single
+    /// writev. This trades a little latency for fewer system calls and
+    /// packets when many threads make small calls on one channel.
+    void setCoalesceWrites(bool enable) { coalesceWrites_ = enable; }
+
     // Socket overrides
     bool onReadable(SocketManager* sockman) override;
+    bool onWritable(SocketManager* sockman) override;
+    std::pair<void*, size_t> readBuffer() override;
+    bool onRead(SocketManager* sockman, ssize_t len) override;
 
     // Channel overrides
     std::unique_ptr<XdrSink> acquireSendBuffer() override;
     void releaseSendBuffer(std::unique_ptr<XdrSink>&& msg) override;
     void sendMessage(std::unique_ptr<XdrSink>&& msg) override;
+    void sendMessages(
+        std::vector<std::unique_ptr<XdrSink>>&& msgs) override;
     std::unique_ptr<XdrSource> receiveMessage(
         std::shared_ptr<Channel>& replyChan,
         clock_type::duration timeout) override;
     void releaseReceiveBuffer(std::unique_ptr<XdrSource>&& msg) override;
     AddressInfo remoteAddress() const override;
 
+protected:
+    /// Return true if writes which can't complete immediately should be
+    /// queued for our SocketManager's event loop to finish rather than
+    /// blocking the caller
+    virtual bool queueWrites() const;
+
+    /// Return true if reads and writes should be performed by our
+    /// SocketManager's io_uring engine rather than synchronously
+    bool asyncIo() const;
+
+    /// Discard any partially received record, e.g. after reconnecting.
+    /// This may be called from any thread: the input is discarded by
+    /// the thread which next reads from the socket.
+    void discardInput();
+
 private:
-    void readAll(void* buf, size_t len);
+    /// Discard buffered input if discardInput was called since the
+    /// last check. Called by the thread which owns running_.
+    void checkDiscard();
+
+    /// Return the buffer for the next read from the socket. When
+    /// reading ahead, this is as much space as is available, otherwise
+    /// it is limited to the rest of the current record marker or
+    /// fragment.
+    std::pair<void*, size_t> nextReadBuffer(bool readAhead);
+
+    /// Account for len bytes read into the buffer returned by
+    /// nextReadBuffer
+    void received(size_t len);
+
+    /// Consume as much buffered input as possible, returning the next
+    /// complete record or nullptr if more data is needed. Throws
+    /// std::system_error if the stream is invalid.
+    std::unique_ptr<XdrSource> parseRecord();
+
+    /// Consume as much buffered input as possible, dispatching any
+    /// complete records
+    void parseRecords();
+
+    /// Stop completion-based reads, waking any threads waiting for
+    /// replies so that one of them can take over reading
+    void stopReading();
+
+    /// Messages gathered for a single write by a thread sending
+    /// synchronously on behalf of others
+    struct WriteBatch
+    {
+        std::vector<std::unique_ptr<Message>> msgs;
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    /// Add the record marker to an encoded message
+    std::unique_ptr<Message> frameMessage(std::unique_ptr<XdrSink>&& xdrs);
+
+    /// Send the messages just added to nextBatch_ synchronously, writing
+    /// any messages from other threads which are queued behind ours in
+    /// the same system call. Called with writeMutex_ held.
+    void sendCoalesced(std::unique_lock<std::mutex>& lock);
+
+    /// Write everything in batch, blocking if necessary, and return
+    /// the number of system calls used
+    size_t writeBatch(const WriteBatch& batch);
+
+    /// Return the unwritten part of the message at the head of sendq_
+    /// and, if coalescing writes or the messages were sent together by
+    /// sendMessages, as many following messages as will fit in one
+    /// writev. Called with writeMutex_ held.
+    std::vector<iovec> pendingIov() const;
+
+    /// Account for one system call writing len bytes from the head of
+    /// sendq_. Called with writeMutex_ held.
+    void wrote(size_t len);
+
+    /// Write as much of sendq_ as possible without blocking. Called with
+    /// writeMutex_ held.
+    void flushQueue();
+
+    /// Ask our SocketManager for write notifications while sendq_ is
+    /// not empty and pause reading if it is too large. Called with
+    /// writeMutex_ held.
+    void updateInterest();
+
+    /// Start writing the message at the head of sendq_ using io_uring.
+    /// Called with writeMutex_ held.
+    void startWrite();
+
+    /// Called when a write started by startWrite completes
+    void onWriteComplete(ssize_t len);
 
     // Optional REST api support
     std::weak_ptr<RestRegistry> restreg_;
     std::shared_ptr<RestChannel> restchan_;
 
-    // Protects sendbuf_ and sender_
+    // Partially received input, only accessed by the thread which
+    // owns running_
+    bool reading_ = false;      // true if io_uring reads own running_
+    bool eventRead_ = false;    // reading from onReadable
+    bool eventReadDone_ = false; // onReadable has already read once
+    bool sawRecord_ = false;    // at least one record marker accepted
+    std::vector<uint8_t> inbuf_;
+    size_t inStart_ = 0;        // first unparsed byte in inbuf_
+    size_t inEnd_ = 0;          // end of valid data in inbuf_
+    std::unique_ptr<XdrMemory> frag_; // partially received fragment
+    size_t fragPos_ = 0;        // bytes of frag_ received so far
+    bool fragLast_ = false;     // frag_ is the last fragment of its record
+    bool directRead_ = false;   // reading directly into frag_
+    std::deque<std::unique_ptr<XdrMemory>> fragments_;
+    size_t recordSize_ = 0;     // size of the fragments in fragments_
+    std::atomic<bool> discard_{false}; // set by discardInput
+
+    // Protects sendbuf_ and the asynchronous send queue
     std::mutex writeMutex_;
     std::unique_ptr<Message> sendbuf_;
+    std::deque<std::unique_ptr<Message>> sendq_;
+    size_t sendOffset_ = 0;     // bytes of sendq_.front() written
+    size_t sendQueued_ = 0;     // unwritten bytes in sendq_
+    size_t sendGather_ = 0;     // head of sendq_ to write together
+    size_t sendQueueLimit_ = 4*1024*1024;
+    bool sending_ = false;      // true if a write is in progress
+    bool writeWanted_ = false;  // waiting for onWritable
+    bool readPaused_ = false;   // not reading because of backpressure
+    int sendError_ = 0;         // errno from a failed write
+    bool coalesceWrites_ = false;
+    std::shared_ptr<WriteBatch> nextBatch_; // waiting for sending_ to clear
+    std::condition_variable batchDone_;
+    WriteStats writeStats_ = {0, 0};
 };
 
 /// A specialisation of StreamChannel which re-connects the channel if The
@@ -427,14 +902,109 @@ public:
     }
 
     // Socket overrides
-    ssize_t send(const std::vector<iovec>& iov) override;
+    ssize_t send(const std::vector<iovec>& iov, int flags = 0) override;
     ssize_t recv(void* buf, size_t buflen) override;
 
+protected:
+    // StreamChannel overrides - reconnecting relies on seeing send
+    // and receive errors synchronously
+    bool queueWrites() const override { return false; }
+
 private:
     AddressInfo addrinfo_;
     std::function<void()> reconnectCallback_;
 };
 
+/// A channel which spreads calls over several connections to the same
+/// endpoint, sending each call to the connection with the fewest calls
+/// in progress. Stream connections made by Channel::open reconnect
+/// independently of each other. After a connection fails to send, it
+/// is avoided for retryDelay unless every connection has failed.
+class PooledChannel: public Channel
+{
+public:
+    static std::chrono::seconds retryDelay;
+
+    /// Open size connections to the given address using Channel::open
+    PooledChannel(const AddressInfo& ai, int size);
+
+    /// Create a pool from existing channels
+    PooledChannel(std::vector<std::shared_ptr<Channel>> members);
+
+    /// Return the channels in the pool, e.g. to add them to a
+    /// SocketManager or set their timeout manager for asynchronous
+    /// calls
+    std::vector<std::shared_ptr<Channel>> members() const;
+
+    /// Return the number of calls in progress on each member
+    std::vector<int> outstanding() const;
+
+    // Channel overrides
+    uint32_t startCall(
+        Client* client, uint32_t proc,
+        std::function<void(XdrSink*)> xargs,
+        std::function<void(XdrSource*)> xresults,
+        std::function<void(std::exception_ptr)> done,
+        Protection prot, clock_type::duration timeout) override;
+    bool cancelCall(uint32_t xid) override;
+    void call(
+        Client* client, uint32_t proc,
+        std::function<void(XdrSink*)> xargs,
+        std::function<void(XdrSource*)> xresults,
+        Protection prot, clock_type::duration timeout) override;
+    void callBatch(
+        Client* client, std::vector<BatchCall>& calls,
+        Protection prot, clock_type::duration timeout) override;
+    void send(
+        Client* client, uint32_t proc,
+        std::function<void(XdrSink*)> xargs,
+        Protection prot) override;
+    void onReconnect(std::function<void()> cb) override;
+    AddressInfo remoteAddress() const override;
+
+    // Messages sent and received directly use the first member
+    std::unique_ptr<XdrSink> acquireSendBuffer() override;
+    void releaseSendBuffer(std::unique_ptr<XdrSink>&& msg) override;
+    void sendMessage(std::unique_ptr<XdrSink>&& msg) override;
+    std::unique_ptr<XdrSource> receiveMessage(
+        std::shared_ptr<Channel>& replyChan,
+        clock_type::duration timeout) override;
+    void releaseReceiveBuffer(std::unique_ptr<XdrSource>&& msg) override;
+
+private:
+    struct Member
+    {
+        std::shared_ptr<Channel> chan;
+        std::atomic<int> outstanding{0};
+        std::atomic<clock_type::rep> retryTime{0}; // avoid until then
+    };
+
+    /// Return the member with the fewest calls in progress, preferring
+    /// members which haven't failed recently, and count a new call
+    /// against it
+    std::shared_ptr<Member> choose(int calls = 1);
+
+    /// Finish counting calls against m. If error is a connection error,
+    /// avoid m for a while.
+    static void finished(
+        Member& m, std::exception_ptr error, int calls = 1);
+
+    /// Calls started by startCall, indexed by the handle returned to the
+    /// caller, with the member making each call and its xid there.
+    /// Shared with the calls' done callbacks, which remove their entries.
+    struct CallTable
+    {
+        std::mutex mutex;
+        uint32_t next = 0;
+        std::unordered_map<
+            uint32_t, std::pair<std::shared_ptr<Member>, uint32_t>> calls;
+    };
+
+    std::vector<std::shared_ptr<Member>> members_;
+    std::atomic<unsigned> next_{0}; // spreads ties between members
+    std::shared_ptr<CallTable> calls_ = std::make_shared<CallTable>();
+};
+
 /// Accept incoming connections to a socket and create instances of
 /// StreamChannel for each new connection.
 class ListenSocket: public Socket
@@ -456,18 +1026,36 @@ public:
     {
     }
 
+    /// Create a listening socket bound to the given address for each
+    /// manager in the group, using SO_REUSEPORT so that the kernel
+    /// spreads incoming connections over the group's event loops. If
+    /// the address has a zero port, all the sockets share the port
+    /// chosen for the first one.
+    static std::vector<std::shared_ptr<ListenSocket>> listenGroup(
+        SocketManagerGroup& group, const AddressInfo& ai,
+        std::shared_ptr<ServiceRegistry> svcreg,
+        std::shared_ptr<RestRegistry> restreg = nullptr);
+
     /// Return the buffer size for new channels
     auto bufferSize() const { return bufferSize_; }
 
     /// Set the channel buffer size for new channels
     void setBufferSize(size_t sz) { bufferSize_ = sz; }
 
+    /// Hand new connections to the managers in group in round-robin
+    /// order rather than to the manager which owns this socket
+    void setGroup(std::shared_ptr<SocketManagerGroup> group)
+    {
+        group_ = group;
+    }
+
     // Socket overrides
     bool onReadable(SocketManager* sockman) override;
 
 private:
     std::weak_ptr<ServiceRegistry> svcreg_;
     std::weak_ptr<RestRegistry> restreg_;
+    std::weak_ptr<SocketManagerGroup> group_;
     size_t bufferSize_ = Channel::DEFAULT_BUFFER_SIZE;
 };
 
@@ -0,0 +1,266 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+// Coroutine support requires C++20. The rest of the library builds as
+// C++14 so this header is empty for older language modes.
+#if __cplusplus > 201703L && __has_include(<coroutine>)
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include <rpc++/channel.h>
+
+namespace oncrpc {
+
+template <typename T> class Task;
+
+namespace _detail {
+
+class TaskPromiseBase
+{
+public:
+    /// Resume whatever is awaiting the task, if anything. A detached
+    /// task destroys itself.
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<P> h) noexcept
+        {
+            auto& p = h.promise();
+            if (p.continuation_)
+                return p.continuation_;
+            if (p.detached_) {
+                // Nothing can observe the exception of a detached task
+                if (p.error_)
+                    std::terminate();
+                h.destroy();
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error_ = std::current_exception(); }
+
+    std::coroutine_handle<> continuation_;
+    bool detached_ = false;
+    std::exception_ptr error_;
+};
+
+template <typename T>
+class TaskPromise: public TaskPromiseBase
+{
+public:
+    Task<T> get_return_object();
+
+    template <typename U>
+    void return_value(U&& value)
+    {
+        value_.emplace(std::forward<U>(value));
+    }
+
+    T result()
+    {
+        if (error_)
+            std::rethrow_exception(error_);
+        return std::move(*value_);
+    }
+
+private:
+    std::optional<T> value_;
+};
+
+template <>
+class TaskPromise<void>: public TaskPromiseBase
+{
+public:
+    Task<void> get_return_object();
+
+    void return_void() {}
+
+    void result()
+    {
+        if (error_)
+            std::rethrow_exception(error_);
+    }
+};
+
+}
+
+/// A coroutine returning a value of type T. Tasks start suspended and
+/// run when they are awaited or passed to spawn. As with any coroutine,
+/// arguments passed by reference must outlive the task.
+template <typename T = void>
+class Task
+{
+public:
+    using promise_type = _detail::TaskPromise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit Task(handle_type h)
+        : h_(h)
+    {
+    }
+
+    Task(Task&& other)
+        : h_(std::exchange(other.h_, nullptr))
+    {
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont)
+    {
+        h_.promise().continuation_ = cont;
+        return h_;
+    }
+
+    T await_resume()
+    {
+        return h_.promise().result();
+    }
+
+    /// Start the task without waiting for it. The task frees itself
+    /// when it finishes; an exception escaping from it terminates the
+    /// program.
+    void detach() &&
+    {
+        auto h = std::exchange(h_, nullptr);
+        h.promise().detached_ = true;
+        h.resume();
+    }
+
+private:
+    handle_type h_;
+};
+
+template <typename T>
+Task<T> _detail::TaskPromise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> _detail::TaskPromise<void>::get_return_object()
+{
+    return Task<void>(
+        std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/// Run a task in the calling thread until its first suspension, leaving
+/// it to finish in whichever thread resumes it
+inline void spawn(Task<void>&& task)
+{
+    std::move(task).detach();
+}
+
+/// Awaitable remote procedure call using Channel::startCall. The
+/// awaiting coroutine is suspended until the call completes and is
+/// resumed by the thread which completes it, typically the channel's
+/// SocketManager. Awaiting the result throws if the call failed.
+class CallAwaiter
+{
+public:
+    CallAwaiter(
+        std::shared_ptr<Channel> chan,
+        Client* client, uint32_t proc,
+        std::function<void(XdrSink*)> xargs,
+        std::function<void(XdrSource*)> xresults,
+        Protection prot = Protection::DEFAULT,
+        Channel::clock_type::duration timeout = std::chrono::seconds(30))
+        : chan_(std::move(chan)),
+          client_(client),
+          proc_(proc),
+          xargs_(std::move(xargs)),
+          xresults_(std::move(xresults)),
+          prot_(prot),
+          timeout_(timeout)
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        // The reply may arrive in another thread before startCall
+        // returns. Whichever of the two finishes second resumes the
+        // coroutine, or avoids suspending it at all.
+        handle_ = h;
+        chan_->startCall(
+            client_, proc_, std::move(xargs_), std::move(xresults_),
+            [this](std::exception_ptr error) {
+                error_ = error;
+                if (done_.exchange(true, std::memory_order_acq_rel))
+                    handle_.resume();
+            },
+            prot_, timeout_);
+        return !done_.exchange(true, std::memory_order_acq_rel);
+    }
+
+    void await_resume()
+    {
+        if (error_)
+            std::rethrow_exception(error_);
+    }
+
+private:
+    std::shared_ptr<Channel> chan_;
+    Client* client_;
+    uint32_t proc_;
+    std::function<void(XdrSink*)> xargs_;
+    std::function<void(XdrSource*)> xresults_;
+    Protection prot_;
+    Channel::clock_type::duration timeout_;
+    std::coroutine_handle<> handle_;
+    std::exception_ptr error_;
+    std::atomic<bool> done_ = false;
+};
+
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace oncrpc {
+
+/// An interface for running work such as service handlers
+class Executor
+{
+public:
+    virtual ~Executor() {}
+
+    /// Arrange for fn to be called, possibly in some other thread
+    virtual void execute(std::function<void()>&& fn) = 0;
+};
+
+/// An executor which calls functions immediately in the calling thread
+class InlineExecutor: public Executor
+{
+public:
+    // Executor overrides
+    void execute(std::function<void()>&& fn) override
+    {
+        fn();
+    }
+};
+
+/// A pool of worker threads, each with its own queue of work. Work
+/// submitted from outside the pool is distributed over the queues in
+/// round-robin order. Work submitted by a worker goes to its own queue.
+/// Idle workers steal work from the other queues so that one slow
+/// function only delays the work queued behind it until another worker
+/// becomes free.
+class ThreadPoolExecutor: public Executor
+{
+public:
+    /// Create a pool with the given number of threads. If count is zero,
+    /// one thread is created for each CPU.
+    ThreadPoolExecutor(int count = 0);
+
+    /// Finish any queued work and stop the worker threads
+    ~ThreadPoolExecutor();
+
+    /// Return the number of worker threads
+    int size() const { return int(workers_.size()); }
+
+    // Executor overrides
+    void execute(std::function<void()>&& fn) override;
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> queue;
+        std::thread thread;
+    };
+
+    /// Main loop for worker index
+    void run(int index);
+
+    /// Take a function from the queue for worker index, returning false
+    /// if it is empty
+    bool take(int index, std::function<void()>& fn);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<unsigned> next_;
+    std::atomic<int> pending_;  // queued functions, over all workers
+    std::atomic<int> idle_;     // workers waiting for cv_
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+};
+
+}
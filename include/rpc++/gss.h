@@ -130,14 +130,12 @@ template <typename F>
 static std::vector<uint8_t>
 _encapsulateBody(const uint32_t seq, F&& xbody)
 {
-    XdrSizer xsz;
-    xdr(seq, &xsz);
-    xbody(&xsz);
-    std::vector<uint8_t> body(xsz.size());
-    XdrMemory xm(body.data(), body.size());
-    xdr(seq, &xm);
-    xbody(&xm);
-    return body;
+    // The body is an opaque callback so it can't be sized without
+    // encoding it - encode it once into a buffer which grows as needed
+    XdrVector xv;
+    xdr(seq, &xv);
+    xbody(&xv);
+    return xv.release();
 }
 
 /// Encode a message body given the RPCSEC_GSS service and sequence
@@ -0,0 +1,88 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace oncrpc {
+
+/// Estimate the round trip time of a channel and a retransmit timeout
+/// from it, using the method of RFC 6298 (Jacobson/Karels). Samples
+/// should only be taken from calls which were sent once since a reply
+/// to a retransmitted call can't be matched to a particular send
+/// (Karn's rule). Not thread safe.
+class RttEstimator
+{
+public:
+    typedef std::chrono::microseconds duration;
+
+    struct Stats
+    {
+        duration srtt;          // smoothed round trip time
+        duration rttvar;        // round trip time variation
+        duration timeout;       // current retransmit timeout
+        uint64_t samples;       // round trip times measured
+        uint64_t backoffs;      // retransmit timeouts expired
+    };
+
+    /// Create an estimator which returns initial until the first sample
+    /// and keeps its timeout between minTimeout and maxTimeout
+    RttEstimator(
+        duration initial = std::chrono::seconds(1),
+        duration minTimeout = std::chrono::milliseconds(20),
+        duration maxTimeout = std::chrono::seconds(30));
+
+    /// Add a round trip time measurement
+    void sample(duration rtt);
+
+    /// Double the timeout after a retransmit timer expires. The timeout
+    /// stays backed off until the next sample.
+    void backoff();
+
+    /// Return the current retransmit timeout
+    duration timeout() const;
+
+    /// Change the limits on the retransmit timeout
+    void setLimits(duration minTimeout, duration maxTimeout);
+
+    Stats stats() const;
+
+private:
+    duration initial_;
+    duration min_;
+    duration max_;
+    duration srtt_ = duration::zero();
+    duration rttvar_ = duration::zero();
+    int shift_ = 0;             // backoffs since the last sample
+    uint64_t samples_ = 0;
+    uint64_t backoffs_ = 0;
+};
+
+}
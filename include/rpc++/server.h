@@ -41,6 +41,7 @@
 #include <rpc++/channel.h>
 #include <rpc++/cred.h>
 #include <rpc++/errors.h>
+#include <rpc++/executor.h>
 #include <rpc++/gss.h>
 
 namespace std {
@@ -177,6 +178,9 @@ public:
 
     ~CallContext();
 
+    /// Return the context of the call being dispatched by the calling
+    /// thread. A coroutine handler can only use this before it first
+    /// suspends.
     static CallContext& current()
     {
 #ifdef __APPLE__
@@ -322,6 +326,26 @@ public:
     /// Look up a service handler for the given program and version
     const Service lookup(uint32_t prog, uint32_t vers) const;
 
+    /// Register an object implementing the typed interface T for the
+    /// given program and version. A LocalChannel using this registry
+    /// will hand it to client stubs for T, which call it directly. The
+    /// object must stay valid until it is removed with remove.
+    template <typename T>
+    void addLocal(uint32_t prog, uint32_t vers, T* impl)
+    {
+        addLocal(prog, vers, typeid(T), impl);
+    }
+
+    /// Type-erased version of addLocal
+    void addLocal(
+        uint32_t prog, uint32_t vers, const std::type_info& type, void* impl);
+
+    /// Return the object registered with addLocal for the given program
+    /// and version if it implements the interface with the given type,
+    /// otherwise nullptr
+    void* lookupLocal(
+        uint32_t prog, uint32_t vers, const std::type_info& type) const;
+
     /// Process an RPC message and possibly dispatch to a suitable handler
     void process(CallContext&& ctx);
 
@@ -349,17 +373,53 @@ public:
         filter_ = filter;
     }
 
+    /// Set the executor used to run service handlers. By default,
+    /// handlers run in the thread which received the call. The registry
+    /// must outlive any calls it has passed to the executor.
+    void setExecutor(std::shared_ptr<Executor> executor)
+    {
+        executor_ = executor;
+    }
+
+    /// If ordered is true, calls received on the same channel are run
+    /// one at a time in the order they arrived, even if the executor has
+    /// several threads. Calls on different channels may still run
+    /// concurrently.
+    void setOrdered(bool ordered)
+    {
+        ordered_ = ordered;
+    }
+
 private:
     bool validateAuth(CallContext& ctx);
 
+    /// Run the next queued call for an ordered channel, re-submitting
+    /// to the executor if there are more
+    void runOrdered(Channel* chan);
+
     mutable std::mutex mutex_;
     std::chrono::system_clock::duration clientLifetime_;
     std::unordered_map<uint32_t, std::unordered_set<uint32_t>> programs_;
     std::unordered_map<std::pair<uint32_t, uint32_t>, Service> services_;
+    struct LocalService
+    {
+        const std::type_info* type;
+        void* impl;
+    };
+    std::unordered_map<
+        std::pair<uint32_t, uint32_t>, LocalService> localServices_;
     std::unordered_map<
         uint32_t, std::shared_ptr<_detail::GssClientContext>> clients_;
     std::unordered_map<std::string, std::shared_ptr<CredMapper>> credmap_;
     std::shared_ptr<Filter> filter_;
+    std::shared_ptr<Executor> executor_;
+    bool ordered_ = false;
+
+    // Calls waiting for ordered channels. The call at the front of each
+    // queue is the one running or waiting to run.
+    std::mutex orderMutex_;
+    std::unordered_map<
+        Channel*, std::deque<std::unique_ptr<CallContext>>> orderQueues_;
 };
 
 }
@@ -0,0 +1,271 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <rpc++/channel.h>
+
+namespace oncrpc {
+
+namespace _detail {
+struct ShmRing;
+}
+
+/// Send RPC messages to a process on the same host through a pair of
+/// single-producer, single-consumer rings in a shared memory mapping,
+/// avoiding a system call for each message when both sides are busy.
+///
+/// The mapping is set up over a connected unix domain socket, which is
+/// closed once the rings are ready. Each side has a doorbell (an eventfd
+/// where available, otherwise a pipe) which the other side rings only
+/// when the reader has stopped polling its ring. The doorbell is the
+/// channel's file descriptor so that it can be served by a
+/// SocketManager. A reader which finds its ring empty polls it for a
+/// short time before waiting on the doorbell. The polling time adapts
+/// to how quickly messages have been arriving. Thread safe.
+///
+/// The channel can't tell if the peer has exited, so calls to a dead
+/// peer time out. Servers should use setCloseOnIdle.
+class ShmChannel: public SocketChannel
+{
+public:
+    /// Default size of each ring
+    static constexpr size_t DEFAULT_RING_SIZE = 1024*1024;
+
+    /// Default maximum time to poll an empty ring
+    static constexpr std::chrono::microseconds DEFAULT_MAX_SPIN{50};
+
+    /// Set up the rings using the connected unix domain socket sock,
+    /// which is closed when this returns. One side of the connection
+    /// (typically the server) must pass create=true, which makes the
+    /// shared mapping and sends it to the peer. The other side passes
+    /// create=false and waits for the mapping. The ring size is the
+    /// capacity of each ring in bytes, rounded up to a power of two.
+    ShmChannel(
+        int sock, bool create,
+        std::shared_ptr<ServiceRegistry> svcreg = nullptr,
+        size_t ringSize = DEFAULT_RING_SIZE);
+
+    ~ShmChannel();
+
+    /// Connect to a ShmListenSocket listening on the unix domain socket
+    /// at path
+    static std::shared_ptr<ShmChannel> open(
+        const std::string& path,
+        std::shared_ptr<ServiceRegistry> svcreg = nullptr);
+
+    /// Return the capacity of each ring in bytes
+    size_t ringSize() const { return ringSize_; }
+
+    /// Return the maximum time spent polling an empty ring
+    auto maxSpin() const { return maxSpin_; }
+
+    /// Set the maximum time spent polling an empty ring before waiting
+    /// for the doorbell. Zero disables polling.
+    void setMaxSpin(std::chrono::microseconds spin)
+    {
+        maxSpin_ = spin;
+        spin_ = spin;
+    }
+
+    // Socket overrides
+    bool onReadable(SocketManager* sockman) override;
+
+    // Channel overrides
+    std::unique_ptr<XdrSink> acquireSendBuffer() override;
+    void releaseSendBuffer(std::unique_ptr<XdrSink>&& msg) override;
+    void sendMessage(std::unique_ptr<XdrSink>&& msg) override;
+    std::unique_ptr<XdrSource> receiveMessage(
+        std::shared_ptr<Channel>& replyChan,
+        clock_type::duration timeout) override;
+    void releaseReceiveBuffer(std::unique_ptr<XdrSource>&& msg) override;
+
+private:
+    /// Make the shared mapping and doorbells and send them to the peer
+    void create(int sock, size_t ringSize);
+
+    /// Receive the shared mapping and doorbells from the peer
+    void attach(int sock);
+
+    /// Map the shared memory in fd and locate our rings
+    void map(int fd, size_t size, bool creator);
+
+    /// Release the mapping and doorbells
+    void unmap();
+
+    /// Copy the next message from our receive ring, if any
+    std::unique_ptr<Message> takeMessage();
+
+    void* map_ = nullptr;               // shared mapping
+    size_t mapSize_ = 0;
+    size_t ringSize_ = 0;
+    _detail::ShmRing* sendRing_ = nullptr;
+    _detail::ShmRing* recvRing_ = nullptr;
+    uint8_t* sendData_ = nullptr;
+    uint8_t* recvData_ = nullptr;
+    int selfBell_ = -1;                 // rings our own doorbell
+    int peerBell_ = -1;                 // rings the peer's doorbell
+    std::mutex sendMutex_;              // serialises writes to sendRing_
+    std::unique_ptr<Message> xdrs_;
+    bool draining_ = false;             // true while in onReadable
+    std::chrono::microseconds maxSpin_ = DEFAULT_MAX_SPIN;
+    std::chrono::microseconds spin_ = DEFAULT_MAX_SPIN;
+};
+
+/// Accept connections to a unix domain socket and create an instance of
+/// ShmChannel for each one
+class ShmListenSocket: public Socket
+{
+public:
+    ShmListenSocket(int fd, std::shared_ptr<ServiceRegistry> svcreg)
+        : Socket(fd),
+          svcreg_(svcreg)
+    {
+    }
+
+    /// Return the buffer size for new channels
+    auto bufferSize() const { return bufferSize_; }
+
+    /// Set the channel buffer size for new channels
+    void setBufferSize(size_t sz) { bufferSize_ = sz; }
+
+    /// Return the ring size for new channels
+    auto ringSize() const { return ringSize_; }
+
+    /// Set the ring size for new channels
+    void setRingSize(size_t sz) { ringSize_ = sz; }
+
+    // Socket overrides
+    bool onReadable(SocketManager* sockman) override;
+
+private:
+    std::weak_ptr<ServiceRegistry> svcreg_;
+    size_t bufferSize_ = Channel::DEFAULT_BUFFER_SIZE;
+    size_t ringSize_ = ShmChannel::DEFAULT_RING_SIZE;
+};
+
+/// Send RPC messages over a connected unix domain stream socket. Large
+/// buffers encoded with putBuffer are not copied through the socket.
+/// Instead each one is passed to the peer as a shared memory object
+/// using SCM_RIGHTS, next to the rest of the message, and the peer
+/// maps it when the message is decoded. Buffers made by allocateBuffer
+/// are already in shared memory and are passed without copying. Both
+/// sides of the connection must use UnixChannel. Thread safe.
+class UnixChannel: public SocketChannel
+{
+public:
+    /// Default size from which buffers are passed as shared memory
+    static constexpr size_t DEFAULT_BULK_THRESHOLD = 64*1024;
+
+    /// Largest number of buffers passed as shared memory with one
+    /// message. Any others are copied through the socket.
+    static constexpr size_t MAX_BULK_BUFFERS = 16;
+
+    UnixChannel(int sock, std::shared_ptr<ServiceRegistry> svcreg = nullptr);
+
+    ~UnixChannel();
+
+    /// Connect to a UnixListenSocket listening on the unix domain
+    /// socket at path
+    static std::shared_ptr<UnixChannel> open(
+        const std::string& path,
+        std::shared_ptr<ServiceRegistry> svcreg = nullptr);
+
+    /// Allocate a buffer in shared memory which can be sent to a peer
+    /// without copying. The peer sees a private copy-on-write mapping
+    /// of the contents so the buffer should not be changed after it is
+    /// sent.
+    static std::shared_ptr<Buffer> allocateBuffer(size_t size);
+
+    /// Return the size from which buffers are passed as shared memory
+    size_t bulkThreshold() const { return bulkThreshold_; }
+
+    /// Set the size from which buffers are passed as shared memory
+    /// rather than copied through the socket
+    void setBulkThreshold(size_t sz) { bulkThreshold_ = sz; }
+
+    // Channel overrides
+    std::unique_ptr<XdrSink> acquireSendBuffer() override;
+    void releaseSendBuffer(std::unique_ptr<XdrSink>&& msg) override;
+    void sendMessage(std::unique_ptr<XdrSink>&& msg) override;
+    std::unique_ptr<XdrSource> receiveMessage(
+        std::shared_ptr<Channel>& replyChan,
+        clock_type::duration timeout) override;
+    void releaseReceiveBuffer(std::unique_ptr<XdrSource>&& msg) override;
+
+private:
+    /// Read exactly len bytes from the socket, keeping any descriptors
+    /// which arrive with them in fds_
+    void readFully(void* p, size_t len);
+
+    std::mutex sendMutex_;              // serialises writes to the socket
+    std::unique_ptr<Message> xdrs_;
+    std::vector<int> fds_;              // received, not yet claimed
+    size_t bulkThreshold_ = DEFAULT_BULK_THRESHOLD;
+};
+
+/// Accept connections to a unix domain socket and create an instance of
+/// UnixChannel for each one
+class UnixListenSocket: public Socket
+{
+public:
+    UnixListenSocket(int fd, std::shared_ptr<ServiceRegistry> svcreg)
+        : Socket(fd),
+          svcreg_(svcreg)
+    {
+    }
+
+    /// Return the buffer size for new channels
+    auto bufferSize() const { return bufferSize_; }
+
+    /// Set the channel buffer size for new channels
+    void setBufferSize(size_t sz) { bufferSize_ = sz; }
+
+    /// Return the bulk threshold for new channels
+    auto bulkThreshold() const { return bulkThreshold_; }
+
+    /// Set the bulk threshold for new channels
+    void setBulkThreshold(size_t sz) { bulkThreshold_ = sz; }
+
+    // Socket overrides
+    bool onReadable(SocketManager* sockman) override;
+
+private:
+    std::weak_ptr<ServiceRegistry> svcreg_;
+    size_t bufferSize_ = Channel::DEFAULT_BUFFER_SIZE;
+    size_t bulkThreshold_ = UnixChannel::DEFAULT_BULK_THRESHOLD;
+};
+
+}
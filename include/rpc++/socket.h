@@ -29,6 +29,7 @@
 #pragma once
 
 #include <chrono>
+#include <cstring>
 #include <string>
 #include <system_error>
 #include <vector>
@@ -39,8 +40,22 @@
 #include <sys/un.h>
 #include <sys/uio.h>
 
+#if defined(__linux__) || defined(__FreeBSD__)
+#define HAVE_MMSG
+#endif
+
 namespace oncrpc {
 
+#ifndef HAVE_MMSG
+/// Platforms without recvmmsg and sendmmsg use this to describe a
+/// batch of datagrams which Socket transfers one at a time
+struct mmsghdr
+{
+    msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
 /// Given a Network ID (see RFC 5665), return a pair with the first element
 /// the protocol family which implements the Network ID and the second element
 /// the socket type to use.
@@ -273,6 +288,25 @@ public:
     /// true if the socket is still active or false if it should be closed
     virtual bool onReadable(SocketManager* sockman) { return false; }
 
+    /// Called from SocketManager::run when the socket is writable, if
+    /// it has asked to be notified using SocketManager::setInterest.
+    /// Return true if the socket is still active or false if it should
+    /// be closed
+    virtual bool onWritable(SocketManager*) { return true; }
+
+    /// Called by SocketManager engines which support completion-based
+    /// reads (currently io_uring) to find where the next read from the
+    /// socket should be placed. Return an empty buffer to use onReadable
+    /// instead.
+    virtual std::pair<void*, size_t> readBuffer() { return {nullptr, 0}; }
+
+    /// Called from SocketManager::run when a read into the buffer
+    /// returned by readBuffer completes. The len argument is the number
+    /// of bytes read, zero at end of file or a negative errno value on
+    /// error. Return true if the socket is still active or false if it
+    /// should be closed
+    virtual bool onRead(SocketManager*, ssize_t) { return false; }
+
     /// Bind the local address
     virtual void bind(const Address& addr);
 
@@ -298,9 +332,21 @@ public:
         return len;
     }
 
-    virtual ssize_t send(const std::vector<iovec>& iov)
+    /// Write from iov. Non-zero flags, e.g. MSG_MORE, are passed to
+    /// sendmsg
+    virtual ssize_t send(const std::vector<iovec>& iov, int flags = 0)
     {
-        auto len = ::writev(fd_, iov.data(), iov.size());
+        ssize_t len;
+        if (flags) {
+            msghdr mh;
+            std::memset(&mh, 0, sizeof(mh));
+            mh.msg_iov = const_cast<iovec*>(iov.data());
+            mh.msg_iovlen = iov.size();
+            len = ::sendmsg(fd_, &mh, flags);
+        }
+        else {
+            len = ::writev(fd_, iov.data(), iov.size());
+        }
         if (len < 0)
             throw std::system_error(errno, std::system_category());
         return len;
@@ -347,6 +393,72 @@ public:
         return len;
     }
 
+    /// Receive up to vlen datagrams without waiting, using a single
+    /// system call where the platform supports it. Return the number
+    /// of datagrams received, which is zero if none were waiting
+    virtual ssize_t recvmmsg(mmsghdr* msgs, size_t vlen)
+    {
+#ifdef HAVE_MMSG
+        auto n = ::recvmmsg(fd_, msgs, vlen, MSG_DONTWAIT, nullptr);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            throw std::system_error(errno, std::system_category());
+        }
+        return n;
+#else
+        size_t n = 0;
+        while (n < vlen) {
+            auto len = ::recvmsg(fd_, &msgs[n].msg_hdr, MSG_DONTWAIT);
+            if (len < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                if (n > 0)
+                    break;
+                throw std::system_error(errno, std::system_category());
+            }
+            msgs[n].msg_len = len;
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    /// Send up to vlen datagrams, using a single system call where the
+    /// platform supports it. Return the number of datagrams sent
+    virtual ssize_t sendmmsg(mmsghdr* msgs, size_t vlen)
+    {
+#ifdef HAVE_MMSG
+        auto n = ::sendmmsg(fd_, msgs, vlen, 0);
+        if (n < 0)
+            throw std::system_error(errno, std::system_category());
+        return n;
+#else
+        size_t n = 0;
+        while (n < vlen) {
+            auto len = ::sendmsg(fd_, &msgs[n].msg_hdr, 0);
+            if (len < 0) {
+                if (n > 0)
+                    break;
+                throw std::system_error(errno, std::system_category());
+            }
+            msgs[n].msg_len = len;
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    /// Send the data in iov together with the file descriptors in fds,
+    /// which the peer receives with recvFds. Only supported for unix
+    /// domain sockets
+    virtual ssize_t sendFds(
+        const std::vector<iovec>& iov, const std::vector<int>& fds);
+
+    /// Receive up to buflen bytes, appending any file descriptors sent
+    /// with them to fds
+    virtual ssize_t recvFds(void* buf, size_t buflen, std::vector<int>& fds);
+
     Address peerName() const
     {
         struct sockaddr_storage ss;
@@ -28,17 +28,28 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <rpc++/timeout.h>
+#include <rpc++/uring.h>
 
 #ifdef __FreeBSD__
 #define HAVE_KQUEUE
 #endif
 
+#ifdef __linux__
+#define HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 namespace oncrpc {
 
 class Socket;
@@ -47,19 +58,47 @@ class SocketManager: public TimeoutManager,
                      public std::enable_shared_from_this<SocketManager>
 {
 public:
-    SocketManager();
+    /// The mechanism used to wait for socket events
+    enum class Engine {
+        DEFAULT,        // kqueue, epoll or select depending on platform
+        URING,          // Linux io_uring
+    };
+
+    /// Create a socket manager using the given engine. If the engine
+    /// is not supported by the platform or the running kernel, the
+    /// default engine is used instead.
+    SocketManager(Engine engine = Engine::DEFAULT);
     ~SocketManager();
 
+    /// Return the engine in use
+    Engine engine() const { return engine_; }
+
     void add(std::shared_ptr<Socket> conn);
 
     void remove(std::shared_ptr<Socket> conn);
 
     void changed(std::shared_ptr<Socket> conn);
 
+    /// Set the events the socket is waiting for. Sockets start out
+    /// waiting only to become readable. A socket with output which
+    /// could not be written immediately can wait for Socket::onWritable
+    /// and a socket applying backpressure can stop reading for a while.
+    void setInterest(std::shared_ptr<Socket> conn, bool read, bool write);
+
     void run();
 
     void stop();
 
+    /// Write iov to the socket, calling done with the number of bytes
+    /// written or a negative errno value. With the io_uring engine, the
+    /// write is queued and done is called from the thread running
+    /// run() when it completes - the memory referenced by iov must
+    /// remain valid until then. Otherwise the write happens immediately
+    /// and done is called before write returns.
+    void write(
+        std::shared_ptr<Socket> sock, const std::vector<iovec>& iov,
+        std::function<void(ssize_t)> done);
+
     auto idleTimeout() const { return idleTimeout_; }
     void setIdleTimeout(clock_type::duration d) { idleTimeout_ = d; }
 
@@ -71,22 +110,147 @@ private:
     struct Entry {
         clock_type::time_point time;
         int fd;
+        bool read = true;       // waiting for the socket to be readable
+        bool write = false;     // waiting for the socket to be writable
+        uint64_t op = 0;        // armed io_uring read or poll, if any
+        uint64_t writeOp = 0;   // armed io_uring write poll, if any
     };
 
+    /// Wake the event loop if it is running in some other thread so
+    /// that it sees changes to the interest list. Called with mutex_
+    /// held.
+    void wakeup();
+
+    /// Return the time to wait for events, given the current time
+    std::chrono::microseconds waitTime(clock_type::time_point now);
+
+    /// Remove any sockets which have been idle for longer than
+    /// idleTimeout_. Called with mutex_ held.
+    void expireIdle(
+        std::unique_lock<std::mutex>& lock, clock_type::time_point now);
+
+    /// Call onWritable and onReadable for each socket in ready,
+    /// skipping any which are no longer registered. Called with mutex_
+    /// held, which is released while running the callbacks.
+    void dispatch(
+        std::unique_lock<std::mutex>& lock,
+        std::vector<std::pair<std::shared_ptr<Socket>, int>>& ready);
+
+#ifdef HAVE_IO_URING
+    struct Op {
+        enum {
+            POLL,               // wait for the socket to become readable
+            RECV,               // read into Socket::readBuffer
+            WRITE,              // write from iov
+            WRITABLE            // wait for the socket to become writable
+        } type;
+        std::shared_ptr<Socket> sock;
+        std::vector<iovec> iov;
+        std::function<void(ssize_t)> done;
+    };
+
+    struct Completion {
+        Op op;
+        int res;
+        bool live;              // false if the socket was removed
+    };
+
+    /// The io_uring version of run(). Called with mutex_ held.
+    void runUring(std::unique_lock<std::mutex>& lock);
+
+    /// Queue a read or poll for the socket. Called with mutex_ held.
+    void arm(const std::shared_ptr<Socket>& sock, Entry& entry);
+
+    /// Cancel any armed read or poll. Called with mutex_ held.
+    void disarm(Entry& entry);
+
+    /// Queue a poll for the socket to become writable. Called with
+    /// mutex_ held.
+    void armWrite(const std::shared_ptr<Socket>& sock, Entry& entry);
+
+    /// Cancel an operation by user_data value. Called with mutex_ held.
+    void cancel(uint64_t op);
+
+    /// Queue a poll for the notification pipe. Called with mutex_ held.
+    void armWakeup();
+
+    /// Submit queued operations unless we are running in the event loop
+    /// thread, which submits them in batches. Called with mutex_ held.
+    void submit();
+#endif
+
     std::mutex mutex_;
+    Engine engine_ = Engine::DEFAULT;
     bool running_ = false;
     bool stopping_ = false;
+    std::thread::id loopThread_;
     std::unordered_map<
         std::shared_ptr<Socket>, Entry> sockets_;
     int pipefds_[2];
     clock_type::duration idleTimeout_;
+    clock_type::time_point nextIdleCheck_;
 #ifdef HAVE_KEVENT
     int kq_;
     std::vector<::kevent> changes_;
+#elif defined(HAVE_EPOLL)
+    int epfd_;
+    std::unordered_map<int, std::shared_ptr<Socket>> fds_;
+    std::vector<::epoll_event> events_;
+    std::vector<std::pair<std::shared_ptr<Socket>, int>> ready_;
 #else
     int maxfd_;
     fd_set rset_;
+    fd_set wset_;
+#endif
+#ifdef HAVE_IO_URING
+    std::unique_ptr<IoUring> uring_;
+    std::unordered_map<uint64_t, Op> ops_;      // in-flight operations
+    uint64_t nextOp_;
+    std::vector<Completion> completed_;
+    std::vector<std::shared_ptr<Socket>> rearm_;
 #endif
 };
 
+/// A group of socket managers, each running its own event loop thread,
+/// which can be used to spread connections over several cores. Each
+/// manager owns its sockets and timeouts independently of the others.
+class SocketManagerGroup
+{
+public:
+    typedef SocketManager::Engine Engine;
+
+    /// Create a group of count managers using the given engine. If count
+    /// is zero, one manager is created for each CPU.
+    SocketManagerGroup(int count = 0, Engine engine = Engine::DEFAULT);
+    ~SocketManagerGroup();
+
+    /// Return the number of managers in the group
+    int size() const { return int(managers_.size()); }
+
+    /// Return the i'th manager in the group
+    const std::shared_ptr<SocketManager>& manager(int i) const
+    {
+        return managers_[i];
+    }
+
+    /// Return a manager chosen in round-robin order
+    const std::shared_ptr<SocketManager>& next();
+
+    /// Add a socket to the manager returned by next()
+    void add(std::shared_ptr<Socket> sock);
+
+    /// Start a thread running the event loop for each manager. If pin
+    /// is true, the thread for manager i is bound to the i'th CPU
+    /// (modulo the number of CPUs).
+    void start(bool pin = true);
+
+    /// Stop the event loops and wait for their threads to finish
+    void stop();
+
+private:
+    std::vector<std::shared_ptr<SocketManager>> managers_;
+    std::vector<std::thread> threads_;
+    std::atomic<unsigned> next_;
+};
+
 }
@@ -34,6 +34,7 @@
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <unordered_set>
 
 namespace oncrpc {
 
@@ -48,6 +49,9 @@ public:
         queue_.clear();
     }
 
+    /// Return the number of tasks waiting to run
+    size_t size() const;
+
     virtual task_type add(
         clock_type::time_point when, std::function<void()> what);
     void update(clock_type::time_point now);
@@ -70,9 +74,14 @@ protected:
         }
     };
 
+    /// Remove cancelled tasks from the front of the queue and, if they
+    /// make up most of it, from the rest. Called with mutex_ held.
+    void prune();
+
     mutable std::mutex mutex_;
     task_type nextTid_ = 1;
     std::deque<Task> queue_;
+    std::unordered_set<task_type> active_; // tasks not cancelled or run
 };
 
 }
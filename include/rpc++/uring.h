@@ -0,0 +1,127 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// -*- c++ -*-
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+namespace oncrpc {
+
+/// A minimal wrapper for a Linux io_uring instance. We use the raw
+/// system calls rather than liburing to avoid an extra dependency.
+///
+/// Submission queue entries returned by getSqe are not visible to the
+/// kernel until the next call to flush or submit, allowing several
+/// threads to fill entries under an external lock while another thread
+/// is waiting for completions in wait. Not thread safe.
+class IoUring
+{
+public:
+    /// Return true if the running kernel supports the io_uring features
+    /// we depend on
+    static bool supported();
+
+    IoUring(unsigned entries);
+    ~IoUring();
+
+    /// Return a zeroed submission queue entry, submitting queued entries
+    /// to the kernel if the submission ring is full
+    io_uring_sqe* getSqe();
+
+    /// Make any entries returned by getSqe visible to the kernel and
+    /// return the number of entries which are waiting to be submitted
+    unsigned flush();
+
+    /// Flush and submit any queued entries without waiting
+    void submit();
+
+    /// Submit toSubmit entries (typically the value returned by
+    /// flush) and wait for at least one completion or for the timeout
+    void wait(unsigned toSubmit, std::chrono::microseconds timeout);
+
+    /// Call fn(user_data, res) for each available completion and return
+    /// the number of completions processed
+    template <typename F>
+    int reap(F&& fn)
+    {
+        auto head = *cqHead_;
+        auto tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        int count = 0;
+        while (head != tail) {
+            const auto& cqe = cqes_[head & cqMask_];
+            auto data = cqe.user_data;
+            auto res = cqe.res;
+            head++;
+            count++;
+            // Publish the new head before calling fn so that the slot
+            // can be re-used if fn submits more work
+            __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+            fn(data, res);
+        }
+        return count;
+    }
+
+private:
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags,
+              void* arg, size_t argsz);
+
+    int fd_;
+    void* sqRing_;
+    size_t sqRingSize_;
+    void* cqRing_;
+    size_t cqRingSize_;
+    io_uring_sqe* sqes_;
+    size_t sqesSize_;
+
+    unsigned* sqHead_;
+    unsigned* sqTail_;
+    unsigned* sqArray_;
+    unsigned sqMask_;
+    unsigned sqEntries_;
+    unsigned sqeTail_;          // entries filled by getSqe
+
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned cqMask_;
+    io_uring_cqe* cqes_;
+};
+
+}
+
+#endif
@@ -33,11 +33,17 @@
 #include <cassert>
 #include <cinttypes>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
+#include <initializer_list>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+#include <sys/uio.h>
+
+#include <rpc++/bufpool.h>
 #include <rpc++/errors.h>
 
 namespace oncrpc {
@@ -170,11 +176,24 @@ public:
     {
     }
 
-    /// A reference to data owned by this buffer
+    /// A reference to externally managed data which is freed by calling
+    /// release when the buffer is destroyed. If the data is a shared
+    /// memory mapping, fd is the descriptor of the mapped object, which
+    /// should be closed by release.
+    Buffer(size_t size, uint8_t* data,
+           std::function<void(uint8_t*)> release, int fd = -1)
+        : size_(size),
+          storage_(data, std::move(release)),
+          data_(data),
+          fd_(fd)
+    {
+    }
+
+    /// A reference to data owned by this buffer, allocated from the
+    /// buffer pool
     Buffer(size_t size)
         : size_(size),
-          storage_((uint8_t*) std::malloc(size),
-                   [](uint8_t* p) { std::free(p); }),
+          storage_(BufferPool::instance().allocate(size)),
           data_(storage_.get())
     {
     }
@@ -193,7 +212,8 @@ public:
         : size_(other.size_),
           storage_(std::move(other.storage_)),
           data_(other.data_),
-          parent_(std::move(other.parent_))
+          parent_(std::move(other.parent_)),
+          fd_(other.fd_)
     {
     }
 
@@ -210,6 +230,10 @@ public:
     size_t size() const { return size_; }
     uint8_t* data() const { return data_; }
 
+    /// Return the shared memory object holding the buffer contents or
+    /// -1 if the buffer is not backed by shared memory
+    int fd() const { return fd_; }
+
     std::string toString() const
     {
         return std::string(reinterpret_cast<const char*>(data_), size_);
@@ -220,6 +244,167 @@ private:
     std::unique_ptr<uint8_t, std::function<void(uint8_t*)>> storage_;
     uint8_t* data_;
     std::shared_ptr<Buffer> parent_;
+    int fd_ = -1;
+};
+
+/// A read-only view of variable length XDR data which references a
+/// Buffer instead of owning a copy of the bytes. Views decoded from a
+/// received message usually share the message's receive buffer so
+/// decoding them doesn't copy the data, at the cost of keeping the
+/// receive buffer alive for as long as the view.
+template <typename T>
+class xdr_view
+{
+public:
+    /// An empty view
+    xdr_view() {}
+
+    /// A view of the contents of buf
+    explicit xdr_view(std::shared_ptr<Buffer> buf)
+        : buf_(std::move(buf))
+    {
+    }
+
+    /// A view of a copy of len elements starting at p
+    xdr_view(const T* p, size_t len)
+    {
+        if (len > 0) {
+            buf_ = std::make_shared<Buffer>(len);
+            std::copy_n(reinterpret_cast<const uint8_t*>(p), len,
+                        buf_->data());
+        }
+    }
+
+    const T* data() const
+    {
+        return buf_ ? reinterpret_cast<const T*>(buf_->data()) : nullptr;
+    }
+    size_t size() const { return buf_ ? buf_->size() : 0; }
+    bool empty() const { return size() == 0; }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size(); }
+
+    T operator[](size_t i) const
+    {
+        assert(i < size());
+        return data()[i];
+    }
+
+    /// Return the buffer holding the viewed bytes, which may be null
+    /// for an empty view
+    const std::shared_ptr<Buffer>& buffer() const { return buf_; }
+
+private:
+    std::shared_ptr<Buffer> buf_;
+};
+
+template <typename T>
+bool operator==(const xdr_view<T>& x, const xdr_view<T>& y)
+{
+    return x.size() == y.size() && std::equal(x.begin(), x.end(), y.begin());
+}
+
+template <typename T>
+bool operator!=(const xdr_view<T>& x, const xdr_view<T>& y)
+{
+    return !(x == y);
+}
+
+/// A view of an XDR string, used in place of std::string for string
+/// fields of types generated with rpcgen -v
+class xdr_string_view: public xdr_view<char>
+{
+public:
+    using xdr_view<char>::xdr_view;
+
+    xdr_string_view() {}
+    xdr_string_view(const char* s) : xdr_view(s, std::strlen(s)) {}
+    xdr_string_view(const std::string& s) : xdr_view(s.data(), s.size()) {}
+
+    /// Return a copy of the viewed string
+    std::string str() const
+    {
+        return std::string(data(), size());
+    }
+};
+
+inline bool operator==(const xdr_string_view& x, const std::string& y)
+{
+    return x.size() == y.size() && std::equal(x.begin(), x.end(), y.begin());
+}
+
+inline bool operator==(const xdr_string_view& x, const char* y)
+{
+    return x == std::string(y);
+}
+
+inline bool operator!=(const xdr_string_view& x, const std::string& y)
+{
+    return !(x == y);
+}
+
+inline bool operator!=(const xdr_string_view& x, const char* y)
+{
+    return !(x == y);
+}
+
+inline bool operator==(const std::string& x, const xdr_string_view& y)
+{
+    return y == x;
+}
+
+inline bool operator==(const char* x, const xdr_string_view& y)
+{
+    return y == x;
+}
+
+inline bool operator!=(const std::string& x, const xdr_string_view& y)
+{
+    return !(y == x);
+}
+
+inline bool operator!=(const char* x, const xdr_string_view& y)
+{
+    return !(y == x);
+}
+
+/// A view of variable length XDR opaque data, used in place of
+/// std::vector<uint8_t> for opaque fields of types generated with
+/// rpcgen -v
+class xdr_opaque_span: public xdr_view<uint8_t>
+{
+public:
+    using xdr_view<uint8_t>::xdr_view;
+
+    xdr_opaque_span() {}
+    xdr_opaque_span(const std::vector<uint8_t>& v)
+        : xdr_view(v.data(), v.size())
+    {
+    }
+
+    /// Return a copy of the viewed bytes
+    std::vector<uint8_t> to_vector() const
+    {
+        return std::vector<uint8_t>(begin(), end());
+    }
+};
+
+/// Views of bounded strings and opaque data (e.g. string<512> or
+/// opaque<1024> in the XDR language)
+template <size_t N>
+class bounded_string_view: public xdr_string_view
+{
+public:
+    using xdr_string_view::xdr_string_view;
+    bounded_string_view() {}
+};
+
+template <size_t N>
+class bounded_opaque_span: public xdr_opaque_span
+{
+public:
+    using xdr_opaque_span::xdr_opaque_span;
+    bounded_opaque_span() {}
 };
 
 /// A 32-bit word stored in network byte order
@@ -257,11 +442,24 @@ private:
 };
 
 template <typename T>
-inline T __round(T len)
+constexpr T __round(T len)
 {
     return (len + (sizeof(uint32_t) - 1)) & ~(sizeof(uint32_t) - 1);
 }
 
+namespace _detail {
+
+/// Copy n 32-bit words from src to dst, converting between host and
+/// network byte order. The arrays may be unaligned and may be the same
+/// but must not otherwise overlap.
+void swapWords(void* dst, const void* src, size_t n);
+
+/// Copy n 64-bit words from src to dst, converting between host and
+/// network byte order
+void swapHypers(void* dst, const void* src, size_t n);
+
+}
+
 class XdrSink
 {
 public:
@@ -309,6 +507,49 @@ public:
         putBytes(static_cast<const uint8_t*>(p), len);
     }
 
+    /// Write an array of 32-bit words to the stream in network byte
+    /// order, converting as many as fit in the write buffer at a time
+    void putWords(const uint32_t* p, size_t n)
+    {
+        while (n > 0) {
+            size_t avail = (writeLimit_ - writeCursor_) / sizeof(uint32_t);
+            if (avail == 0) {
+                // The buffer is full or ends part way through a word
+                putWord(*p++);
+                n--;
+                continue;
+            }
+            if (avail > n)
+                avail = n;
+            _detail::swapWords(writeCursor_, p, avail);
+            writeCursor_ += avail * sizeof(uint32_t);
+            p += avail;
+            n -= avail;
+        }
+    }
+
+    /// Write an array of 64-bit words to the stream in network byte
+    /// order
+    void putHypers(const uint64_t* p, size_t n)
+    {
+        while (n > 0) {
+            size_t avail = (writeLimit_ - writeCursor_) / sizeof(uint64_t);
+            if (avail == 0) {
+                auto v = *p++;
+                putWord(static_cast<uint32_t>(v >> 32));
+                putWord(static_cast<uint32_t>(v));
+                n--;
+                continue;
+            }
+            if (avail > n)
+                avail = n;
+            _detail::swapHypers(writeCursor_, p, avail);
+            writeCursor_ += avail * sizeof(uint64_t);
+            p += avail;
+            n -= avail;
+        }
+    }
+
     /// If there are at least len bytes of space in the write buffer,
     /// return a pointer to the next free byte and advance the write
     /// cursor by len bytes. If not, return nullptr. Len must be a
@@ -393,6 +634,49 @@ public:
         getBytes(static_cast<uint8_t*>(p), len);
     }
 
+    /// Read an array of 32-bit words from the stream, converting as
+    /// many as are in the read buffer at a time
+    void getWords(uint32_t* p, size_t n)
+    {
+        while (n > 0) {
+            size_t avail = (readLimit_ - readCursor_) / sizeof(uint32_t);
+            if (avail == 0) {
+                // The buffer is empty or ends part way through a word
+                getWord(*p++);
+                n--;
+                continue;
+            }
+            if (avail > n)
+                avail = n;
+            _detail::swapWords(p, readCursor_, avail);
+            readCursor_ += avail * sizeof(uint32_t);
+            p += avail;
+            n -= avail;
+        }
+    }
+
+    /// Read an array of 64-bit words from the stream
+    void getHypers(uint64_t* p, size_t n)
+    {
+        while (n > 0) {
+            size_t avail = (readLimit_ - readCursor_) / sizeof(uint64_t);
+            if (avail == 0) {
+                uint32_t v0, v1;
+                getWord(v0);
+                getWord(v1);
+                *p++ = (static_cast<uint64_t>(v0) << 32) | v1;
+                n--;
+                continue;
+            }
+            if (avail > n)
+                avail = n;
+            _detail::swapHypers(p, readCursor_, avail);
+            readCursor_ += avail * sizeof(uint64_t);
+            p += avail;
+            n -= avail;
+        }
+    }
+
     /// If there are at least len bytes of space in the read buffer,
     /// return a pointer to the next free byte and advance the read
     /// cursor by len bytes. If not, return nullptr. Len must be a
@@ -635,6 +919,70 @@ inline void xdr(std::shared_ptr<Buffer>& v, XdrSource* xdrs)
     xdrs->getBuffer(v, sz);
 }
 
+namespace _detail {
+
+/// Read len bytes into a view, borrowing them from the source if it
+/// supports that
+template <typename T>
+inline void getView(xdr_view<T>& v, uint32_t len, XdrSource* xdrs)
+{
+    std::shared_ptr<Buffer> buf;
+    if (len > 0)
+        xdrs->getBuffer(buf, len);
+    v = xdr_view<T>(std::move(buf));
+}
+
+}
+
+template <typename T>
+inline void xdr(const xdr_view<T>& v, XdrSink* xdrs)
+{
+    xdrs->putWord(v.size());
+    xdrs->putBytes(reinterpret_cast<const uint8_t*>(v.data()), v.size());
+}
+
+template <typename T>
+inline void xdr(xdr_view<T>& v, XdrSource* xdrs)
+{
+    uint32_t len;
+    xdrs->getWord(len);
+    _detail::getView(v, len, xdrs);
+}
+
+template <size_t N>
+inline void xdr(const bounded_string_view<N>& v, XdrSink* xdrs)
+{
+    assert(v.size() <= N);
+    xdr(static_cast<const xdr_view<char>&>(v), xdrs);
+}
+
+template <size_t N>
+inline void xdr(bounded_string_view<N>& v, XdrSource* xdrs)
+{
+    uint32_t len;
+    xdrs->getWord(len);
+    if (len > N)
+        throw XdrError("string overflow");
+    _detail::getView(v, len, xdrs);
+}
+
+template <size_t N>
+inline void xdr(const bounded_opaque_span<N>& v, XdrSink* xdrs)
+{
+    assert(v.size() <= N);
+    xdr(static_cast<const xdr_view<uint8_t>&>(v), xdrs);
+}
+
+template <size_t N>
+inline void xdr(bounded_opaque_span<N>& v, XdrSource* xdrs)
+{
+    uint32_t len;
+    xdrs->getWord(len);
+    if (len > N)
+        throw XdrError("array overflow");
+    _detail::getView(v, len, xdrs);
+}
+
 inline void xdr(const int v, XdrSink* xdrs)
 {
     xdr(reinterpret_cast<const uint32_t&>(v), xdrs);
@@ -713,34 +1061,60 @@ inline void xdr(bool& v, XdrSource* xdrs)
     v = t;
 }
 
-template <typename T, size_t N>
-inline void xdr(const std::array<T, N>& v, XdrSink* xdrs)
+namespace _detail {
+
+/// True for element types which are encoded as a single 32-bit or
+/// 64-bit word. Arrays of these are converted in bulk rather than one
+/// element at a time.
+template <typename T>
+struct XdrBulk: std::integral_constant<
+    bool,
+    std::is_same<T, int32_t>::value || std::is_same<T, uint32_t>::value ||
+    std::is_same<T, int64_t>::value || std::is_same<T, uint64_t>::value ||
+    ((std::is_same<T, long>::value ||
+      std::is_same<T, unsigned long>::value) && sizeof(long) == 8) ||
+    std::is_same<T, float>::value || std::is_same<T, double>::value>
+{
+};
+
+template <typename C>
+inline void putElements(const C& v, XdrSink* xdrs, std::false_type)
 {
     for (const auto& e : v)
         xdr(e, xdrs);
 }
 
-template <typename T, size_t N>
-inline void xdr(std::array<T, N>& v, XdrSource* xdrs)
+template <typename C>
+inline void putElements(const C& v, XdrSink* xdrs, std::true_type)
+{
+    typedef typename std::remove_reference<decltype(v[0])>::type T;
+    if (sizeof(T) == sizeof(uint32_t))
+        xdrs->putWords(reinterpret_cast<const uint32_t*>(v.data()), v.size());
+    else
+        xdrs->putHypers(reinterpret_cast<const uint64_t*>(v.data()), v.size());
+}
+
+template <typename C>
+inline void getElements(C& v, XdrSource* xdrs, std::false_type)
 {
     for (auto& e : v)
         xdr(e, xdrs);
 }
 
-template <typename T>
-inline void xdr(const std::vector<T>& v, XdrSink* xdrs)
+template <typename C>
+inline void getElements(C& v, XdrSource* xdrs, std::true_type)
 {
-    uint32_t sz = v.size();
-    xdr(sz, xdrs);
-    for (const auto& e : v)
-        xdr(e, xdrs);
+    typedef typename std::remove_reference<decltype(v[0])>::type T;
+    if (sizeof(T) == sizeof(uint32_t))
+        xdrs->getWords(reinterpret_cast<uint32_t*>(v.data()), v.size());
+    else
+        xdrs->getHypers(reinterpret_cast<uint64_t*>(v.data()), v.size());
 }
 
 template <typename T>
-inline void xdr(std::vector<T>& v, XdrSource* xdrs)
+inline void getVector(std::vector<T>& v, uint32_t sz, XdrSource* xdrs,
+                      std::false_type)
 {
-    uint32_t sz;
-    xdr(sz, xdrs);
     v.clear();
     v.reserve(sz);
     for (uint32_t i = 0; i < sz; i++) {
@@ -750,14 +1124,51 @@ inline void xdr(std::vector<T>& v, XdrSource* xdrs)
     }
 }
 
+template <typename T>
+inline void getVector(std::vector<T>& v, uint32_t sz, XdrSource* xdrs,
+                      std::true_type)
+{
+    v.resize(sz);
+    getElements(v, xdrs, std::true_type());
+}
+
+}
+
+template <typename T, size_t N>
+inline void xdr(const std::array<T, N>& v, XdrSink* xdrs)
+{
+    _detail::putElements(v, xdrs, _detail::XdrBulk<T>());
+}
+
+template <typename T, size_t N>
+inline void xdr(std::array<T, N>& v, XdrSource* xdrs)
+{
+    _detail::getElements(v, xdrs, _detail::XdrBulk<T>());
+}
+
+template <typename T>
+inline void xdr(const std::vector<T>& v, XdrSink* xdrs)
+{
+    uint32_t sz = v.size();
+    xdr(sz, xdrs);
+    _detail::putElements(v, xdrs, _detail::XdrBulk<T>());
+}
+
+template <typename T>
+inline void xdr(std::vector<T>& v, XdrSource* xdrs)
+{
+    uint32_t sz;
+    xdr(sz, xdrs);
+    _detail::getVector(v, sz, xdrs, _detail::XdrBulk<T>());
+}
+
 template <typename T, size_t N>
 inline void xdr(const bounded_vector<T, N>& v, XdrSink* xdrs)
 {
     uint32_t sz = v.size();
     assert(sz <= N);
     xdr(sz, xdrs);
-    for (const auto& e : v)
-        xdr(e, xdrs);
+    _detail::putElements(v, xdrs, _detail::XdrBulk<T>());
 }
 
 template <typename T, size_t N>
@@ -768,9 +1179,7 @@ inline void xdr(bounded_vector<T, N>& v, XdrSource* xdrs)
     if (sz > N)
         throw XdrError("array overflow");
     v.resize(sz);
-    for (uint32_t i = 0; i < sz; i++) {
-        xdr(v.data()[i], xdrs);
-    }
+    _detail::getElements(v, xdrs, _detail::XdrBulk<T>());
 }
 
 template <typename T>
@@ -802,7 +1211,8 @@ inline void xdr(std::unique_ptr<T>& v, XdrSource* xdrs)
 class XdrMemory: public XdrSink, public XdrSource
 {
 public:
-    /// Create a memory encoder/decoder which owns its storage
+    /// Create a memory encoder/decoder which owns its storage, allocated
+    /// from the buffer pool
     XdrMemory(size_t sz);
 
     /// Create a memory encoder/decoder which uses external storage
@@ -826,8 +1236,13 @@ public:
         return buf_;
     }
 
+    /// Reset the cursors to the start of the buffer. If slices of the
+    /// buffer returned by getBuffer are still in use, the contents are
+    /// copied to fresh storage so that the slices are not overwritten.
     void rewind()
     {
+        if (storage_.use_count() > 1)
+            unshare();
         writeCursor_ = buf_;
         readCursor_ = buf_;
     }
@@ -873,43 +1288,436 @@ public:
         return readLimit_ - buf_;
     }
     void fill() override;
+    void getBuffer(std::shared_ptr<Buffer>& buf, size_t size) override;
+
+    // Messages are created and destroyed for each call so the objects
+    // themselves also come from the buffer pool
+    static void* operator new(size_t sz)
+    {
+        return BufferPool::instance().allocateRaw(sz);
+    }
+    static void operator delete(void* p, size_t sz)
+    {
+        BufferPool::instance().release(p, sz);
+    }
 
 protected:
-    std::unique_ptr<uint8_t, std::function<void(uint8_t*)>> storage_;
+    /// Replace shared storage with a copy in a new buffer from the pool
+    void unshare();
+
+    std::shared_ptr<Buffer> storage_; // null if using external storage
+    size_t size_;
+    uint8_t* buf_;
+};
+
+/// An XdrSink which encodes into a chain of segments allocated from the
+/// buffer pool. When a segment fills up, a new one twice the size is
+/// added so that messages of any size can be encoded without
+/// reallocating or copying what has already been written. Buffers added
+/// with putBuffer are referenced rather than copied. The encoded message
+/// is available as a list of iovecs suitable for a gather write.
+class XdrChain: public XdrSink
+{
+public:
+    /// Create a chain whose first segment is sz bytes
+    XdrChain(size_t sz);
+
+    /// Return the first segment, e.g. to receive a message into
+    uint8_t* buf() const
+    {
+        return buf_;
+    }
+
+    size_t bufferSize() const
+    {
+        return size_;
+    }
+
+    /// Return the total number of bytes written, including referenced
+    /// buffers
+    size_t writePos() const
+    {
+        return iovBytes_ + (writeCursor_ - runStart_);
+    }
+
+    /// Advance the write cursor. Typically used after reading into the
+    /// first segment from some other source
+    void advanceWrite(size_t sz)
+    {
+        assert(writeCursor_ + sz <= writeLimit_);
+        writeCursor_ += sz;
+    }
+
+    /// Reset the chain back to empty, releasing all but the first
+    /// segment. If the first segment is shared with slices returned by
+    /// Message::getBuffer, it is replaced with a new one.
+    void rewind();
+
+    /// Return the encoded bytes as a list of iovecs
+    std::vector<iovec> iov() const;
+
+    /// Return the external buffers referenced by the chain, in the
+    /// order they were added with putBuffer
+    const auto& buffers() const { return buffers_; }
+
+    /// Return the number of segments in use
+    size_t segments() const
+    {
+        return 1 + segments_.size();
+    }
+
+    /// Write the contents of the chain to xdrs, passing referenced
+    /// buffers to its putBuffer
+    void copyTo(XdrSink* xdrs) const;
+
+    // XdrSink overrides
+    void putBuffer(const std::shared_ptr<Buffer>& buf) override;
+    void flush() override;
+
+    // Messages are created and destroyed for each call so the objects
+    // themselves also come from the buffer pool
+    static void* operator new(size_t sz)
+    {
+        return BufferPool::instance().allocateRaw(sz);
+    }
+    static void operator delete(void* p, size_t sz)
+    {
+        BufferPool::instance().release(p, sz);
+    }
+
+protected:
+    /// Add the bytes written since the last call to the iovec list
+    void endRun();
+
+    /// Return the segment containing p or null if p is not in any
+    /// segment, e.g. if it is in a buffer added with putBuffer
+    const std::shared_ptr<Buffer>* segmentOf(const uint8_t* p) const;
+
+    std::shared_ptr<Buffer> storage_; // the first segment
     size_t size_;
     uint8_t* buf_;
+    std::vector<std::shared_ptr<Buffer>> segments_; // segments after the first
+    size_t segmentSize_;        // size of the current segment
+    uint8_t* runStart_;         // start of bytes not yet in iov_
+    std::vector<iovec> iov_;
+    size_t iovBytes_ = 0;       // total length of iov_
+    std::vector<std::shared_ptr<Buffer>> buffers_;
+    uint8_t pad_[4] = {0, 0, 0, 0};
 };
 
-class XdrSizer: public XdrMemory
+/// An XdrSink which counts the bytes written to it. Encoded words pass
+/// through a small scratch buffer which is recycled on each flush and
+/// external buffers are counted without being copied.
+class XdrSizer: public XdrSink
 {
 public:
     XdrSizer()
-        : XdrMemory(1024)
     {
+        writeCursor_ = scratch_;
+        writeLimit_ = scratch_ + sizeof(scratch_);
     }
 
     size_t size() const
     {
-        return size_ + writePos();
+        return size_ + (writeCursor_ - scratch_);
     }
 
     // XdrSink overrides
     void flush() override
     {
-        size_ += writePos();
-        rewind();
+        size_ += writeCursor_ - scratch_;
+        writeCursor_ = scratch_;
+    }
+    void putBuffer(const std::shared_ptr<Buffer>& buf) override
+    {
+        size_ += __round(buf->size());
     }
 
 private:
+    alignas(uint64_t) uint8_t scratch_[256];
     size_t size_ = 0;
 };
 
+/// An XdrSink which encodes into a std::vector<uint8_t>, doubling its
+/// size each time it fills up. This is used when the encoded size can't
+/// be computed in advance, e.g. for message bodies supplied as callbacks.
+class XdrVector: public XdrSink
+{
+public:
+    XdrVector(size_t sz = 0)
+        : buf_(std::max(sz, MIN_SIZE))
+    {
+        writeCursor_ = buf_.data();
+        writeLimit_ = buf_.data() + buf_.size();
+    }
+
+    size_t writePos() const
+    {
+        return writeCursor_ - buf_.data();
+    }
+
+    /// Return the encoded bytes, leaving the sink empty
+    std::vector<uint8_t> release()
+    {
+        buf_.resize(writePos());
+        std::vector<uint8_t> res = std::move(buf_);
+        buf_.resize(MIN_SIZE);
+        writeCursor_ = buf_.data();
+        writeLimit_ = buf_.data() + buf_.size();
+        return res;
+    }
+
+    // XdrSink overrides
+    void flush() override
+    {
+        auto pos = writePos();
+        buf_.resize(2 * buf_.size());
+        writeCursor_ = buf_.data() + pos;
+        writeLimit_ = buf_.data() + buf_.size();
+    }
+
+private:
+    static constexpr size_t MIN_SIZE = 64;
+    std::vector<uint8_t> buf_;
+};
+
+/// Compute the encoded size of a value without encoding it. Types whose
+/// size does not depend on their value also have a constexpr
+/// xdr_fixed_size overload which takes a (null) pointer to the type so
+/// that it can be used without an instance. It returns zero for
+/// variable sized types.
 template <typename T>
-size_t XdrSizeof(const T& v)
+constexpr size_t xdr_fixed_size(const T*)
+{
+    return 0;
+}
+
+constexpr size_t xdr_fixed_size(const uint32_t*)
+{
+    return sizeof(XdrWord);
+}
+
+constexpr size_t xdr_fixed_size(const uint64_t*)
+{
+    return 2 * sizeof(XdrWord);
+}
+
+constexpr size_t xdr_fixed_size(const int*)
+{
+    return sizeof(XdrWord);
+}
+
+constexpr size_t xdr_fixed_size(const long*)
+{
+    return 2 * sizeof(XdrWord);
+}
+
+#ifndef __FreeBSD__
+constexpr size_t xdr_fixed_size(const unsigned long*)
+{
+    return 2 * sizeof(XdrWord);
+}
+
+constexpr size_t xdr_fixed_size(const int64_t*)
+{
+    return 2 * sizeof(XdrWord);
+}
+#endif
+
+constexpr size_t xdr_fixed_size(const float*)
+{
+    return sizeof(XdrWord);
+}
+
+constexpr size_t xdr_fixed_size(const double*)
+{
+    return 2 * sizeof(XdrWord);
+}
+
+constexpr size_t xdr_fixed_size(const bool*)
+{
+    return sizeof(XdrWord);
+}
+
+template <size_t N>
+constexpr size_t xdr_fixed_size(const std::array<uint8_t, N>*)
+{
+    return __round(N);
+}
+
+template <typename T, size_t N>
+constexpr size_t xdr_fixed_size(const std::array<T, N>*)
+{
+    return N * xdr_fixed_size(static_cast<const T*>(nullptr));
+}
+
+/// Combine the fixed sizes of the fields of a structure, returning zero
+/// if any of them are variable sized
+constexpr size_t xdr_fixed_sum(std::initializer_list<size_t> sizes)
+{
+    size_t sum = 0;
+    for (auto sz: sizes) {
+        if (sz == 0)
+            return 0;
+        sum += sz;
+    }
+    return sum;
+}
+
+constexpr size_t xdr_size(const uint32_t)
+{
+    return sizeof(XdrWord);
+}
+
+constexpr size_t xdr_size(const uint64_t)
+{
+    return 2 * sizeof(XdrWord);
+}
+
+constexpr size_t xdr_size(const int)
+{
+    return sizeof(XdrWord);
+}
+
+constexpr size_t xdr_size(const long)
+{
+    return 2 * sizeof(XdrWord);
+}
+
+#ifndef __FreeBSD__
+constexpr size_t xdr_size(const unsigned long)
+{
+    return 2 * sizeof(XdrWord);
+}
+
+constexpr size_t xdr_size(const int64_t)
+{
+    return 2 * sizeof(XdrWord);
+}
+#endif
+
+constexpr size_t xdr_size(const float)
+{
+    return sizeof(XdrWord);
+}
+
+constexpr size_t xdr_size(const double)
+{
+    return 2 * sizeof(XdrWord);
+}
+
+constexpr size_t xdr_size(const bool)
+{
+    return sizeof(XdrWord);
+}
+
+inline size_t xdr_size(const std::string& v)
+{
+    return sizeof(XdrWord) + __round(v.size());
+}
+
+inline size_t xdr_size(const std::vector<uint8_t>& v)
+{
+    return sizeof(XdrWord) + __round(v.size());
+}
+
+inline size_t xdr_size(const std::shared_ptr<Buffer>& v)
+{
+    return sizeof(XdrWord) + __round(v->size());
+}
+
+template <typename T>
+inline size_t xdr_size(const xdr_view<T>& v)
+{
+    return sizeof(XdrWord) + __round(v.size());
+}
+
+template <size_t N>
+constexpr size_t xdr_size(const std::array<uint8_t, N>&)
+{
+    return __round(N);
+}
+
+template <size_t N>
+inline size_t xdr_size(const bounded_vector<uint8_t, N>& v)
+{
+    return sizeof(XdrWord) + __round(v.size());
+}
+
+// The remaining overloads recurse through their element types so they
+// must all be declared before any of them are defined
+template <typename T, size_t N>
+size_t xdr_size(const std::array<T, N>& v);
+template <typename T>
+size_t xdr_size(const std::vector<T>& v);
+template <typename T, size_t N>
+size_t xdr_size(const bounded_vector<T, N>& v);
+template <typename T>
+size_t xdr_size(const std::unique_ptr<T>& v);
+
+namespace _detail {
+
+/// Use xdr_size if the type supports it, otherwise encode the value
+/// into an XdrSizer
+template <typename T>
+inline auto sizeOf(const T& v, int) -> decltype(xdr_size(v))
+{
+    return xdr_size(v);
+}
+
+template <typename T>
+inline size_t sizeOf(const T& v, long)
 {
     XdrSizer xdrs;
     xdr(v, &xdrs);
     return xdrs.size();
 }
 
+template <typename C>
+inline size_t elementsSize(const C& v)
+{
+    typedef typename std::decay<decltype(*v.begin())>::type T;
+    constexpr size_t fixed = xdr_fixed_size(static_cast<const T*>(nullptr));
+    if (fixed)
+        return v.size() * fixed;
+    size_t sz = 0;
+    for (const auto& e: v)
+        sz += sizeOf(e, 0);
+    return sz;
+}
+
+}
+
+template <typename T, size_t N>
+inline size_t xdr_size(const std::array<T, N>& v)
+{
+    return _detail::elementsSize(v);
+}
+
+template <typename T>
+inline size_t xdr_size(const std::vector<T>& v)
+{
+    return sizeof(XdrWord) + _detail::elementsSize(v);
+}
+
+template <typename T, size_t N>
+inline size_t xdr_size(const bounded_vector<T, N>& v)
+{
+    return sizeof(XdrWord) + _detail::elementsSize(v);
+}
+
+template <typename T>
+inline size_t xdr_size(const std::unique_ptr<T>& v)
+{
+    return sizeof(XdrWord) + (v ? _detail::sizeOf(*v, 0) : 0);
+}
+
+/// Return the encoded size of v, using xdr_size where available and
+/// falling back to encoding into an XdrSizer
+template <typename T>
+size_t XdrSizeof(const T& v)
+{
+    return _detail::sizeOf(v, 0);
+}
+
 }
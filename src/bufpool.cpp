@@ -0,0 +1,323 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include <sys/mman.h>
+
+#include <rpc++/bufpool.h>
+
+using namespace oncrpc;
+
+namespace {
+
+/// Size classes from 64k upwards may use huge page slabs
+constexpr int HUGE_CLASS = 8;
+
+/// Entries in the caches are tagged with this bit if the buffer is part
+/// of a huge page slab
+constexpr uintptr_t SLAB_TAG = 1;
+
+/// Maximum number of buffers of the given class kept in each thread
+size_t
+threadLimit(int cls)
+{
+    return std::min<size_t>(
+        64, std::max<size_t>(2, (256*1024) / BufferPool::classSize(cls)));
+}
+
+/// Maximum number of buffers of the given class kept in the shared cache
+size_t
+sharedLimit(int cls)
+{
+    return std::min<size_t>(
+        1024, std::max<size_t>(8, (4*1024*1024) / BufferPool::classSize(cls)));
+}
+
+}
+
+struct BufferPool::ThreadCache
+{
+    ThreadCache();
+    ~ThreadCache();
+
+    std::array<std::vector<uintptr_t>, CLASSES> free;
+};
+
+// State of the calling thread's cache. Buffers released by other
+// thread-local destructors after the cache has gone use the shared cache
+// directly.
+enum class CacheState { NONE, LIVE, DESTROYED };
+static thread_local CacheState threadCacheState;
+
+BufferPool::ThreadCache::ThreadCache()
+{
+    for (int cls = 0; cls < CLASSES; cls++)
+        free[cls].reserve(threadLimit(cls));
+    threadCacheState = CacheState::LIVE;
+}
+
+BufferPool::ThreadCache::~ThreadCache()
+{
+    threadCacheState = CacheState::DESTROYED;
+    auto& pool = instance();
+    for (int cls = 0; cls < CLASSES; cls++) {
+        for (auto entry: free[cls]) {
+            pool.bytesHeld_ -= classSize(cls);
+            pool.put(
+                reinterpret_cast<uint8_t*>(entry & ~SLAB_TAG), cls,
+                (entry & SLAB_TAG) != 0);
+        }
+    }
+}
+
+BufferPool&
+BufferPool::instance()
+{
+    // Never destroyed so that buffers may be released during exit
+    static BufferPool* pool = new BufferPool;
+    return *pool;
+}
+
+BufferPool::BufferPool()
+    : hugePages_(false),
+      hits_(0),
+      misses_(0),
+      bytesHeld_(0)
+{
+}
+
+int
+BufferPool::sizeClass(size_t size)
+{
+    if (size <= MIN_SIZE)
+        return 0;
+    if (size > MAX_SIZE)
+        return -1;
+    int bits = 8 * sizeof(unsigned long) - __builtin_clzl(size - 1);
+    return bits - __builtin_ctzl(MIN_SIZE);
+}
+
+BufferPool::Storage
+BufferPool::allocate(size_t size)
+{
+    int cls = sizeClass(size);
+    if (cls < 0) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        auto p = static_cast<uint8_t*>(std::malloc(size));
+        if (!p)
+            throw std::bad_alloc();
+        return Storage(p, [](uint8_t* p) { std::free(p); });
+    }
+    bool slab;
+    auto p = get(cls, slab);
+    return Storage(p, [cls, slab](uint8_t* p) { instance().put(p, cls, slab); });
+}
+
+void*
+BufferPool::allocateRaw(size_t size)
+{
+    // Large objects don't use the pool since we can't tell whether they
+    // came from a slab when they are released
+    int cls = sizeClass(size);
+    if (cls < 0 || cls >= HUGE_CLASS) {
+        auto p = std::malloc(size);
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+    bool slab;
+    return get(cls, slab);
+}
+
+void
+BufferPool::release(void* p, size_t size)
+{
+    int cls = sizeClass(size);
+    if (cls < 0 || cls >= HUGE_CLASS)
+        std::free(p);
+    else
+        put(static_cast<uint8_t*>(p), cls, false);
+}
+
+BufferPool::Stats
+BufferPool::stats() const
+{
+    return Stats{
+        hits_.load(std::memory_order_relaxed),
+        misses_.load(std::memory_order_relaxed),
+        bytesHeld_.load(std::memory_order_relaxed)};
+}
+
+void
+BufferPool::trim()
+{
+    if (threadCacheState == CacheState::LIVE) {
+        auto& tc = threadCache();
+        for (int cls = 0; cls < CLASSES; cls++) {
+            // Slab buffers can't be freed individually so they move to
+            // the shared cache and are still held
+            auto& sc = shared_[cls];
+            std::unique_lock<std::mutex> lock(sc.mutex);
+            for (auto entry: tc.free[cls]) {
+                if (entry & SLAB_TAG) {
+                    sc.free.push_back(entry);
+                    continue;
+                }
+                bytesHeld_ -= classSize(cls);
+                std::free(reinterpret_cast<uint8_t*>(entry));
+            }
+            tc.free[cls].clear();
+        }
+    }
+    for (int cls = 0; cls < CLASSES; cls++) {
+        auto& sc = shared_[cls];
+        std::unique_lock<std::mutex> lock(sc.mutex);
+        auto i = std::remove_if(
+            sc.free.begin(), sc.free.end(),
+            [this, cls](auto entry) {
+                if (entry & SLAB_TAG)
+                    return false;
+                bytesHeld_ -= classSize(cls);
+                std::free(reinterpret_cast<uint8_t*>(entry));
+                return true;
+            });
+        sc.free.erase(i, sc.free.end());
+    }
+}
+
+BufferPool::ThreadCache&
+BufferPool::threadCache()
+{
+    static thread_local ThreadCache cache;
+    return cache;
+}
+
+uint8_t*
+BufferPool::get(int cls, bool& slab)
+{
+    uintptr_t entry = 0;
+    if (threadCacheState != CacheState::DESTROYED) {
+        auto& tc = threadCache();
+        if (tc.free[cls].size() > 0) {
+            entry = tc.free[cls].back();
+            tc.free[cls].pop_back();
+        }
+    }
+    if (!entry) {
+        auto& sc = shared_[cls];
+        std::unique_lock<std::mutex> lock(sc.mutex);
+        if (sc.free.size() > 0) {
+            entry = sc.free.back();
+            sc.free.pop_back();
+        }
+    }
+    if (entry) {
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        bytesHeld_ -= classSize(cls);
+        slab = (entry & SLAB_TAG) != 0;
+        return reinterpret_cast<uint8_t*>(entry & ~SLAB_TAG);
+    }
+
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    if (hugePages_ && cls >= HUGE_CLASS) {
+        auto p = newSlab(cls);
+        if (p) {
+            slab = true;
+            return p;
+        }
+    }
+    slab = false;
+    auto p = static_cast<uint8_t*>(std::malloc(classSize(cls)));
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void
+BufferPool::put(uint8_t* p, int cls, bool slab)
+{
+    auto entry = reinterpret_cast<uintptr_t>(p) | (slab ? SLAB_TAG : 0);
+    if (threadCacheState != CacheState::DESTROYED) {
+        auto& tc = threadCache();
+        if (tc.free[cls].size() < threadLimit(cls)) {
+            tc.free[cls].push_back(entry);
+            bytesHeld_ += classSize(cls);
+            return;
+        }
+    }
+
+    // Slab buffers always go back to the shared cache since they can't
+    // be freed individually
+    auto& sc = shared_[cls];
+    std::unique_lock<std::mutex> lock(sc.mutex);
+    if (slab || sc.free.size() < sharedLimit(cls)) {
+        sc.free.push_back(entry);
+        bytesHeld_ += classSize(cls);
+        return;
+    }
+    lock.unlock();
+    std::free(p);
+}
+
+uint8_t*
+BufferPool::newSlab(int cls)
+{
+    void* p;
+#if defined(__linux__)
+    p = ::mmap(nullptr, SLAB_SIZE, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+        // No reserved huge pages - ask for transparent huge pages instead
+        p = ::mmap(nullptr, SLAB_SIZE, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED)
+            ::madvise(p, SLAB_SIZE, MADV_HUGEPAGE);
+    }
+#elif defined(__FreeBSD__)
+    p = ::mmap(nullptr, SLAB_SIZE, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANON|MAP_ALIGNED_SUPER, -1, 0);
+#else
+    p = ::mmap(nullptr, SLAB_SIZE, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANON, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+        return nullptr;
+
+    // Return the first buffer to the caller and add the rest to the
+    // shared cache
+    auto base = static_cast<uint8_t*>(p);
+    auto size = classSize(cls);
+    auto& sc = shared_[cls];
+    std::unique_lock<std::mutex> lock(sc.mutex);
+    for (size_t off = size; off + size <= SLAB_SIZE; off += size) {
+        sc.free.push_back(reinterpret_cast<uintptr_t>(base + off) | SLAB_TAG);
+        bytesHeld_ += size;
+    }
+    return base;
+}
@@ -24,7 +24,10 @@
  * SUCH DAMAGE.
  */
 
+#include <climits>
+#include <cstring>
 #include <random>
+#include <tuple>
 
 #include <unistd.h>
 #include <sys/select.h>
@@ -63,66 +66,21 @@ static auto toMilliseconds(Dur dur)
 }
 
 Message::Message(size_t sz)
-    : XdrMemory(sz)
+    : XdrChain(sz)
 {
-    iov_.emplace_back(iovec{writeCursor_, 0});
     readCursor_ = readLimit_ = nullptr;
 }
 
-void
-Message::putBuffer(const std::shared_ptr<Buffer>& buf)
-{
-    auto p = buf->data();
-    auto len = buf->size();
-
-    if (len == 0)
-        return;
-
-    refBytes_ += len;
-    iovec* iovp = &iov_.back();
-    void* base = iovp->iov_base;
-    void* wp = writeCursor_;
-    if (wp > base) {
-        iovp->iov_len = uintptr_t(wp) - uintptr_t(base);
-        iov_.emplace_back(iovec{p, len});
-    }
-    else {
-        *iovp = iovec{p, len};
-    }
-    buffers_.push_back(buf);
-
-    size_t pad = __round(len) - len;
-    if (pad > 0) {
-        refBytes_ += pad;
-        iov_.emplace_back(iovec{pad_, pad});
-    }
-
-    iov_.emplace_back(iovec{writeCursor_, 0});
-}
-
-void
-Message::flush()
-{
-    iovec* iovp = &iov_.back();
-    void* base = iovp->iov_base;
-    void* wp = writeCursor_;
-    if (wp > base) {
-        iovp->iov_len = uintptr_t(wp) - uintptr_t(base);
-    }
-    else {
-        iov_.pop_back();
-    }
-}
-
 size_t
 Message::readSize() const
 {
-    return XdrMemory::readSize() + refBytes_;
+    return writePos();
 }
 
 void
 Message::fill()
 {
+    endRun();
     if (readIndex_ == int(iov_.size()))
         throw XdrError("overflow");
     auto iovp = &iov_[readIndex_];
@@ -131,6 +89,50 @@ Message::fill()
     readIndex_++;
 }
 
+void
+Message::getBuffer(std::shared_ptr<Buffer>& buf, size_t size)
+{
+    if (size == 0) {
+        XdrSource::getBuffer(buf, size);
+        return;
+    }
+    if (readCursor_ == readLimit_)
+        fill();
+
+    // Buffers added with putBuffer, e.g. received as shared memory,
+    // are returned without copying if the owner of the message allows.
+    // Otherwise they are not part of any segment and are copied below.
+    if (shareBuffers_ && size_t(readLimit_ - readCursor_) == size) {
+        for (auto& b: buffers_) {
+            if (b->data() == readCursor_ && b->size() == size) {
+                buf = b;
+                readCursor_ = readLimit_;
+                // Skip the padding added by putBuffer
+                if (__round(size) != size) {
+                    fill();
+                    readCursor_ = readLimit_;
+                }
+                return;
+            }
+        }
+    }
+
+    // Otherwise, if the bytes are contiguous in one of our segments,
+    // return a slice of it. The slice holds a reference to the segment
+    // so that it survives rewind or destruction of the message.
+    auto len = __round(size);
+    if (readCursor_ + len <= readLimit_) {
+        auto seg = segmentOf(readCursor_);
+        if (seg) {
+            size_t off = readCursor_ - (*seg)->data();
+            buf = std::make_shared<Buffer>(*seg, off, off + size);
+            readCursor_ += len;
+            return;
+        }
+    }
+    XdrSource::getBuffer(buf, size);
+}
+
 std::chrono::seconds Channel::maxBackoff(30);
 
 std::shared_ptr<Channel> Channel::open(const AddressInfo& ai)
@@ -219,6 +221,135 @@ std::shared_ptr<Channel> Channel::open(
     return Channel::open(getAddressInfo(url, netid));
 }
 
+Channel::TransactionTable::TransactionTable()
+{
+    resize(64);
+}
+
+void
+Channel::TransactionTable::insert(Transaction* tx)
+{
+    if (2 * (size_ + 1) > slots_.size())
+        resize(2 * slots_.size());
+    auto i = lookup(tx->xid);
+    if (slots_[i].tx)
+        return;
+    slots_[i] = Slot{tx->xid, tx};
+    size_++;
+    tx->pending = true;
+    track(*tx);
+}
+
+Channel::Transaction*
+Channel::TransactionTable::find(uint32_t xid) const
+{
+    return slots_[lookup(xid)].tx;
+}
+
+void
+Channel::TransactionTable::erase(uint32_t xid)
+{
+    auto i = lookup(xid);
+    auto tx = slots_[i].tx;
+    if (!tx)
+        return;
+    untrack(*tx);
+    tx->pending = false;
+    size_--;
+
+    // Move any following entries which would no longer be found back
+    // into the gap
+    auto j = i;
+    for (;;) {
+        j = (j + 1) & mask_;
+        if (!slots_[j].tx)
+            break;
+        auto k = slots_[j].xid & mask_;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        slots_[i] = slots_[j];
+        i = j;
+    }
+    slots_[i] = Slot{0, nullptr};
+}
+
+void
+Channel::TransactionTable::setState(
+    Transaction& tx, Transaction::State state)
+{
+    if (tx.pending) {
+        untrack(tx);
+        tx.state = state;
+        track(tx);
+    }
+    else {
+        tx.state = state;
+    }
+}
+
+size_t
+Channel::TransactionTable::lookup(uint32_t xid) const
+{
+    auto i = xid & mask_;
+    while (slots_[i].tx && slots_[i].xid != xid)
+        i = (i + 1) & mask_;
+    return i;
+}
+
+void
+Channel::TransactionTable::resize(size_t count)
+{
+    std::vector<Slot> old(count, Slot{0, nullptr});
+    std::swap(old, slots_);
+    mask_ = count - 1;
+    for (auto& slot: old) {
+        if (slot.tx)
+            slots_[lookup(slot.xid)] = slot;
+    }
+}
+
+void
+Channel::TransactionTable::track(Transaction& tx)
+{
+    switch (tx.state) {
+    case Transaction::REPLY:
+    case Transaction::RESEND:
+        awake_++;
+        break;
+    case Transaction::SLEEPING:
+        tx.prevSleeper = nullptr;
+        tx.nextSleeper = sleepers_;
+        if (sleepers_)
+            sleepers_->prevSleeper = &tx;
+        sleepers_ = &tx;
+        break;
+    default:
+        break;
+    }
+}
+
+void
+Channel::TransactionTable::untrack(Transaction& tx)
+{
+    switch (tx.state) {
+    case Transaction::REPLY:
+    case Transaction::RESEND:
+        awake_--;
+        break;
+    case Transaction::SLEEPING:
+        if (tx.prevSleeper)
+            tx.prevSleeper->nextSleeper = tx.nextSleeper;
+        else
+            sleepers_ = tx.nextSleeper;
+        if (tx.nextSleeper)
+            tx.nextSleeper->prevSleeper = tx.prevSleeper;
+        tx.prevSleeper = tx.nextSleeper = nullptr;
+        break;
+    default:
+        break;
+    }
+}
+
 Channel::Channel()
     : xid_(nextXid())
 {
@@ -236,154 +367,654 @@ Channel::~Channel()
     assert(pending_.size() == 0);
 }
 
-std::future<void>
-Channel::callAsync(
+uint32_t
+Channel::startCall(
     Client* client, uint32_t proc,
     std::function<void(XdrSink*)> xargs,
     std::function<void(XdrSource*)> xresults,
+    std::function<void(std::exception_ptr)> done,
     Protection prot,
     clock_type::duration timeout)
 {
-    uint32_t xid;
-    auto txp = new Transaction;
-    auto& tx = *txp;
-
-    auto now = clock_type::now();
-    auto maxTime = now + timeout;
-    int gen;
-    std::unique_ptr<XdrSink> xdrout;
+    // If the client needs to establish an authentication context, do
+    // that synchronously before starting the call
+    int gen = client->validateAuth(this, false);
+    if (!gen)
+        gen = client->validateAuth(this);
 
     std::unique_lock<std::mutex> lock(mutex_);
-    xid = tx.xid = xid_++;
-    VLOG(3) << "assigning new xid: " << tx.xid;
+    auto tx = allocTransaction();
+    tx->client = client;
+    tx->proc = proc;
+    tx->prot = prot;
+    tx->gen = gen;
+    tx->xargs = std::move(xargs);
+    tx->xresults = std::move(xresults);
+    tx->done = std::move(done);
+    tx->maxTime = clock_type::now() + timeout;
+    tx->retransmitInterval = initialRetransmit(timeout);
     lock.unlock();
 
-    for (;;) {
-        gen = client->validateAuth(this, false);
-        if (!gen) {
-            using namespace std::placeholders;
-            delete txp;
-            return std::async(
-                std::bind(&Channel::call, this, _1, _2, _3, _4, _5, _6),
-                client, proc, xargs, xresults, prot, timeout);
-        }
-
-        xdrout = acquireSendBuffer();
-        if (!client->processCall(
-            xid, gen, proc, xdrout.get(), xargs, prot, tx.seq)) {
-            continue;
-        }
-        break;
+    try {
+        return sendCall(tx);
     }
-
-    if (tman_) {
-        // XXX: Should attempt to support retransmits here
-        tx.tid = tman_->add(maxTime, [=]() {
-            std::unique_lock<std::mutex> lock(mutex_);
-            pending_.erase(xid);
-            txp->continuation();
-            delete txp;
-        });
+    catch (...) {
+        lock.lock();
+        releaseTransaction(tx);
+        throw;
     }
-    tx.async = true;
-    tx.continuation = std::packaged_task<void()>([=]() {
-        auto now = clock_type::now();
-        auto& tx = *txp;
-        if (!tx.body)
-            throw TimeoutError();
-        if (!processReply(client, proc, tx, prot, gen, xresults)) {
-            // This should be rare - just process the call synchronously
-            call(client, proc, xargs, xresults, prot, maxTime - now);
-        }
-    });
-    tx.timeout = maxTime;
-
-    lock.lock();
-    pending_.emplace(xid, txp);
-    lock.unlock();
+}
 
-    auto res = tx.continuation.get_future();
-    sendMessage(std::move(xdrout));
-    return res;
+bool
+Channel::cancelCall(uint32_t xid)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto tx = pending_.find(xid);
+    if (!tx || !tx->done)
+        return false;
+    VLOG(3) << "xid: " << xid << ": cancelled";
+    pending_.erase(xid);
+    auto tman = timeoutManager();
+    if (tman && tx->tid)
+        tman->cancel(tx->tid);
+    releaseTransaction(tx);
+    return true;
 }
 
-void
-Channel::call(
+std::future<void>
+Channel::callAsync(
     Client* client, uint32_t proc,
     std::function<void(XdrSink*)> xargs,
     std::function<void(XdrSource*)> xresults,
     Protection prot,
     clock_type::duration timeout)
 {
-    int nretries = 0;
-    auto retransmitInterval = retransmitInterval_;
-    if (retransmitInterval.count() == 0)
-	retransmitInterval = timeout;
+    auto promise = std::make_shared<std::promise<void>>();
+    auto res = promise->get_future();
+    startCall(
+        client, proc, xargs, xresults,
+        [promise](std::exception_ptr error) {
+            if (error)
+                promise->set_exception(error);
+            else
+                promise->set_value();
+        },
+        prot, timeout);
+    return res;
+}
 
-    uint32_t xid;
-    Transaction tx;
+void
+Channel::callBatch(
+    Client* client, std::vector<BatchCall>& calls,
+    Protection prot,
+    clock_type::duration timeout)
+{
+    if (calls.size() == 0)
+        return;
 
-    auto now = clock_type::now();
-    auto maxTime = now + timeout;
+    int gen = client->validateAuth(this, false);
+    if (!gen)
+        gen = client->validateAuth(this);
+
+    // The calling thread waits using a transaction which is never
+    // sent. It sits in pending_ so that, like a thread in Channel::call,
+    // it can be woken to take over reading replies. The done callback
+    // of the last call to complete also wakes it.
+    Transaction waiter;
+    size_t remaining = calls.size();
+    std::vector<Transaction*> txs;
+    txs.reserve(calls.size());
+    auto maxTime = clock_type::now() + timeout;
+    auto tman = timeoutManager();
 
     std::unique_lock<std::mutex> lock(mutex_);
-    for (;;) {
-        if (!tx.xid) {
-            xid = tx.xid = xid_++;
-            pending_.emplace(xid, &tx);
-            VLOG(3) << "assigning new xid: " << tx.xid;
+    waiter.xid = xid_++;
+    pending_.insert(&waiter);
+    pending_.setState(waiter, Transaction::REPLY);
+    for (auto& call: calls) {
+        auto tx = allocTransaction();
+        tx->client = client;
+        tx->proc = call.proc;
+        tx->prot = prot;
+        tx->gen = gen;
+        tx->xargs = call.xargs;
+        tx->xresults = call.xresults;
+        tx->done = [this, &call, &waiter, &remaining](
+            std::exception_ptr error) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            call.error = error;
+            if (--remaining == 0)
+                waiter.cv.notify_one();
+        };
+        tx->maxTime = maxTime;
+        tx->retransmitInterval = initialRetransmit(timeout);
+        tx->xid = xid_++;
+        tx->sent = clock_type::now();
+        tx->refs++;             // held until the batch is finished
+        pending_.insert(tx);
+        armCallTimer(tx);
+        txs.push_back(tx);
+    }
+    VLOG(3) << "xid: " << txs.front()->xid << ".." << txs.back()->xid
+            << ": starting batch";
+
+    // Remove any calls which are still pending, returning their
+    // indices. Called with mutex_ held.
+    auto takePending = [&]() {
+        std::vector<size_t> res;
+        for (size_t i = 0; i < txs.size(); i++) {
+            auto tx = txs[i];
+            if (!tx->pending)
+                continue;
+            pending_.setState(*tx, Transaction::SEND);
+            pending_.erase(tx->xid);
+            if (tman && tx->tid)
+                tman->cancel(tx->tid);
+            tx->tid = 0;
+            res.push_back(i);
+        }
+        return res;
+    };
+
+    // Finish calls removed by takePending with an error. Called with
+    // mutex_ held.
+    auto fail = [&](
+        const std::vector<size_t>& which, std::exception_ptr error) {
+        for (auto i: which) {
+            calls[i].error = error;
+            remaining--;
+            releaseTransaction(txs[i]);
         }
+    };
 
-        tx.state = Transaction::AUTH;
-        VLOG(3) << "xid: " << xid << ": validating auth";
+    // After the channel reconnects, send each unfinished call again
+    // with a new xid
+    auto resend = [&]() {
+        auto which = takePending();
         lock.unlock();
-        int gen = client->validateAuth(this);
+        for (auto i: which) {
+            try {
+                sendCall(txs[i]);
+            }
+            catch (...) {
+                lock.lock();
+                fail({i}, std::current_exception());
+                lock.unlock();
+            }
+        }
         lock.lock();
-        tx.state = Transaction::SEND;
-
-        // Drop the lock while we transmit
+    };
+
+    // Without a TimeoutManager, no timer retransmits the calls so the
+    // waiting thread wakes at the earliest retransmit time and resends
+    // any overdue calls itself
+    auto nextWakeup = [&]() {
+        auto res = maxTime;
+        if (!tman) {
+            for (auto tx: txs)
+                if (tx->pending && tx->timeout < res)
+                    res = tx->timeout;
+        }
+        return res;
+    };
+
+    // Retransmit calls whose timeout has passed. Called with mutex_
+    // held.
+    auto retransmit = [&](clock_type::time_point now) {
+        std::vector<size_t> which;
+        for (size_t i = 0; i < txs.size(); i++) {
+            auto tx = txs[i];
+            if (!tx->pending || tx->timeout > now)
+                continue;
+            VLOG(3) << "xid: " << tx->xid << ": retransmitting";
+            tx->retransmitted = true;
+            rtt_.backoff();
+            if (tx->retransmitInterval < maxBackoff)
+                tx->retransmitInterval *= 2;
+            armCallTimer(tx);
+            which.push_back(i);
+        }
+        if (which.empty())
+            return;
         lock.unlock();
-        auto xdrout = acquireSendBuffer();
-        if (!client->processCall(
-            xid, gen, proc, xdrout.get(), xargs, prot, tx.seq)) {
-            lock.lock();
-            continue;
+        for (auto i: which) {
+            auto tx = txs[i];
+            auto xid = tx->xid;
+            try {
+                transmitCall(tx);
+            }
+            catch (...) {
+                // Unless the call completed while we were sending
+                lock.lock();
+                if (pending_.find(xid) == tx) {
+                    pending_.erase(xid);
+                    fail({i}, std::current_exception());
+                }
+                lock.unlock();
+            }
         }
-        try {
-            sendMessage(std::move(xdrout));
+        lock.lock();
+    };
+
+    lock.unlock();
+    try {
+        std::vector<std::unique_ptr<XdrSink>> msgs;
+        msgs.reserve(txs.size());
+        for (auto tx: txs)
+            msgs.push_back(encodeCall(tx));
+        sendMessages(std::move(msgs));
+        lock.lock();
+    }
+    catch (ResendMessage&) {
+        VLOG(3) << "channel reconnected, resending batch";
+        lock.lock();
+        resend();
+    }
+    catch (std::runtime_error& e) {
+        LOG(INFO) << "error sending batch: " << e.what();
+        lock.lock();
+        fail(takePending(), std::current_exception());
+    }
+
+    while (remaining > 0) {
+        auto now = clock_type::now();
+        if (now >= maxTime) {
+            VLOG(2) << "batch timeout";
+            fail(takePending(), std::make_exception_ptr(TimeoutError()));
+            // Calls which some other thread is completing finish soon
+            if (remaining > 0)
+                waiter.cv.wait_for(lock, std::chrono::milliseconds(1));
+            continue;
         }
-        catch (ResendMessage&) {
-            VLOG(3) << "xid: " << xid
-                    << ": channel reconnected, resending";
-            lock.lock();
-            pending_.erase(xid);
+        if (waiter.state == Transaction::RESEND) {
+            VLOG(3) << "channel reconnected, resending batch";
+            pending_.setState(waiter, Transaction::REPLY);
+            resend();
             continue;
         }
-        catch (std::runtime_error& e) {
-            LOG(INFO) << "xid: " << xid << " error sending: " << e.what();
-            lock.lock();
-            pending_.erase(xid);
-            throw;
+        if (!tman) {
+            retransmit(now);
+            if (remaining == 0)
+                break;
+        }
+        auto wakeup = nextWakeup();
+        if (running_ || replyDispatch_) {
+            // Someone else is reading replies, wait until they wake us,
+            // the last call completes or a call needs retransmitting
+            pending_.setState(waiter, Transaction::SLEEPING);
+            waiter.cv.wait_until(lock, wakeup);
+            if (waiter.state == Transaction::SLEEPING)
+                pending_.setState(waiter, Transaction::REPLY);
+        }
+        else {
+            running_ = true;
+            try {
+                processIncomingMessage(waiter, lock, wakeup - now);
+            }
+            catch (ResendMessage&) {
+                running_ = false;
+                pending_.forEach([this](Transaction& other) {
+                    pending_.setState(other, Transaction::RESEND);
+                    other.cv.notify_one();
+                });
+                continue;
+            }
+            catch (std::runtime_error& e) {
+                running_ = false;
+                LOG(INFO) << "error receiving batch: " << e.what();
+                fail(takePending(), std::current_exception());
+                continue;
+            }
+            running_ = false;
         }
+    }
+
+    pending_.erase(waiter.xid);
+    for (auto tx: txs)
+        releaseTransaction(tx);
+    wakeReader();
+}
+
+Channel::Transaction*
+Channel::allocTransaction()
+{
+    Transaction* tx;
+    if (freeTransactions_.size() > 0) {
+        tx = freeTransactions_.back().release();
+        freeTransactions_.pop_back();
+    }
+    else {
+        tx = new Transaction;
+    }
+    tx->refs = 1;
+    return tx;
+}
+
+void
+Channel::releaseTransaction(Transaction* tx)
+{
+    if (--tx->refs > 0)
+        return;
+
+    // Reset the transaction for its next use, dropping anything the
+    // callbacks captured
+    tx->state = Transaction::SEND;
+    tx->xid = 0;
+    tx->seq = 0;
+    tx->reply = rpc_msg();
+    tx->body.reset();
+    tx->ready = false;
+    tx->tid = 0;
+    tx->retransmitted = false;
+    tx->client = nullptr;
+    tx->xargs = nullptr;
+    tx->xresults = nullptr;
+    tx->done = nullptr;
+    freeTransactions_.emplace_back(tx);
+}
+
+uint32_t
+Channel::sendCall(Transaction* tx)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto xid = tx->xid = xid_++;
+    VLOG(3) << "assigning new xid: " << xid;
+    tx->body.reset();
+    tx->ready = false;
+    tx->sent = clock_type::now();
+    tx->retransmitted = false;
+    pending_.insert(tx);
+    armCallTimer(tx);
+    tx->refs++;
+    lock.unlock();
+
+    try {
+        transmitCall(tx);
+    }
+    catch (...) {
+        // If the call completed while we were sending, the error is
+        // moot, otherwise our caller owns it and reports the error
         lock.lock();
+        bool owned = pending_.find(xid) == tx;
+        if (owned) {
+            pending_.erase(xid);
+            auto tman = timeoutManager();
+            if (tman && tx->tid)
+                tman->cancel(tx->tid);
+            tx->tid = 0;
+        }
+        releaseTransaction(tx);
+        if (owned)
+            throw;
+        return xid;
+    }
+    lock.lock();
+    releaseTransaction(tx);
+    return xid;
+}
 
-	auto sendTime = now;
-        tx.timeout  = now + retransmitInterval;
-        if (tx.timeout > maxTime)
-            tx.timeout = maxTime;
-	VLOG(3) << "retransmit in "
-		<< std::chrono::duration_cast<
-		    std::chrono::milliseconds>(retransmitInterval).count()
-		<< "ms";
+RttEstimator::Stats
+Channel::rttStats()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return rtt_.stats();
+}
 
-        // Loop waiting for replies until we either get a matching
-        // reply message or we time out
-        for (;;) {
-            tx.state = Transaction::REPLY;
-            now = clock_type::now();
-            assert(lock);
-            if (!tx.body) {
-                if (now >= tx.timeout) {
+Channel::clock_type::duration
+Channel::initialRetransmit(clock_type::duration timeout)
+{
+    if (retransmitInterval_.count() == 0)
+        return timeout;
+    if (adaptiveRetransmit_)
+        return rtt_.timeout();
+    return retransmitInterval_;
+}
+
+void
+Channel::sampleRtt(const Transaction& tx)
+{
+    rtt_.sample(
+        std::chrono::duration_cast<RttEstimator::duration>(
+            clock_type::now() - tx.sent));
+}
+
+void
+Channel::wakeReader()
+{
+    if (pending_.size() > 0 && !replyDispatch_) {
+        VLOG(3) << pending_.size() << " transactions pending";
+        if (pending_.awake() == 0) {
+            auto toWake = pending_.sleeper();
+            if (!toWake) {
+                // If there are no sleeping threads, then all the pending
+                // transactions must be in auth state. Exactly one of
+                // those threads must be performing the auth while the
+                // rest sleep. Since no non-auth transactions can be
+                // in-flight and we have just completed a transaction,
+                // it must be true that this thread is the auth performer
+                // which means that we also own one of the transactions
+                // in AUTH state - if we just return, that transaction
+                // will move back to AWAKE state and we can continue to
+                // make forward progress.
+            }
+            else {
+                VLOG(3) << "waking thread for " << "xid: " << toWake->xid;
+                toWake->cv.notify_one();
+            }
+        }
+    }
+}
+
+std::unique_ptr<XdrSink>
+Channel::encodeCall(Transaction* tx)
+{
+    for (;;) {
+        uint32_t seq;
+        auto xdrout = acquireSendBuffer();
+        if (!tx->client->processCall(
+                tx->xid, tx->gen, tx->proc, xdrout.get(), tx->xargs,
+                tx->prot, seq)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        tx->seq = seq;
+        return xdrout;
+    }
+}
+
+void
+Channel::transmitCall(Transaction* tx)
+{
+    sendMessage(encodeCall(tx));
+}
+
+void
+Channel::sendMessages(std::vector<std::unique_ptr<XdrSink>>&& msgs)
+{
+    for (auto& msg: msgs)
+        sendMessage(std::move(msg));
+}
+
+void
+Channel::armCallTimer(Transaction* tx)
+{
+    tx->timeout = std::min(
+        clock_type::now() + tx->retransmitInterval, tx->maxTime);
+    auto tman = timeoutManager();
+    if (!tman)
+        return;
+    auto xid = tx->xid;
+    std::weak_ptr<Channel> self = shared_from_this();
+    tx->tid = tman->add(tx->timeout, [self, xid]() {
+        auto chan = self.lock();
+        if (chan)
+            chan->onCallTimer(xid);
+    });
+}
+
+void
+Channel::onCallTimer(uint32_t xid)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto tx = pending_.find(xid);
+    if (!tx || !tx->done)
+        return;
+    tx->tid = 0;
+    if (clock_type::now() >= tx->maxTime) {
+        VLOG(2) << "xid: " << xid << ": timeout";
+        pending_.erase(xid);
+        lock.unlock();
+        completeCall(tx);
+        return;
+    }
+
+    VLOG(3) << "xid: " << xid << ": retransmitting";
+    tx->retransmitted = true;
+    rtt_.backoff();
+    if (tx->retransmitInterval < maxBackoff)
+        tx->retransmitInterval *= 2;
+    armCallTimer(tx);
+    tx->refs++;
+    lock.unlock();
+
+    std::exception_ptr error;
+    try {
+        transmitCall(tx);
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    lock.lock();
+    if (error && pending_.find(xid) == tx) {
+        pending_.erase(xid);
+        auto tman = timeoutManager();
+        if (tman && tx->tid)
+            tman->cancel(tx->tid);
+        tx->tid = 0;
+        auto done = std::move(tx->done);
+        releaseTransaction(tx);
+        releaseTransaction(tx);
+        lock.unlock();
+        done(error);
+        return;
+    }
+    releaseTransaction(tx);
+}
+
+void
+Channel::completeCall(Transaction* tx)
+{
+    std::exception_ptr error;
+    try {
+        if (!tx->body)
+            throw TimeoutError();
+        if (!processReply(
+                tx->client, tx->proc, *tx, tx->prot, tx->gen, tx->xresults)) {
+            // Send again with a new xid
+            sendCall(tx);
+            return;
+        }
+    }
+    catch (GssError& e) {
+        // As for call, a GSS-API error is most likely a sequence number
+        // mismatch - send again with a new xid and sequence number
+        LOG(ERROR) << "GSS-API error processing reply: resending";
+        try {
+            sendCall(tx);
+            return;
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto done = std::move(tx->done);
+    releaseTransaction(tx);
+    lock.unlock();
+    done(error);
+}
+
+void
+Channel::call(
+    Client* client, uint32_t proc,
+    std::function<void(XdrSink*)> xargs,
+    std::function<void(XdrSource*)> xresults,
+    Protection prot,
+    clock_type::duration timeout)
+{
+    int nretries = 0;
+    uint32_t xid = 0;
+    Transaction tx;
+    int sends = 0;              // times the current xid was sent
+
+    auto now = clock_type::now();
+    auto maxTime = now + timeout;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto retransmitInterval = initialRetransmit(timeout);
+    for (;;) {
+        if (!tx.xid) {
+            xid = tx.xid = xid_++;
+            pending_.insert(&tx);
+            sends = 0;
+            VLOG(3) << "assigning new xid: " << tx.xid;
+        }
+
+        pending_.setState(tx, Transaction::AUTH);
+        VLOG(3) << "xid: " << xid << ": validating auth";
+        lock.unlock();
+        int gen = client->validateAuth(this);
+        lock.lock();
+        pending_.setState(tx, Transaction::SEND);
+
+        // Drop the lock while we transmit
+        lock.unlock();
+        auto xdrout = acquireSendBuffer();
+        if (!client->processCall(
+            xid, gen, proc, xdrout.get(), xargs, prot, tx.seq)) {
+            lock.lock();
+            continue;
+        }
+        if (sends++ == 0)
+            tx.sent = clock_type::now();
+        try {
+            sendMessage(std::move(xdrout));
+        }
+        catch (ResendMessage&) {
+            VLOG(3) << "xid: " << xid
+                    << ": channel reconnected, resending";
+            lock.lock();
+            continue;
+        }
+        catch (std::runtime_error& e) {
+            LOG(INFO) << "xid: " << xid << " error sending: " << e.what();
+            lock.lock();
+            pending_.erase(xid);
+            throw;
+        }
+        lock.lock();
+
+	auto sendTime = now;
+        tx.timeout  = now + retransmitInterval;
+        if (tx.timeout > maxTime)
+            tx.timeout = maxTime;
+	VLOG(3) << "retransmit in "
+		<< std::chrono::duration_cast<
+		    std::chrono::milliseconds>(retransmitInterval).count()
+		<< "ms";
+
+        // Loop waiting for replies until we either get a matching
+        // reply message or we time out
+        for (;;) {
+            pending_.setState(tx, Transaction::REPLY);
+            now = clock_type::now();
+            assert(lock);
+            if (!tx.body) {
+                if (now >= tx.timeout) {
 		    auto delta =
 			std::chrono::duration_cast<
 			std::chrono::milliseconds>(now - sendTime);
@@ -392,12 +1023,24 @@ Channel::call(
                     break;
                 }
                 auto timeoutDuration = tx.timeout - now;
-                if (running_) {
+                if (replyDispatch_ && replySpin_.count() > 0) {
+                    // Poll briefly in case the reply is about to arrive
+                    auto spinUntil =
+                        now + std::min(replySpin_, timeoutDuration);
+                    lock.unlock();
+                    while (!tx.ready.load(std::memory_order_acquire) &&
+                           clock_type::now() < spinUntil)
+                        std::this_thread::yield();
+                    lock.lock();
+                    if (tx.body)
+                        break;
+                }
+                if (running_ || replyDispatch_) {
                     // Someone else is reading replies, wait until they wake
                     // us or until we time out.
                     VLOG(3) << "xid: " << xid << ": waiting for other thread: "
                             << toMilliseconds(timeoutDuration) << "ms";
-                    tx.state = Transaction::SLEEPING;
+                    pending_.setState(tx, Transaction::SLEEPING);
                     tx.cv.wait_for(lock, timeoutDuration);
                     // If the channel was reconnected, we need to re-send
                     if (tx.state == Transaction::RESEND) {
@@ -405,7 +1048,7 @@ Channel::call(
                                 << ": channel reconnected, resending";
                         break;
                     }
-                    tx.state = Transaction::REPLY;
+                    pending_.setState(tx, Transaction::REPLY);
                 }
                 else {
                     running_ = true;
@@ -418,10 +1061,10 @@ Channel::call(
                         running_ = false;
                         VLOG(3) << "xid: " << xid
                                 << ": channel reconnected, resending";
-                        for (auto& i: pending_) {
-                            i.second->state = Transaction::RESEND;
-                            i.second->cv.notify_one();
-                        }
+                        pending_.forEach([this](Transaction& other) {
+                            pending_.setState(other, Transaction::RESEND);
+                            other.cv.notify_one();
+                        });
                         break;
                     }
                     catch (std::runtime_error& e) {
@@ -441,8 +1084,9 @@ Channel::call(
         }
 
         assert(lock);
-        pending_.erase(xid);
 
+        // The transaction stays in pending_ while we retransmit so
+        // that a dispatching reader can still match the reply
         if (!tx.body) {
             // Socket reconnect - retransmit without timeout checking
             if (tx.state == Transaction::RESEND)
@@ -452,60 +1096,28 @@ Channel::call(
             if (now >= maxTime) {
                 // XXX wakeup pending threads here?
 		VLOG(2) << "xid: " << xid << ": timeout";
+                pending_.erase(xid);
                 throw TimeoutError();
             }
             VLOG(3) << "xid: " << xid << ": retransmitting";
             nretries++;
+            rtt_.backoff();
             if (retransmitInterval < maxBackoff)
                 retransmitInterval *= 2;
             continue;
         }
 
+        pending_.erase(xid);
         VLOG(3) << "xid: " << xid << ": reply received";
+        if (sends == 1)
+            sampleRtt(tx);
         assert(tx.reply.xid == xid);
         tx.reply.xid = 0;
         tx.xid = 0;
 
         // If we have any pending transactions, make sure that at least
         // one thread is awake to read replies.
-        if (pending_.size() > 0) {
-            VLOG(3) << pending_.size() << " transactions pending";
-            int liveThreads = 0;
-            Transaction* toWake = nullptr;
-            for (auto& i: pending_) {
-                switch (i.second->state) {
-                case Transaction::SEND:
-                    break;
-                case Transaction::AUTH:
-                    break;
-                case Transaction::REPLY:
-                case Transaction::RESEND:
-                    liveThreads++;
-                    break;
-                case Transaction::SLEEPING:
-                    toWake = i.second;
-                    break;
-                }
-            }
-            if (liveThreads == 0) {
-                if (!toWake) {
-                    // If there are no sleeping threads, then all the pending
-                    // transactions must be in auth state. Exactly one of
-                    // those threads must be performing the auth while the
-                    // rest sleep. Since no non-auth transactions can be
-                    // in-flight and we have just completed a transaction,
-                    // it must be true that this thread is the auth performer
-                    // which means that we also own one of the transactions
-                    // in AUTH state - if we just return, that transaction
-                    // will move back to AWAKE state and we can continue to
-                    // make forward progress.
-                }
-                else {
-                    VLOG(3) << "waking thread for " << "xid: " << toWake->xid;
-                    toWake->cv.notify_one();
-                }
-            }
-        }
+        wakeReader();
 
         lock.unlock();
 	try {
@@ -527,6 +1139,7 @@ Channel::call(
 	}
         lock.lock();
         tx.body.reset();
+        tx.ready = false;
     }
 }
 
@@ -588,15 +1201,28 @@ bool Channel::processIncomingMessage(
             lock.lock();
             throw;
         }
+        if (!body) {
+            now = clock_type::now();
+            if (tman_) tman_->update(now);
+        }
         lock.lock();
         if (body)
             break;
-        now = clock_type::now();
-        if (tman_) tman_->update(now);
         if (now >= timeoutPoint)
             return false;
     }
 
+    dispatchMessage(tx, lock, std::move(body), replyChan);
+    return true;
+}
+
+void
+Channel::dispatchMessage(
+    Transaction& tx,
+    std::unique_lock<std::mutex>& lock,
+    std::unique_ptr<XdrSource>&& body,
+    std::shared_ptr<Channel> replyChan)
+{
     auto svcreg = svcreg_.lock();
     rpc_msg msg;
     try {
@@ -611,29 +1237,35 @@ bool Channel::processIncomingMessage(
             VLOG(3) << "xid: " << msg.xid << ": matched reply";
             tx.reply = std::move(msg);
             tx.body = std::move(body);
-            return true;
+            return;
         }
         // This may be some other thread's reply. Find them and
         // wake them up to process it
         VLOG(3) << "xid: " << msg.xid << ": finding transaction";
         assert(lock);
-        auto i = pending_.find(msg.xid);
-        if (i != pending_.end()) {
-            auto& other = *i->second;
+        auto otherp = pending_.find(msg.xid);
+        if (otherp) {
+            auto& other = *otherp;
             other.reply = std::move(msg);
             other.body = std::move(body);
-            if (other.async) {
-                // Note: the transaction was allocated in callAsync so we
-                // need to free it here
-                if (tman_) tman_->cancel(other.tid);
-                pending_.erase(msg.xid);
-                other.continuation();
-                delete &other;
+            if (other.done) {
+                // A call made by startCall - finish it here
+                if (!other.retransmitted)
+                    sampleRtt(other);
+                auto tman = timeoutManager();
+                if (tman && other.tid)
+                    tman->cancel(other.tid);
+                other.tid = 0;
+                pending_.erase(other.xid);
+                lock.unlock();
+                completeCall(&other);
+                lock.lock();
             }
             else {
+                other.ready.store(true, std::memory_order_release);
                 other.cv.notify_one();
             }
-            return true;
+            return;
         }
     }
     else if (msg.mtype == CALL && svcreg) {
@@ -641,7 +1273,7 @@ bool Channel::processIncomingMessage(
         svcreg->process(
             CallContext(std::move(msg), std::move(body), replyChan));
         lock.lock();
-        return true;
+        return;
     }
 
     // If we don't have a matching transaction, drop the message
@@ -652,7 +1284,6 @@ drop:
     lock.unlock();
     releaseReceiveBuffer(std::move(body));
     lock.lock();
-    return true;
 }
 
 bool
@@ -742,7 +1373,7 @@ LocalChannel::LocalChannel(std::shared_ptr<ServiceRegistry> svcreg)
 std::unique_ptr<XdrSink>
 LocalChannel::acquireSendBuffer()
 {
-    return std::make_unique<XdrMemory>(bufferSize_);
+    return std::make_unique<Message>(bufferSize_);
 }
 
 void
@@ -754,10 +1385,7 @@ LocalChannel::releaseSendBuffer(std::unique_ptr<XdrSink>&& msg)
 void
 LocalChannel::sendMessage(std::unique_ptr<XdrSink>&& xdrs)
 {
-    std::unique_ptr<XdrMemory> msg(static_cast<XdrMemory*>(xdrs.release()));
-    msg->setReadSize(msg->writePos());
-    msg->rewind();
-
+    std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
     if (msg->readSize() < 2*sizeof(XdrWord))
         return;
     XdrWord* p = reinterpret_cast<XdrWord*>(msg->buf());
@@ -796,6 +1424,18 @@ LocalChannel::releaseReceiveBuffer(
     msg.reset();
 }
 
+void*
+LocalChannel::localService(
+    uint32_t prog, uint32_t vers, const std::type_info& type)
+{
+    if (!directCalls_)
+        return nullptr;
+    auto svcreg = svcreg_.lock();
+    if (!svcreg)
+        return nullptr;
+    return svcreg->lookupLocal(prog, vers, type);
+}
+
 void
 LocalChannel::processReply()
 {
@@ -813,6 +1453,14 @@ SocketChannel::SocketChannel(int sock)
 {
 }
 
+TimeoutManager*
+SocketChannel::timeoutManager() const
+{
+    if (tman_)
+        return tman_;
+    return owner().get();
+}
+
 SocketChannel::SocketChannel(int sock, std::shared_ptr<ServiceRegistry> svcreg)
     : Channel(svcreg),
       Socket(sock)
@@ -848,10 +1496,44 @@ SocketChannel::onReadable(SocketManager* sockman)
     }
 }
 
+/// State shared between a DatagramChannel and the reply channels for the
+/// calls it receives. Message buffers circulate between the channels
+/// through the pool and, when batching, replies are queued here until
+/// the batch is finished
+struct DatagramChannel::Batch
+{
+    std::mutex mutex;
+    bool open = false;          // true while dispatching a batch
+    size_t poolLimit = 16;      // maximum number of pooled buffers
+    std::vector<std::unique_ptr<Message>> pool;
+    std::vector<Address> replyAddrs;
+    std::vector<std::unique_ptr<Message>> replies;
+
+    /// Return a pooled buffer of the given size, if any
+    std::unique_ptr<Message> get(size_t size)
+    {
+        while (pool.size() > 0) {
+            auto msg = std::move(pool.back());
+            pool.pop_back();
+            if (msg->bufferSize() == size)
+                return msg;
+        }
+        return nullptr;
+    }
+
+    void put(std::unique_ptr<Message>&& msg)
+    {
+        if (pool.size() < poolLimit) {
+            msg->rewind();
+            pool.push_back(std::move(msg));
+        }
+    }
+};
+
 DatagramChannel::DatagramChannel(int sock)
-    : SocketChannel(sock),
-      xdrs_(std::make_unique<Message>(bufferSize_))
+    : SocketChannel(sock)
 {
+    adaptiveRetransmit_ = true;
 }
 
 DatagramChannel::DatagramChannel(
@@ -874,7 +1556,6 @@ DatagramChannel::acquireSendBuffer()
     if (xdrs_ && xdrs_->bufferSize() != bufferSize_)
         xdrs_.reset();
     if (xdrs_) {
-        xdrs_->setWriteSize(xdrs_->bufferSize());
         return std::move(xdrs_);
     }
     else {
@@ -891,11 +1572,22 @@ DatagramChannel::releaseSendBuffer(std::unique_ptr<XdrSink>&& xdrs)
     xdrs_ = std::move(msg);
 }
 
+void
+DatagramChannel::checkMessageSize(std::unique_ptr<Message>& msg)
+{
+    auto len = msg->writePos();
+    if (len <= bufferSize_)
+        return;
+    VLOG(2) << "message too large for a datagram: " << len;
+    releaseSendBuffer(std::move(msg));
+    throw std::system_error(EMSGSIZE, std::system_category());
+}
+
 void
 DatagramChannel::sendMessage(std::unique_ptr<XdrSink>&& xdrs)
 {
     std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
-    msg->flush();
+    checkMessageSize(msg);
     for (auto& addr: remoteAddrs_)
         sendto(msg->iov(), addr);
     releaseSendBuffer(std::move(msg));
@@ -909,6 +1601,7 @@ DatagramChannel::receiveMessage(
         return nullptr;
 
     std::unique_ptr<Message> msg;
+    std::shared_ptr<Batch> batch;
     {
         std::unique_lock<std::mutex> lock(mutex_);
         if (xdrs_) {
@@ -917,23 +1610,28 @@ DatagramChannel::receiveMessage(
             else
                 xdrs_.reset();
         }
+        batch = sharedState();
+    }
+    if (!msg) {
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        msg = batch->get(bufferSize_);
     }
     if (!msg)
         msg = std::make_unique<Message>(bufferSize_);
 
     Address addr;
     auto bytes = recvfrom(msg->buf(), msg->bufferSize(), addr);
-    if (bytes == 0)
+    if (bytes == 0) {
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->put(std::move(msg));
         return nullptr;
+    }
 
     // Set up the message to decode the packet
     msg->advanceWrite(bytes);
-    msg->flush();
 
-    // We could try to cache reply channels here but there is little point
-    // since the allocation is cheap and datagram sockets are discouraged
-    // for high-performance applications
-    replyChan = std::make_shared<DatagramReplyChannel>(fd(), addr);
+    std::unique_lock<std::mutex> lock(mutex_);
+    replyChan = replyChannel(addr);
     return std::move(msg);
 }
 
@@ -958,51 +1656,399 @@ DatagramChannel::remoteAddress() const
     return ai;
 }
 
-StreamChannel::StreamChannel(int sock)
-    : SocketChannel(sock)
+void
+DatagramChannel::setBatchSize(size_t n)
 {
-    // Disable retransmits - we assume the stream protocol is reliable
-    retransmitInterval_ = std::chrono::seconds(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    batchSize_ = n;
+    auto batch = sharedState();
+    std::unique_lock<std::mutex> block(batch->mutex);
+    batch->poolLimit = std::max(batch->poolLimit, 2 * n);
 }
 
-StreamChannel::StreamChannel(int sock, std::shared_ptr<ServiceRegistry> svcreg)
-    : StreamChannel(sock)
+void
+DatagramChannel::setReplyCacheSize(size_t n)
 {
-    svcreg_ = svcreg;
+    std::unique_lock<std::mutex> lock(mutex_);
+    replyCacheSize_ = n;
+    replyCache_.clear();
 }
 
-StreamChannel::StreamChannel(
-    int sock,
-    std::shared_ptr<ServiceRegistry> svcreg,
-    std::shared_ptr<RestRegistry> restreg)
-    : StreamChannel(sock, svcreg)
+std::shared_ptr<DatagramChannel::Batch>
+DatagramChannel::sharedState()
 {
-    restreg_ = restreg;
+    if (!batch_)
+        batch_ = std::make_shared<Batch>();
+    return batch_;
 }
 
-StreamChannel::~StreamChannel()
+std::shared_ptr<DatagramReplyChannel>
+DatagramChannel::replyChannel(const Address& addr)
 {
+    auto makeChannel = [&]() {
+        auto chan = std::make_shared<DatagramReplyChannel>(
+            fd(), addr, sharedState());
+        chan->setBufferSize(bufferSize_);
+        return chan;
+    };
+
+    if (replyCacheSize_ == 0)
+        return makeChannel();
+    if (replyCache_.size() != replyCacheSize_)
+        replyCache_.resize(replyCacheSize_);
+
+    // A direct-mapped cache indexed by a hash of the peer address
+    // (FNV-1a) - a collision just replaces the older entry
+    auto p = reinterpret_cast<const uint8_t*>(addr.addr());
+    uint32_t hash = 2166136261u;
+    for (socklen_t i = 0; i < addr.len(); i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    auto& entry = replyCache_[hash % replyCacheSize_];
+    if (!entry || !(entry->remoteAddrs_[0] == addr) ||
+        entry->bufferSize() != bufferSize_ || entry->batch_ != batch_)
+        entry = makeChannel();
+    return entry;
 }
 
 bool
-StreamChannel::onReadable(SocketManager* sockman)
+DatagramChannel::onReadable(SocketManager* sockman)
 {
-    if (restchan_)
-        return restchan_->onReadable(this);
-    auto res = SocketChannel::onReadable(sockman);
+    if (batchSize_ <= 1)
+        return SocketChannel::onReadable(sockman);
 
-    // If restchan_ is non-null after calling
-    // SocketChannel::onReadable, we have detected that the client is
-    // sending REST requests on this channel. Return true to our
-    // caller to indicate that the socket is still valid.
-    if (!res && restchan_)
+    Transaction nulltx;
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (running_)
+        // Some other thread is reading from the socket
         return true;
-
-    return res;
+    running_ = true;
+    try {
+        receiveBatch(nulltx, lock);
+        running_ = false;
+        return true;
+    }
+    catch (std::system_error& e) {
+        running_ = false;
+        return false;
+    }
+    catch (ResendMessage& e) {
+        running_ = false;
+        return false;
+    }
+    catch (XdrError& e) {
+        running_ = false;
+        return false;
+    }
 }
 
-std::unique_ptr<XdrSink>
-StreamChannel::acquireSendBuffer()
+void
+DatagramChannel::receiveBatch(
+    Transaction& tx, std::unique_lock<std::mutex>& lock)
+{
+    auto batch = sharedState();
+    auto n = batchSize_;
+    auto size = bufferSize_;
+    lock.unlock();
+
+    std::vector<std::unique_ptr<Message>> msgs;
+    {
+        std::unique_lock<std::mutex> block(batch->mutex);
+        while (msgs.size() < n) {
+            auto msg = batch->get(size);
+            if (!msg)
+                break;
+            msgs.push_back(std::move(msg));
+        }
+    }
+    while (msgs.size() < n)
+        msgs.push_back(std::make_unique<Message>(size));
+
+    std::vector<Address> addrs(n);
+    std::vector<iovec> iov(n);
+    std::vector<mmsghdr> hdrs(n);
+    for (size_t i = 0; i < n; i++) {
+        iov[i] = iovec{msgs[i]->buf(), msgs[i]->bufferSize()};
+        auto& mh = hdrs[i].msg_hdr;
+        mh.msg_name = addrs[i].addr();
+        mh.msg_namelen = addrs[i].storageLen();
+        mh.msg_iov = &iov[i];
+        mh.msg_iovlen = 1;
+        mh.msg_control = nullptr;
+        mh.msg_controllen = 0;
+        mh.msg_flags = 0;
+        hdrs[i].msg_len = 0;
+    }
+
+    size_t count;
+    try {
+        count = recvmmsg(hdrs.data(), n);
+    }
+    catch (std::system_error&) {
+        lock.lock();
+        throw;
+    }
+    VLOG(3) << "received " << count << " datagrams";
+
+    // Open the batch so that replies made while dispatching are queued
+    // and return the unused buffers to the pool
+    {
+        std::unique_lock<std::mutex> block(batch->mutex);
+        batch->open = true;
+        for (size_t i = count; i < n; i++)
+            batch->put(std::move(msgs[i]));
+    }
+
+    lock.lock();
+    try {
+        for (size_t i = 0; i < count; i++) {
+            std::unique_ptr<Message> msg = std::move(msgs[i]);
+            if (hdrs[i].msg_len == 0) {
+                std::unique_lock<std::mutex> block(batch->mutex);
+                batch->put(std::move(msg));
+                continue;
+            }
+            msg->advanceWrite(hdrs[i].msg_len);
+            dispatchMessage(
+                tx, lock, std::move(msg), replyChannel(addrs[i]));
+        }
+    }
+    catch (...) {
+        // Close the batch and send the replies made so far, otherwise
+        // later replies would be queued forever
+        if (lock)
+            lock.unlock();
+        sendBatch(*batch);
+        lock.lock();
+        throw;
+    }
+    lock.unlock();
+    sendBatch(*batch);
+    lock.lock();
+}
+
+void
+DatagramChannel::sendBatch(Batch& batch)
+{
+    std::vector<Address> addrs;
+    std::vector<std::unique_ptr<Message>> msgs;
+    {
+        std::unique_lock<std::mutex> block(batch.mutex);
+        batch.open = false;
+        std::swap(addrs, batch.replyAddrs);
+        std::swap(msgs, batch.replies);
+    }
+    if (msgs.size() == 0)
+        return;
+
+    auto n = msgs.size();
+    std::vector<std::vector<iovec>> iovs(n);
+    std::vector<mmsghdr> hdrs(n);
+    for (size_t i = 0; i < n; i++) {
+        iovs[i] = msgs[i]->iov();
+        auto& mh = hdrs[i].msg_hdr;
+        mh.msg_name = addrs[i].addr();
+        mh.msg_namelen = addrs[i].len();
+        mh.msg_iov = iovs[i].data();
+        mh.msg_iovlen = iovs[i].size();
+        mh.msg_control = nullptr;
+        mh.msg_controllen = 0;
+        mh.msg_flags = 0;
+        hdrs[i].msg_len = 0;
+    }
+
+    size_t i = 0;
+    while (i < n) {
+        try {
+            i += sendmmsg(&hdrs[i], n - i);
+        }
+        catch (std::system_error& e) {
+            // Drop the reply which failed and carry on with the rest,
+            // as we would for a lost packet
+            VLOG(2) << "error sending reply: " << e.what();
+            i++;
+        }
+    }
+    VLOG(3) << "sent " << n << " replies";
+
+    std::unique_lock<std::mutex> block(batch.mutex);
+    for (auto& msg: msgs)
+        batch.put(std::move(msg));
+}
+
+std::unique_ptr<XdrSink>
+DatagramReplyChannel::acquireSendBuffer()
+{
+    if (batch_) {
+        std::unique_lock<std::mutex> lock(batch_->mutex);
+        auto msg = batch_->get(bufferSize_);
+        if (msg)
+            return msg;
+    }
+    return DatagramChannel::acquireSendBuffer();
+}
+
+void
+DatagramReplyChannel::releaseSendBuffer(std::unique_ptr<XdrSink>&& xdrs)
+{
+    if (batch_) {
+        std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+        std::unique_lock<std::mutex> lock(batch_->mutex);
+        batch_->put(std::move(msg));
+        return;
+    }
+    DatagramChannel::releaseSendBuffer(std::move(xdrs));
+}
+
+void
+DatagramReplyChannel::sendMessage(std::unique_ptr<XdrSink>&& xdrs)
+{
+    if (batch_) {
+        std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+        checkMessageSize(msg);
+        std::unique_lock<std::mutex> lock(batch_->mutex);
+        if (batch_->open) {
+            batch_->replyAddrs.push_back(remoteAddrs_[0]);
+            batch_->replies.push_back(std::move(msg));
+            return;
+        }
+        lock.unlock();
+        xdrs = std::move(msg);
+    }
+    DatagramChannel::sendMessage(std::move(xdrs));
+}
+
+void
+DatagramReplyChannel::releaseReceiveBuffer(std::unique_ptr<XdrSource>&& xdrs)
+{
+    if (batch_) {
+        std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+        std::unique_lock<std::mutex> lock(batch_->mutex);
+        batch_->put(std::move(msg));
+        return;
+    }
+    DatagramChannel::releaseReceiveBuffer(std::move(xdrs));
+}
+
+#ifdef IOV_MAX
+static constexpr size_t MAX_IOV = IOV_MAX;
+#else
+static constexpr size_t MAX_IOV = 1024;
+#endif
+
+/// Return iov without its first skip bytes
+static std::vector<iovec>
+skipIov(std::vector<iovec> iov, size_t skip)
+{
+    auto i = iov.begin();
+    while (skip > 0 && skip >= i->iov_len) {
+        skip -= i->iov_len;
+        ++i;
+    }
+    if (skip > 0) {
+        i->iov_base = static_cast<uint8_t*>(i->iov_base) + skip;
+        i->iov_len -= skip;
+    }
+    iov.erase(iov.begin(), i);
+    return iov;
+}
+
+/// Combine the fragments of a record into a single buffer
+static std::unique_ptr<XdrMemory>
+joinFragments(std::deque<std::unique_ptr<XdrMemory>>& fragments, size_t total)
+{
+    if (fragments.size() == 1) {
+        auto msg = std::move(fragments[0]);
+        fragments.clear();
+        return msg;
+    }
+
+    // We could create a new XdrSource here to process the queue but
+    // most cases should take the simpler single-fragment path
+    auto msg = std::make_unique<XdrMemory>(total);
+    auto p = msg->buf();
+    for (const auto& frag: fragments) {
+        auto n = frag->bufferSize();
+        std::copy_n(frag->buf(), n, p);
+        p += n;
+    }
+    fragments.clear();
+    return msg;
+}
+
+StreamChannel::StreamChannel(int sock)
+    : SocketChannel(sock)
+{
+    // Disable retransmits - we assume the stream protocol is reliable
+    retransmitInterval_ = std::chrono::seconds(0);
+}
+
+StreamChannel::StreamChannel(int sock, std::shared_ptr<ServiceRegistry> svcreg)
+    : StreamChannel(sock)
+{
+    svcreg_ = svcreg;
+}
+
+StreamChannel::StreamChannel(
+    int sock,
+    std::shared_ptr<ServiceRegistry> svcreg,
+    std::shared_ptr<RestRegistry> restreg)
+    : StreamChannel(sock, svcreg)
+{
+    restreg_ = restreg;
+}
+
+StreamChannel::~StreamChannel()
+{
+}
+
+bool
+StreamChannel::onReadable(SocketManager* sockman)
+{
+    using namespace std::literals::chrono_literals;
+    if (restchan_)
+        return restchan_->onReadable(this);
+
+    Transaction nulltx;
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (running_)
+        // Some other thread is reading from the socket
+        return true;
+    running_ = true;
+
+    // Read once, dispatching every complete record which arrived. Any
+    // partial record stays buffered until the socket is readable again.
+    bool res = true;
+    eventRead_ = true;
+    eventReadDone_ = false;
+    try {
+        while (processIncomingMessage(nulltx, lock, 0s))
+            ;
+    }
+    catch (std::system_error& e) {
+        res = false;
+    }
+    catch (ResendMessage& e) {
+        res = false;
+    }
+    catch (XdrError& e) {
+        res = false;
+    }
+    eventRead_ = false;
+    running_ = false;
+
+    // If restchan_ is non-null after reading, we have detected that
+    // the client is sending REST requests on this channel. Return true
+    // to our caller to indicate that the socket is still valid.
+    if (!res && restchan_)
+        return true;
+
+    return res;
+}
+
+std::unique_ptr<XdrSink>
+StreamChannel::acquireSendBuffer()
 {
     std::unique_lock<std::mutex> lock(writeMutex_);
     std::unique_ptr<Message> msg = std::move(sendbuf_);
@@ -1027,113 +2073,625 @@ StreamChannel::releaseSendBuffer(std::unique_ptr<XdrSink>&& xdrs)
 void
 StreamChannel::sendMessage(std::unique_ptr<XdrSink>&& xdrs)
 {
-    std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
-    msg->flush();
-
-    // Send this as a single fragment record
+    auto msg = frameMessage(std::move(xdrs));
     auto iov = msg->iov();
     auto len = msg->writePos();
-    *reinterpret_cast<XdrWord*>(iov[0].iov_base) =
-        (len - sizeof(uint32_t)) | (1<<31);
 
     std::unique_lock<std::mutex> lock(writeMutex_);
+    if (queueWrites()) {
+        if (sendError_)
+            throw std::system_error(sendError_, std::system_category());
+        VLOG(3) << "queueing " << len << " bytes for socket";
+        sendq_.push_back(std::move(msg));
+        sendQueued_ += len;
+        if (asyncIo()) {
+            if (!sending_)
+                startWrite();
+        }
+        else if (sendq_.size() == 1) {
+            // Nothing ahead of us - try to write it now
+            flushQueue();
+            if (sendError_)
+                throw std::system_error(sendError_, std::system_category());
+        }
+        updateInterest();
+        return;
+    }
+
+    if (coalesceWrites_) {
+        if (!nextBatch_)
+            nextBatch_ = std::make_shared<WriteBatch>();
+        nextBatch_->msgs.push_back(std::move(msg));
+        sendCoalesced(lock);
+        return;
+    }
+
     VLOG(3) << "writing " << len << " bytes to socket";
-    // This cast shouldn't be necessary but clang-3.8 gets confused
-    // since send appears as a method in both Channel and Socket
-    auto bytes = static_cast<Socket*>(this)->send(iov);
-    if (bytes == 0)
-        throw std::system_error(ENOTCONN, std::system_category());
+    size_t written = 0;
+    while (written < len) {
+        // This cast shouldn't be necessary but clang-3.8 gets confused
+        // since send appears as a method in both Channel and Socket
+        auto bytes = static_cast<Socket*>(this)->send(
+            written ? skipIov(iov, written) : iov);
+        if (bytes == 0)
+            throw std::system_error(ENOTCONN, std::system_category());
+        written += bytes;
+        writeStats_.writes++;
+    }
+    writeStats_.messages++;
 
     msg->rewind();
     sendbuf_ = std::move(msg);
 }
 
 void
-StreamChannel::readAll(void* buf, size_t len)
+StreamChannel::sendMessages(std::vector<std::unique_ptr<XdrSink>>&& msgs)
 {
-    auto p = reinterpret_cast<uint8_t*>(buf);
-    auto n = len;
+    if (msgs.size() == 0)
+        return;
+    if (msgs.size() == 1) {
+        sendMessage(std::move(msgs[0]));
+        return;
+    }
 
-    while (n > 0) {
-        auto bytes = recv(p, n);
-        if (bytes == 0)
-            throw std::system_error(ENOTCONN, std::system_category());
-        p += bytes;
-        n -= bytes;
+    std::vector<std::unique_ptr<Message>> framed;
+    framed.reserve(msgs.size());
+    for (auto& xdrs: msgs)
+        framed.push_back(frameMessage(std::move(xdrs)));
+
+    std::unique_lock<std::mutex> lock(writeMutex_);
+    if (queueWrites()) {
+        if (sendError_)
+            throw std::system_error(sendError_, std::system_category());
+        VLOG(3) << "queueing " << framed.size() << " messages for socket";
+        for (auto& msg: framed) {
+            sendQueued_ += msg->writePos();
+            sendq_.push_back(std::move(msg));
+        }
+        sendGather_ = sendq_.size();
+        if (asyncIo()) {
+            if (!sending_)
+                startWrite();
+        }
+        else if (sendq_.size() == framed.size()) {
+            flushQueue();
+            if (sendError_)
+                throw std::system_error(sendError_, std::system_category());
+        }
+        updateInterest();
+        return;
+    }
+
+    if (coalesceWrites_) {
+        if (!nextBatch_)
+            nextBatch_ = std::make_shared<WriteBatch>();
+        for (auto& msg: framed)
+            nextBatch_->msgs.push_back(std::move(msg));
+        sendCoalesced(lock);
+        return;
+    }
+
+    WriteBatch batch;
+    batch.msgs = std::move(framed);
+    VLOG(3) << "writing " << batch.msgs.size() << " messages to socket";
+    writeStats_.writes += writeBatch(batch);
+    writeStats_.messages += batch.msgs.size();
+    auto& last = batch.msgs.back();
+    last->rewind();
+    sendbuf_ = std::move(last);
+}
+
+std::unique_ptr<Message>
+StreamChannel::frameMessage(std::unique_ptr<XdrSink>&& xdrs)
+{
+    std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+
+    // Send this as a single fragment record
+    auto len = msg->writePos();
+    *reinterpret_cast<XdrWord*>(msg->buf()) =
+        (len - sizeof(uint32_t)) | (1<<31);
+    return msg;
+}
+
+void
+StreamChannel::sendCoalesced(std::unique_lock<std::mutex>& lock)
+{
+    auto batch = nextBatch_;
+
+    // Wait for any write in progress. Either it was ours, written by
+    // some other thread, or we write our batch ourselves.
+    batchDone_.wait(lock, [&]() { return batch->done || !sending_; });
+    if (!batch->done) {
+        VLOG(3) << "writing " << batch->msgs.size() << " messages to socket";
+        nextBatch_.reset();
+        sending_ = true;
+        lock.unlock();
+        size_t writes = 0;
+        try {
+            writes = writeBatch(*batch);
+        }
+        catch (...) {
+            batch->error = std::current_exception();
+        }
+        lock.lock();
+        sending_ = false;
+        batch->done = true;
+        if (!batch->error) {
+            writeStats_.writes += writes;
+            writeStats_.messages += batch->msgs.size();
+        }
+        auto& last = batch->msgs.back();
+        last->rewind();
+        sendbuf_ = std::move(last);
+        batchDone_.notify_all();
+    }
+    if (batch->error)
+        std::rethrow_exception(batch->error);
+}
+
+size_t
+StreamChannel::writeBatch(const WriteBatch& batch)
+{
+    std::vector<iovec> iov;
+    for (auto& msg: batch.msgs) {
+        auto msgiov = msg->iov();
+        iov.insert(iov.end(), msgiov.begin(), msgiov.end());
+    }
+    size_t writes = 0;
+    size_t start = 0;
+    while (start < iov.size()) {
+        std::vector<iovec> chunk(
+            iov.begin() + start,
+            iov.begin() + std::min(iov.size(), start + MAX_IOV));
+        size_t len = 0;
+        for (auto& v: chunk)
+            len += v.iov_len;
+        int flags = 0;
+#ifdef MSG_MORE
+        // Let the kernel hold back a partial segment until we write
+        // the last chunk
+        if (start + chunk.size() < iov.size())
+            flags |= MSG_MORE;
+#endif
+        size_t written = 0;
+        while (written < len) {
+            auto bytes = static_cast<Socket*>(this)->send(
+                written ? skipIov(chunk, written) : chunk, flags);
+            if (bytes == 0)
+                throw std::system_error(ENOTCONN, std::system_category());
+            written += bytes;
+            writes++;
+        }
+        start += chunk.size();
+    }
+    return writes;
+}
+
+StreamChannel::WriteStats
+StreamChannel::writeStats()
+{
+    std::unique_lock<std::mutex> lock(writeMutex_);
+    return writeStats_;
+}
+
+bool
+StreamChannel::onWritable(SocketManager*)
+{
+    std::unique_lock<std::mutex> lock(writeMutex_);
+    if (!asyncIo())
+        flushQueue();
+    updateInterest();
+    return sendError_ == 0;
+}
+
+std::vector<iovec>
+StreamChannel::pendingIov() const
+{
+    auto iov = skipIov(sendq_.front()->iov(), sendOffset_);
+    auto end = coalesceWrites_ ?
+        sendq_.end() : sendq_.begin() + std::max<size_t>(sendGather_, 1);
+    for (auto i = sendq_.begin() + 1; i != end; ++i) {
+        auto msgiov = (*i)->iov();
+        if (iov.size() + msgiov.size() > MAX_IOV)
+            break;
+        iov.insert(iov.end(), msgiov.begin(), msgiov.end());
+    }
+    return iov;
+}
+
+void
+StreamChannel::wrote(size_t len)
+{
+    writeStats_.writes++;
+    sendQueued_ -= len;
+    while (len > 0) {
+        auto n = std::min(len, sendq_.front()->writePos() - sendOffset_);
+        sendOffset_ += n;
+        len -= n;
+        if (sendOffset_ == sendq_.front()->writePos()) {
+            auto msg = std::move(sendq_.front());
+            sendq_.pop_front();
+            sendOffset_ = 0;
+            if (sendGather_ > 0)
+                sendGather_--;
+            msg->rewind();
+            sendbuf_ = std::move(msg);
+            writeStats_.messages++;
+        }
+    }
+}
+
+void
+StreamChannel::flushQueue()
+{
+    while (sendq_.size() > 0 && !sendError_) {
+        auto iov = pendingIov();
+        msghdr mh;
+        std::memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov.data();
+        mh.msg_iovlen = iov.size();
+        int flags = MSG_DONTWAIT;
+#ifdef MSG_MORE
+        // If the queue is too long for one writev, let the kernel hold
+        // back a partial segment until we write the rest
+        size_t iovlen = 0;
+        for (auto& v: iov)
+            iovlen += v.iov_len;
+        if (iovlen < sendQueued_)
+            flags |= MSG_MORE;
+#endif
+        auto len = ::sendmsg(fd(), &mh, flags);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            sendError_ = errno;
+        }
+        else if (len == 0) {
+            sendError_ = ENOTCONN;
+        }
+        else {
+            VLOG(3) << "wrote " << len << " bytes to socket";
+            wrote(len);
+        }
+    }
+    if (sendError_) {
+        LOG(ERROR) << "error writing to socket: "
+                   << std::system_category().message(sendError_);
+        sendq_.clear();
+        sendOffset_ = 0;
+        sendQueued_ = 0;
+        sendGather_ = 0;
+    }
+}
+
+void
+StreamChannel::updateInterest()
+{
+    auto sockman = owner();
+    if (!sockman)
+        return;
+
+    // Only channels which serve calls stop reading - a client must keep
+    // reading replies to avoid deadlocking with its server
+    bool paused = readPaused_;
+    if (sendQueued_ > sendQueueLimit_ && svcreg_.lock())
+        paused = true;
+    else if (sendQueued_ <= sendQueueLimit_ / 2)
+        paused = false;
+    bool write = !asyncIo() && sendq_.size() > 0;
+    if (paused == readPaused_ && write == writeWanted_)
+        return;
+    if (paused != readPaused_)
+        VLOG(2) << (paused ? "pausing" : "resuming") << " reads with "
+                << sendQueued_ << " bytes queued";
+    readPaused_ = paused;
+    writeWanted_ = write;
+    auto self = std::static_pointer_cast<StreamChannel>(shared_from_this());
+    sockman->setInterest(self, !paused, write);
+}
+
+void
+StreamChannel::startWrite()
+{
+    auto sockman = owner();
+    if (!sockman) {
+        sendError_ = ENOTCONN;
+        sendq_.clear();
+        sendQueued_ = 0;
+        sendGather_ = 0;
+        return;
+    }
+
+    auto iov = pendingIov();
+    sending_ = true;
+    auto self = std::static_pointer_cast<StreamChannel>(shared_from_this());
+    sockman->write(self, iov, [self](ssize_t len) {
+        self->onWriteComplete(len);
+    });
+}
+
+void
+StreamChannel::onWriteComplete(ssize_t len)
+{
+    std::unique_lock<std::mutex> lock(writeMutex_);
+    sending_ = false;
+    if (len <= 0) {
+        sendError_ = len < 0 ? int(-len) : ENOTCONN;
+        LOG(ERROR) << "error writing to socket: "
+                   << std::system_category().message(sendError_);
+        sendq_.clear();
+        sendOffset_ = 0;
+        sendQueued_ = 0;
+        sendGather_ = 0;
+        return;
     }
+    wrote(len);
+    if (sendq_.size() > 0)
+        startWrite();
+    updateInterest();
 }
 
 std::unique_ptr<XdrSource>
 StreamChannel::receiveMessage(
     std::shared_ptr<Channel>& replyChan, clock_type::duration timeout)
 {
-    if (!waitForReadable(timeout))
-        return nullptr;
-
     replyChan = shared_from_this();
-    bool done = false;
-    std::deque<std::unique_ptr<XdrMemory>> fragments;
-    size_t total = 0;
-    while (!done) {
-        uint8_t recbuf[sizeof(uint32_t)];
-        readAll(recbuf, sizeof(uint32_t));
-        uint32_t rec = *reinterpret_cast<const XdrWord*>(recbuf);
-        uint32_t reclen = rec & 0x7fffffff;
-        if (total + reclen > bufferSize_) {
-            // Check for a possible REST connection
-            if (restreg_.lock()) {
-                std::array<char, 4> data;
-                data[0] = recbuf[0];
-                data[1] = recbuf[1];
-                data[2] = recbuf[2];
-                data[3] = recbuf[3];
-                if (data == std::array<char, 4>{{'G','E','T',' '}} ||
-                    data == std::array<char, 4>{{'P','U','T',' '}} ||
-                    data == std::array<char, 4>{{'P','O','S','T'}} ||
-                    data == std::array<char, 4>{{'D','E','L','E'}} ||
-                    data == std::array<char, 4>{{'H','E','A','D'}}) {
-                    VLOG(2) << "Treating channel as REST endpoint";
-                    restchan_ = std::make_shared<RestChannel>(restreg_.lock(), data);
-                    // Throw a system_error to unwind back to
-                    // StreamChannel::onReadable which will detect
-                    // that we are treating this channel as a REST
-                    // endpoint
-                    throw std::system_error(EIO, std::system_category());
-                }
-            }
-            LOG(ERROR) << "Record too large: " << reclen;
-            close();
+    auto deadline = clock_type::now() + timeout;
+    for (;;) {
+        auto body = parseRecord();
+        if (body)
+            return body;
+        if (eventRead_) {
+            // Called from onReadable - don't wait for the rest of a
+            // partial record
+            if (eventReadDone_ || !waitForReadable(clock_type::duration(0)))
+                return nullptr;
+            eventReadDone_ = true;
+        }
+        else {
+            auto now = clock_type::now();
+            if (!waitForReadable(
+                    now < deadline ? deadline - now : clock_type::duration(0)))
+                return nullptr;
+        }
+
+        // Only read ahead when called from onReadable which dispatches
+        // everything we read. Other callers return after one record and
+        // nothing would be left to process any following records.
+        auto buf = nextReadBuffer(eventRead_);
+        auto bytes = recv(buf.first, buf.second);
+        if (bytes == 0)
             throw std::system_error(ENOTCONN, std::system_category());
+        received(bytes);
+    }
+}
+
+bool
+StreamChannel::queueWrites() const
+{
+    return bool(owner());
+}
+
+bool
+StreamChannel::asyncIo() const
+{
+    // REST detection depends on the synchronous receive path
+    auto sockman = owner();
+    return queueWrites() &&
+        sockman->engine() == SocketManager::Engine::URING &&
+        !restreg_.lock() && !restchan_;
+}
+
+std::pair<void*, size_t>
+StreamChannel::readBuffer()
+{
+    if (!asyncIo())
+        return {nullptr, 0};
+    if (!reading_) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (running_)
+            // Some other thread is reading from the socket - use
+            // onReadable until they are finished
+            return {nullptr, 0};
+        running_ = true;
+        reading_ = true;
+    }
+    return nextReadBuffer(true);
+}
+
+bool
+StreamChannel::onRead(SocketManager*, ssize_t len)
+{
+    if (len <= 0) {
+        VLOG(3) << "read failed: "
+                << (len < 0 ? std::system_category().message(-len) : "EOF");
+        stopReading();
+        return false;
+    }
+    received(len);
+    try {
+        parseRecords();
+        return true;
+    }
+    catch (std::system_error& e) {
+    }
+    catch (XdrError& e) {
+    }
+    stopReading();
+    return false;
+}
+
+std::pair<void*, size_t>
+StreamChannel::nextReadBuffer(bool readAhead)
+{
+    checkDiscard();
+
+    // Until we have seen a valid record marker, a channel which
+    // supports REST must not read past the first four bytes so that
+    // RestChannel sees the rest of the request
+    if (restreg_.lock() && !sawRecord_)
+        readAhead = false;
+
+    // If we are part way through a fragment, read the rest of it
+    // directly into place unless it is small enough that reading ahead
+    // is likely to save a system call
+    directRead_ = false;
+    if (frag_ && inStart_ == inEnd_) {
+        auto resid = frag_->bufferSize() - fragPos_;
+        if (!readAhead || resid >= READ_AHEAD / 2) {
+            directRead_ = true;
+            return {frag_->buf() + fragPos_, resid};
         }
-        done = (rec & (1 << 31)) != 0;
-        VLOG(4) << reclen << " byte record, eor=" << done;
-        auto frag = std::make_unique<XdrMemory>(reclen);
-        readAll(frag->buf(), reclen);
-        VLOG(4) << "read fragment body";
-        fragments.push_back(std::move(frag));
-        total += reclen;
     }
 
-    if (fragments.size() == 1) {
-        return std::move(fragments[0]);
+    if (inbuf_.size() == 0)
+        inbuf_.resize(READ_AHEAD);
+    if (inStart_ == inEnd_)
+        inStart_ = inEnd_ = 0;
+    if (inbuf_.size() - inEnd_ < READ_AHEAD / 2) {
+        std::copy(
+            inbuf_.begin() + inStart_, inbuf_.begin() + inEnd_,
+            inbuf_.begin());
+        inEnd_ -= inStart_;
+        inStart_ = 0;
     }
+    if (!readAhead) {
+        // We only get here when waiting for a record marker
+        assert(!frag_);
+        return {inbuf_.data() + inEnd_,
+                sizeof(uint32_t) - (inEnd_ - inStart_)};
+    }
+    return {inbuf_.data() + inEnd_, inbuf_.size() - inEnd_};
+}
 
-    // We could create a new XdrSource here to process the queue but
-    // most cases should take the simpler single-fragment path
-    auto msg = std::make_unique<XdrMemory>(total);
-    auto p = msg->buf();
-    for (const auto& frag: fragments) {
-        auto n = frag->bufferSize();
-        std::copy_n(frag->buf(), n, p);
-        p += n;
+void
+StreamChannel::received(size_t len)
+{
+    if (directRead_) {
+        fragPos_ += len;
+        directRead_ = false;
     }
-    return std::move(msg);
+    else {
+        inEnd_ += len;
+    }
+}
+
+std::unique_ptr<XdrSource>
+StreamChannel::parseRecord()
+{
+    checkDiscard();
+    for (;;) {
+        if (!frag_) {
+            if (inEnd_ - inStart_ < sizeof(uint32_t))
+                return nullptr;
+            auto recbuf = inbuf_.data() + inStart_;
+            // The marker may not be word aligned in inbuf_
+            uint32_t rec;
+            std::memcpy(&rec, recbuf, sizeof(rec));
+            rec = ntohl(rec);
+            uint32_t reclen = rec & 0x7fffffff;
+            if (recordSize_ + reclen > maxRecordSize_) {
+                // Check for a possible REST connection
+                if (restreg_.lock() && !sawRecord_) {
+                    std::array<char, 4> data;
+                    std::copy_n(recbuf, 4, data.begin());
+                    if (data == std::array<char, 4>{{'G','E','T',' '}} ||
+                        data == std::array<char, 4>{{'P','U','T',' '}} ||
+                        data == std::array<char, 4>{{'P','O','S','T'}} ||
+                        data == std::array<char, 4>{{'D','E','L','E'}} ||
+                        data == std::array<char, 4>{{'H','E','A','D'}}) {
+                        VLOG(2) << "Treating channel as REST endpoint";
+                        inStart_ += sizeof(uint32_t);
+                        restchan_ = std::make_shared<RestChannel>(
+                            restreg_.lock(), data);
+                        // Throw a system_error to unwind back to
+                        // StreamChannel::onReadable which will detect
+                        // that we are treating this channel as a REST
+                        // endpoint
+                        throw std::system_error(EIO, std::system_category());
+                    }
+                }
+                LOG(ERROR) << "Record too large: " << reclen;
+                close();
+                throw std::system_error(ENOTCONN, std::system_category());
+            }
+            inStart_ += sizeof(uint32_t);
+            sawRecord_ = true;
+            frag_ = std::make_unique<XdrMemory>(reclen);
+            fragPos_ = 0;
+            fragLast_ = (rec & (1 << 31)) != 0;
+            VLOG(4) << reclen << " byte record, eor=" << fragLast_;
+        }
+
+        auto n = std::min(frag_->bufferSize() - fragPos_, inEnd_ - inStart_);
+        std::copy_n(inbuf_.data() + inStart_, n, frag_->buf() + fragPos_);
+        inStart_ += n;
+        fragPos_ += n;
+        if (fragPos_ < frag_->bufferSize())
+            return nullptr;
+
+        recordSize_ += frag_->bufferSize();
+        fragments_.push_back(std::move(frag_));
+        if (!fragLast_)
+            continue;
+
+        auto total = recordSize_;
+        recordSize_ = 0;
+        return joinFragments(fragments_, total);
+    }
+}
+
+void
+StreamChannel::parseRecords()
+{
+    for (;;) {
+        auto body = parseRecord();
+        if (!body)
+            return;
+        Transaction nulltx;
+        std::unique_lock<std::mutex> lock(mutex_);
+        dispatchMessage(nulltx, lock, std::move(body), shared_from_this());
+    }
+}
+
+void
+StreamChannel::discardInput()
+{
+    // The thread reading from the socket may be using the buffered
+    // input so leave it to that thread to reset it
+    discard_ = true;
+}
+
+void
+StreamChannel::checkDiscard()
+{
+    if (!discard_.exchange(false))
+        return;
+    inStart_ = inEnd_ = 0;
+    frag_.reset();
+    fragPos_ = 0;
+    directRead_ = false;
+    fragments_.clear();
+    recordSize_ = 0;
+}
+
+void
+StreamChannel::stopReading()
+{
+    if (!reading_)
+        return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    reading_ = false;
+    running_ = false;
+    pending_.forEach([](Transaction& tx) { tx.cv.notify_one(); });
 }
 
 void
 StreamChannel::releaseReceiveBuffer(std::unique_ptr<XdrSource>&& xdrs)
 {
-    // XXX: rework the receive path to use standard sized buffers
+    // Both the message and its storage return to the buffer pool
     xdrs.reset();
 }
 
@@ -1158,11 +2716,11 @@ ReconnectChannel::ReconnectChannel(int sock, const AddressInfo& ai)
 }
 
 ssize_t
-ReconnectChannel::send(const std::vector<iovec>& iov)
+ReconnectChannel::send(const std::vector<iovec>& iov, int flags)
 {
     for (;;) {
         try {
-            auto bytes = Socket::send(iov);
+            auto bytes = Socket::send(iov, flags);
             if (bytes == 0)
                 throw std::system_error(ENOTCONN, std::system_category());
             return bytes;
@@ -1195,6 +2753,7 @@ ReconnectChannel::reconnect()
     LOG(INFO) << "reconnecting channel";
     if (fd() >= 0)
         ::close(fd());
+    discardInput();
     try {
         int fd = ::socket(
             addrinfo_.family, addrinfo_.socktype, addrinfo_.protocol);
@@ -1216,6 +2775,257 @@ ReconnectChannel::reconnect()
     reconnectCallback_();
 }
 
+std::chrono::seconds PooledChannel::retryDelay(1);
+
+PooledChannel::PooledChannel(const AddressInfo& ai, int size)
+{
+    assert(size > 0);
+    for (int i = 0; i < size; i++) {
+        auto m = std::make_shared<Member>();
+        m->chan = Channel::open(ai);
+        members_.push_back(m);
+    }
+}
+
+PooledChannel::PooledChannel(std::vector<std::shared_ptr<Channel>> members)
+{
+    assert(members.size() > 0);
+    for (auto& chan: members) {
+        auto m = std::make_shared<Member>();
+        m->chan = chan;
+        members_.push_back(m);
+    }
+}
+
+std::vector<std::shared_ptr<Channel>>
+PooledChannel::members() const
+{
+    std::vector<std::shared_ptr<Channel>> res;
+    for (auto& m: members_)
+        res.push_back(m->chan);
+    return res;
+}
+
+std::vector<int>
+PooledChannel::outstanding() const
+{
+    std::vector<int> res;
+    for (auto& m: members_)
+        res.push_back(m->outstanding);
+    return res;
+}
+
+std::shared_ptr<PooledChannel::Member>
+PooledChannel::choose(int calls)
+{
+    auto now = clock_type::now().time_since_epoch().count();
+    auto n = members_.size();
+    auto start = next_++;
+    std::shared_ptr<Member> best;
+    bool bestHealthy = false;
+    int bestCount = 0;
+    for (size_t i = 0; i < n; i++) {
+        auto& m = members_[(start + i) % n];
+        bool healthy = m->retryTime.load(std::memory_order_relaxed) <= now;
+        int count = m->outstanding.load(std::memory_order_relaxed);
+        if (!best || (healthy && !bestHealthy)
+            || (healthy == bestHealthy && count < bestCount)) {
+            best = m;
+            bestHealthy = healthy;
+            bestCount = count;
+        }
+    }
+    best->outstanding += calls;
+    return best;
+}
+
+void
+PooledChannel::finished(Member& m, std::exception_ptr error, int calls)
+{
+    m.outstanding -= calls;
+    if (!error)
+        return;
+    try {
+        std::rethrow_exception(error);
+    }
+    catch (std::system_error& e) {
+        LOG(INFO) << "pool member failed: " << e.what();
+        auto retry = clock_type::now() + retryDelay;
+        m.retryTime = retry.time_since_epoch().count();
+    }
+    catch (...) {
+    }
+}
+
+uint32_t
+PooledChannel::startCall(
+    Client* client, uint32_t proc,
+    std::function<void(XdrSink*)> xargs,
+    std::function<void(XdrSource*)> xresults,
+    std::function<void(std::exception_ptr)> done,
+    Protection prot,
+    clock_type::duration timeout)
+{
+    // Members allocate xids independently so the caller gets a handle
+    // of our own which records the member making the call
+    auto m = choose();
+    auto table = calls_;
+    uint32_t handle;
+    {
+        std::unique_lock<std::mutex> lock(table->mutex);
+        handle = table->next++;
+        table->calls[handle] = std::make_pair(m, 0u);
+    }
+    uint32_t xid;
+    try {
+        xid = m->chan->startCall(
+            client, proc, xargs, xresults,
+            [m, table, handle, done = std::move(done)](
+                std::exception_ptr error) {
+                {
+                    std::unique_lock<std::mutex> lock(table->mutex);
+                    table->calls.erase(handle);
+                }
+                finished(*m, error);
+                done(error);
+            },
+            prot, timeout);
+    }
+    catch (...) {
+        {
+            std::unique_lock<std::mutex> lock(table->mutex);
+            table->calls.erase(handle);
+        }
+        finished(*m, std::current_exception());
+        throw;
+    }
+
+    // The call may already have completed
+    std::unique_lock<std::mutex> lock(table->mutex);
+    auto i = table->calls.find(handle);
+    if (i != table->calls.end())
+        i->second.second = xid;
+    return handle;
+}
+
+bool
+PooledChannel::cancelCall(uint32_t handle)
+{
+    std::shared_ptr<Member> m;
+    uint32_t xid;
+    {
+        std::unique_lock<std::mutex> lock(calls_->mutex);
+        auto i = calls_->calls.find(handle);
+        if (i == calls_->calls.end())
+            return false;
+        std::tie(m, xid) = i->second;
+        calls_->calls.erase(i);
+    }
+    if (!m->chan->cancelCall(xid))
+        return false;
+    m->outstanding--;
+    return true;
+}
+
+void
+PooledChannel::call(
+    Client* client, uint32_t proc,
+    std::function<void(XdrSink*)> xargs,
+    std::function<void(XdrSource*)> xresults,
+    Protection prot,
+    clock_type::duration timeout)
+{
+    auto m = choose();
+    try {
+        m->chan->call(client, proc, xargs, xresults, prot, timeout);
+    }
+    catch (...) {
+        finished(*m, std::current_exception());
+        throw;
+    }
+    finished(*m, nullptr);
+}
+
+void
+PooledChannel::callBatch(
+    Client* client, std::vector<BatchCall>& calls,
+    Protection prot,
+    clock_type::duration timeout)
+{
+    // Keep the batch together so that it is still sent as a group
+    int count = int(calls.size());
+    auto m = choose(count);
+    try {
+        m->chan->callBatch(client, calls, prot, timeout);
+    }
+    catch (...) {
+        finished(*m, std::current_exception(), count);
+        throw;
+    }
+    finished(*m, nullptr, count);
+}
+
+void
+PooledChannel::send(
+    Client* client, uint32_t proc,
+    std::function<void(XdrSink*)> xargs,
+    Protection prot)
+{
+    auto m = choose();
+    try {
+        m->chan->send(client, proc, xargs, prot);
+    }
+    catch (...) {
+        finished(*m, std::current_exception());
+        throw;
+    }
+    finished(*m, nullptr);
+}
+
+void
+PooledChannel::onReconnect(std::function<void()> cb)
+{
+    for (auto& m: members_)
+        m->chan->onReconnect(cb);
+}
+
+AddressInfo
+PooledChannel::remoteAddress() const
+{
+    return members_[0]->chan->remoteAddress();
+}
+
+std::unique_ptr<XdrSink>
+PooledChannel::acquireSendBuffer()
+{
+    return members_[0]->chan->acquireSendBuffer();
+}
+
+void
+PooledChannel::releaseSendBuffer(std::unique_ptr<XdrSink>&& msg)
+{
+    members_[0]->chan->releaseSendBuffer(std::move(msg));
+}
+
+void
+PooledChannel::sendMessage(std::unique_ptr<XdrSink>&& msg)
+{
+    members_[0]->chan->sendMessage(std::move(msg));
+}
+
+std::unique_ptr<XdrSource>
+PooledChannel::receiveMessage(
+    std::shared_ptr<Channel>& replyChan, clock_type::duration timeout)
+{
+    return members_[0]->chan->receiveMessage(replyChan, timeout);
+}
+
+void
+PooledChannel::releaseReceiveBuffer(std::unique_ptr<XdrSource>&& msg)
+{
+    members_[0]->chan->releaseReceiveBuffer(std::move(msg));
+}
+
 bool
 ListenSocket::onReadable(SocketManager* sockman)
 {
@@ -1231,6 +3041,53 @@ ListenSocket::onReadable(SocketManager* sockman)
         newsock, svcreg_.lock(), restreg_.lock());
     chan->setCloseOnIdle(true);
     chan->setBufferSize(bufferSize_);
-    sockman->add(chan);
+    auto group = group_.lock();
+    if (group)
+        group->add(chan);
+    else
+        sockman->add(chan);
     return true;
 }
+
+std::vector<std::shared_ptr<ListenSocket>>
+ListenSocket::listenGroup(
+    SocketManagerGroup& group, const AddressInfo& ai,
+    std::shared_ptr<ServiceRegistry> svcreg,
+    std::shared_ptr<RestRegistry> restreg)
+{
+    std::vector<std::shared_ptr<ListenSocket>> res;
+    Address addr = ai.addr;
+    for (int i = 0; i < group.size(); i++) {
+        int fd = ::socket(ai.family, ai.socktype, ai.protocol);
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category());
+        auto sock = std::make_shared<ListenSocket>(fd, svcreg, restreg);
+        int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT_LB
+        // FreeBSD needs SO_REUSEPORT_LB to balance connections
+        if (::setsockopt(
+                fd, SOL_SOCKET, SO_REUSEPORT_LB, &one, sizeof(one)) < 0)
+            throw std::system_error(errno, std::system_category());
+#else
+        if (::setsockopt(
+                fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+            throw std::system_error(errno, std::system_category());
+#endif
+        sock->bind(addr);
+        if (i == 0 && addr.port() == 0) {
+            sockaddr_storage ss;
+            socklen_t len = sizeof(ss);
+            if (::getsockname(
+                    fd, reinterpret_cast<sockaddr*>(&ss), &len) < 0)
+                throw std::system_error(errno, std::system_category());
+            Address bound(reinterpret_cast<const sockaddr&>(ss));
+            addr.setPort(bound.port());
+        }
+        sock->listen();
+        res.push_back(sock);
+    }
+    for (int i = 0; i < group.size(); i++)
+        group.manager(i)->add(res[i]);
+    return res;
+}
@@ -129,6 +129,12 @@ static void xdr(RefType<authsys_parms, XDR> v, XDR* xdrs)
     xdr(v.gids, xdrs);
 }
 
+static size_t xdr_size(const authsys_parms& v)
+{
+    return XdrSizeof(v.stamp) + XdrSizeof(v.machinename) +
+        XdrSizeof(v.uid) + XdrSizeof(v.gid) + XdrSizeof(v.gids);
+}
+
 }
 
 SysClient::SysClient(uint32_t program, uint32_t version)
@@ -0,0 +1,134 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <cassert>
+#include <exception>
+#include <glog/logging.h>
+
+#include <rpc++/executor.h>
+
+using namespace oncrpc;
+
+ThreadPoolExecutor::ThreadPoolExecutor(int count)
+    : next_(0),
+      pending_(0),
+      idle_(0)
+{
+    if (count <= 0)
+        count = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < count; i++)
+        workers_.emplace_back(std::make_unique<Worker>());
+    for (int i = 0; i < count; i++)
+        workers_[i]->thread = std::thread([this, i]() { run(i); });
+}
+
+ThreadPoolExecutor::~ThreadPoolExecutor()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker: workers_)
+        worker->thread.join();
+}
+
+void
+ThreadPoolExecutor::execute(std::function<void()>&& fn)
+{
+    // Work submitted by one of our workers stays on that worker's queue
+    // where it is likely to find a warm cache
+    auto self = std::this_thread::get_id();
+    Worker* target = nullptr;
+    for (auto& worker: workers_) {
+        if (worker->thread.get_id() == self) {
+            target = worker.get();
+            break;
+        }
+    }
+    if (!target)
+        target = workers_[next_++ % workers_.size()].get();
+
+    {
+        std::unique_lock<std::mutex> lock(target->mutex);
+        target->queue.push_back(std::move(fn));
+    }
+
+    // If a worker is going to sleep, it increments idle_ before checking
+    // pending_ so at least one of us sees the other's update
+    pending_++;
+    if (idle_ > 0) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.notify_one();
+    }
+}
+
+bool
+ThreadPoolExecutor::take(int index, std::function<void()>& fn)
+{
+    auto& worker = *workers_[index];
+    std::unique_lock<std::mutex> lock(worker.mutex);
+    if (worker.queue.empty())
+        return false;
+    fn = std::move(worker.queue.front());
+    worker.queue.pop_front();
+    return true;
+}
+
+void
+ThreadPoolExecutor::run(int index)
+{
+    int count = int(workers_.size());
+    for (;;) {
+        // Try our own queue first, then try to steal from the others
+        std::function<void()> fn;
+        bool found = false;
+        for (int i = 0; i < count && !found; i++)
+            found = take((index + i) % count, fn);
+
+        if (found) {
+            pending_--;
+            try {
+                fn();
+            }
+            catch (std::exception& e) {
+                LOG(ERROR) << "unhandled exception in executor: " << e.what();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (pending_ > 0)
+            // Some work was queued after we looked
+            continue;
+        if (stopping_)
+            break;
+        idle_++;
+        while (pending_ == 0 && !stopping_)
+            cv_.wait(lock);
+        idle_--;
+    }
+}
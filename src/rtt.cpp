@@ -0,0 +1,91 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+
+#include <rpc++/rtt.h>
+
+using namespace oncrpc;
+
+RttEstimator::RttEstimator(
+    duration initial, duration minTimeout, duration maxTimeout)
+    : initial_(initial),
+      min_(minTimeout),
+      max_(maxTimeout)
+{
+}
+
+void
+RttEstimator::sample(duration rtt)
+{
+    // RFC 6298 section 2, with alpha = 1/8 and beta = 1/4
+    if (samples_ == 0) {
+        srtt_ = rtt;
+        rttvar_ = rtt / 2;
+    }
+    else {
+        auto err = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+        rttvar_ = (3 * rttvar_ + err) / 4;
+        srtt_ = (7 * srtt_ + rtt) / 8;
+    }
+    shift_ = 0;
+    samples_++;
+}
+
+void
+RttEstimator::backoff()
+{
+    backoffs_++;
+    if (timeout() < max_)
+        shift_++;
+}
+
+RttEstimator::duration
+RttEstimator::timeout() const
+{
+    // Allow at least a millisecond for variation so that a perfectly
+    // steady round trip time doesn't give a timeout equal to it
+    duration res = initial_;
+    if (samples_ > 0)
+        res = srtt_ + std::max(duration(1000), 4 * rttvar_);
+    res = std::max(res, min_);
+    for (int i = 0; i < shift_ && res < max_; i++)
+        res *= 2;
+    return std::min(res, max_);
+}
+
+void
+RttEstimator::setLimits(duration minTimeout, duration maxTimeout)
+{
+    min_ = minTimeout;
+    max_ = maxTimeout;
+}
+
+RttEstimator::Stats
+RttEstimator::stats() const
+{
+    return Stats{srtt_, rttvar_, timeout(), samples_, backoffs_};
+}
@@ -25,6 +25,7 @@
  */
 
 #include <cassert>
+#include <exception>
 #include <iomanip>
 #include <sstream>
 #include <system_error>
@@ -327,6 +328,15 @@ CallContext::CallContext(CallContext&& other)
       credptr_(other.credptr_ == &other.cred_ ? &cred_ : other.credptr_),
       cred_(std::move(other.cred_))
 {
+    // Coroutine service stubs move the context into their frame. Keep
+    // current() pointing at the live copy.
+#ifdef __APPLE__
+    if (pthread_getspecific(currentContextKey()) == &other)
+        pthread_setspecific(currentContextKey(), this);
+#else
+    if (currentContext_ == &other)
+        currentContext_ = this;
+#endif
 }
 
 CallContext::~CallContext()
@@ -474,7 +484,16 @@ void CallContext::sendReply(std::function<void(XdrSink*)> fn)
         }
     }
     VLOG(3) << "xid: " << msg_.xid << ": sent reply";
-    chan_->sendMessage(std::move(reply));
+    try {
+        chan_->sendMessage(std::move(reply));
+    }
+    catch (std::system_error& e) {
+        // A datagram channel can't send replies larger than its buffer
+        if (e.code().value() != EMSGSIZE)
+            throw;
+        LOG(ERROR) << "xid: " << msg_.xid << ": reply too large";
+        systemError();
+    }
 }
 
 void CallContext::rpcMismatch()
@@ -604,6 +623,7 @@ ServiceRegistry::remove(uint32_t prog, uint32_t vers)
     if (p->second.size() == 0)
         programs_.erase(prog);
     services_.erase(std::pair<uint32_t, uint32_t>(prog, vers));
+    localServices_.erase(std::pair<uint32_t, uint32_t>(prog, vers));
 }
 
 uint32_t
@@ -635,6 +655,25 @@ ServiceRegistry::lookup(uint32_t prog, uint32_t vers) const
     return p->second;
 }
 
+void
+ServiceRegistry::addLocal(
+    uint32_t prog, uint32_t vers, const std::type_info& type, void* impl)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    localServices_[std::make_pair(prog, vers)] = LocalService{&type, impl};
+}
+
+void*
+ServiceRegistry::lookupLocal(
+    uint32_t prog, uint32_t vers, const std::type_info& type) const
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto p = localServices_.find(std::make_pair(prog, vers));
+    if (p == localServices_.end() || *p->second.type != type)
+        return nullptr;
+    return p->second.impl;
+}
+
 void
 ServiceRegistry::process(CallContext&& ctx)
 {
@@ -662,14 +701,33 @@ ServiceRegistry::process(CallContext&& ctx)
         return;
 
     try {
-        // Simple single-threaded dispatch. To implement more sophisticated
-        // dispatch mechanisms, we could wrap the value returned by lookup
-        // with a shim which moves the call context to be executed by a thread
-        // pool. Alternatively, the application can supply a service handler
-        // which could defer execution to some other executor.
         ctx.setService(lookup(ctx.prog(), ctx.vers()));
-        ctx.lookupCred();
-        ctx();
+        auto executor = executor_;
+        if (!executor) {
+            // Simple single-threaded dispatch
+            ctx.lookupCred();
+            ctx();
+        }
+        else if (ordered_) {
+            auto chan = ctx.channel().get();
+            std::unique_lock<std::mutex> lock(orderMutex_);
+            auto& queue = orderQueues_[chan];
+            queue.emplace_back(std::make_unique<CallContext>(std::move(ctx)));
+            if (queue.size() == 1) {
+                // Nothing else is running for this channel
+                lock.unlock();
+                executor->execute([this, chan]() { runOrdered(chan); });
+            }
+        }
+        else {
+            // Credential lookup can block so we defer it to the executor
+            // along with the call
+            auto p = std::make_shared<CallContext>(std::move(ctx));
+            executor->execute([p]() {
+                p->lookupCred();
+                (*p)();
+            });
+        }
     }
     catch (ProgramUnavailable& e) {
         // Figure out which error message to use
@@ -693,6 +751,42 @@ ServiceRegistry::process(CallContext&& ctx)
     }
 }
 
+void
+ServiceRegistry::runOrdered(Channel* chan)
+{
+    // The channel's queue can't be removed while it is non-empty and the
+    // calls in it keep the channel alive
+    std::unique_lock<std::mutex> lock(orderMutex_);
+    auto& queue = orderQueues_[chan];
+    auto ctx = queue.front().get();
+    lock.unlock();
+
+    // The queue must advance even if the call fails, otherwise every
+    // later call on this channel would wait behind it forever
+    std::exception_ptr error;
+    try {
+        ctx->lookupCred();
+        (*ctx)();
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    lock.lock();
+    queue.pop_front();
+    bool more = !queue.empty();
+    if (!more)
+        orderQueues_.erase(chan);
+    lock.unlock();
+
+    // Re-submit rather than looping here so that a busy channel can't
+    // monopolise a worker thread
+    if (more)
+        executor_->execute([this, chan]() { runOrdered(chan); });
+    if (error)
+        std::rethrow_exception(error);
+}
+
 void ServiceRegistry::clearClients()
 {
     std::unique_lock<std::mutex> lock(mutex_);
@@ -0,0 +1,919 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <new>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/eventfd.h>)
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD
+#endif
+#endif
+
+#include <glog/logging.h>
+#include <rpc++/shm.h>
+#include <rpc++/sockman.h>
+
+namespace oncrpc {
+namespace _detail {
+
+/// Control block for one ring in the shared mapping. The producer
+/// advances head and the consumer advances tail, both counting bytes
+/// since the ring was created
+struct ShmRing
+{
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> waiting; // consumer wants the doorbell
+};
+
+}
+}
+
+using namespace oncrpc;
+using _detail::ShmRing;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "shared memory rings need lock-free atomics");
+
+namespace {
+
+constexpr uint32_t SHM_MAGIC = 0x52504378;      // "RPCx"
+constexpr uint32_t SHM_VERSION = 1;
+
+/// Start of the shared mapping, followed by the data for each ring
+struct ShmHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ringSize;
+    ShmRing rings[2];           // rings[0] carries messages from the creator
+};
+
+/// Each message in a ring is preceded by its length and padded to a
+/// multiple of RECORD_ALIGN bytes
+constexpr size_t RECORD_HEADER = 8;
+constexpr size_t RECORD_ALIGN = 8;
+
+/// How long a sender waits for space in a full ring before giving up
+constexpr auto SEND_TIMEOUT = std::chrono::seconds(30);
+
+size_t
+recordSize(size_t len)
+{
+    return (RECORD_HEADER + len + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+void
+copyToRing(
+    uint8_t* data, size_t size, uint64_t pos, const void* p, size_t len)
+{
+    auto off = pos & (size - 1);
+    auto n = std::min(len, size_t(size - off));
+    std::memcpy(data + off, p, n);
+    std::memcpy(data, static_cast<const uint8_t*>(p) + n, len - n);
+}
+
+void
+copyFromRing(
+    const uint8_t* data, size_t size, uint64_t pos, void* p, size_t len)
+{
+    auto off = pos & (size - 1);
+    auto n = std::min(len, size_t(size - off));
+    std::memcpy(p, data + off, n);
+    std::memcpy(static_cast<uint8_t*>(p) + n, data, len - n);
+}
+
+/// Create an anonymous shared memory object of the given size. If seal
+/// is set and the platform supports it, the size of the object is
+/// sealed so that a peer which maps it can rely on it not shrinking.
+int
+makeSharedMemory(size_t size, bool seal = false)
+{
+#if defined(__linux__)
+    int fd = ::memfd_create(
+        "rpcxx-shm", MFD_CLOEXEC | (seal ? MFD_ALLOW_SEALING : 0));
+#elif defined(SHM_ANON)
+    int fd = ::shm_open(SHM_ANON, O_RDWR | O_CREAT, 0600);
+#else
+    static std::atomic<int> index(0);
+    auto name = "/rpcxx-" + std::to_string(::getpid()) + "-" +
+        std::to_string(index++);
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+        ::shm_unlink(name.c_str());
+#endif
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category());
+    if (::ftruncate(fd, size) < 0) {
+        auto err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::system_category());
+    }
+#ifdef F_SEAL_SHRINK
+    if (seal && ::fcntl(
+            fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        auto err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::system_category());
+    }
+#endif
+    return fd;
+}
+
+/// Create a doorbell, returning file descriptors for waiting on it and
+/// for ringing it. Neither blocks.
+std::pair<int, int>
+makeDoorbell()
+{
+#ifdef HAVE_EVENTFD
+    int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category());
+    int wfd = ::dup(fd);
+    if (wfd < 0) {
+        auto err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::system_category());
+    }
+    return {fd, wfd};
+#else
+    int fds[2];
+    if (::pipe(fds) < 0)
+        throw std::system_error(errno, std::system_category());
+    for (auto fd: fds) {
+        ::fcntl(fd, F_SETFL, O_NONBLOCK);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return {fds[0], fds[1]};
+#endif
+}
+
+void
+ringDoorbell(int fd)
+{
+    // An eventfd needs an eight byte counter value. If the write fails
+    // because the pipe is full, the doorbell is already ringing
+    uint64_t one = 1;
+    auto res = ::write(fd, &one, sizeof(one));
+    (void) res;
+}
+
+void
+drainDoorbell(int fd)
+{
+    uint64_t buf[8];
+    while (::read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/// Each UnixChannel message starts with the number of bytes sent
+/// through the socket and the number of buffers passed as shared
+/// memory, followed by the position and size of each buffer
+struct BulkHeader
+{
+    uint32_t length;
+    uint32_t count;
+};
+
+struct BulkRef
+{
+    uint32_t offset;            // position in the bytes sent inline
+    uint32_t size;
+};
+
+/// Map a shared memory object received from a peer, closing fd
+std::shared_ptr<Buffer>
+mapBulkBuffer(int fd, size_t size)
+{
+    struct stat st;
+    int err = 0;
+    if (::fstat(fd, &st) < 0)
+        err = errno;
+    else if (size == 0 || size_t(st.st_size) < size)
+        err = EPROTO;
+#ifdef F_SEAL_SHRINK
+    // Make sure the peer can't shrink the object while we are using it
+    else if (!(::fcntl(fd, F_GET_SEALS) & F_SEAL_SHRINK))
+        err = EPROTO;
+#endif
+    void* p = MAP_FAILED;
+    if (!err) {
+        // Map the object privately so that changes made by the receiver
+        // are not seen by the sender
+        p = ::mmap(
+            nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            err = errno;
+    }
+    ::close(fd);
+    if (err)
+        throw std::system_error(err, std::system_category());
+    return std::make_shared<Buffer>(
+        size, static_cast<uint8_t*>(p),
+        [size](uint8_t* p) { ::munmap(p, size); });
+}
+
+}
+
+constexpr std::chrono::microseconds ShmChannel::DEFAULT_MAX_SPIN;
+
+ShmChannel::ShmChannel(
+    int sock, bool create, std::shared_ptr<ServiceRegistry> svcreg,
+    size_t ringSize)
+    : SocketChannel(-1, svcreg)
+{
+    // Messages can't be lost so there is no need to retransmit
+    retransmitInterval_ = std::chrono::seconds(0);
+    try {
+        if (create)
+            this->create(sock, ringSize);
+        else
+            attach(sock);
+    }
+    catch (std::system_error&) {
+        ::close(sock);
+        unmap();
+        throw;
+    }
+    ::close(sock);
+}
+
+ShmChannel::~ShmChannel()
+{
+    unmap();
+}
+
+std::shared_ptr<ShmChannel>
+ShmChannel::open(
+    const std::string& path, std::shared_ptr<ServiceRegistry> svcreg)
+{
+    sockaddr_un sun;
+    if (path.size() >= sizeof(sun.sun_path))
+        throw std::system_error(ENAMETOOLONG, std::system_category());
+    std::memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_LOCAL;
+    std::strcpy(sun.sun_path, path.c_str());
+
+    int sock = ::socket(AF_LOCAL, SOCK_STREAM, 0);
+    if (sock < 0)
+        throw std::system_error(errno, std::system_category());
+    if (::connect(sock, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)) < 0) {
+        auto err = errno;
+        ::close(sock);
+        throw std::system_error(err, std::system_category());
+    }
+    return std::make_shared<ShmChannel>(sock, false, svcreg);
+}
+
+void
+ShmChannel::create(int sock, size_t ringSize)
+{
+    size_t size = 1;
+    while (size < ringSize)
+        size <<= 1;
+
+    int memfd = -1;
+    std::pair<int, int> ours(-1, -1), theirs(-1, -1);
+    try {
+        memfd = makeSharedMemory(sizeof(ShmHeader) + 2 * size);
+        map(memfd, sizeof(ShmHeader) + 2 * size, true);
+        ours = makeDoorbell();
+        theirs = makeDoorbell();
+    }
+    catch (std::system_error&) {
+        for (auto fd: {memfd, ours.first, ours.second, theirs.first})
+            if (fd >= 0) ::close(fd);
+        throw;
+    }
+    setFd(ours.first);
+    selfBell_ = ours.second;
+    peerBell_ = theirs.second;
+
+    // Send the mapping with the peer's doorbell and a way to ring ours
+    int fds[4] = { memfd, theirs.first, theirs.second, ours.second };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    std::memset(cbuf, 0, sizeof(cbuf));
+    char byte = 0;
+    iovec iov { &byte, 1 };
+    msghdr mh;
+    std::memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    auto cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    auto res = ::sendmsg(sock, &mh, 0);
+    auto err = errno;
+    ::close(memfd);
+    ::close(theirs.first);
+    if (res < 0)
+        throw std::system_error(err, std::system_category());
+}
+
+void
+ShmChannel::attach(int sock)
+{
+    int fds[4];
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    char byte;
+    iovec iov { &byte, 1 };
+    msghdr mh;
+    std::memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    auto res = ::recvmsg(sock, &mh, 0);
+    if (res < 0)
+        throw std::system_error(errno, std::system_category());
+    auto cmsg = CMSG_FIRSTHDR(&mh);
+    if (res == 0 || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        throw std::system_error(EPROTO, std::system_category());
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    setFd(fds[1]);
+    selfBell_ = fds[2];
+    peerBell_ = fds[3];
+
+    struct stat st;
+    if (::fstat(fds[0], &st) < 0) {
+        auto err = errno;
+        ::close(fds[0]);
+        throw std::system_error(err, std::system_category());
+    }
+    try {
+        map(fds[0], st.st_size, false);
+    }
+    catch (std::system_error&) {
+        ::close(fds[0]);
+        throw;
+    }
+    ::close(fds[0]);
+}
+
+void
+ShmChannel::map(int fd, size_t size, bool creator)
+{
+    if (size < sizeof(ShmHeader))
+        throw std::system_error(EPROTO, std::system_category());
+    auto p = ::mmap(
+        nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        throw std::system_error(errno, std::system_category());
+    map_ = p;
+    mapSize_ = size;
+
+    auto hdr = static_cast<ShmHeader*>(p);
+    if (creator) {
+        hdr = new (p) ShmHeader();
+        hdr->magic = SHM_MAGIC;
+        hdr->version = SHM_VERSION;
+        hdr->ringSize = (size - sizeof(ShmHeader)) / 2;
+        // Neither reader is polling yet so both want the doorbell for
+        // the first message
+        hdr->rings[0].waiting = hdr->rings[1].waiting = 1;
+    }
+    else {
+        auto ringSize = hdr->ringSize;
+        if (hdr->magic != SHM_MAGIC || hdr->version != SHM_VERSION ||
+            ringSize == 0 || (ringSize & (ringSize - 1)) != 0 ||
+            sizeof(ShmHeader) + 2 * ringSize != size)
+            throw std::system_error(EPROTO, std::system_category());
+    }
+    ringSize_ = hdr->ringSize;
+    auto data = static_cast<uint8_t*>(p) + sizeof(ShmHeader);
+    int send = creator ? 0 : 1;
+    sendRing_ = &hdr->rings[send];
+    sendData_ = data + send * ringSize_;
+    recvRing_ = &hdr->rings[1 - send];
+    recvData_ = data + (1 - send) * ringSize_;
+}
+
+void
+ShmChannel::unmap()
+{
+    if (map_) {
+        ::munmap(map_, mapSize_);
+        map_ = nullptr;
+    }
+    if (selfBell_ >= 0) {
+        ::close(selfBell_);
+        selfBell_ = -1;
+    }
+    if (peerBell_ >= 0) {
+        ::close(peerBell_);
+        peerBell_ = -1;
+    }
+}
+
+bool
+ShmChannel::onReadable(SocketManager*)
+{
+    Transaction nulltx;
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (running_)
+        // Some other thread is reading from the ring
+        return true;
+    running_ = true;
+    draining_ = true;
+    try {
+        // Keep reading while messages arrive within the polling time so
+        // that a busy peer doesn't need to ring the doorbell
+        while (processIncomingMessage(nulltx, lock, spin_))
+            ;
+        draining_ = false;
+        running_ = false;
+        return true;
+    }
+    catch (std::system_error& e) {
+        draining_ = false;
+        running_ = false;
+        return false;
+    }
+    catch (XdrError& e) {
+        draining_ = false;
+        running_ = false;
+        return false;
+    }
+}
+
+std::unique_ptr<XdrSink>
+ShmChannel::acquireSendBuffer()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (xdrs_ && xdrs_->bufferSize() != bufferSize_)
+        xdrs_.reset();
+    if (xdrs_) {
+        return std::move(xdrs_);
+    }
+    else {
+        return std::make_unique<Message>(bufferSize_);
+    }
+}
+
+void
+ShmChannel::releaseSendBuffer(std::unique_ptr<XdrSink>&& xdrs)
+{
+    std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+    msg->rewind();
+    std::unique_lock<std::mutex> lock(mutex_);
+    xdrs_ = std::move(msg);
+}
+
+void
+ShmChannel::sendMessage(std::unique_ptr<XdrSink>&& xdrs)
+{
+    std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+    auto iov = msg->iov();
+    size_t len = 0;
+    for (auto& v: iov)
+        len += v.iov_len;
+    auto need = recordSize(len);
+    if (need > ringSize_) {
+        releaseSendBuffer(std::move(msg));
+        throw std::system_error(EMSGSIZE, std::system_category());
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(sendMutex_);
+        auto ring = sendRing_;
+        auto head = ring->head.load(std::memory_order_relaxed);
+        if (head + need - ring->tail.load(std::memory_order_acquire)
+            > ringSize_) {
+            // Wait for the peer to make room
+            auto deadline = clock_type::now() + SEND_TIMEOUT;
+            while (head + need - ring->tail.load(std::memory_order_acquire)
+                   > ringSize_) {
+                if (clock_type::now() > deadline) {
+                    lock.unlock();
+                    releaseSendBuffer(std::move(msg));
+                    throw std::system_error(
+                        ETIMEDOUT, std::system_category());
+                }
+                std::this_thread::yield();
+            }
+        }
+
+        uint32_t hdr[2] = { uint32_t(len), 0 };
+        copyToRing(sendData_, ringSize_, head, hdr, RECORD_HEADER);
+        auto pos = head + RECORD_HEADER;
+        for (auto& v: iov) {
+            copyToRing(sendData_, ringSize_, pos, v.iov_base, v.iov_len);
+            pos += v.iov_len;
+        }
+
+        // Publish the message, then ring the doorbell if the peer has
+        // stopped polling. Both are sequentially consistent so that
+        // either we see waiting set or the peer sees the new head
+        ring->head.store(head + need);
+        if (ring->waiting.load() && ring->waiting.exchange(0))
+            ringDoorbell(peerBell_);
+    }
+    releaseSendBuffer(std::move(msg));
+}
+
+std::unique_ptr<Message>
+ShmChannel::takeMessage()
+{
+    auto ring = recvRing_;
+    auto tail = ring->tail.load(std::memory_order_relaxed);
+    auto head = ring->head.load(std::memory_order_acquire);
+    if (head == tail)
+        return nullptr;
+
+    // The ring is shared with the peer so check its contents before
+    // trusting them
+    if (head - tail > ringSize_)
+        throw std::system_error(EPROTO, std::system_category());
+    uint32_t hdr[2];
+    copyFromRing(recvData_, ringSize_, tail, hdr, RECORD_HEADER);
+    size_t len = hdr[0];
+    if (recordSize(len) > ringSize_ || recordSize(len) > head - tail)
+        throw std::system_error(EPROTO, std::system_category());
+
+    std::unique_ptr<Message> msg;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (xdrs_ && xdrs_->bufferSize() >= len)
+            msg = std::move(xdrs_);
+    }
+    if (!msg)
+        msg = std::make_unique<Message>(std::max(len, bufferSize_));
+    copyFromRing(recvData_, ringSize_, tail + RECORD_HEADER, msg->buf(), len);
+    ring->tail.store(tail + recordSize(len), std::memory_order_release);
+
+    // Set up the message to decode the record
+    msg->advanceWrite(len);
+    return msg;
+}
+
+std::unique_ptr<XdrSource>
+ShmChannel::receiveMessage(
+    std::shared_ptr<Channel>& replyChan, clock_type::duration timeout)
+{
+    replyChan = shared_from_this();
+    auto ring = recvRing_;
+    auto start = clock_type::now();
+    auto deadline = start + timeout;
+
+    auto msg = takeMessage();
+    if (!msg && spin_.count() > 0 && timeout.count() > 0) {
+        // Poll the ring for a while. The peer won't ring the doorbell
+        // while waiting is clear. If this finds a message, allow longer
+        // polls, otherwise poll for less time next time.
+        auto spinEnd = start + std::min<clock_type::duration>(timeout, spin_);
+        ring->waiting.store(0);
+        do {
+            msg = takeMessage();
+        } while (!msg && clock_type::now() < spinEnd);
+        if (msg)
+            spin_ = std::min(maxSpin_, 2 * spin_);
+        else
+            spin_ = std::max(maxSpin_ / 16, spin_ / 2);
+    }
+    while (!msg) {
+        // Ask for the doorbell before checking the ring one last time
+        ring->waiting.store(1);
+        drainDoorbell(fd());
+        msg = takeMessage();
+        if (msg)
+            break;
+        auto now = clock_type::now();
+        if (now >= deadline || !waitForReadable(deadline - now))
+            return nullptr;
+    }
+
+    // Make sure the peer rings the doorbell for the next message. If
+    // there are more messages already and we are not going to read
+    // them, ring our own doorbell so that they are not stranded.
+    ring->waiting.store(1);
+    if (!draining_ && ring->head.load() != ring->tail.load())
+        ringDoorbell(selfBell_);
+
+    return msg;
+}
+
+void
+ShmChannel::releaseReceiveBuffer(std::unique_ptr<XdrSource>&& xdrs)
+{
+    std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+    msg->rewind();
+    std::unique_lock<std::mutex> lock(mutex_);
+    xdrs_ = std::move(msg);
+}
+
+bool
+ShmListenSocket::onReadable(SocketManager* sockman)
+{
+    auto newsock = ::accept(fd(), nullptr, nullptr);
+    if (newsock < 0)
+        throw std::system_error(errno, std::system_category());
+    VLOG(3) << "New shared memory connection fd: " << newsock;
+    std::shared_ptr<ShmChannel> chan;
+    try {
+        chan = std::make_shared<ShmChannel>(
+            newsock, true, svcreg_.lock(), ringSize_);
+    }
+    catch (std::system_error& e) {
+        LOG(ERROR) << "Can't set up shared memory channel: " << e.what();
+        return true;
+    }
+    chan->setCloseOnIdle(true);
+    chan->setBufferSize(bufferSize_);
+    sockman->add(chan);
+    return true;
+}
+
+constexpr size_t UnixChannel::MAX_BULK_BUFFERS;
+
+UnixChannel::UnixChannel(int sock, std::shared_ptr<ServiceRegistry> svcreg)
+    : SocketChannel(sock, svcreg)
+{
+    // Disable retransmits - we assume the stream protocol is reliable
+    retransmitInterval_ = std::chrono::seconds(0);
+}
+
+UnixChannel::~UnixChannel()
+{
+    for (auto fd: fds_)
+        ::close(fd);
+}
+
+std::shared_ptr<UnixChannel>
+UnixChannel::open(
+    const std::string& path, std::shared_ptr<ServiceRegistry> svcreg)
+{
+    sockaddr_un sun;
+    if (path.size() >= sizeof(sun.sun_path))
+        throw std::system_error(ENAMETOOLONG, std::system_category());
+    std::memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_LOCAL;
+    std::strcpy(sun.sun_path, path.c_str());
+
+    int sock = ::socket(AF_LOCAL, SOCK_STREAM, 0);
+    if (sock < 0)
+        throw std::system_error(errno, std::system_category());
+    if (::connect(sock, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)) < 0) {
+        auto err = errno;
+        ::close(sock);
+        throw std::system_error(err, std::system_category());
+    }
+    return std::make_shared<UnixChannel>(sock, svcreg);
+}
+
+std::shared_ptr<Buffer>
+UnixChannel::allocateBuffer(size_t size)
+{
+    int fd = makeSharedMemory(size, true);
+    auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        auto err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::system_category());
+    }
+    return std::make_shared<Buffer>(
+        size, static_cast<uint8_t*>(p),
+        [size, fd](uint8_t* p) { ::munmap(p, size); ::close(fd); }, fd);
+}
+
+std::unique_ptr<XdrSink>
+UnixChannel::acquireSendBuffer()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (xdrs_ && xdrs_->bufferSize() != bufferSize_)
+        xdrs_.reset();
+    if (xdrs_) {
+        return std::move(xdrs_);
+    }
+    else {
+        return std::make_unique<Message>(bufferSize_);
+    }
+}
+
+void
+UnixChannel::releaseSendBuffer(std::unique_ptr<XdrSink>&& xdrs)
+{
+    std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+    msg->rewind();
+    std::unique_lock<std::mutex> lock(mutex_);
+    xdrs_ = std::move(msg);
+}
+
+void
+UnixChannel::sendMessage(std::unique_ptr<XdrSink>&& xdrs)
+{
+    std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+    auto iov = msg->iov();
+    auto& buffers = msg->buffers();
+
+    // Replace large buffers with references to shared memory objects,
+    // copying any which are not already in shared memory
+    BulkHeader hdr;
+    BulkRef refs[MAX_BULK_BUFFERS];
+    std::vector<int> fds;
+    std::vector<std::shared_ptr<Buffer>> copies;
+    std::vector<iovec> out;
+    out.reserve(iov.size() + 2);
+    out.push_back(iovec{&hdr, sizeof(hdr)});
+    out.push_back(iovec{refs, 0});
+    size_t len = 0, j = 0;
+    try {
+        for (size_t i = 0; i < iov.size(); i++) {
+            auto& v = iov[i];
+            if (j < buffers.size() && buffers[j]->data() == v.iov_base) {
+                auto buf = buffers[j++];
+                auto sz = buf->size();
+                if (fds.size() < MAX_BULK_BUFFERS && sz >= bulkThreshold_) {
+                    if (buf->fd() < 0) {
+                        auto copy = allocateBuffer(sz);
+                        std::copy_n(buf->data(), sz, copy->data());
+                        copies.push_back(copy);
+                        buf = copy;
+                    }
+                    refs[fds.size()] = BulkRef{uint32_t(len), uint32_t(sz)};
+                    fds.push_back(buf->fd());
+
+                    // The receiver adds the padding which follows the
+                    // buffer
+                    if (__round(sz) != sz)
+                        i++;
+                    continue;
+                }
+            }
+            out.push_back(v);
+            len += v.iov_len;
+        }
+    }
+    catch (std::system_error&) {
+        releaseSendBuffer(std::move(msg));
+        throw;
+    }
+    hdr.length = len;
+    hdr.count = fds.size();
+    out[1].iov_len = fds.size() * sizeof(BulkRef);
+
+    try {
+        std::unique_lock<std::mutex> lock(sendMutex_);
+
+        // The descriptors go with the first write. If the socket buffer
+        // fills, write the rest of the message normally.
+        auto n = sendFds(out, fds);
+        for (;;) {
+            while (out.size() > 0 && size_t(n) >= out[0].iov_len) {
+                n -= out[0].iov_len;
+                out.erase(out.begin());
+            }
+            if (out.size() == 0)
+                break;
+            out[0].iov_base = static_cast<uint8_t*>(out[0].iov_base) + n;
+            out[0].iov_len -= n;
+            n = Socket::send(out);
+        }
+    }
+    catch (std::system_error&) {
+        releaseSendBuffer(std::move(msg));
+        throw;
+    }
+    releaseSendBuffer(std::move(msg));
+}
+
+void
+UnixChannel::readFully(void* p, size_t len)
+{
+    auto bp = static_cast<uint8_t*>(p);
+    while (len > 0) {
+        auto n = recvFds(bp, len, fds_);
+        if (n == 0)
+            throw std::system_error(ENOTCONN, std::system_category());
+        bp += n;
+        len -= n;
+    }
+}
+
+std::unique_ptr<XdrSource>
+UnixChannel::receiveMessage(
+    std::shared_ptr<Channel>& replyChan, clock_type::duration timeout)
+{
+    replyChan = shared_from_this();
+    if (!waitForReadable(timeout))
+        return nullptr;
+
+    BulkHeader hdr;
+    BulkRef refs[MAX_BULK_BUFFERS];
+    readFully(&hdr, sizeof(hdr));
+    if (hdr.count > MAX_BULK_BUFFERS)
+        throw std::system_error(EPROTO, std::system_category());
+    readFully(refs, hdr.count * sizeof(BulkRef));
+
+    // The descriptors arrive with the first byte of the message so any
+    // more than the header describes can only come from a broken peer.
+    // Those left in fds_ are closed with the channel.
+    if (fds_.size() != hdr.count || hdr.length > maxRecordSize_)
+        throw std::system_error(EPROTO, std::system_category());
+    std::vector<int> fds;
+    std::swap(fds, fds_);
+
+    size_t len = hdr.length;
+    std::unique_ptr<Message> msg;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (xdrs_ && xdrs_->bufferSize() >= len)
+            msg = std::move(xdrs_);
+    }
+    if (!msg)
+        msg = std::make_unique<Message>(std::max(len, bufferSize_));
+    msg->setShareBuffers(true);
+
+    // Read the inline parts of the message directly into the buffer,
+    // adding each shared memory buffer at its original position
+    size_t pos = 0;
+    size_t i = 0;
+    try {
+        for (; i < hdr.count; i++) {
+            auto& ref = refs[i];
+            if (ref.offset < pos || ref.offset > len)
+                throw std::system_error(EPROTO, std::system_category());
+            readFully(msg->buf() + pos, ref.offset - pos);
+            msg->advanceWrite(ref.offset - pos);
+            pos = ref.offset;
+            auto fd = fds[i];
+            fds[i] = -1;
+            msg->putBuffer(mapBulkBuffer(fd, ref.size));
+        }
+        readFully(msg->buf() + pos, len - pos);
+        msg->advanceWrite(len - pos);
+    }
+    catch (std::system_error&) {
+        for (; i < hdr.count; i++)
+            if (fds[i] >= 0)
+                ::close(fds[i]);
+        throw;
+    }
+    return msg;
+}
+
+void
+UnixChannel::releaseReceiveBuffer(std::unique_ptr<XdrSource>&& xdrs)
+{
+    std::unique_ptr<Message> msg(static_cast<Message*>(xdrs.release()));
+    msg->rewind();
+    std::unique_lock<std::mutex> lock(mutex_);
+    xdrs_ = std::move(msg);
+}
+
+bool
+UnixListenSocket::onReadable(SocketManager* sockman)
+{
+    auto newsock = ::accept(fd(), nullptr, nullptr);
+    if (newsock < 0)
+        throw std::system_error(errno, std::system_category());
+    VLOG(3) << "New unix domain connection fd: " << newsock;
+    auto chan = std::make_shared<UnixChannel>(newsock, svcreg_.lock());
+    chan->setCloseOnIdle(true);
+    chan->setBufferSize(bufferSize_);
+    chan->setBulkThreshold(bulkThreshold_);
+    sockman->add(chan);
+    return true;
+}
@@ -619,3 +619,64 @@ Socket::bind(const Address& addr)
     if (::bind(fd_, addr.addr(), addr.len()) < 0)
         throw std::system_error(errno, std::system_category());
 }
+
+ssize_t
+Socket::sendFds(const std::vector<iovec>& iov, const std::vector<int>& fds)
+{
+    std::vector<uint8_t> cbuf(CMSG_SPACE(fds.size() * sizeof(int)));
+    msghdr mh;
+    std::memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = const_cast<iovec*>(iov.data());
+    mh.msg_iovlen = iov.size();
+    if (fds.size() > 0) {
+        mh.msg_control = cbuf.data();
+        mh.msg_controllen = cbuf.size();
+        auto cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+    auto len = ::sendmsg(fd_, &mh, 0);
+    if (len < 0)
+        throw std::system_error(errno, std::system_category());
+    return len;
+}
+
+ssize_t
+Socket::recvFds(void* buf, size_t buflen, std::vector<int>& fds)
+{
+    // Enough space for the largest number of descriptors which can be
+    // passed with a single message on any supported platform
+    std::vector<uint8_t> cbuf(CMSG_SPACE(256 * sizeof(int)));
+    iovec iov { buf, buflen };
+    msghdr mh;
+    std::memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.data();
+    mh.msg_controllen = cbuf.size();
+#ifdef MSG_CMSG_CLOEXEC
+    auto len = ::recvmsg(fd_, &mh, MSG_CMSG_CLOEXEC);
+#else
+    auto len = ::recvmsg(fd_, &mh, 0);
+#endif
+    if (len < 0)
+        throw std::system_error(errno, std::system_category());
+    for (auto cmsg = CMSG_FIRSTHDR(&mh); cmsg;
+         cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        auto n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        auto p = CMSG_DATA(cmsg);
+        for (size_t i = 0; i < n; i++) {
+            int fd;
+            std::memcpy(&fd, p + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
+    }
+    if (mh.msg_flags & MSG_CTRUNC)
+        // Some descriptors were discarded so the stream can't be trusted
+        throw std::system_error(EMSGSIZE, std::system_category());
+    return len;
+}
@@ -24,7 +24,15 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <system_error>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
 #include <glog/logging.h>
 
 #include <rpc++/socket.h>
@@ -32,27 +40,98 @@
 
 using namespace oncrpc;
 
-SocketManager::SocketManager()
+// Events reported for a ready socket
+static constexpr int READABLE = 1;
+static constexpr int WRITABLE = 2;
+
+#ifdef HAVE_IO_URING
+// Reserved io_uring user_data values - real operations start at
+// FIRST_OP
+static constexpr uint64_t IGNORE_OP = 0;
+static constexpr uint64_t WAKEUP_OP = 1;
+static constexpr uint64_t FIRST_OP = 2;
+#endif
+
+SocketManager::SocketManager(Engine engine)
     : idleTimeout_(std::chrono::seconds(30))
 {
     ::pipe(pipefds_);
 
+#ifdef HAVE_IO_URING
+    if (engine == Engine::URING) {
+        try {
+            if (IoUring::supported()) {
+                uring_ = std::make_unique<IoUring>(256);
+                engine_ = Engine::URING;
+                nextOp_ = FIRST_OP;
+                armWakeup();
+                uring_->submit();
+            }
+        }
+        catch (std::system_error& e) {
+            LOG(INFO) << "io_uring setup failed: " << e.what();
+            uring_.reset();
+        }
+    }
+#endif
+    if (engine != engine_)
+        LOG(INFO) << "io_uring not available, using default engine";
+
 #ifdef HAVE_KEVENT
     kq_ = ::kqueue();
     struct kevent kev;
     EV_SET(&kev, pipefds_[0], EVFILT_READ, EV_ADD, 0, 0, nullptr);
     changes_.push_back(kev);
+#elif defined(HAVE_EPOLL)
+    epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0)
+        throw std::system_error(errno, std::system_category());
+    ::epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = pipefds_[0];
+    ::epoll_ctl(epfd_, EPOLL_CTL_ADD, pipefds_[0], &ev);
+    events_.resize(256);
 #else
     maxfd_ = pipefds_[0];
     FD_ZERO(&rset_);
+    FD_ZERO(&wset_);
     FD_SET(pipefds_[0], &rset_);
 #endif
 }
 
 SocketManager::~SocketManager()
 {
+#ifdef HAVE_IO_URING
+    if (uring_) {
+        // Cancel everything in flight and wait for the kernel to finish
+        // with our buffers before tearing down the ring
+        for (auto& i: ops_) {
+            auto sqe = uring_->getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = i.first;
+            sqe->user_data = IGNORE_OP;
+        }
+        auto sqe = uring_->getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = WAKEUP_OP;
+        sqe->user_data = IGNORE_OP;
+        auto deadline = clock_type::now() + std::chrono::seconds(1);
+        while (ops_.size() > 0 && clock_type::now() < deadline) {
+            uring_->wait(uring_->flush(), std::chrono::milliseconds(100));
+            uring_->reap([this](uint64_t data, int) {
+                ops_.erase(data);
+            });
+        }
+        if (ops_.size() > 0)
+            LOG(ERROR) << ops_.size() << " io_uring operations not cancelled";
+        ops_.clear();
+        uring_.reset();
+    }
+#endif
 #ifdef HAVE_KEVENT
     ::close(kq_);
+#elif defined(HAVE_EPOLL)
+    ::close(epfd_);
 #endif
     ::close(pipefds_[0]);
     ::close(pipefds_[1]);
@@ -65,10 +144,30 @@ SocketManager::add(std::shared_ptr<Socket> sock)
     std::unique_lock<std::mutex> lock(mutex_);
     assert(!sock->owner());
     int fd = sock->fd();
+#ifdef HAVE_IO_URING
+    if (uring_) {
+        auto& entry = sockets_[sock];
+        entry = {clock_type::now(), fd};
+        if (fd >= 0)
+            arm(sock, entry);
+        submit();
+        sock->setOwner(shared_from_this());
+        return;
+    }
+#endif
 #ifdef HAVE_KEVENT
     struct kevent kev;
     EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, sock.get());
     changes_.push_back(kev);
+#elif defined(HAVE_EPOLL)
+    if (fd >= 0) {
+        ::epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+            throw std::system_error(errno, std::system_category());
+        fds_[fd] = sock;
+    }
 #else
     if (sock->fd() >= FD_SETSIZE) {
         LOG(FATAL) << "file descriptor too large for select: " << sock->fd();
@@ -90,12 +189,40 @@ SocketManager::remove(std::shared_ptr<Socket> sock)
     auto i = sockets_.find(sock);
     assert(i != sockets_.end());
     int fd = i->second.fd;
+#ifdef HAVE_IO_URING
+    if (uring_) {
+        disarm(i->second);
+        if (i->second.writeOp) {
+            cancel(i->second.writeOp);
+            i->second.writeOp = 0;
+        }
+        sockets_.erase(i);
+        sock->setOwner(nullptr);
+        submit();
+        return;
+    }
+#endif
 #ifdef HAVE_KEVENT
     struct kevent kev;
     EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, sock.get());
     changes_.push_back(kev);
+    if (i->second.write) {
+        EV_SET(&kev, fd, EVFILT_WRITE, EV_DELETE, 0, 0, sock.get());
+        changes_.push_back(kev);
+    }
+#elif defined(HAVE_EPOLL)
+    // The descriptor may already have been closed, in which case the
+    // kernel has dropped it from the interest list and this fails
+    // harmlessly.
+    if (fd >= 0) {
+        ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+        fds_.erase(fd);
+    }
+    sockets_.erase(i);
+    sock->setOwner(nullptr);
 #else
     FD_CLR(fd, &rset_);
+    FD_CLR(fd, &wset_);
     sockets_.erase(i);
     sock->setOwner(nullptr);
     if (maxfd_ == fd) {
@@ -119,16 +246,63 @@ SocketManager::changed(std::shared_ptr<Socket> sock)
     assert(i != sockets_.end());
     int oldfd = i->second.fd;
     int newfd = sock->fd();
+#ifdef HAVE_IO_URING
+    if (uring_) {
+        if (oldfd != newfd) {
+            auto& entry = i->second;
+            disarm(entry);
+            if (entry.writeOp) {
+                cancel(entry.writeOp);
+                entry.writeOp = 0;
+            }
+            entry.fd = newfd;
+            if (newfd >= 0) {
+                if (entry.read)
+                    arm(sock, entry);
+                if (entry.write)
+                    armWrite(sock, entry);
+            }
+            submit();
+        }
+        return;
+    }
+#endif
     if (oldfd != newfd) {
 #ifdef HAVE_KEVENT
         struct kevent kev;
         EV_SET(&kev, oldfd, EVFILT_READ, EV_DELETE, 0, 0, sock.get());
         changes_.push_back(kev);
-        EV_SET(&kev, newfd, EVFILT_READ, EV_ADD, 0, 0, sock.get());
+        EV_SET(&kev, newfd, EVFILT_READ,
+               EV_ADD | (i->second.read ? 0 : EV_DISABLE), 0, 0, sock.get());
         changes_.push_back(kev);
+        if (i->second.write) {
+            EV_SET(&kev, oldfd, EVFILT_WRITE, EV_DELETE, 0, 0, sock.get());
+            changes_.push_back(kev);
+            EV_SET(&kev, newfd, EVFILT_WRITE, EV_ADD, 0, 0, sock.get());
+            changes_.push_back(kev);
+        }
+#elif defined(HAVE_EPOLL)
+        if (oldfd >= 0) {
+            ::epoll_ctl(epfd_, EPOLL_CTL_DEL, oldfd, nullptr);
+            fds_.erase(oldfd);
+        }
+        if (newfd >= 0) {
+            ::epoll_event ev;
+            ev.events = (i->second.read ? uint32_t(EPOLLIN) : 0) |
+                (i->second.write ? uint32_t(EPOLLOUT) : 0);
+            ev.data.fd = newfd;
+            if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, newfd, &ev) < 0)
+                throw std::system_error(errno, std::system_category());
+            fds_[newfd] = sock;
+        }
+        i->second.fd = newfd;
 #else
         FD_CLR(oldfd, &rset_);
-        FD_SET(newfd, &rset_);
+        FD_CLR(oldfd, &wset_);
+        if (i->second.read)
+            FD_SET(newfd, &rset_);
+        if (i->second.write)
+            FD_SET(newfd, &wset_);
         i->second.fd = newfd;
         if (newfd > maxfd_)
             maxfd_ = newfd;
@@ -145,52 +319,127 @@ SocketManager::changed(std::shared_ptr<Socket> sock)
 }
 
 void
-SocketManager::run()
+SocketManager::setInterest(std::shared_ptr<Socket> sock, bool read, bool write)
 {
     std::unique_lock<std::mutex> lock(mutex_);
-    running_ = true;
-    stopping_ = false;
-    while (!stopping_) {
-        auto idleLimit = clock_type::now() - idleTimeout_;
-        std::vector<std::shared_ptr<Socket>> idle;
-        for (const auto& i: sockets_) {
-            if (i.first->closeOnIdle() &&
-                i.second.time < idleLimit) {
-                VLOG(3) << "idle timeout for socket " << i.second.fd;
-                idle.push_back(i.first);
-                continue;
+    auto i = sockets_.find(sock);
+    if (i == sockets_.end())
+        // The socket was removed, e.g. after an error
+        return;
+    auto& entry = i->second;
+    if (entry.read == read && entry.write == write)
+        return;
+    VLOG(3) << "socket " << sock << " interest read=" << read
+            << ", write=" << write;
+    bool oldRead = entry.read;
+    bool oldWrite = entry.write;
+    entry.read = read;
+    entry.write = write;
+    int fd = entry.fd;
+    if (fd < 0)
+        return;
+#ifdef HAVE_IO_URING
+    if (uring_) {
+        // A queued poll can be cancelled but a queued read is left to
+        // complete so that we don't lose data - we just don't queue
+        // another until reading is resumed
+        if (!read && oldRead && entry.op &&
+            ops_.at(entry.op).type == Op::POLL)
+            disarm(entry);
+        if (read && !oldRead && !entry.op)
+            arm(sock, entry);
+        if (write != oldWrite) {
+            if (!write) {
+                cancel(entry.writeOp);
+                entry.writeOp = 0;
             }
-        }
-
-        if (idle.size() > 0) {
-            lock.unlock();
-            for (auto sock: idle) {
-                remove(sock);
+            else {
+                armWrite(sock, entry);
             }
-            idle.clear();
-            lock.lock();
         }
+        submit();
+        return;
+    }
+#endif
+#ifdef HAVE_KEVENT
+    struct kevent kev;
+    if (read != oldRead) {
+        EV_SET(&kev, fd, EVFILT_READ, read ? EV_ENABLE : EV_DISABLE,
+               0, 0, sock.get());
+        changes_.push_back(kev);
+    }
+    if (write != oldWrite) {
+        EV_SET(&kev, fd, EVFILT_WRITE, write ? EV_ADD : EV_DELETE,
+               0, 0, sock.get());
+        changes_.push_back(kev);
+    }
+    wakeup();
+#elif defined(HAVE_EPOLL)
+    ::epoll_event ev;
+    ev.events = (read ? uint32_t(EPOLLIN) : 0) |
+        (write ? uint32_t(EPOLLOUT) : 0);
+    ev.data.fd = fd;
+    if (::epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) < 0)
+        throw std::system_error(errno, std::system_category());
+#else
+    if (read)
+        FD_SET(fd, &rset_);
+    else
+        FD_CLR(fd, &rset_);
+    if (write)
+        FD_SET(fd, &wset_);
+    else
+        FD_CLR(fd, &wset_);
+    wakeup();
+#endif
+}
+
+void
+SocketManager::wakeup()
+{
+    if (running_ && std::this_thread::get_id() != loopThread_) {
+        char ch = 0;
+        ::write(pipefds_[1], &ch, 1);
+    }
+}
+
+void
+SocketManager::run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    running_ = true;
+    loopThread_ = std::this_thread::get_id();
+    // Note: stopping_ is cleared on exit rather than here so that a
+    // call to stop() which races with starting the loop is not lost
+#ifdef HAVE_IO_URING
+    if (uring_) {
+        runUring(lock);
+        running_ = false;
+        stopping_ = false;
+        return;
+    }
+#endif
+    while (!stopping_) {
+        // Scanning for idle sockets is linear in the number of sockets
+        // so we only do it periodically rather than on every wakeup
+        if (clock_type::now() >= nextIdleCheck_)
+            expireIdle(lock, clock_type::now());
 
 #ifdef HAVE_KEVENT
         std::vector<::kevent> changes(std::move(changes_));
+#elif defined(HAVE_EPOLL)
+        // Interest list changes are applied directly with epoll_ctl
 #else
         fd_set rset = rset_;
+        fd_set wset = wset_;
         int maxfd = maxfd_;
 #endif
         lock.unlock();
 
-        auto stopTime = next();
         auto now = clock_type::now();
-        auto timeout =
-            std::chrono::duration_cast<std::chrono::system_clock::duration>(
-                std::chrono::duration_cast<std::chrono::microseconds>(
-                    stopTime - now));
-        if (timeout > idleTimeout_)
-            timeout = idleTimeout_;
-        if (timeout.count() < 0)
-            timeout = std::chrono::seconds(0);
-        auto sec = timeout.count() / 1000000;
-        auto usec = timeout.count() % 1000000;
+        auto us = waitTime(now).count();
+        auto sec = us / 1000000;
+        auto usec = us % 1000000;
         if (sec > 999999)
             sec = 999999; //std::numeric_limits<int>::max();
         VLOG(3) << "sleeping for " << sec << "." << usec << "s";
@@ -200,9 +449,14 @@ SocketManager::run()
         auto rv = ::kevent(
             kq_, changes.data(), changes.size(),
             events.data(), events.size(), &ts);
+#elif defined(HAVE_EPOLL)
+        // Round up to the next millisecond so that we don't spin
+        // waiting for a timeout which is less than 1ms in the future.
+        int ms = int(sec * 1000 + (usec + 999) / 1000);
+        auto rv = ::epoll_wait(epfd_, events_.data(), events_.size(), ms);
 #else
         ::timeval tv { int(sec), int(usec) };
-        auto rv = ::select(maxfd + 1, &rset, nullptr, nullptr, &tv);
+        auto rv = ::select(maxfd + 1, &rset, &wset, nullptr, &tv);
 #endif
         if (rv < 0) {
             if (errno == EBADF || errno == EINTR) {
@@ -222,22 +476,64 @@ SocketManager::run()
         }
 
 #ifdef HAVE_KEVENT
+        lock.lock();
+        std::vector<std::pair<std::shared_ptr<Socket>, int>> ready;
         for (int i = 0; i < rv; i++) {
             auto& ev = events[i];
             // The notification pipe entry has udata set to nullptr
             if (ev.udata == nullptr) {
                 char ch;
                 ::read(pipefds_[0], &ch, 1);
-                lock.lock();
                 continue;
             }
-            else {
-                auto sock = static_cast<Socket*>(ev.udata);
-                if (!sock->onReadable(this))
-                    remove(sock);
-            }
+            // Look the socket up using a non-owning pointer - if it
+            // has already been removed, udata may be dangling
+            auto j = sockets_.find(std::shared_ptr<Socket>(
+                std::shared_ptr<Socket>(), static_cast<Socket*>(ev.udata)));
+            if (j == sockets_.end())
+                continue;
+            j->second.time = now;
+            ready.emplace_back(
+                j->first, ev.filter == EVFILT_WRITE ? WRITABLE : READABLE);
         }
+        dispatch(lock, ready);
+#elif defined(HAVE_EPOLL)
         lock.lock();
+        for (int i = 0; i < rv; i++) {
+            int fd = events_[i].data.fd;
+            if (fd == pipefds_[0]) {
+                char buf[64];
+                ::read(pipefds_[0], buf, sizeof(buf));
+                continue;
+            }
+            // The socket may have been removed since epoll_wait returned
+            auto j = fds_.find(fd);
+            if (j == fds_.end())
+                continue;
+            auto& entry = sockets_[j->second];
+            entry.time = now;
+
+            // Errors are reported to whichever callback the socket is
+            // waiting for, or onReadable if it is waiting for neither
+            auto ev = events_[i].events;
+            int what = 0;
+            if (entry.write && (ev & (EPOLLOUT|EPOLLERR|EPOLLHUP)))
+                what |= WRITABLE;
+            if ((entry.read && (ev & (EPOLLIN|EPOLLERR|EPOLLHUP))) ||
+                (!entry.read && !entry.write &&
+                 (ev & (EPOLLERR|EPOLLHUP))))
+                what |= READABLE;
+            ready_.emplace_back(j->second, what);
+        }
+        if (rv == int(events_.size()) && events_.size() < 65536) {
+            // We filled the event buffer - grow it so that a busy
+            // loop can process more sockets per system call
+            events_.resize(2 * events_.size());
+        }
+        // Only the thread in run() touches ready_ so we can walk it
+        // without holding the lock
+        dispatch(lock, ready_);
+        ready_.clear();
 #else
         if (FD_ISSET(pipefds_[0], &rset)) {
             char ch;
@@ -247,22 +543,307 @@ SocketManager::run()
         }
 
         lock.lock();
-        std::vector<std::shared_ptr<Socket>> ready;
+        std::vector<std::pair<std::shared_ptr<Socket>, int>> ready;
         for (auto& i: sockets_) {
-            if (FD_ISSET(i.second.fd, &rset)) {
+            int what = 0;
+            if (FD_ISSET(i.second.fd, &wset))
+                what |= WRITABLE;
+            if (FD_ISSET(i.second.fd, &rset))
+                what |= READABLE;
+            if (what) {
                 i.second.time = now;
-                ready.push_back(i.first);
+                ready.emplace_back(i.first, what);
             }
         }
+        dispatch(lock, ready);
+#endif
+    }
+    running_ = false;
+    stopping_ = false;
+}
+
+void
+SocketManager::dispatch(
+    std::unique_lock<std::mutex>& lock,
+    std::vector<std::pair<std::shared_ptr<Socket>, int>>& ready)
+{
+    for (auto& r: ready) {
+        auto& sock = r.first;
+        // A previous callback in this batch may have removed the socket
+        if (!sockets_.count(sock))
+            continue;
+        lock.unlock();
+        bool ok = true;
+        if (r.second & WRITABLE)
+            ok = sock->onWritable(this);
+        lock.lock();
+        if (ok && (r.second & READABLE) && sockets_.count(sock)) {
+            lock.unlock();
+            ok = sock->onReadable(this);
+            lock.lock();
+        }
+        if (!ok && sockets_.count(sock)) {
+            lock.unlock();
+            remove(sock);
+            lock.lock();
+        }
+    }
+}
+
+std::chrono::microseconds
+SocketManager::waitTime(clock_type::time_point now)
+{
+    // Note: the resolution of clock_type varies between platforms
+    // so we convert explicitly to microseconds here
+    auto timeout = std::min<clock_type::duration>(
+        {next() - now, idleTimeout_, nextIdleCheck_ - now});
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(timeout);
+    if (us.count() < 0)
+        us = std::chrono::microseconds::zero();
+    return us;
+}
+
+#ifdef HAVE_IO_URING
+
+void
+SocketManager::runUring(std::unique_lock<std::mutex>& lock)
+{
+    while (!stopping_) {
+        if (clock_type::now() >= nextIdleCheck_)
+            expireIdle(lock, clock_type::now());
+
+        // Anything queued while we were processing the last batch of
+        // completions is submitted in the same system call as the wait
+        auto toSubmit = uring_->flush();
         lock.unlock();
-        for (auto sock: ready) {
-            if (!sock->onReadable(this))
-                remove(sock);
+
+        auto now = clock_type::now();
+        auto timeout = waitTime(now);
+        VLOG(3) << "sleeping for " << timeout.count() << "us";
+        uring_->wait(toSubmit, timeout);
+
+        // Execute timeouts, if any
+        now = clock_type::now();
+        update(now);
+
+        lock.lock();
+        uring_->reap([this, now](uint64_t data, int res) {
+            if (data == IGNORE_OP)
+                return;
+            if (data == WAKEUP_OP) {
+                char buf[64];
+                ::read(pipefds_[0], buf, sizeof(buf));
+                armWakeup();
+                return;
+            }
+            auto i = ops_.find(data);
+            if (i == ops_.end())
+                return;
+            Completion c{std::move(i->second), res, true};
+            ops_.erase(i);
+            if (c.op.type == Op::WRITABLE) {
+                auto j = sockets_.find(c.op.sock);
+                if (j == sockets_.end() || j->second.writeOp != data)
+                    return;
+                j->second.writeOp = 0;
+                j->second.time = now;
+            }
+            else if (c.op.type != Op::WRITE) {
+                // The socket may have been removed or re-armed since the
+                // operation was queued
+                auto j = sockets_.find(c.op.sock);
+                if (j != sockets_.end() && j->second.op == data) {
+                    j->second.op = 0;
+                    j->second.time = now;
+                }
+                else if (c.op.type == Op::POLL) {
+                    return;
+                }
+                else {
+                    c.live = false;
+                }
+            }
+            completed_.push_back(std::move(c));
+        });
+
+        // Only the thread in run() touches completed_ and rearm_ so we
+        // can walk them without holding the lock
+        lock.unlock();
+        for (auto& c: completed_) {
+            auto& sock = c.op.sock;
+            switch (c.op.type) {
+            case Op::POLL:
+                if (sock->onReadable(this))
+                    rearm_.push_back(sock);
+                else
+                    remove(sock);
+                break;
+
+            case Op::RECV:
+                if (!c.live) {
+                    // Let the socket know its read was abandoned
+                    sock->onRead(this, -ECANCELED);
+                }
+                else if (sock->onRead(this, c.res)) {
+                    rearm_.push_back(sock);
+                }
+                else {
+                    remove(sock);
+                }
+                break;
+
+            case Op::WRITE:
+                c.op.done(c.res);
+                break;
+
+            case Op::WRITABLE:
+                if (sock->onWritable(this))
+                    rearm_.push_back(sock);
+                else
+                    remove(sock);
+                break;
+            }
         }
+        completed_.clear();
+
         lock.lock();
+        for (auto& sock: rearm_) {
+            auto i = sockets_.find(sock);
+            if (i == sockets_.end() || i->second.fd < 0)
+                continue;
+            auto& entry = i->second;
+            if (entry.read && entry.op == 0)
+                arm(sock, entry);
+            if (entry.write && entry.writeOp == 0)
+                armWrite(sock, entry);
+        }
+        rearm_.clear();
+    }
+}
+
+void
+SocketManager::arm(const std::shared_ptr<Socket>& sock, Entry& entry)
+{
+    auto buf = sock->readBuffer();
+    auto id = nextOp_++;
+    auto sqe = uring_->getSqe();
+    sqe->fd = entry.fd;
+    sqe->user_data = id;
+    if (buf.second > 0) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = reinterpret_cast<uintptr_t>(buf.first);
+        sqe->len = buf.second;
+        ops_[id] = Op{Op::RECV, sock, {}, nullptr};
+    }
+    else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        ops_[id] = Op{Op::POLL, sock, {}, nullptr};
+    }
+    entry.op = id;
+}
+
+void
+SocketManager::disarm(Entry& entry)
+{
+    if (entry.op) {
+        cancel(entry.op);
+        entry.op = 0;
+    }
+}
+
+void
+SocketManager::armWrite(const std::shared_ptr<Socket>& sock, Entry& entry)
+{
+    auto id = nextOp_++;
+    auto sqe = uring_->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = entry.fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = id;
+    ops_[id] = Op{Op::WRITABLE, sock, {}, nullptr};
+    entry.writeOp = id;
+}
+
+void
+SocketManager::cancel(uint64_t op)
+{
+    // The operation stays in ops_ until its completion arrives so that
+    // the socket and its buffers stay valid until then
+    auto sqe = uring_->getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = op;
+    sqe->user_data = IGNORE_OP;
+}
+
+void
+SocketManager::armWakeup()
+{
+    auto sqe = uring_->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = pipefds_[0];
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = WAKEUP_OP;
+}
+
+void
+SocketManager::submit()
+{
+    if (!running_ || std::this_thread::get_id() != loopThread_)
+        uring_->submit();
+}
+
 #endif
+
+void
+SocketManager::write(
+    std::shared_ptr<Socket> sock, const std::vector<iovec>& iov,
+    std::function<void(ssize_t)> done)
+{
+#ifdef HAVE_IO_URING
+    if (uring_) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto id = nextOp_++;
+        auto& op = ops_[id];
+        op = Op{Op::WRITE, sock, iov, std::move(done)};
+        auto sqe = uring_->getSqe();
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = sock->fd();
+        sqe->addr = reinterpret_cast<uintptr_t>(op.iov.data());
+        sqe->len = op.iov.size();
+        sqe->user_data = id;
+        submit();
+        return;
+    }
+#endif
+    auto len = ::writev(sock->fd(), iov.data(), iov.size());
+    done(len < 0 ? -errno : len);
+}
+
+void
+SocketManager::expireIdle(
+    std::unique_lock<std::mutex>& lock, clock_type::time_point now)
+{
+    nextIdleCheck_ = now + std::min<clock_type::duration>(
+        idleTimeout_, std::chrono::seconds(1));
+
+    auto idleLimit = now - idleTimeout_;
+    std::vector<std::shared_ptr<Socket>> idle;
+    for (const auto& i: sockets_) {
+        if (i.first->closeOnIdle() &&
+            i.second.time < idleLimit) {
+            VLOG(3) << "idle timeout for socket " << i.second.fd;
+            idle.push_back(i.first);
+        }
+    }
+
+    if (idle.size() > 0) {
+        lock.unlock();
+        for (auto sock: idle) {
+            remove(sock);
+        }
+        lock.lock();
     }
-    running_ = false;
 }
 
 void
@@ -286,3 +867,73 @@ SocketManager::add(
     }
     return tid;
 }
+
+SocketManagerGroup::SocketManagerGroup(int count, Engine engine)
+    : next_(0)
+{
+    if (count <= 0)
+        count = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < count; i++)
+        managers_.push_back(std::make_shared<SocketManager>(engine));
+}
+
+SocketManagerGroup::~SocketManagerGroup()
+{
+    stop();
+}
+
+const std::shared_ptr<SocketManager>&
+SocketManagerGroup::next()
+{
+    return managers_[next_++ % managers_.size()];
+}
+
+void
+SocketManagerGroup::add(std::shared_ptr<Socket> sock)
+{
+    next()->add(sock);
+}
+
+/// Bind a thread to a single CPU
+static void
+pinThread(std::thread& t, int cpu)
+{
+#if defined(__linux__) || defined(__FreeBSD__)
+#ifdef __FreeBSD__
+    cpuset_t set;
+#else
+    cpu_set_t set;
+#endif
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = ::pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+    if (err)
+        LOG(WARNING) << "can't bind event loop to cpu " << cpu << ": "
+                     << std::system_category().message(err);
+#endif
+}
+
+void
+SocketManagerGroup::start(bool pin)
+{
+    assert(threads_.size() == 0);
+    int ncpu = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < size(); i++) {
+        auto sockman = managers_[i];
+        threads_.emplace_back([sockman]() { sockman->run(); });
+        if (pin)
+            pinThread(threads_.back(), i % ncpu);
+    }
+}
+
+void
+SocketManagerGroup::stop()
+{
+    if (threads_.size() == 0)
+        return;
+    for (auto& sockman: managers_)
+        sockman->stop();
+    for (auto& t: threads_)
+        t.join();
+    threads_.clear();
+}
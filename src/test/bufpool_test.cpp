@@ -0,0 +1,160 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <thread>
+
+#include <rpc++/bufpool.h>
+#include <rpc++/xdr.h>
+#include <gtest/gtest.h>
+
+using namespace oncrpc;
+using namespace std;
+
+TEST(BufferPoolTest, SizeClasses)
+{
+    EXPECT_EQ(0, BufferPool::sizeClass(0));
+    EXPECT_EQ(0, BufferPool::sizeClass(BufferPool::MIN_SIZE));
+    EXPECT_EQ(1, BufferPool::sizeClass(BufferPool::MIN_SIZE + 1));
+    EXPECT_EQ(1, BufferPool::sizeClass(2 * BufferPool::MIN_SIZE));
+    EXPECT_EQ(BufferPool::CLASSES - 1,
+              BufferPool::sizeClass(BufferPool::MAX_SIZE));
+    EXPECT_EQ(-1, BufferPool::sizeClass(BufferPool::MAX_SIZE + 1));
+    for (int cls = 0; cls < BufferPool::CLASSES; cls++)
+        EXPECT_EQ(cls, BufferPool::sizeClass(BufferPool::classSize(cls)));
+}
+
+TEST(BufferPoolTest, Reuse)
+{
+    auto& pool = BufferPool::instance();
+    auto p = pool.allocate(1000).get();
+    auto before = pool.stats();
+    {
+        auto buf = pool.allocate(1000);
+        EXPECT_EQ(p, buf.get());
+    }
+    auto after = pool.stats();
+    EXPECT_EQ(before.hits + 1, after.hits);
+    EXPECT_EQ(before.misses, after.misses);
+    EXPECT_EQ(before.bytesHeld, after.bytesHeld);
+}
+
+TEST(BufferPoolTest, Trim)
+{
+    auto& pool = BufferPool::instance();
+    pool.allocate(5000);
+    EXPECT_GT(pool.stats().bytesHeld, 0);
+    pool.trim();
+    EXPECT_EQ(0, pool.stats().bytesHeld);
+}
+
+TEST(BufferPoolTest, Large)
+{
+    auto& pool = BufferPool::instance();
+    auto before = pool.stats();
+    {
+        auto buf = pool.allocate(BufferPool::MAX_SIZE + 1);
+        buf.get()[BufferPool::MAX_SIZE] = 1;
+    }
+    auto after = pool.stats();
+    EXPECT_EQ(before.misses + 1, after.misses);
+    EXPECT_EQ(before.bytesHeld, after.bytesHeld);
+}
+
+TEST(BufferPoolTest, CrossThread)
+{
+    // Buffers freed by another thread should be reused once that
+    // thread's cache overflows or the thread exits
+    auto& pool = BufferPool::instance();
+    pool.trim();
+    vector<BufferPool::Storage> bufs;
+    for (int i = 0; i < 10; i++)
+        bufs.push_back(pool.allocate(100000));
+    thread t([&bufs]() { bufs.clear(); });
+    t.join();
+    auto before = pool.stats();
+    for (int i = 0; i < 10; i++)
+        bufs.push_back(pool.allocate(100000));
+    auto after = pool.stats();
+    EXPECT_EQ(before.misses, after.misses);
+    EXPECT_EQ(before.hits + 10, after.hits);
+}
+
+TEST(BufferPoolTest, HugePages)
+{
+    auto& pool = BufferPool::instance();
+    pool.setHugePages(true);
+    {
+        auto size = BufferPool::SLAB_SIZE / 4;
+        auto before = pool.stats();
+        vector<BufferPool::Storage> bufs;
+        for (int i = 0; i < 4; i++) {
+            bufs.push_back(pool.allocate(size));
+            std::fill_n(bufs.back().get(), size, i);
+        }
+        auto after = pool.stats();
+        EXPECT_LE(after.misses - before.misses, 4);
+    }
+    pool.setHugePages(false);
+    pool.trim();
+}
+
+TEST(BufferPoolTest, TrimSlabs)
+{
+    // Slab buffers trimmed from a partly filled thread cache must be
+    // reusable
+    auto& pool = BufferPool::instance();
+    pool.setHugePages(true);
+    {
+        auto size = 64*1024;
+        auto count = BufferPool::SLAB_SIZE / size;
+        {
+            auto b1 = pool.allocate(size);
+            auto b2 = pool.allocate(size);
+        }
+        pool.trim();
+        auto before = pool.stats();
+        vector<BufferPool::Storage> bufs;
+        for (size_t i = 0; i < count; i++)
+            bufs.push_back(pool.allocate(size));
+        auto after = pool.stats();
+        EXPECT_EQ(before.misses, after.misses);
+        EXPECT_EQ(before.bytesHeld - count * size, after.bytesHeld);
+    }
+    pool.setHugePages(false);
+    pool.trim();
+}
+
+TEST(BufferPoolTest, XdrMemory)
+{
+    // Both the object and its storage should come from the pool
+    auto& pool = BufferPool::instance();
+    make_unique<XdrMemory>(1000);
+    auto before = pool.stats();
+    make_unique<XdrMemory>(1000);
+    auto after = pool.stats();
+    EXPECT_EQ(before.misses, after.misses);
+    EXPECT_EQ(before.hits + 2, after.hits);
+}
@@ -24,6 +24,8 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
+
 #include <sys/socket.h>
 #include <sys/un.h>
 
@@ -149,7 +151,15 @@ public:
 
     ~SimpleServer()
     {
-        thread_.join();
+        join();
+    }
+
+    /// Derived classes must call this before destroying the state
+    /// used by the server thread
+    void join()
+    {
+        if (thread_.joinable())
+            thread_.join();
     }
 
     void stop(shared_ptr<Channel> chan, shared_ptr<Client> client)
@@ -169,8 +179,11 @@ public:
 class SimpleDatagramServer: public SimpleServer
 {
 public:
-    SimpleDatagramServer(int sock)
+    /// If drop is non-zero, that many incoming datagrams are discarded
+    /// before the server starts replying
+    SimpleDatagramServer(int sock, int drop = 0)
         : sock_(sock),
+          drop_(drop),
           buf_(make_unique<XdrMemory>(1500))
     {
         start();
@@ -178,6 +191,7 @@ public:
 
     ~SimpleDatagramServer()
     {
+        join();
         ::close(sock_);
     }
 
@@ -190,6 +204,10 @@ public:
             reinterpret_cast<sockaddr*>(&addr_), &addrlen_);
         if (bytes < 0)
             throw system_error(errno, system_category());
+        if (drop_ > 0) {
+            drop_--;
+            return acquireBuffer();
+        }
         return buf_.get();
     }
 
@@ -213,6 +231,7 @@ public:
     }
 
     int sock_;
+    int drop_;
     sockaddr_un addr_;
     socklen_t addrlen_;
     unique_ptr<XdrMemory> buf_;
@@ -249,6 +268,7 @@ public:
 
     ~SimpleStreamServer()
     {
+        join();
         ::close(sock_);
     }
 
@@ -310,6 +330,33 @@ public:
     uint8_t buf_[1500];
 };
 
+/// A channel whose asynchronous calls wait until they are failed with a
+/// connection error
+class FailingChannel: public TimeoutChannel
+{
+public:
+    uint32_t startCall(
+        Client* client, uint32_t proc,
+        std::function<void(XdrSink*)> xargs,
+        std::function<void(XdrSource*)> xresults,
+        std::function<void(std::exception_ptr)> done,
+        Protection prot, clock_type::duration timeout) override
+    {
+        calls_.push_back(done);
+        return 1;
+    }
+
+    void fail()
+    {
+        for (auto& done: calls_)
+            done(make_exception_ptr(
+                system_error(ECONNRESET, system_category())));
+        calls_.clear();
+    }
+
+    vector<std::function<void(std::exception_ptr)>> calls_;
+};
+
 TEST_F(ChannelTest, Message)
 {
     // Three parts - one word, a reference to four bytes and a second word
@@ -348,6 +395,103 @@ TEST_F(ChannelTest, Message)
     EXPECT_EQ(t1, t2);
 }
 
+TEST_F(ChannelTest, LargeMessage)
+{
+    // Messages larger than the buffer size grow by adding segments
+    Message msg(16);
+    vector<int> v1(10000);
+    for (int i = 0; i < int(v1.size()); i++)
+        v1[i] = i;
+    xdr(v1, static_cast<XdrSink*>(&msg));
+    EXPECT_LT(1, msg.segments());
+    EXPECT_EQ(XdrSizeof(v1), msg.writePos());
+    EXPECT_EQ(XdrSizeof(v1), msg.readSize());
+
+    vector<int> v2;
+    xdr(v2, static_cast<XdrSource*>(&msg));
+    EXPECT_EQ(v1, v2);
+
+    msg.rewind();
+    EXPECT_EQ(1, msg.segments());
+    EXPECT_EQ(0, msg.writePos());
+}
+
+TEST_F(ChannelTest, MessageViews)
+{
+    // Views decoded from the first segment share it instead of copying
+    Message msg(64);
+    xdr(string("hello"), static_cast<XdrSink*>(&msg));
+    xdr(vector<uint8_t>(100, 7), static_cast<XdrSink*>(&msg));
+    EXPECT_LT(1, msg.segments());
+
+    auto buf = msg.buf();
+    xdr_string_view s;
+    xdr_opaque_span o;
+    xdr(s, static_cast<XdrSource*>(&msg));
+    xdr(o, static_cast<XdrSource*>(&msg));
+    EXPECT_EQ(reinterpret_cast<const char*>(buf + 4), s.data());
+    EXPECT_EQ("hello", s);
+    EXPECT_EQ(vector<uint8_t>(100, 7), o.to_vector());
+
+    // Rewinding replaces the lent segment
+    msg.rewind();
+    EXPECT_NE(buf, msg.buf());
+    xdr(string("world"), static_cast<XdrSink*>(&msg));
+    EXPECT_EQ("hello", s);
+}
+
+TEST_F(ChannelTest, MessageBuffers)
+{
+    Message msg(64);
+    auto b1 = make_shared<Buffer>(1001);
+    fill_n(b1->data(), b1->size(), 1);
+    vector<uint8_t> v1(2000, 2), v2(1500, 3);
+    xdr(b1, static_cast<XdrSink*>(&msg));
+    xdr(v1, static_cast<XdrSink*>(&msg));
+    xdr(v2, static_cast<XdrSink*>(&msg));
+    xdr(42, static_cast<XdrSink*>(&msg));
+    EXPECT_LT(1, msg.segments());
+
+    // Buffers added with putBuffer are passed through as-is if the
+    // message allows it
+    msg.setShareBuffers(true);
+    shared_ptr<Buffer> b2, b3;
+    vector<uint8_t> v3;
+    int i;
+    xdr(b2, static_cast<XdrSource*>(&msg));
+    EXPECT_EQ(b1, b2);
+
+    // Buffers encoded into a later segment are returned as slices of
+    // the segment. The first vector spans segments so it is copied.
+    xdr(v3, static_cast<XdrSource*>(&msg));
+    EXPECT_EQ(v1, v3);
+    xdr(b3, static_cast<XdrSource*>(&msg));
+    xdr(i, static_cast<XdrSource*>(&msg));
+    EXPECT_EQ(42, i);
+    ASSERT_EQ(v2.size(), b3->size());
+    auto iov = msg.iov();
+    EXPECT_TRUE(any_of(
+        iov.begin(), iov.end(),
+        [&](auto& e) {
+            auto p = static_cast<uint8_t*>(e.iov_base);
+            return b3->data() >= p && b3->end() <= p + e.iov_len;
+        }));
+    msg.rewind();
+    EXPECT_TRUE(all_of(b3->begin(), b3->end(), [](auto c) { return c == 3; }));
+
+    // Otherwise they are copied
+    Message msg2(64);
+    xdr(b1, static_cast<XdrSink*>(&msg2));
+    xdr(42, static_cast<XdrSink*>(&msg2));
+    shared_ptr<Buffer> b4;
+    xdr(b4, static_cast<XdrSource*>(&msg2));
+    xdr(i, static_cast<XdrSource*>(&msg2));
+    EXPECT_EQ(42, i);
+    ASSERT_EQ(b1->size(), b4->size());
+    EXPECT_NE(b1->data(), b4->data());
+    EXPECT_TRUE(equal(b1->begin(), b1->end(), b4->begin()));
+}
+
 TEST_F(ChannelTest, Basic)
 {
     TimeoutChannel channel;
@@ -408,6 +552,31 @@ TEST_F(ChannelTest, LocalChannel)
     EXPECT_THROW(simpleCall(channel, client, 1), ProgramUnavailable);
 }
 
+TEST_F(ChannelTest, LocalLargeReply)
+{
+    auto svcreg = make_shared<ServiceRegistry>();
+    auto channel = make_shared<LocalChannel>(svcreg);
+
+    // A reply much larger than the channel's buffer size
+    vector<int> data(100000);
+    for (int i = 0; i < int(data.size()); i++)
+        data[i] = i;
+    svcreg->add(
+        1234, 1,
+        [&](CallContext&& ctx)
+        {
+            ctx.getArgs([](XdrSource* xdrs) {});
+            ctx.sendReply([&](XdrSink* xdrs){ xdr(data, xdrs); });
+        });
+
+    vector<int> reply;
+    channel->call(
+        client.get(), 1,
+        [](XdrSink* xdrs) {},
+        [&](XdrSource* xdrs) { xdr(reply, xdrs); });
+    EXPECT_EQ(data, reply);
+}
+
 TEST_F(ChannelTest, LocalManyThreads)
 {
     auto svcreg = make_shared<ServiceRegistry>();
@@ -506,6 +675,43 @@ TEST_F(ChannelTest, DatagramManyThreads)
     unlinkLocalAddress(caddr);
 }
 
+TEST_F(ChannelTest, DatagramReplyDispatch)
+{
+    Address saddr = makeLocalAddress(0);
+    int ssock = socket(AF_LOCAL, SOCK_DGRAM, 0);
+    ASSERT_GE(::bind(ssock, saddr.addr(), saddr.len()), 0);
+
+    // Lose the first request so that the call must be retransmitted
+    SimpleDatagramServer server(ssock, 1);
+
+    Address caddr = makeLocalAddress(1);
+    int clsock = socket(AF_LOCAL, SOCK_DGRAM, 0);
+    auto chan = make_shared<DatagramChannel>(clsock);
+    chan->bind(caddr);
+    chan->connect(saddr);
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(chan);
+    chan->setReplyDispatch(true);
+    thread t([&]() { sockman->run(); });
+
+    // The reply to the retransmitted call must still reach the caller
+    chan->call(
+        client.get(), 1,
+        [](XdrSink* xdrs) {
+            uint32_t v = 123; xdr(v, xdrs); },
+        [](XdrSource* xdrs) {
+            uint32_t v; xdr(v, xdrs); EXPECT_EQ(v, 123); },
+        Protection::DEFAULT, 10s);
+
+    server.stop(chan, client);
+    sockman->stop();
+    t.join();
+
+    unlinkLocalAddress(saddr);
+    unlinkLocalAddress(caddr);
+}
+
 TEST_F(ChannelTest, StreamChannel)
 {
     int sockpair[2];
@@ -550,6 +756,250 @@ TEST_F(ChannelTest, StreamManyThreads)
     server.stop(chan, client);
 }
 
+TEST_F(ChannelTest, StreamCoalesced)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+
+    int ssock = sockpair[0];
+    int clsock = sockpair[1];
+
+    SimpleStreamServer server(ssock);
+
+    auto chan = make_shared<StreamChannel>(clsock);
+    chan->setCoalesceWrites(true);
+
+    int threadCount = 20;
+    int iterations = 200;
+
+    deque<thread> threads;
+    for (int i = 0; i < threadCount; i++)
+        threads.push_back(callMany(chan, 1, iterations));
+
+    for (auto& t: threads)
+        t.join();
+
+    // Every call should have been written, sharing system calls where
+    // senders overlapped
+    auto stats = chan->writeStats();
+    EXPECT_EQ(uint64_t(threadCount * iterations), stats.messages);
+    EXPECT_LE(stats.writes, stats.messages);
+
+    // Ask the server to stop running
+    server.stop(chan, client);
+}
+
+TEST_F(ChannelTest, LocalCallBatch)
+{
+    auto svcreg = make_shared<ServiceRegistry>();
+    auto chan = std::make_shared<LocalChannel>(svcreg);
+    svcreg->add(
+        1234, 1,
+        [](CallContext&& ctx) {
+            if (ctx.proc() == 1) {
+                uint32_t val;
+                ctx.getArgs([&](XdrSource* xdrs){ xdr(val, xdrs); });
+                ctx.sendReply([&](XdrSink* xdrs){ xdr(val, xdrs); });
+            }
+            else {
+                ctx.procedureUnavailable();
+            }
+        });
+
+    // Each call reports its own outcome
+    vector<uint32_t> results(10);
+    vector<Channel::BatchCall> calls;
+    for (uint32_t i = 0; i < 10; i++) {
+        calls.push_back({
+            i == 5 ? 2u : 1u,
+            [i](XdrSink* xdrs) { uint32_t v = i; xdr(v, xdrs); },
+            [i, &results](XdrSource* xdrs) { xdr(results[i], xdrs); }});
+    }
+    chan->callBatch(client.get(), calls);
+    for (uint32_t i = 0; i < 10; i++) {
+        if (i == 5) {
+            ASSERT_TRUE(bool(calls[i].error));
+            EXPECT_THROW(
+                rethrow_exception(calls[i].error), ProcedureUnavailable);
+        }
+        else {
+            EXPECT_FALSE(bool(calls[i].error));
+            EXPECT_EQ(i, results[i]);
+        }
+    }
+}
+
+TEST_F(ChannelTest, StreamCallBatch)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+
+    int ssock = sockpair[0];
+    int clsock = sockpair[1];
+
+    SimpleStreamServer server(ssock);
+
+    auto chan = make_shared<StreamChannel>(clsock);
+
+    // The whole batch should be sent with a single write
+    int count = 64;
+    vector<uint32_t> results(count);
+    vector<Channel::BatchCall> calls;
+    for (int i = 0; i < count; i++) {
+        calls.push_back({
+            1,
+            [i](XdrSink* xdrs) { uint32_t v = i; xdr(v, xdrs); },
+            [i, &results](XdrSource* xdrs) { xdr(results[i], xdrs); }});
+    }
+    chan->callBatch(client.get(), calls);
+    for (int i = 0; i < count; i++) {
+        EXPECT_FALSE(bool(calls[i].error));
+        EXPECT_EQ(uint32_t(i), results[i]);
+    }
+    auto stats = chan->writeStats();
+    EXPECT_EQ(uint64_t(count), stats.messages);
+    EXPECT_EQ(1u, stats.writes);
+
+    // Ask the server to stop running
+    server.stop(chan, client);
+}
+
+TEST_F(ChannelTest, DatagramCallBatch)
+{
+    Address saddr = makeLocalAddress(0);
+    int ssock = socket(AF_LOCAL, SOCK_DGRAM, 0);
+    ASSERT_GE(::bind(ssock, saddr.addr(), saddr.len()), 0);
+
+    // Lose the first request so that one call must be retransmitted
+    SimpleDatagramServer server(ssock, 1);
+
+    Address caddr = makeLocalAddress(1);
+    int clsock = socket(AF_LOCAL, SOCK_DGRAM, 0);
+    auto chan = make_shared<DatagramChannel>(clsock);
+    chan->bind(caddr);
+    chan->connect(saddr);
+
+    // The channel has no SocketManager and therefore no
+    // TimeoutManager so the calling thread must retransmit
+    int count = 8;
+    vector<uint32_t> results(count);
+    vector<Channel::BatchCall> calls;
+    for (int i = 0; i < count; i++) {
+        calls.push_back({
+            1,
+            [i](XdrSink* xdrs) { uint32_t v = i; xdr(v, xdrs); },
+            [i, &results](XdrSource* xdrs) { xdr(results[i], xdrs); }});
+    }
+    auto start = Channel::clock_type::now();
+    chan->callBatch(client.get(), calls, Protection::DEFAULT, 30s);
+    EXPECT_LT(Channel::clock_type::now() - start, 10s);
+    for (int i = 0; i < count; i++) {
+        EXPECT_FALSE(bool(calls[i].error));
+        EXPECT_EQ(uint32_t(i), results[i]);
+    }
+
+    server.stop(chan, client);
+
+    unlinkLocalAddress(saddr);
+    unlinkLocalAddress(caddr);
+}
+
+TEST_F(ChannelTest, PooledChannel)
+{
+    auto svcreg = make_shared<ServiceRegistry>();
+    svcreg->add(
+        1234, 1,
+        [](CallContext&& ctx) {
+            uint32_t val;
+            ctx.getArgs([&](XdrSource* xdrs){ xdr(val, xdrs); });
+            ctx.sendReply([&](XdrSink* xdrs){ xdr(val, xdrs); });
+        });
+    auto chan1 = make_shared<LocalChannel>(svcreg);
+    auto chan2 = make_shared<LocalChannel>(svcreg);
+    auto pool = make_shared<PooledChannel>(
+        vector<shared_ptr<Channel>>{chan1, chan2});
+    simpleCall(pool, client, 1);
+
+    // Replies to these calls wait until we process them so each call
+    // goes to the member with fewer calls in progress
+    auto f1 = simpleCallAsync(pool, client, 1);
+    auto f2 = simpleCallAsync(pool, client, 1);
+    EXPECT_EQ((vector<int>{1, 1}), pool->outstanding());
+    chan2->processReply();
+    EXPECT_EQ((vector<int>{1, 0}), pool->outstanding());
+    auto f3 = simpleCallAsync(pool, client, 1);
+    EXPECT_EQ((vector<int>{1, 1}), pool->outstanding());
+    chan1->processReply();
+    chan2->processReply();
+    f1.get();
+    f2.get();
+    f3.get();
+    EXPECT_EQ((vector<int>{0, 0}), pool->outstanding());
+
+    // Calls are cancelled on the member which made them
+    auto handle = pool->startCall(
+        client.get(), 1,
+        [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+        [](XdrSource* xdrs) {},
+        [](exception_ptr) { FAIL() << "cancelled call completed"; },
+        Protection::DEFAULT, 30s);
+    EXPECT_EQ((vector<int>{1, 0}), pool->outstanding());
+    EXPECT_TRUE(pool->cancelCall(handle));
+    EXPECT_FALSE(pool->cancelCall(handle));
+    EXPECT_EQ((vector<int>{0, 0}), pool->outstanding());
+}
+
+TEST_F(ChannelTest, PooledChannelAsyncError)
+{
+    auto svcreg = make_shared<ServiceRegistry>();
+    svcreg->add(
+        1234, 1,
+        [](CallContext&& ctx) {
+            uint32_t val;
+            ctx.getArgs([&](XdrSource* xdrs){ xdr(val, xdrs); });
+            ctx.sendReply([&](XdrSink* xdrs){ xdr(val, xdrs); });
+        });
+    auto chan1 = make_shared<FailingChannel>();
+    auto chan2 = make_shared<LocalChannel>(svcreg);
+    auto pool = make_shared<PooledChannel>(
+        vector<shared_ptr<Channel>>{chan1, chan2});
+
+    // A member whose calls fail asynchronously is avoided afterwards
+    auto f1 = simpleCallAsync(pool, client, 1);
+    EXPECT_EQ((vector<int>{1, 0}), pool->outstanding());
+    chan1->fail();
+    EXPECT_THROW(f1.get(), system_error);
+    auto f2 = simpleCallAsync(pool, client, 1);
+    auto f3 = simpleCallAsync(pool, client, 1);
+    EXPECT_EQ((vector<int>{0, 2}), pool->outstanding());
+    chan2->processReply();
+    chan2->processReply();
+    f2.get();
+    f3.get();
+}
+
+TEST_F(ChannelTest, RttStats)
+{
+    auto svcreg = make_shared<ServiceRegistry>();
+    auto chan = std::make_shared<LocalChannel>(svcreg);
+    svcreg->add(
+        1234, 1,
+        [](CallContext&& ctx) {
+            uint32_t val;
+            ctx.getArgs([&](XdrSource* xdrs){ xdr(val, xdrs); });
+            ctx.sendReply([&](XdrSink* xdrs){ xdr(val, xdrs); });
+        });
+
+    // Both synchronous and asynchronous calls measure round trips
+    simpleCall(chan, client, 1);
+    auto f = simpleCallAsync(chan, client, 1);
+    chan->processReply();
+    f.get();
+    auto stats = chan->rttStats();
+    EXPECT_EQ(2u, stats.samples);
+    EXPECT_EQ(0u, stats.backoffs);
+}
+
 TEST_F(ChannelTest, BadReply)
 {
     auto svcreg = make_shared<ServiceRegistry>();
@@ -638,6 +1088,149 @@ TEST_F(ChannelTest, StreamCallAsync)
     t.join();
 }
 
+TEST_F(ChannelTest, StreamManyAsync)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+
+    int ssock = sockpair[0];
+    int clsock = sockpair[1];
+
+    SimpleStreamServer server(ssock);
+    auto chan = make_shared<StreamChannel>(clsock);
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(chan);
+    thread t([&]() { sockman->run(); });
+
+    // Enough calls in flight to grow the transaction table
+    deque<future<void>> calls;
+    for (int i = 0; i < 512; i++)
+        calls.push_back(simpleCallAsync(chan, client, 1));
+    for (auto& f: calls)
+        f.get();
+
+    server.stop(chan, client);
+    sockman->stop();
+    t.join();
+}
+
+TEST_F(ChannelTest, StreamReplyDispatch)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+
+    int ssock = sockpair[0];
+    int clsock = sockpair[1];
+
+    SimpleStreamServer server(ssock);
+    auto chan = make_shared<StreamChannel>(clsock);
+
+    // Callers leave reading replies to the SocketManager
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(chan);
+    chan->setReplyDispatch(true);
+    chan->setReplySpin(50us);
+    thread t([&]() { sockman->run(); });
+
+    deque<thread> threads;
+    for (int i = 0; i < 20; i++)
+        threads.push_back(callMany(chan, 1, 200));
+    for (auto& th: threads)
+        th.join();
+
+    server.stop(chan, client);
+    sockman->stop();
+    t.join();
+}
+
+TEST_F(ChannelTest, StreamStartCall)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+
+    int ssock = sockpair[0];
+    int clsock = sockpair[1];
+
+    SimpleStreamServer server(ssock);
+    auto chan = make_shared<StreamChannel>(clsock);
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(chan);
+    thread t([&]() { sockman->run(); });
+
+    // Keep many calls in flight from a single thread
+    mutex mtx;
+    condition_variable cv;
+    int count = 1000;
+    int completed = 0;
+    for (int i = 0; i < count; i++) {
+        chan->startCall(
+            client.get(), 1,
+            [](XdrSink* xdrs) {
+                uint32_t v = 123; xdr(v, xdrs); },
+            [](XdrSource* xdrs) {
+                uint32_t v; xdr(v, xdrs); EXPECT_EQ(v, 123); },
+            [&](exception_ptr error) {
+                EXPECT_FALSE(bool(error));
+                unique_lock<mutex> lock(mtx);
+                completed++;
+                cv.notify_one();
+            });
+    }
+    {
+        unique_lock<mutex> lock(mtx);
+        EXPECT_TRUE(cv.wait_for(
+            lock, 10s, [&]() { return completed == count; }));
+    }
+
+    server.stop(chan, client);
+    sockman->stop();
+    t.join();
+}
+
+TEST_F(ChannelTest, LocalCancelCall)
+{
+    auto svcreg = make_shared<ServiceRegistry>();
+    TimeoutManager tman;
+    auto chan = std::make_shared<LocalChannel>(svcreg);
+    chan->setTimeoutManager(&tman);
+
+    // The call's timer should be cancelled along with the call and
+    // the reply dropped
+    bool called = false;
+    auto xid = chan->startCall(
+        client.get(), 1,
+        [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+        [](XdrSource* xdrs) { uint32_t v; xdr(v, xdrs); },
+        [&](exception_ptr error) { called = true; });
+    EXPECT_EQ(1, tman.size());
+    EXPECT_TRUE(chan->cancelCall(xid));
+    EXPECT_FALSE(chan->cancelCall(xid));
+    EXPECT_EQ(0, tman.size());
+    chan->processReply();
+    EXPECT_FALSE(called);
+}
+
+TEST_F(ChannelTest, LocalStartCallTimeout)
+{
+    auto svcreg = make_shared<ServiceRegistry>();
+    TimeoutManager tman;
+    auto chan = std::make_shared<LocalChannel>(svcreg);
+    chan->setTimeoutManager(&tman);
+    exception_ptr result;
+    chan->startCall(
+        client.get(), 1,
+        [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+        [](XdrSource* xdrs) { uint32_t v; xdr(v, xdrs); },
+        [&](exception_ptr error) { result = error; },
+        Protection::DEFAULT, 5ms);
+    std::this_thread::sleep_for(10ms);
+    chan->processReply();
+    ASSERT_TRUE(bool(result));
+    EXPECT_THROW(rethrow_exception(result), TimeoutError);
+}
+
 TEST_F(ChannelTest, LocalAsyncTimeout)
 {
     auto svcreg = make_shared<ServiceRegistry>();
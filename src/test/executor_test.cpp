@@ -0,0 +1,129 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include <rpc++/executor.h>
+#include <gtest/gtest.h>
+
+using namespace oncrpc;
+using namespace std;
+using namespace std::literals::chrono_literals;
+
+namespace {
+
+/// Count completed functions and wait for a given total
+class Counter
+{
+public:
+    void add()
+    {
+        unique_lock<mutex> lock(mutex_);
+        count_++;
+        cv_.notify_all();
+    }
+
+    bool waitFor(int count)
+    {
+        unique_lock<mutex> lock(mutex_);
+        return cv_.wait_for(lock, 5s, [=]() { return count_ >= count; });
+    }
+
+private:
+    mutex mutex_;
+    condition_variable cv_;
+    int count_ = 0;
+};
+
+TEST(ExecutorTest, Inline)
+{
+    InlineExecutor exec;
+    int count = 0;
+    exec.execute([&]() { count++; });
+    EXPECT_EQ(1, count);
+}
+
+TEST(ExecutorTest, ThreadPool)
+{
+    ThreadPoolExecutor exec(4);
+    EXPECT_EQ(4, exec.size());
+    Counter counter;
+    for (int i = 0; i < 1000; i++)
+        exec.execute([&]() { counter.add(); });
+    EXPECT_TRUE(counter.waitFor(1000));
+}
+
+TEST(ExecutorTest, Nested)
+{
+    // Work submitted from a worker thread goes to that worker's queue
+    ThreadPoolExecutor exec(2);
+    Counter counter;
+    for (int i = 0; i < 10; i++) {
+        exec.execute([&]() {
+            for (int j = 0; j < 10; j++)
+                exec.execute([&]() { counter.add(); });
+        });
+    }
+    EXPECT_TRUE(counter.waitFor(100));
+}
+
+TEST(ExecutorTest, Steal)
+{
+    // Block one worker and check that the work queued behind it is
+    // taken by the other
+    ThreadPoolExecutor exec(2);
+    mutex mtx;
+    condition_variable cv;
+    bool blocked = true;
+    exec.execute([&]() {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [&]() { return !blocked; });
+    });
+    Counter counter;
+    for (int i = 0; i < 10; i++)
+        exec.execute([&]() { counter.add(); });
+    EXPECT_TRUE(counter.waitFor(10));
+    {
+        unique_lock<mutex> lock(mtx);
+        blocked = false;
+    }
+    cv.notify_all();
+}
+
+TEST(ExecutorTest, DrainOnDestroy)
+{
+    atomic<int> count(0);
+    {
+        ThreadPoolExecutor exec(2);
+        for (int i = 0; i < 100; i++)
+            exec.execute([&]() { count++; });
+    }
+    EXPECT_EQ(100, count);
+}
+
+}
@@ -0,0 +1,88 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <rpc++/rtt.h>
+#include <gtest/gtest.h>
+
+using namespace oncrpc;
+using namespace std;
+using namespace std::literals::chrono_literals;
+
+namespace {
+
+TEST(RttTest, Initial)
+{
+    RttEstimator rtt(1s, 20ms, 30s);
+    EXPECT_EQ(RttEstimator::duration(1s), rtt.timeout());
+    EXPECT_EQ(0u, rtt.stats().samples);
+}
+
+TEST(RttTest, Converge)
+{
+    // A steady round trip time should give a timeout just above it
+    RttEstimator rtt(1s, 1ms, 30s);
+    for (int i = 0; i < 100; i++)
+        rtt.sample(5ms);
+    auto stats = rtt.stats();
+    EXPECT_EQ(RttEstimator::duration(5ms), stats.srtt);
+    EXPECT_EQ(RttEstimator::duration(6ms), stats.timeout);
+    EXPECT_EQ(100u, stats.samples);
+
+    // Variation widens the margin
+    for (int i = 0; i < 100; i++)
+        rtt.sample(i % 2 ? 2ms : 8ms);
+    EXPECT_GT(rtt.timeout(), RttEstimator::duration(8ms));
+}
+
+TEST(RttTest, Limits)
+{
+    RttEstimator rtt(1s, 20ms, 30s);
+    rtt.sample(100us);
+    EXPECT_EQ(RttEstimator::duration(20ms), rtt.timeout());
+    rtt.sample(60s);
+    EXPECT_EQ(RttEstimator::duration(30s), rtt.timeout());
+}
+
+TEST(RttTest, Backoff)
+{
+    RttEstimator rtt(1s, 1ms, 30s);
+    rtt.sample(10ms);
+    auto base = rtt.timeout();
+    rtt.backoff();
+    EXPECT_EQ(2 * base, rtt.timeout());
+    rtt.backoff();
+    EXPECT_EQ(4 * base, rtt.timeout());
+    for (int i = 0; i < 20; i++)
+        rtt.backoff();
+    EXPECT_EQ(RttEstimator::duration(30s), rtt.timeout());
+    EXPECT_EQ(22u, rtt.stats().backoffs);
+
+    // A new sample clears the backoff
+    rtt.sample(10ms);
+    EXPECT_GE(base, rtt.timeout());
+}
+
+}
@@ -127,6 +127,10 @@ public:
             *reply_msg = std::move(msg);
     }
 
+    /// Make many overlapping calls over a stream channel, with the
+    /// server dispatching calls to a thread pool
+    void multiThread(SocketManager::Engine engine);
+
     shared_ptr<ServiceRegistry> svcreg;
     shared_ptr<Client> client;
 };
@@ -265,6 +269,160 @@ TEST_F(ServerTest, Datagram)
     server.join();
 }
 
+TEST_F(ServerTest, DatagramReplyCache)
+{
+    // Record the reply channel used for each call
+    vector<shared_ptr<Channel>> replyChans;
+    svcreg->add(
+        1235, 1,
+        [&](CallContext&& ctx) {
+            replyChans.push_back(ctx.channel());
+            ctx.getArgs([](XdrSource*) {});
+            ctx.sendReply([](XdrSink*) {});
+        });
+    auto client2 = make_shared<Client>(1235, 1);
+
+    auto schan = make_shared<LocalDatagramChannel>(svcreg);
+    auto cchan = make_shared<LocalDatagramChannel>();
+    schan->connect(cchan->localAddr());
+    cchan->connect(schan->localAddr());
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(schan);
+    thread server([sockman]() { sockman->run(); });
+
+    // Calls from the same peer should share a reply channel unless the
+    // cache is disabled
+    for (int i = 0; i < 3; i++)
+        cchan->call(client2.get(), 1, [](XdrSink*) {}, [](XdrSource*) {});
+    schan->setReplyCacheSize(0);
+    cchan->call(client2.get(), 1, [](XdrSink*) {}, [](XdrSource*) {});
+
+    sockman->stop();
+    server.join();
+
+    ASSERT_EQ(4u, replyChans.size());
+    EXPECT_EQ(replyChans[0], replyChans[1]);
+    EXPECT_EQ(replyChans[0], replyChans[2]);
+    EXPECT_NE(replyChans[0], replyChans[3]);
+}
+
+TEST_F(ServerTest, DatagramBatched)
+{
+    auto schan = make_shared<LocalDatagramChannel>(svcreg);
+    auto cchan = make_shared<LocalDatagramChannel>();
+    schan->connect(cchan->localAddr());
+    cchan->connect(schan->localAddr());
+    schan->setBatchSize(16);
+    schan->setBufferSize(DatagramChannel::MAX_DATAGRAM_SIZE);
+    EXPECT_EQ(16u, schan->batchSize());
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(schan);
+    thread server([sockman]() { sockman->run(); });
+
+    // Several threads making calls at once should give the server more
+    // than one datagram to read at a time
+    deque<thread> threads;
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back(
+            [this, cchan, i]() {
+                for (int j = 0; j < 50; j++) {
+                    uint32_t val = i * 100 + j;
+                    cchan->call(
+                        client.get(), 1,
+                        [&](XdrSink* xdrs) { xdr(val, xdrs); },
+                        [&](XdrSource* xdrs) {
+                            uint32_t v;
+                            xdr(v, xdrs);
+                            EXPECT_EQ(val, v);
+                        });
+                }
+            });
+    }
+    for (auto& t: threads)
+        t.join();
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ServerTest, DatagramLargeReply)
+{
+    auto schan = make_shared<LocalDatagramChannel>(svcreg);
+    auto cchan = make_shared<LocalDatagramChannel>();
+    schan->connect(cchan->localAddr());
+    cchan->connect(schan->localAddr());
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(schan);
+    thread server([sockman]() { sockman->run(); });
+
+    // A reply which doesn't fit in a datagram fails just this call
+    vector<uint8_t> data(10000);
+    svcreg->add(
+        1235, 1,
+        [&](CallContext&& ctx) {
+            ctx.getArgs([](XdrSource*) {});
+            ctx.sendReply([&](XdrSink* xdrs) { xdr(data, xdrs); });
+        });
+    auto client2 = make_shared<Client>(1235, 1);
+    EXPECT_THROW(
+        cchan->call(
+            client2.get(), 1,
+            [](XdrSink*) {},
+            [&](XdrSource* xdrs) { xdr(data, xdrs); }),
+        SystemError);
+
+    // Large calls are refused before sending
+    EXPECT_THROW(
+        cchan->call(
+            client2.get(), 1,
+            [&](XdrSink* xdrs) { xdr(data, xdrs); },
+            [](XdrSource*) {}),
+        system_error);
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ServerTest, StreamLargeReply)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+
+    auto chan = make_shared<StreamChannel>(sockpair[0]);
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(make_shared<StreamChannel>(sockpair[1], svcreg));
+    thread server([sockman]() { sockman->run(); });
+
+    // Replies larger than the buffer size are received, up to the
+    // record size limit
+    vector<uint8_t> data(10000, 42);
+    svcreg->add(
+        1235, 1,
+        [&](CallContext&& ctx) {
+            ctx.getArgs([](XdrSource*) {});
+            ctx.sendReply([&](XdrSink* xdrs) { xdr(data, xdrs); });
+        });
+    auto client2 = make_shared<Client>(1235, 1);
+    auto call = [&]() {
+        vector<uint8_t> reply;
+        chan->call(
+            client2.get(), 1,
+            [](XdrSink*) {},
+            [&](XdrSource* xdrs) { xdr(reply, xdrs); });
+        EXPECT_EQ(data, reply);
+    };
+    call();
+    chan->setMaxRecordSize(1000);
+    EXPECT_THROW(call(), system_error);
+
+    sockman->stop();
+    server.join();
+}
+
 TEST_F(ServerTest, Stream)
 {
     int sockpair[2];
@@ -286,6 +444,202 @@ TEST_F(ServerTest, Stream)
     server.join();
 }
 
+TEST_F(ServerTest, StreamPooled)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+
+    auto chan = make_shared<StreamChannel>(sockpair[0]);
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(make_shared<StreamChannel>(sockpair[1], svcreg));
+    thread server([sockman]() { sockman->run(); });
+
+    // Once the buffer pool is warmed up, calls should not need to
+    // allocate any new buffers
+    auto call = [&]() {
+        chan->call(
+            client.get(), 1,
+            [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+            [](XdrSource* xdrs) {
+                uint32_t v; xdr(v, xdrs); EXPECT_EQ(v, 123); });
+    };
+    for (int i = 0; i < 10; i++)
+        call();
+    auto before = BufferPool::instance().stats();
+    for (int i = 0; i < 100; i++)
+        call();
+    auto after = BufferPool::instance().stats();
+    EXPECT_EQ(before.misses, after.misses);
+    EXPECT_GE(after.hits - before.hits, 100);
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ServerTest, StreamPartial)
+{
+    int slow[2], fast[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, slow), 0);
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, fast), 0);
+
+    auto chan = make_shared<StreamChannel>(fast[0]);
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(make_shared<StreamChannel>(slow[1], svcreg));
+    sockman->add(make_shared<StreamChannel>(fast[1], svcreg));
+    thread server([sockman]() { sockman->run(); });
+
+    // Encode two pipelined calls
+    vector<uint8_t> buf(256);
+    XdrMemory xm(buf.data(), buf.size());
+    for (uint32_t xid = 1; xid <= 2; xid++) {
+        auto pos = xm.writePos();
+        xm.putWord(0);
+        call_body cbody;
+        cbody.prog = 1234;
+        cbody.vers = 1;
+        cbody.proc = 1;
+        cbody.cred = { AUTH_NONE, {} };
+        cbody.verf = { AUTH_NONE, {} };
+        rpc_msg msg(xid, std::move(cbody));
+        xdr(msg, static_cast<XdrSink*>(&xm));
+        uint32_t v = 100 + xid;
+        xdr(v, static_cast<XdrSink*>(&xm));
+        *reinterpret_cast<XdrWord*>(buf.data() + pos) =
+            (xm.writePos() - pos - sizeof(uint32_t)) | (1<<31);
+    }
+    auto len = xm.writePos();
+
+    // Send part of the first record - the server should carry on
+    // handling other connections while it waits for the rest
+    ASSERT_EQ(10, ::write(slow[0], buf.data(), 10));
+    chan->call(
+        client.get(), 1,
+        [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+        [](XdrSource* xdrs) { uint32_t v; xdr(v, xdrs); EXPECT_EQ(v, 123); });
+
+    // Send the rest of both records and check that both are answered
+    ASSERT_EQ(len - 10, ::write(slow[0], buf.data() + 10, len - 10));
+    auto slowchan = make_shared<StreamChannel>(slow[0]);
+    for (uint32_t xid = 1; xid <= 2; xid++) {
+        shared_ptr<Channel> replyChan;
+        auto xdrs = slowchan->receiveMessage(replyChan, 5s);
+        ASSERT_TRUE(bool(xdrs));
+        rpc_msg reply;
+        xdr(reply, xdrs.get());
+        EXPECT_EQ(xid, reply.xid);
+        EXPECT_EQ(MSG_ACCEPTED, reply.rbody().stat);
+        uint32_t v;
+        xdr(v, xdrs.get());
+        EXPECT_EQ(100 + xid, v);
+        slowchan->releaseReceiveBuffer(move(xdrs));
+    }
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ServerTest, StreamBackpressure)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+
+    // A service with replies large enough to fill the socket buffer
+    vector<uint8_t> data(65536);
+    svcreg->add(
+        1235, 1,
+        [&](CallContext&& ctx) {
+            ctx.getArgs([](XdrSource*) {});
+            ctx.sendReply([&](XdrSink* xdrs) {
+                xdrs->putBytes(data.data(), data.size()); });
+        });
+
+    auto schan = make_shared<StreamChannel>(sockpair[1], svcreg);
+    schan->setBufferSize(data.size() + 100);
+    schan->setSendQueueLimit(4 * data.size());
+
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(schan);
+    thread server([sockman]() { sockman->run(); });
+
+    // Pipeline a batch of calls without reading any replies. The server
+    // must queue replies which don't fit in the socket buffer and stop
+    // reading calls once the queue is full.
+    int count = 32;
+    vector<uint8_t> buf(4096);
+    XdrMemory xm(buf.data(), buf.size());
+    for (int xid = 1; xid <= count; xid++) {
+        auto pos = xm.writePos();
+        xm.putWord(0);
+        call_body cbody;
+        cbody.prog = 1235;
+        cbody.vers = 1;
+        cbody.proc = 1;
+        cbody.cred = { AUTH_NONE, {} };
+        cbody.verf = { AUTH_NONE, {} };
+        rpc_msg msg(xid, std::move(cbody));
+        xdr(msg, static_cast<XdrSink*>(&xm));
+        *reinterpret_cast<XdrWord*>(buf.data() + pos) =
+            (xm.writePos() - pos - sizeof(uint32_t)) | (1<<31);
+    }
+    auto len = xm.writePos();
+    ASSERT_EQ(len, ::write(sockpair[0], buf.data(), len));
+    this_thread::sleep_for(50ms);
+
+    // Every call should be answered, in order, once we start reading
+    auto chan = make_shared<StreamChannel>(sockpair[0]);
+    chan->setBufferSize(data.size() + 100);
+    for (int xid = 1; xid <= count; xid++) {
+        shared_ptr<Channel> replyChan;
+        auto xdrs = chan->receiveMessage(replyChan, 5s);
+        ASSERT_TRUE(bool(xdrs));
+        rpc_msg reply;
+        xdr(reply, xdrs.get());
+        EXPECT_EQ(uint32_t(xid), reply.xid);
+        EXPECT_EQ(MSG_ACCEPTED, reply.rbody().stat);
+        vector<uint8_t> res(data.size());
+        xdrs->getBytes(res.data(), res.size());
+        EXPECT_EQ(data, res);
+        chan->releaseReceiveBuffer(move(xdrs));
+    }
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ServerTest, StreamUring)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+
+    auto chan = make_shared<StreamChannel>(sockpair[0]);
+    auto schan = make_shared<StreamChannel>(sockpair[1], svcreg);
+
+    auto sockman = make_shared<SocketManager>(SocketManager::Engine::URING);
+    sockman->add(schan);
+    thread server([sockman]() { sockman->run(); });
+
+    // Send a mix of small messages and messages large enough to need
+    // several reads and check the replies
+    vector<uint8_t> data(200000);
+    chan->setBufferSize(data.size() + 100);
+    schan->setBufferSize(data.size() + 100);
+    for (int i = 0; i < 10; i++) {
+        size_t len = (i & 1) ? data.size() : 0;
+        chan->call(
+            client.get(), 1,
+            [&](XdrSink* xdrs) {
+                uint32_t v = 123; xdr(v, xdrs);
+                xdrs->putBytes(data.data(), len); },
+            [](XdrSource* xdrs) {
+                uint32_t v; xdr(v, xdrs); EXPECT_EQ(v, 123); });
+    }
+
+    sockman->stop();
+    server.join();
+}
+
 TEST_F(ServerTest, Listen)
 {
     // Make a local socket to listen on
@@ -322,6 +676,81 @@ TEST_F(ServerTest, Listen)
     EXPECT_GE(::unlink(sun.sun_path), 0);
 }
 
+TEST_F(ServerTest, ListenHandoff)
+{
+    // Make a local socket to listen on
+    ostringstream ss;
+    ss << "/tmp/rpcTest-" << ::getpid();
+    auto sockname = ss.str();
+    sockaddr_un sun;
+    sun.sun_len = sizeof(sun);
+    sun.sun_family = AF_LOCAL;
+    strcpy(sun.sun_path, sockname.c_str());
+    int lsock = socket(AF_LOCAL, SOCK_STREAM, 0);
+    ASSERT_GE(::bind(lsock, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)), 0);
+    ASSERT_GE(::listen(lsock, 5), 0);
+
+    // Accept on one manager and hand the connections to a group
+    auto group = make_shared<SocketManagerGroup>(4);
+    auto sockman = make_shared<SocketManager>();
+    auto listener = make_shared<ListenSocket>(lsock, svcreg);
+    listener->setGroup(group);
+    sockman->add(listener);
+    group->start();
+    thread server([sockman]() { sockman->run(); });
+
+    for (int i = 0; i < 8; i++) {
+        int sock = socket(AF_LOCAL, SOCK_STREAM, 0);
+        ASSERT_GE(::connect(
+                      sock, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)), 0);
+        auto chan = make_shared<StreamChannel>(sock);
+        chan->call(
+            client.get(), 1,
+            [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+            [](XdrSource* xdrs) {
+                uint32_t v; xdr(v, xdrs); EXPECT_EQ(v, 123); });
+    }
+
+    sockman->stop();
+    server.join();
+    group->stop();
+
+    EXPECT_GE(::unlink(sun.sun_path), 0);
+}
+
+TEST_F(ServerTest, ListenGroup)
+{
+    SocketManagerGroup group(4);
+    AddressInfo ai;
+    ai.family = AF_INET;
+    ai.socktype = SOCK_STREAM;
+    ai.protocol = 0;
+    ai.addr = Address("127.0.0.1");
+    auto listeners = ListenSocket::listenGroup(group, ai, svcreg);
+    ASSERT_EQ(4u, listeners.size());
+    group.start();
+
+    // All the listeners should share the same port
+    sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    ASSERT_GE(::getsockname(
+                  listeners[0]->fd(), reinterpret_cast<sockaddr*>(&ss),
+                  &len), 0);
+    ai.addr = reinterpret_cast<const sockaddr&>(ss);
+    EXPECT_NE(0, ai.addr.port());
+
+    for (int i = 0; i < 8; i++) {
+        auto chan = Channel::open(ai);
+        chan->call(
+            client.get(), 1,
+            [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+            [](XdrSource* xdrs) {
+                uint32_t v; xdr(v, xdrs); EXPECT_EQ(v, 123); });
+    }
+
+    group.stop();
+}
+
 struct ThreadPool
 {
     ThreadPool(Service svc, int workerCount)
@@ -403,7 +832,8 @@ struct ThreadPool
     atomic<int> pending_;
 };
 
-TEST_F(ServerTest, MultiThread)
+void
+ServerTest::multiThread(SocketManager::Engine engine)
 {
     int sockpair[2];
     ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
@@ -411,7 +841,7 @@ TEST_F(ServerTest, MultiThread)
     auto cchan = make_shared<StreamChannel>(sockpair[0]);
     auto schan = make_shared<StreamChannel>(sockpair[1], svcreg);
 
-    auto sockman = make_shared<SocketManager>();
+    auto sockman = make_shared<SocketManager>(engine);
     sockman->add(cchan);
     sockman->add(schan);
     thread t([sockman]() { sockman->run(); });
@@ -446,4 +876,141 @@ TEST_F(ServerTest, MultiThread)
     t.join();
 }
 
+TEST_F(ServerTest, Executor)
+{
+    // A slow call shouldn't delay calls on other channels
+    mutex mtx;
+    condition_variable cv;
+    bool blocked = true;
+    svcreg->add(1235, 1, [&](CallContext&& ctx) {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [&]() { return !blocked; });
+        ctx.sendReply([](XdrSink*) {});
+    });
+    svcreg->setExecutor(make_shared<ThreadPoolExecutor>(2));
+
+    auto sockman = make_shared<SocketManager>();
+    vector<shared_ptr<StreamChannel>> chans;
+    for (int i = 0; i < 2; i++) {
+        int sockpair[2];
+        ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+        chans.push_back(make_shared<StreamChannel>(sockpair[0]));
+        sockman->add(make_shared<StreamChannel>(sockpair[1], svcreg));
+    }
+    thread server([sockman]() { sockman->run(); });
+
+    auto slowClient = make_shared<Client>(1235, 1);
+    thread slow([&]() {
+        chans[0]->call(
+            slowClient.get(), 0, [](XdrSink*) {}, [](XdrSource*) {});
+    });
+    chans[1]->call(
+        client.get(), 1,
+        [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+        [](XdrSource* xdrs) { uint32_t v; xdr(v, xdrs); EXPECT_EQ(v, 123); });
+    {
+        unique_lock<mutex> lock(mtx);
+        blocked = false;
+    }
+    cv.notify_all();
+    slow.join();
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ServerTest, ExecutorOrdered)
+{
+    // Pipelined calls on one channel must be handled in order even
+    // though the executor has several threads
+    mutex mtx;
+    vector<uint32_t> seen;
+    svcreg->add(1235, 1, [&](CallContext&& ctx) {
+        uint32_t val;
+        ctx.getArgs([&](XdrSource* xdrs) { xdr(val, xdrs); });
+        {
+            unique_lock<mutex> lock(mtx);
+            seen.push_back(val);
+        }
+        ctx.sendReply([](XdrSink*) {});
+    });
+    svcreg->setExecutor(make_shared<ThreadPoolExecutor>(4));
+    svcreg->setOrdered(true);
+
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+    auto cchan = make_shared<StreamChannel>(sockpair[0]);
+    auto schan = make_shared<StreamChannel>(sockpair[1], svcreg);
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(cchan);
+    sockman->add(schan);
+    thread t([sockman]() { sockman->run(); });
+
+    auto orderedClient = make_shared<Client>(1235, 1);
+    deque<future<void>> calls;
+    for (uint32_t i = 0; i < 200; i++) {
+        calls.emplace_back(cchan->callAsync(
+            orderedClient.get(), 0,
+            [=](XdrSink* xdrs) { uint32_t v = i; xdr(v, xdrs); },
+            [](XdrSource*) {}));
+    }
+    for (auto& f: calls)
+        f.get();
+
+    ASSERT_EQ(200u, seen.size());
+    for (uint32_t i = 0; i < 200; i++)
+        EXPECT_EQ(i, seen[i]);
+
+    sockman->stop();
+    t.join();
+}
+
+TEST_F(ServerTest, ExecutorOrderedError)
+{
+    // A call which fails after replying must not stall the calls
+    // queued behind it
+    svcreg->add(1235, 1, [&](CallContext&& ctx) {
+        uint32_t val;
+        ctx.getArgs([&](XdrSource* xdrs) { xdr(val, xdrs); });
+        ctx.sendReply([](XdrSink*) {});
+        if (val % 2 == 0)
+            throw system_error(EPIPE, system_category());
+    });
+    svcreg->setExecutor(make_shared<ThreadPoolExecutor>(4));
+    svcreg->setOrdered(true);
+
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+    auto cchan = make_shared<StreamChannel>(sockpair[0]);
+    auto schan = make_shared<StreamChannel>(sockpair[1], svcreg);
+    auto sockman = make_shared<SocketManager>();
+    sockman->add(cchan);
+    sockman->add(schan);
+    thread t([sockman]() { sockman->run(); });
+
+    auto orderedClient = make_shared<Client>(1235, 1);
+    deque<future<void>> calls;
+    for (uint32_t i = 0; i < 10; i++) {
+        calls.emplace_back(cchan->callAsync(
+            orderedClient.get(), 0,
+            [=](XdrSink* xdrs) { uint32_t v = i; xdr(v, xdrs); },
+            [](XdrSource*) {}));
+    }
+    for (auto& f: calls)
+        EXPECT_EQ(future_status::ready, f.wait_for(chrono::seconds(5)));
+
+    sockman->stop();
+    t.join();
+}
+
+TEST_F(ServerTest, MultiThread)
+{
+    multiThread(SocketManager::Engine::DEFAULT);
+}
+
+TEST_F(ServerTest, MultiThreadUring)
+{
+    multiThread(SocketManager::Engine::URING);
+}
+
 }
@@ -0,0 +1,358 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <rpc++/client.h>
+#include <rpc++/server.h>
+#include <rpc++/shm.h>
+#include <rpc++/sockman.h>
+#include <rpc++/xdr.h>
+#include <gtest/gtest.h>
+
+using namespace oncrpc;
+using namespace std;
+using namespace std::placeholders;
+
+namespace {
+
+class ShmTest: public ::testing::Test
+{
+public:
+    ShmTest()
+        : svcreg(make_shared<ServiceRegistry>()),
+          client(make_shared<Client>(1234, 1)),
+          sockman(make_shared<SocketManager>())
+    {
+        svcreg->add(1234, 1, bind(&ShmTest::testService, this, _1));
+    }
+
+    void testService(CallContext&& ctx)
+    {
+        switch (ctx.proc()) {
+        case 0:
+            ctx.sendReply([](XdrSink*){});
+            break;
+
+        case 1: {
+            vector<uint32_t> val;
+            ctx.getArgs([&](XdrSource* xdrs){ getWords(val, xdrs); });
+            ctx.sendReply([&](XdrSink* xdrs){ putWords(val, xdrs); });
+            break;
+        }
+
+        case 2: {
+            // Echo a pair of buffers, remembering where they were
+            // received
+            shared_ptr<Buffer> a, b;
+            uint32_t tag;
+            ctx.getArgs([&](XdrSource* xdrs) {
+                xdr(a, xdrs);
+                xdr(b, xdrs);
+                xdr(tag, xdrs);
+            });
+            received = { a, b };
+            ctx.sendReply([&](XdrSink* xdrs) {
+                xdr(a, xdrs);
+                xdr(b, xdrs);
+                xdr(tag, xdrs);
+            });
+            break;
+        }
+
+        default:
+            ctx.procedureUnavailable();
+        }
+    }
+
+    static void putWords(const vector<uint32_t>& v, XdrSink* xdrs)
+    {
+        uint32_t n = v.size();
+        xdr(n, xdrs);
+        for (auto w: v)
+            xdr(w, xdrs);
+    }
+
+    static void getWords(vector<uint32_t>& v, XdrSource* xdrs)
+    {
+        uint32_t n;
+        xdr(n, xdrs);
+        v.resize(n);
+        for (auto& w: v)
+            xdr(w, xdrs);
+    }
+
+    /// Make a connected pair of channels, adding the server side to
+    /// sockman
+    shared_ptr<ShmChannel> connect(size_t ringSize)
+    {
+        int sockpair[2];
+        EXPECT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+        auto server = make_shared<ShmChannel>(
+            sockpair[0], true, svcreg, ringSize);
+        server->setBufferSize(BUFFER_SIZE);
+        sockman->add(server);
+        auto chan = make_shared<ShmChannel>(sockpair[1], false);
+        chan->setBufferSize(BUFFER_SIZE);
+        return chan;
+    }
+
+    void echo(Channel* chan, size_t count)
+    {
+        vector<uint32_t> args(count), res;
+        for (size_t i = 0; i < count; i++)
+            args[i] = i;
+        chan->call(
+            client.get(), 1,
+            [&](XdrSink* xdrs) { putWords(args, xdrs); },
+            [&](XdrSource* xdrs) { getWords(res, xdrs); });
+        EXPECT_EQ(args, res);
+    }
+
+    /// Send two buffers over chan and check that they are echoed
+    void echoBuffers(
+        Channel* chan, shared_ptr<Buffer> a, shared_ptr<Buffer> b)
+    {
+        shared_ptr<Buffer> ra, rb;
+        uint32_t tag = 0;
+        chan->call(
+            client.get(), 2,
+            [&](XdrSink* xdrs) {
+                xdr(a, xdrs);
+                xdr(b, xdrs);
+                xdr(uint32_t(99), xdrs);
+            },
+            [&](XdrSource* xdrs) {
+                xdr(ra, xdrs);
+                xdr(rb, xdrs);
+                xdr(tag, xdrs);
+            });
+        EXPECT_EQ(a->toString(), ra->toString());
+        EXPECT_EQ(b->toString(), rb->toString());
+        EXPECT_EQ(99, tag);
+    }
+
+    static shared_ptr<Buffer> makeBuffer(shared_ptr<Buffer> buf)
+    {
+        for (size_t i = 0; i < buf->size(); i++)
+            buf->data()[i] = i % 251;
+        return buf;
+    }
+
+    /// Return true if the buffer could be a shared memory mapping
+    static bool isMapped(const shared_ptr<Buffer>& buf)
+    {
+        return uintptr_t(buf->data()) % ::getpagesize() == 0;
+    }
+
+    static constexpr size_t BUFFER_SIZE = 65536;
+
+    vector<shared_ptr<Buffer>> received;
+
+    shared_ptr<ServiceRegistry> svcreg;
+    shared_ptr<Client> client;
+    shared_ptr<SocketManager> sockman;
+};
+
+}
+
+TEST_F(ShmTest, Call)
+{
+    auto chan = connect(ShmChannel::DEFAULT_RING_SIZE);
+    thread server([this]() { sockman->run(); });
+
+    echo(chan.get(), 1);
+    echo(chan.get(), 1000);
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ShmTest, WrapAround)
+{
+    // Use a small ring and vary the message size so that records
+    // straddle the end of the ring
+    auto chan = connect(4096);
+    EXPECT_EQ(4096, chan->ringSize());
+    thread server([this]() { sockman->run(); });
+
+    for (int i = 0; i < 200; i++)
+        echo(chan.get(), i % 97);
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ShmTest, NoSpin)
+{
+    // Calls should still complete when the receiver always waits on
+    // the doorbell
+    auto chan = connect(ShmChannel::DEFAULT_RING_SIZE);
+    chan->setMaxSpin(chrono::microseconds(0));
+    thread server([this]() { sockman->run(); });
+
+    for (int i = 0; i < 10; i++)
+        echo(chan.get(), 10);
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ShmTest, TooLarge)
+{
+    // A message which can never fit in the ring should fail rather
+    // than waiting forever
+    auto chan = connect(4096);
+    thread server([this]() { sockman->run(); });
+
+    EXPECT_THROW(echo(chan.get(), 2000), system_error);
+    echo(chan.get(), 10);
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ShmTest, Listen)
+{
+    char path[] = "/tmp/shmtestXXXXXX";
+    ASSERT_NE(nullptr, ::mkdtemp(path));
+    string sockpath = string(path) + "/sock";
+
+    sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_LOCAL;
+    strcpy(sun.sun_path, sockpath.c_str());
+    int fd = ::socket(AF_LOCAL, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    ASSERT_GE(::bind(fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)), 0);
+    ASSERT_GE(::listen(fd, 5), 0);
+    auto listener = make_shared<ShmListenSocket>(fd, svcreg);
+    listener->setBufferSize(BUFFER_SIZE);
+    sockman->add(listener);
+    thread server([this]() { sockman->run(); });
+
+    auto chan = ShmChannel::open(sockpath);
+    chan->setBufferSize(BUFFER_SIZE);
+    echo(chan.get(), 100);
+
+    sockman->stop();
+    server.join();
+    ::unlink(sockpath.c_str());
+    ::rmdir(path);
+}
+
+TEST_F(ShmTest, UnixBulk)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+    auto chan = make_shared<UnixChannel>(sockpair[0]);
+    sockman->add(make_shared<UnixChannel>(sockpair[1], svcreg));
+    thread server([this]() { sockman->run(); });
+
+    // Small buffers are sent inline
+    echoBuffers(chan.get(),
+                makeBuffer(make_shared<Buffer>(10)),
+                makeBuffer(make_shared<Buffer>(1001)));
+    received.clear();
+
+    // Large buffers, including one with padding, are passed as shared
+    // memory, whether or not they were allocated there
+    echoBuffers(chan.get(),
+                makeBuffer(make_shared<Buffer>(100001)),
+                makeBuffer(UnixChannel::allocateBuffer(1024*1024)));
+    EXPECT_TRUE(isMapped(received[0]));
+    EXPECT_TRUE(isMapped(received[1]));
+    received.clear();
+
+    // A mix of the two
+    chan->setBulkThreshold(4096);
+    echoBuffers(chan.get(),
+                makeBuffer(make_shared<Buffer>(4095)),
+                makeBuffer(make_shared<Buffer>(4097)));
+    EXPECT_TRUE(isMapped(received[1]));
+    received.clear();
+
+    sockman->stop();
+    server.join();
+}
+
+TEST_F(ShmTest, UnixBadHeader)
+{
+    int sockpair[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sockpair), 0);
+    auto chan = make_shared<UnixChannel>(sockpair[0]);
+
+    // A message length beyond the record size limit is refused without
+    // allocating a buffer for it
+    uint32_t hdr[2] = { 0xffffffff, 0 };
+    ASSERT_EQ(ssize_t(sizeof(hdr)), ::write(sockpair[1], hdr, sizeof(hdr)));
+    shared_ptr<Channel> replyChan;
+    EXPECT_THROW(chan->receiveMessage(replyChan, 1s), system_error);
+
+    // Descriptors which the header doesn't describe are refused too
+    hdr[0] = 4;
+    vector<iovec> iov{{hdr, sizeof(hdr)}};
+    auto peer = make_shared<UnixChannel>(sockpair[1]);
+    peer->sendFds(iov, {::dup(0)});
+    EXPECT_THROW(chan->receiveMessage(replyChan, 1s), system_error);
+}
+
+TEST_F(ShmTest, UnixListen)
+{
+    char path[] = "/tmp/shmtestXXXXXX";
+    ASSERT_NE(nullptr, ::mkdtemp(path));
+    string sockpath = string(path) + "/sock";
+
+    sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_LOCAL;
+    strcpy(sun.sun_path, sockpath.c_str());
+    int fd = ::socket(AF_LOCAL, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    ASSERT_GE(::bind(fd, reinterpret_cast<sockaddr*>(&sun), sizeof(sun)), 0);
+    ASSERT_GE(::listen(fd, 5), 0);
+    auto listener = make_shared<UnixListenSocket>(fd, svcreg);
+    listener->setBufferSize(BUFFER_SIZE);
+    sockman->add(listener);
+    thread server([this]() { sockman->run(); });
+
+    auto chan = UnixChannel::open(sockpath);
+    chan->setBufferSize(BUFFER_SIZE);
+    echo(chan.get(), 100);
+    echoBuffers(chan.get(),
+                makeBuffer(make_shared<Buffer>(200000)),
+                makeBuffer(make_shared<Buffer>(3)));
+    EXPECT_TRUE(isMapped(received[0]));
+    received.clear();
+
+    sockman->stop();
+    server.join();
+    ::unlink(sockpath.c_str());
+    ::rmdir(path);
+}
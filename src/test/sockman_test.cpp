@@ -0,0 +1,308 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <rpc++/socket.h>
+#include <rpc++/sockman.h>
+#include <gtest/gtest.h>
+
+using namespace oncrpc;
+using namespace std;
+using namespace std::literals::chrono_literals;
+
+namespace {
+
+/// A socket which counts the bytes which arrive on it
+class CountingSocket: public Socket
+{
+public:
+    CountingSocket(int fd)
+        : Socket(fd)
+    {
+    }
+
+    bool onReadable(SocketManager* sockman) override
+    {
+        char buf[64];
+        auto n = ::read(fd(), buf, sizeof(buf));
+        if (n <= 0)
+            return false;
+        unique_lock<mutex> lock(mutex_);
+        count_ += n;
+        cv_.notify_all();
+        return true;
+    }
+
+    bool onWritable(SocketManager* sockman) override
+    {
+        unique_lock<mutex> lock(mutex_);
+        writable_++;
+        cv_.notify_all();
+        return true;
+    }
+
+    /// Wait until at least count bytes have been read
+    bool waitFor(int count)
+    {
+        unique_lock<mutex> lock(mutex_);
+        return cv_.wait_for(lock, 5s, [=]() { return count_ >= count; });
+    }
+
+    /// Wait until onWritable has been called
+    bool waitForWritable()
+    {
+        unique_lock<mutex> lock(mutex_);
+        return cv_.wait_for(lock, 5s, [=]() { return writable_ > 0; });
+    }
+
+    int count()
+    {
+        unique_lock<mutex> lock(mutex_);
+        return count_;
+    }
+
+private:
+    mutex mutex_;
+    condition_variable cv_;
+    int count_ = 0;
+    int writable_ = 0;
+};
+
+class SocketManagerTest:
+    public ::testing::TestWithParam<SocketManager::Engine>
+{
+public:
+    SocketManagerTest()
+        : sockman(make_shared<SocketManager>(GetParam()))
+    {
+    }
+
+    ~SocketManagerTest()
+    {
+        if (thread_.joinable()) {
+            sockman->stop();
+            thread_.join();
+        }
+    }
+
+    void start()
+    {
+        thread_ = thread([this]() { sockman->run(); });
+    }
+
+    shared_ptr<SocketManager> sockman;
+    thread thread_;
+};
+
+TEST_P(SocketManagerTest, Readable)
+{
+    int sv[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), 0);
+    auto sock = make_shared<CountingSocket>(sv[0]);
+    sockman->add(sock);
+    start();
+
+    ASSERT_EQ(1, ::write(sv[1], "x", 1));
+    EXPECT_TRUE(sock->waitFor(1));
+    ASSERT_EQ(2, ::write(sv[1], "yz", 2));
+    EXPECT_TRUE(sock->waitFor(3));
+    ::close(sv[1]);
+}
+
+TEST_P(SocketManagerTest, RemoveOnClose)
+{
+    int sv[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), 0);
+    auto sock = make_shared<CountingSocket>(sv[0]);
+    sockman->add(sock);
+    start();
+
+    // Closing the other end makes the socket readable with EOF which
+    // should cause the manager to drop it
+    ::close(sv[1]);
+    for (int i = 0; i < 500 && sock->owner(); i++)
+        this_thread::sleep_for(10ms);
+    EXPECT_EQ(nullptr, sock->owner());
+}
+
+TEST_P(SocketManagerTest, Changed)
+{
+    int sv1[2], sv2[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv1), 0);
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv2), 0);
+    auto sock = make_shared<CountingSocket>(sv1[0]);
+    sockman->add(sock);
+    start();
+
+    ASSERT_EQ(1, ::write(sv1[1], "x", 1));
+    EXPECT_TRUE(sock->waitFor(1));
+
+    // Switch the socket to a new descriptor, similar to a reconnect
+    sock->close();
+    sock->setFd(sv2[0]);
+    sockman->changed(sock);
+    ASSERT_EQ(1, ::write(sv2[1], "y", 1));
+    EXPECT_TRUE(sock->waitFor(2));
+    ::close(sv1[1]);
+    ::close(sv2[1]);
+}
+
+TEST_P(SocketManagerTest, IdleTimeout)
+{
+    int sv[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), 0);
+    auto sock = make_shared<CountingSocket>(sv[0]);
+    sock->setCloseOnIdle(true);
+    sockman->setIdleTimeout(50ms);
+    sockman->add(sock);
+    start();
+
+    for (int i = 0; i < 500 && sock->owner(); i++)
+        this_thread::sleep_for(10ms);
+    EXPECT_EQ(nullptr, sock->owner());
+    ::close(sv[1]);
+}
+
+#ifdef HAVE_EPOLL
+TEST_P(SocketManagerTest, LargeDescriptors)
+{
+    // Use up enough descriptors to push the test socket past
+    // FD_SETSIZE, which select-based implementations cannot handle
+    vector<shared_ptr<Socket>> idle;
+    while (idle.size() < FD_SETSIZE) {
+        int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+        ASSERT_GE(fd, 0);
+        auto sock = make_shared<CountingSocket>(fd);
+        sockman->add(sock);
+        idle.push_back(sock);
+    }
+
+    int sv[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), 0);
+    EXPECT_GE(sv[0], FD_SETSIZE);
+    auto sock = make_shared<CountingSocket>(sv[0]);
+    sockman->add(sock);
+    start();
+
+    ASSERT_EQ(1, ::write(sv[1], "x", 1));
+    EXPECT_TRUE(sock->waitFor(1));
+    ::close(sv[1]);
+}
+#endif
+
+TEST_P(SocketManagerTest, Write)
+{
+    int sv[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), 0);
+    auto sock = make_shared<CountingSocket>(sv[0]);
+    sockman->add(sock);
+    start();
+
+    mutex mtx;
+    condition_variable cv;
+    ssize_t result = -1;
+    char data[] = "hello";
+    vector<iovec> iov{{data, 2}, {data + 2, 3}};
+    sockman->write(sock, iov, [&](ssize_t len) {
+        unique_lock<mutex> lock(mtx);
+        result = len;
+        cv.notify_all();
+    });
+    {
+        unique_lock<mutex> lock(mtx);
+        EXPECT_TRUE(cv.wait_for(lock, 5s, [&]() { return result >= 0; }));
+    }
+    EXPECT_EQ(5, result);
+    char buf[8];
+    EXPECT_EQ(5, ::read(sv[1], buf, sizeof(buf)));
+    EXPECT_EQ(0, ::memcmp(buf, data, 5));
+    ::close(sv[1]);
+}
+
+TEST_P(SocketManagerTest, Interest)
+{
+    int sv[2];
+    ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), 0);
+    auto sock = make_shared<CountingSocket>(sv[0]);
+    sockman->add(sock);
+    start();
+
+    // Ask for write notifications - an idle socket is writable
+    sockman->setInterest(sock, true, true);
+    EXPECT_TRUE(sock->waitForWritable());
+    sockman->setInterest(sock, true, false);
+
+    // Data should not be read while reading is paused
+    sockman->setInterest(sock, false, false);
+    ASSERT_EQ(1, ::write(sv[1], "x", 1));
+    this_thread::sleep_for(50ms);
+    EXPECT_EQ(0, sock->count());
+    sockman->setInterest(sock, true, false);
+    EXPECT_TRUE(sock->waitFor(1));
+    ::close(sv[1]);
+}
+
+TEST(SocketManagerGroupTest, RoundRobin)
+{
+    SocketManagerGroup group(3);
+    EXPECT_EQ(3, group.size());
+
+    vector<shared_ptr<CountingSocket>> socks;
+    vector<int> writers;
+    for (int i = 0; i < 6; i++) {
+        int sv[2];
+        ASSERT_GE(::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv), 0);
+        auto sock = make_shared<CountingSocket>(sv[0]);
+        group.add(sock);
+        socks.push_back(sock);
+        writers.push_back(sv[1]);
+    }
+    for (int i = 0; i < 6; i++)
+        EXPECT_EQ(group.manager(i % 3), socks[i]->owner());
+
+    group.start();
+    for (int i = 0; i < 6; i++) {
+        ASSERT_EQ(1, ::write(writers[i], "x", 1));
+        EXPECT_TRUE(socks[i]->waitFor(1));
+    }
+    group.stop();
+    for (auto fd: writers)
+        ::close(fd);
+}
+
+INSTANTIATE_TEST_CASE_P(
+    Engines, SocketManagerTest,
+    ::testing::Values(
+        SocketManager::Engine::DEFAULT, SocketManager::Engine::URING));
+
+}
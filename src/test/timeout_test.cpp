@@ -78,4 +78,25 @@ TEST(TimeoutTest, CancelExpired)
     tman.cancel(tid);
 }
 
+TEST(TimeoutTest, CancelMany)
+{
+    auto now = std::chrono::system_clock::now();
+    int count = 0;
+
+    TimeoutManager tman;
+    vector<TimeoutManager::task_type> tids;
+    for (int i = 0; i < 1000; i++)
+        tids.push_back(tman.add(now + 1s + i * 1ms, [&]() { count++; }));
+    EXPECT_EQ(1000, tman.size());
+
+    // Cancel all but the last task
+    for (int i = 0; i < 999; i++)
+        tman.cancel(tids[i]);
+    EXPECT_EQ(1, tman.size());
+    EXPECT_EQ(now + 1s + 999ms, tman.next());
+    tman.update(now + 10s);
+    EXPECT_EQ(1, count);
+    EXPECT_EQ(0, tman.size());
+}
+
 }
@@ -24,9 +24,11 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include <array>
 #include <type_traits>
 #include <vector>
+#include <rpc++/rec.h>
 #include <rpc++/xdr.h>
 #include <gtest/gtest.h>
 
@@ -115,6 +117,57 @@ TEST_F(XdrTest, PODArrays)
         {{0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 4}});
 }
 
+TEST_F(XdrTest, WordArrays)
+{
+    test<vector<int>, 16>({-1, 2, 0x11223344},
+        {{0, 0, 0, 3, 255, 255, 255, 255, 0, 0, 0, 2, 17, 34, 51, 68}});
+    test<array<float, 2>, 8>({{12345678.0, 0.0}},
+        {{75, 60, 97, 78, 0, 0, 0, 0}});
+    test<vector<double>, 20>({12345678.0, -0.0},
+        {{0, 0, 0, 2, 65, 103, 140, 41, 192, 0, 0, 0, 128, 0, 0, 0,
+          0, 0, 0, 0}});
+    test<bounded_vector<uint64_t, 4>, 12>({0x0102030411223344UL},
+        {{0, 0, 0, 1, 1, 2, 3, 4, 17, 34, 51, 68}});
+}
+
+TEST_F(XdrTest, FragmentedWordArrays)
+{
+    // Large arrays are converted in bulk, falling back to one element
+    // at a time where a fragment boundary splits a value
+    vector<int> a(1000);
+    vector<double> b(1000);
+    for (int i = 0; i < 1000; i++) {
+        a[i] = i * 12345 - 6000000;
+        b[i] = i * 1.5;
+    }
+
+    vector<uint8_t> bytes, expected;
+    RecordWriter writer(
+        28, [&](const void* p, size_t len) {
+            auto bp = static_cast<const uint8_t*>(p);
+            bytes.insert(bytes.end(), bp, bp + len);
+            return len;
+        });
+    xdr(a, static_cast<XdrSink*>(&writer));
+    xdr(b, static_cast<XdrSink*>(&writer));
+    writer.pushRecord();
+
+    size_t pos = 0;
+    RecordReader reader(
+        20, [&](void* p, size_t len) {
+            len = min(len, bytes.size() - pos);
+            copy_n(bytes.data() + pos, len, static_cast<uint8_t*>(p));
+            pos += len;
+            return len;
+        });
+    vector<int> ra;
+    vector<double> rb;
+    xdr(ra, static_cast<XdrSource*>(&reader));
+    xdr(rb, static_cast<XdrSource*>(&reader));
+    EXPECT_EQ(a, ra);
+    EXPECT_EQ(b, rb);
+}
+
 TEST_F(XdrTest, Pointers)
 {
     unique_ptr<int> up(nullptr);
@@ -156,6 +209,94 @@ TEST_F(XdrTest, BoundedString)
     EXPECT_THROW(xdr(b, static_cast<XdrSource*>(xdrs.get())), XdrError);
 }
 
+TEST_F(XdrTest, Views)
+{
+    auto xdrs = make_unique<XdrMemory>(512);
+    xdr(string("hello"), static_cast<XdrSink*>(xdrs.get()));
+    xdr(vector<uint8_t>{1, 2, 3, 4, 5, 6}, static_cast<XdrSink*>(xdrs.get()));
+    xdr(string(), static_cast<XdrSink*>(xdrs.get()));
+    EXPECT_EQ(28, xdrs->writePos());
+    xdrs->setReadSize(xdrs->writePos());
+
+    xdr_string_view s;
+    xdr_opaque_span o;
+    xdr_string_view e("not empty");
+    xdr(s, static_cast<XdrSource*>(xdrs.get()));
+    xdr(o, static_cast<XdrSource*>(xdrs.get()));
+    xdr(e, static_cast<XdrSource*>(xdrs.get()));
+    EXPECT_EQ(xdrs->writePos(), xdrs->readPos());
+    EXPECT_EQ("hello", s);
+    EXPECT_EQ((vector<uint8_t>{1, 2, 3, 4, 5, 6}), o.to_vector());
+    EXPECT_TRUE(e.empty());
+    EXPECT_EQ(xdr_size(s) + xdr_size(o) + xdr_size(e), xdrs->writePos());
+
+    // The views should point into the decode buffer instead of copying
+    auto buf = xdrs->buf();
+    EXPECT_EQ(reinterpret_cast<const char*>(buf + 4), s.data());
+    EXPECT_EQ(buf + 16, o.data());
+
+    // Reusing the decoder must not overwrite the views
+    xdrs->rewind();
+    EXPECT_NE(buf, xdrs->buf());
+    xdr(string("world"), static_cast<XdrSink*>(xdrs.get()));
+    xdrs.reset();
+    EXPECT_EQ("hello", s.str());
+    EXPECT_EQ(6, o.size());
+
+    // Views encode like the types they replace
+    XdrMemory xm(512);
+    xdr(s, static_cast<XdrSink*>(&xm));
+    xm.rewind();
+    string copy;
+    xdr(copy, static_cast<XdrSource*>(&xm));
+    EXPECT_EQ("hello", copy);
+}
+
+TEST_F(XdrTest, RewindShared)
+{
+    // Rewinding while a slice is alive must keep the contents so that
+    // the message can be decoded again
+    auto xdrs = make_unique<XdrMemory>(512);
+    xdr(uint32_t(42), static_cast<XdrSink*>(xdrs.get()));
+    xdr(string("hello"), static_cast<XdrSink*>(xdrs.get()));
+    xdrs->setReadSize(xdrs->writePos());
+
+    uint32_t v;
+    xdr_string_view s;
+    xdr(v, static_cast<XdrSource*>(xdrs.get()));
+    xdr(s, static_cast<XdrSource*>(xdrs.get()));
+    auto buf = xdrs->buf();
+    xdrs->rewind();
+    EXPECT_NE(buf, xdrs->buf());
+    EXPECT_EQ(16, xdrs->readSize());
+
+    uint32_t v2;
+    string s2;
+    xdr(v2, static_cast<XdrSource*>(xdrs.get()));
+    xdr(s2, static_cast<XdrSource*>(xdrs.get()));
+    EXPECT_EQ(42, v2);
+    EXPECT_EQ("hello", s2);
+    EXPECT_EQ("hello", s.str());
+}
+
+TEST_F(XdrTest, BoundedViews)
+{
+    auto xdrs = make_unique<XdrMemory>(512);
+    string a(10, 99);
+    xdr(a, static_cast<XdrSink*>(xdrs.get()));
+    xdrs->rewind();
+
+    bounded_string_view<5> b;
+    EXPECT_THROW(xdr(b, static_cast<XdrSource*>(xdrs.get())), XdrError);
+    xdrs->rewind();
+    bounded_opaque_span<5> c;
+    EXPECT_THROW(xdr(c, static_cast<XdrSource*>(xdrs.get())), XdrError);
+    xdrs->rewind();
+    bounded_string_view<10> d;
+    xdr(d, static_cast<XdrSource*>(xdrs.get()));
+    EXPECT_EQ(a, d);
+}
+
 TEST_F(XdrTest, Sizeof)
 {
     EXPECT_EQ(4, XdrSizeof(42));
@@ -165,6 +306,118 @@ TEST_F(XdrTest, Sizeof)
     EXPECT_EQ(12, XdrSizeof(string("Hello")));
 }
 
+TEST_F(XdrTest, Size)
+{
+    static_assert(xdr_fixed_size(static_cast<const int*>(nullptr)) == 4, "");
+    static_assert(xdr_fixed_size(static_cast<const double*>(nullptr)) == 8,
+                  "");
+    static_assert(
+        xdr_fixed_size(static_cast<const array<uint8_t, 7>*>(nullptr)) == 8,
+        "");
+    static_assert(
+        xdr_fixed_size(static_cast<const array<int64_t, 3>*>(nullptr)) == 24,
+        "");
+    static_assert(
+        xdr_fixed_size(static_cast<const vector<int>*>(nullptr)) == 0, "");
+    static_assert(xdr_fixed_sum({4, 8, 4}) == 16, "");
+    static_assert(xdr_fixed_sum({4, 0, 4}) == 0, "");
+
+    EXPECT_EQ(4, xdr_size(true));
+    EXPECT_EQ(8, xdr_size(3.0));
+    EXPECT_EQ(12, xdr_size(string("Hello")));
+    EXPECT_EQ(8, xdr_size(vector<uint8_t>(3)));
+    EXPECT_EQ(8, xdr_size(bounded_vector<uint8_t, 8>{1, 2, 3, 4}));
+    EXPECT_EQ(20, xdr_size(make_shared<Buffer>(13)));
+    EXPECT_EQ(36, xdr_size(vector<array<int, 2>>(4)));
+    vector<string> vs{"a", "bcdef", ""};
+    EXPECT_EQ(4 + 8 + 12 + 4, xdr_size(vs));
+    unique_ptr<string> p;
+    EXPECT_EQ(4, xdr_size(p));
+    p = make_unique<string>("xyz");
+    EXPECT_EQ(12, xdr_size(p));
+}
+
+TEST_F(XdrTest, Sizer)
+{
+    // The sizer counts external buffers without copying them
+    XdrSizer xsz;
+    xdr(make_shared<Buffer>(1 << 20), &xsz);
+    xdr(vector<int>(1000), &xsz);
+    EXPECT_EQ(4 + (1 << 20) + 4 + 4000, xsz.size());
+}
+
+TEST_F(XdrTest, Vector)
+{
+    XdrVector xv;
+    vector<int> a(1000);
+    for (int i = 0; i < 1000; i++)
+        a[i] = i;
+    xdr(a, &xv);
+    xdr(string("Hello"), &xv);
+    EXPECT_EQ(XdrSizeof(a) + 12, xv.writePos());
+    auto buf = xv.release();
+    EXPECT_EQ(XdrSizeof(a) + 12, buf.size());
+    EXPECT_EQ(0, xv.writePos());
+
+    XdrMemory xm(buf.data(), buf.size());
+    vector<int> b;
+    string s;
+    xdr(b, static_cast<XdrSource*>(&xm));
+    xdr(s, static_cast<XdrSource*>(&xm));
+    EXPECT_EQ(a, b);
+    EXPECT_EQ("Hello", s);
+}
+
+TEST_F(XdrTest, Chain)
+{
+    XdrChain xc(64);
+    vector<int> a(1000);
+    for (int i = 0; i < 1000; i++)
+        a[i] = i;
+    auto buf = make_shared<Buffer>(13);
+    std::fill_n(buf->data(), 13, 42);
+    xdr(a, &xc);
+    xdr(buf, static_cast<XdrSink*>(&xc));
+    xdr(string("Hello"), &xc);
+    EXPECT_LT(1, xc.segments());
+    auto len = XdrSizeof(a) + XdrSizeof(buf) + 12;
+    EXPECT_EQ(len, xc.writePos());
+
+    // The buffer is referenced, not copied
+    auto iov = xc.iov();
+    EXPECT_EQ(1, xc.buffers().size());
+    EXPECT_NE(iov.end(), std::find_if(
+        iov.begin(), iov.end(),
+        [&](auto& v) { return v.iov_base == buf->data(); }));
+
+    vector<uint8_t> flat;
+    for (auto& v: iov) {
+        auto p = static_cast<const uint8_t*>(v.iov_base);
+        flat.insert(flat.end(), p, p + v.iov_len);
+    }
+    EXPECT_EQ(len, flat.size());
+    XdrVector xv;
+    xc.copyTo(&xv);
+    EXPECT_EQ(flat, xv.release());
+
+    XdrMemory xm(flat.data(), flat.size());
+    vector<int> b;
+    shared_ptr<Buffer> buf2;
+    string s;
+    xdr(b, static_cast<XdrSource*>(&xm));
+    xdr(buf2, static_cast<XdrSource*>(&xm));
+    xdr(s, static_cast<XdrSource*>(&xm));
+    EXPECT_EQ(a, b);
+    EXPECT_EQ(13, buf2->size());
+    EXPECT_EQ(42, buf2->data()[12]);
+    EXPECT_EQ("Hello", s);
+
+    xc.rewind();
+    EXPECT_EQ(1, xc.segments());
+    EXPECT_EQ(0, xc.writePos());
+    EXPECT_EQ(0, xc.iov().size());
+}
+
 TEST_F(XdrTest, Inline)
 {
     auto xdrs = make_unique<XdrMemory>(100);
@@ -24,6 +24,8 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
+
 #include <glog/logging.h>
 
 #include <rpc++/timeout.h>
@@ -38,6 +40,7 @@ TimeoutManager::add(
     std::unique_lock<std::mutex> lock(mutex_);
     auto tid = nextTid_++;
     queue_.push_back(Task{tid, when, what});
+    active_.insert(tid);
     std::push_heap(queue_.begin(), queue_.end(), Comp());
     return tid;
 }
@@ -50,6 +53,9 @@ TimeoutManager::update(clock_type::time_point now)
         std::pop_heap(queue_.begin(), queue_.end(), Comp());
         auto task = std::move(queue_.back());
         queue_.pop_back();
+        if (active_.erase(task.tid) == 0)
+            // Cancelled
+            continue;
         lock.unlock();
         VLOG(3) << "calling timeout function";
         task.what();
@@ -59,14 +65,36 @@ TimeoutManager::update(clock_type::time_point now)
 
 void
 TimeoutManager::cancel(task_type tid)
+{
+    // Cancelled tasks are left in the queue and skipped when they
+    // reach the front, which keeps this cheap when many calls with
+    // timeouts are in flight
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (active_.erase(tid) > 0)
+        prune();
+}
+
+size_t
+TimeoutManager::size() const
 {
     std::unique_lock<std::mutex> lock(mutex_);
-    for (auto i = queue_.begin(); i != queue_.end(); ++i) {
-        if (i->tid == tid) {
-            queue_.erase(i);
-            std::make_heap(queue_.begin(), queue_.end(), Comp());
-            return;
-        }
+    return active_.size();
+}
+
+void
+TimeoutManager::prune()
+{
+    if (queue_.size() > 2 * active_.size() + 64) {
+        queue_.erase(
+            std::remove_if(
+                queue_.begin(), queue_.end(),
+                [this](const Task& t) { return active_.count(t.tid) == 0; }),
+            queue_.end());
+        std::make_heap(queue_.begin(), queue_.end(), Comp());
+    }
+    while (queue_.size() > 0 && active_.count(queue_.front().tid) == 0) {
+        std::pop_heap(queue_.begin(), queue_.end(), Comp());
+        queue_.pop_back();
     }
 }
 
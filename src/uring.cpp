@@ -0,0 +1,211 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <rpc++/uring.h>
+
+#ifdef HAVE_IO_URING
+
+#include <cstring>
+#include <system_error>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace oncrpc;
+
+static int
+ioUringSetup(unsigned entries, io_uring_params* p)
+{
+    return int(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+bool
+IoUring::supported()
+{
+    static int result = -1;
+    if (result < 0) {
+        // We need IORING_FEAT_EXT_ARG for timed waits, which also
+        // implies a kernel recent enough for IORING_OP_RECV and
+        // IORING_OP_POLL_REMOVE by user_data
+        constexpr unsigned required =
+            IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE |
+            IORING_FEAT_EXT_ARG;
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        int fd = ioUringSetup(4, &p);
+        if (fd >= 0) {
+            ::close(fd);
+            result = (p.features & required) == required;
+        }
+        else {
+            result = 0;
+        }
+    }
+    return result != 0;
+}
+
+IoUring::IoUring(unsigned entries)
+{
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    fd_ = ioUringSetup(entries, &p);
+    if (fd_ < 0)
+        throw std::system_error(errno, std::system_category());
+
+    sqRingSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqRingSize_ > sqRingSize_)
+            sqRingSize_ = cqRingSize_;
+        cqRingSize_ = 0;
+    }
+    sqesSize_ = p.sq_entries * sizeof(io_uring_sqe);
+
+    sqRing_ = ::mmap(
+        nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        auto err = errno;
+        ::close(fd_);
+        throw std::system_error(err, std::system_category());
+    }
+    if (cqRingSize_ > 0) {
+        cqRing_ = ::mmap(
+            nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            auto err = errno;
+            ::munmap(sqRing_, sqRingSize_);
+            ::close(fd_);
+            throw std::system_error(err, std::system_category());
+        }
+    }
+    else {
+        cqRing_ = sqRing_;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(::mmap(
+        nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED) {
+        auto err = errno;
+        if (cqRingSize_ > 0)
+            ::munmap(cqRing_, cqRingSize_);
+        ::munmap(sqRing_, sqRingSize_);
+        ::close(fd_);
+        throw std::system_error(err, std::system_category());
+    }
+
+    auto sq = static_cast<uint8_t*>(sqRing_);
+    sqHead_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sqTail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sqArray_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sqMask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sqEntries_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_entries);
+    sqeTail_ = *sqTail_;
+
+    auto cq = static_cast<uint8_t*>(cqRing_);
+    cqHead_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cqMask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+}
+
+IoUring::~IoUring()
+{
+    ::munmap(sqes_, sqesSize_);
+    if (cqRingSize_ > 0)
+        ::munmap(cqRing_, cqRingSize_);
+    ::munmap(sqRing_, sqRingSize_);
+    ::close(fd_);
+}
+
+io_uring_sqe*
+IoUring::getSqe()
+{
+    auto head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    if (sqeTail_ - head >= sqEntries_) {
+        submit();
+        head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        if (sqeTail_ - head >= sqEntries_)
+            throw std::system_error(EBUSY, std::system_category());
+    }
+    auto index = sqeTail_ & sqMask_;
+    auto sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqArray_[index] = index;
+    sqeTail_++;
+    return sqe;
+}
+
+unsigned
+IoUring::flush()
+{
+    __atomic_store_n(sqTail_, sqeTail_, __ATOMIC_RELEASE);
+    return sqeTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+}
+
+void
+IoUring::submit()
+{
+    auto toSubmit = flush();
+    if (toSubmit > 0)
+        enter(toSubmit, 0, 0, nullptr, 0);
+}
+
+void
+IoUring::wait(unsigned toSubmit, std::chrono::microseconds timeout)
+{
+    __kernel_timespec ts;
+    ts.tv_sec = timeout.count() / 1000000;
+    ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+    io_uring_getevents_arg arg;
+    std::memset(&arg, 0, sizeof(arg));
+    arg.ts = reinterpret_cast<uintptr_t>(&ts);
+    enter(toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+          &arg, sizeof(arg));
+}
+
+int
+IoUring::enter(
+    unsigned toSubmit, unsigned minComplete, unsigned flags,
+    void* arg, size_t argsz)
+{
+    auto rv = int(::syscall(
+        __NR_io_uring_enter, fd_, toSubmit, minComplete, flags, arg, argsz));
+    if (rv < 0) {
+        // Timeouts and signals are expected. If the completion queue
+        // has overflowed, the caller must reap before we can submit
+        // more work.
+        if (errno == ETIME || errno == EINTR || errno == EBUSY ||
+            errno == EAGAIN)
+            return 0;
+        throw std::system_error(errno, std::system_category());
+    }
+    return rv;
+}
+
+#endif
@@ -24,6 +24,20 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <rpc++/xdr.h>
 
 using namespace oncrpc;
@@ -37,11 +51,10 @@ XdrSource::~XdrSource()
 }
 
 XdrMemory::XdrMemory(size_t sz)
-    : storage_((uint8_t*) std::malloc(sz),
-               [](uint8_t* p) { std::free(p); })
+    : storage_(std::make_shared<Buffer>(sz))
 {
     size_ = sz;
-    buf_ = storage_.get();
+    buf_ = storage_->data();
     writeCursor_ = buf_;
     writeLimit_ = buf_ + sz;
     readCursor_ = buf_;
@@ -79,3 +92,340 @@ XdrMemory::fill()
 {
     throw XdrError("overflow");
 }
+
+void
+XdrMemory::getBuffer(std::shared_ptr<Buffer>& buf, size_t size)
+{
+    // If we own the storage and the bytes are all here, return a slice
+    // of it instead of a copy. The slice keeps the storage alive if it
+    // outlives us.
+    auto len = __round(size);
+    if (storage_ && size > 0 && readCursor_ + len <= readLimit_) {
+        size_t off = readCursor_ - buf_;
+        buf = std::make_shared<Buffer>(storage_, off, off + size);
+        readCursor_ += len;
+        return;
+    }
+    XdrSource::getBuffer(buf, size);
+}
+
+void
+XdrMemory::unshare()
+{
+    auto writeSize = writeLimit_ - buf_;
+    auto readSize = readLimit_ - buf_;
+    // Keep the current contents so that they can be read again after
+    // rewinding
+    auto used = std::max(readSize, writeCursor_ ? writeCursor_ - buf_ : 0);
+    storage_ = std::make_shared<Buffer>(size_);
+    std::copy_n(buf_, used, storage_->data());
+    buf_ = storage_->data();
+    writeLimit_ = buf_ + writeSize;
+    readLimit_ = buf_ + readSize;
+}
+
+XdrChain::XdrChain(size_t sz)
+    : storage_(std::make_shared<Buffer>(sz)),
+      size_(sz),
+      buf_(storage_->data()),
+      segmentSize_(sz)
+{
+    writeCursor_ = runStart_ = buf_;
+    writeLimit_ = buf_ + sz;
+}
+
+void
+XdrChain::rewind()
+{
+    if (storage_.use_count() > 1) {
+        storage_ = std::make_shared<Buffer>(size_);
+        buf_ = storage_->data();
+    }
+    segments_.clear();
+    segmentSize_ = size_;
+    writeCursor_ = runStart_ = buf_;
+    writeLimit_ = buf_ + size_;
+    iov_.clear();
+    iovBytes_ = 0;
+    buffers_.clear();
+}
+
+std::vector<iovec>
+XdrChain::iov() const
+{
+    auto res = iov_;
+    if (writeCursor_ > runStart_)
+        res.emplace_back(iovec{runStart_, size_t(writeCursor_ - runStart_)});
+    return res;
+}
+
+void
+XdrChain::copyTo(XdrSink* xdrs) const
+{
+    size_t j = 0;
+    for (const auto& v: iov()) {
+        if (j < buffers_.size() && buffers_[j]->data() == v.iov_base) {
+            xdrs->putBuffer(buffers_[j]);
+            j++;
+        }
+        else if (v.iov_base == pad_) {
+            // Skip - putBuffer above handles this
+        }
+        else {
+            xdrs->putBytes(v.iov_base, v.iov_len);
+        }
+    }
+}
+
+void
+XdrChain::endRun()
+{
+    if (writeCursor_ > runStart_) {
+        size_t len = writeCursor_ - runStart_;
+        iov_.emplace_back(iovec{runStart_, len});
+        iovBytes_ += len;
+        runStart_ = writeCursor_;
+    }
+}
+
+const std::shared_ptr<Buffer>*
+XdrChain::segmentOf(const uint8_t* p) const
+{
+    if (p >= buf_ && p < buf_ + size_)
+        return &storage_;
+    for (const auto& seg: segments_) {
+        if (p >= seg->data() && p < seg->data() + seg->size())
+            return &seg;
+    }
+    return nullptr;
+}
+
+void
+XdrChain::putBuffer(const std::shared_ptr<Buffer>& buf)
+{
+    auto len = buf->size();
+    if (len == 0)
+        return;
+
+    endRun();
+    iov_.emplace_back(iovec{buf->data(), len});
+    iovBytes_ += len;
+    buffers_.push_back(buf);
+
+    size_t pad = __round(len) - len;
+    if (pad > 0) {
+        iov_.emplace_back(iovec{pad_, pad});
+        iovBytes_ += pad;
+    }
+}
+
+void
+XdrChain::flush()
+{
+    // The bytes written so far are always available from iov() so
+    // there is nothing to do unless the current segment is full
+    if (writeLimit_ - writeCursor_ >= ptrdiff_t(sizeof(XdrWord)))
+        return;
+    endRun();
+    size_t next = 2 * segmentSize_;
+    if (next < BufferPool::MIN_SIZE)
+        next = BufferPool::MIN_SIZE;
+    if (next > BufferPool::MAX_SIZE)
+        next = BufferPool::MAX_SIZE;
+    segmentSize_ = next;
+    segments_.push_back(std::make_shared<Buffer>(segmentSize_));
+    writeCursor_ = runStart_ = segments_.back()->data();
+    writeLimit_ = writeCursor_ + segmentSize_;
+}
+
+constexpr size_t XdrVector::MIN_SIZE;
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+
+namespace {
+
+void
+swapWordsScalar(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        uint32_t v;
+        std::memcpy(&v, src + 4 * i, sizeof(v));
+        v = __builtin_bswap32(v);
+        std::memcpy(dst + 4 * i, &v, sizeof(v));
+    }
+}
+
+void
+swapHypersScalar(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        uint64_t v;
+        std::memcpy(&v, src + 8 * i, sizeof(v));
+        v = __builtin_bswap64(v);
+        std::memcpy(dst + 8 * i, &v, sizeof(v));
+    }
+}
+
+#if defined(__SSE2__)
+
+// SSE2 has no byte shuffle so swap the bytes in each 16-bit lane with
+// shifts, then reverse the 16-bit lanes within each word
+
+inline __m128i
+swapBytes16(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+size_t
+swapWordsSSE2(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4*i));
+        v = swapBytes16(v);
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4*i), v);
+    }
+    return i;
+}
+
+size_t
+swapHypersSSE2(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 8*i));
+        v = swapBytes16(v);
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8*i), v);
+    }
+    return i;
+}
+
+#endif
+
+#ifdef HAVE_AVX2_KERNELS
+
+// The AVX2 kernels are compiled for AVX2 regardless of the build flags
+// and only used if the processor supports it
+
+__attribute__((target("avx2"))) size_t
+swapAVX2(uint8_t* dst, const uint8_t* src, size_t len, __m256i mask)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        auto v = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(src + i));
+        v = _mm256_shuffle_epi8(v, mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) size_t
+swapWordsAVX2(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    auto mask = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    return swapAVX2(dst, src, 4 * n, mask) / 4;
+}
+
+__attribute__((target("avx2"))) size_t
+swapHypersAVX2(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    auto mask = _mm256_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    return swapAVX2(dst, src, 8 * n, mask) / 8;
+}
+
+bool
+haveAVX2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+#endif
+
+#if defined(__ARM_NEON)
+
+size_t
+swapWordsNEON(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        vst1q_u8(dst + 4*i, vrev32q_u8(vld1q_u8(src + 4*i)));
+    return i;
+}
+
+size_t
+swapHypersNEON(uint8_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        vst1q_u8(dst + 8*i, vrev64q_u8(vld1q_u8(src + 8*i)));
+    return i;
+}
+
+#endif
+
+}
+
+void
+oncrpc::_detail::swapWords(void* dst, const void* src, size_t n)
+{
+    auto d = static_cast<uint8_t*>(dst);
+    auto s = static_cast<const uint8_t*>(src);
+    size_t i = 0;
+#ifdef HAVE_AVX2_KERNELS
+    if (haveAVX2())
+        i = swapWordsAVX2(d, s, n);
+#endif
+#if defined(__SSE2__)
+    i += swapWordsSSE2(d + 4*i, s + 4*i, n - i);
+#elif defined(__ARM_NEON)
+    i += swapWordsNEON(d + 4*i, s + 4*i, n - i);
+#endif
+    swapWordsScalar(d + 4*i, s + 4*i, n - i);
+}
+
+void
+oncrpc::_detail::swapHypers(void* dst, const void* src, size_t n)
+{
+    auto d = static_cast<uint8_t*>(dst);
+    auto s = static_cast<const uint8_t*>(src);
+    size_t i = 0;
+#ifdef HAVE_AVX2_KERNELS
+    if (haveAVX2())
+        i = swapHypersAVX2(d, s, n);
+#endif
+#if defined(__SSE2__)
+    i += swapHypersSSE2(d + 8*i, s + 8*i, n - i);
+#elif defined(__ARM_NEON)
+    i += swapHypersNEON(d + 8*i, s + 8*i, n - i);
+#endif
+    swapHypersScalar(d + 8*i, s + 8*i, n - i);
+}
+
+#else
+
+void
+oncrpc::_detail::swapWords(void* dst, const void* src, size_t n)
+{
+    if (dst != src)
+        std::memcpy(dst, src, 4 * n);
+}
+
+void
+oncrpc::_detail::swapHypers(void* dst, const void* src, size_t n)
+{
+    if (dst != src)
+        std::memcpy(dst, src, 8 * n);
+}
+
+#endif
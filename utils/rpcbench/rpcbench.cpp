@@ -0,0 +1,456 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <rpc++/channel.h>
+#include <rpc++/client.h>
+#include <rpc++/server.h>
+#include <rpc++/socket.h>
+#include <rpc++/sockman.h>
+#include <rpc++/xdr.h>
+
+using namespace oncrpc;
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+[[noreturn]] static void
+usage(void)
+{
+    cout << "rpcbench sockman [idle [busy [rounds]]]" << endl;
+    cout << "rpcbench stream [default|uring [calls [window]]]" << endl;
+    cout << "rpcbench fanin [leader|dispatch [threads [calls [spinus]]]]"
+         << endl;
+    cout << "rpcbench xdr [int|hyper|float|double [count [rounds]]]" << endl;
+    exit(1);
+}
+
+/// Return the integer value of args[i] if present, otherwise def
+static int
+intArg(const vector<string>& args, size_t i, int def)
+{
+    if (args.size() > i)
+        return stoi(args[i]);
+    return def;
+}
+
+/// Allow the benchmarks to use as many descriptors as possible
+static void
+raiseFileLimit()
+{
+    rlimit rl;
+    if (::getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void
+report(
+    const string& name, bench_clock::duration elapsed, long ops,
+    const string& unit)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+    cout << name << ": " << ops << " " << unit << " in "
+         << ns / 1000000 << "ms, " << double(ns) / ops << "ns/" << unit
+         << endl;
+}
+
+/// A socket which just counts the bytes received
+class CountingSocket: public Socket
+{
+public:
+    CountingSocket(int fd, atomic<long>& count)
+        : Socket(fd),
+          count_(count)
+    {
+    }
+
+    bool onReadable(SocketManager* sockman) override
+    {
+        char buf[256];
+        auto n = ::read(fd(), buf, sizeof(buf));
+        if (n <= 0)
+            return false;
+        count_ += n;
+        return true;
+    }
+
+private:
+    atomic<long>& count_;
+};
+
+/// Measure the cost of a SocketManager wakeup when most of its sockets
+/// are idle. Each round writes one byte to each busy socket and waits
+/// for the manager to consume them all.
+int bench_sockman(const vector<string>& args)
+{
+    if (args.size() > 4)
+        usage();
+    int idleCount = intArg(args, 1, 10000);
+    int busyCount = intArg(args, 2, 100);
+    int rounds = intArg(args, 3, 1000);
+
+    raiseFileLimit();
+    auto sockman = make_shared<SocketManager>();
+    atomic<long> count(0);
+
+    // Unbound datagram sockets never become readable which makes them
+    // a cheap source of idle descriptors
+    vector<shared_ptr<Socket>> sockets;
+    for (int i = 0; i < idleCount; i++) {
+        int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            cerr << "rpcbench: only created " << i << " idle sockets" << endl;
+            return 1;
+        }
+        auto sock = make_shared<CountingSocket>(fd, count);
+        sockman->add(sock);
+        sockets.push_back(sock);
+    }
+
+    vector<int> writers;
+    for (int i = 0; i < busyCount; i++) {
+        int sv[2];
+        if (::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) < 0) {
+            cerr << "rpcbench: only created " << i << " busy sockets" << endl;
+            return 1;
+        }
+        auto sock = make_shared<CountingSocket>(sv[0], count);
+        sockman->add(sock);
+        sockets.push_back(sock);
+        writers.push_back(sv[1]);
+    }
+
+    thread t([sockman]() { sockman->run(); });
+
+    auto start = bench_clock::now();
+    char ch = 0;
+    for (int round = 0; round < rounds; round++) {
+        for (auto fd: writers)
+            ::write(fd, &ch, 1);
+        long target = long(round + 1) * busyCount;
+        while (count < target)
+            this_thread::yield();
+    }
+    auto elapsed = bench_clock::now() - start;
+
+    cout << idleCount << " idle sockets, " << busyCount
+         << " busy sockets" << endl;
+    report("sockman rounds", elapsed, rounds, "round");
+    report("sockman events", elapsed, long(rounds) * busyCount, "event");
+
+    sockman->stop();
+    t.join();
+    for (auto fd: writers)
+        ::close(fd);
+    return 0;
+}
+
+/// Parse a SocketManager engine name
+static SocketManager::Engine
+engineArg(const vector<string>& args, size_t i)
+{
+    if (args.size() <= i || args[i] == "default")
+        return SocketManager::Engine::DEFAULT;
+    if (args[i] == "uring")
+        return SocketManager::Engine::URING;
+    usage();
+}
+
+/// Measure the throughput of small calls over a stream channel with
+/// a window of outstanding asynchronous calls
+int bench_stream(const vector<string>& args)
+{
+    if (args.size() > 4)
+        usage();
+    auto engine = engineArg(args, 1);
+    int callCount = intArg(args, 2, 200000);
+    int window = intArg(args, 3, 100);
+
+    auto svcreg = make_shared<ServiceRegistry>();
+    svcreg->add(1234, 1, [](CallContext&& ctx) {
+        uint32_t val;
+        ctx.getArgs([&](XdrSource* xdrs) { xdr(val, xdrs); });
+        ctx.sendReply([&](XdrSink* xdrs) { xdr(val, xdrs); });
+    });
+    auto client = make_shared<Client>(1234, 1);
+
+    int sv[2];
+    if (::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) < 0) {
+        cerr << "rpcbench: can't create socket pair" << endl;
+        return 1;
+    }
+    auto cchan = make_shared<StreamChannel>(sv[0]);
+    auto schan = make_shared<StreamChannel>(sv[1], svcreg);
+
+    // Use separate managers for client and server so that each side
+    // has its own event loop thread
+    auto csockman = make_shared<SocketManager>(engine);
+    auto ssockman = make_shared<SocketManager>(engine);
+    csockman->add(cchan);
+    ssockman->add(schan);
+    thread ct([csockman]() { csockman->run(); });
+    thread st([ssockman]() { ssockman->run(); });
+
+    auto start = bench_clock::now();
+    deque<future<void>> calls;
+    for (int i = 0; i < callCount; i++) {
+        calls.emplace_back(cchan->callAsync(
+            client.get(), 1,
+            [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+            [](XdrSource* xdrs) { uint32_t v; xdr(v, xdrs); }));
+        while (int(calls.size()) > window) {
+            calls.front().get();
+            calls.pop_front();
+        }
+    }
+    for (auto& f: calls)
+        f.get();
+    auto elapsed = bench_clock::now() - start;
+
+    cout << "engine: "
+         << (csockman->engine() == SocketManager::Engine::URING ?
+             "uring" : "default")
+         << ", window: " << window << endl;
+    report("stream calls", elapsed, callCount, "call");
+
+    csockman->stop();
+    ssockman->stop();
+    ct.join();
+    st.join();
+    return 0;
+}
+
+/// Measure the latency of synchronous calls made by many threads
+/// sharing one stream channel. In leader mode, one of the calling
+/// threads reads replies and wakes the others. In dispatch mode, a
+/// SocketManager reads replies and hands them to the callers.
+int bench_fanin(const vector<string>& args)
+{
+    if (args.size() > 5)
+        usage();
+    bool dispatch = false;
+    if (args.size() > 1) {
+        if (args[1] == "dispatch")
+            dispatch = true;
+        else if (args[1] != "leader")
+            usage();
+    }
+    int threadCount = intArg(args, 2, 32);
+    int callCount = intArg(args, 3, 10000);
+    int spin = intArg(args, 4, 0);
+
+    auto svcreg = make_shared<ServiceRegistry>();
+    svcreg->add(1234, 1, [](CallContext&& ctx) {
+        uint32_t val;
+        ctx.getArgs([&](XdrSource* xdrs) { xdr(val, xdrs); });
+        ctx.sendReply([&](XdrSink* xdrs) { xdr(val, xdrs); });
+    });
+    auto client = make_shared<Client>(1234, 1);
+
+    int sv[2];
+    if (::socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) < 0) {
+        cerr << "rpcbench: can't create socket pair" << endl;
+        return 1;
+    }
+    auto cchan = make_shared<StreamChannel>(sv[0]);
+    auto schan = make_shared<StreamChannel>(sv[1], svcreg);
+
+    auto csockman = make_shared<SocketManager>();
+    auto ssockman = make_shared<SocketManager>();
+    if (dispatch) {
+        csockman->add(cchan);
+        cchan->setReplyDispatch(true);
+        cchan->setReplySpin(chrono::microseconds(spin));
+    }
+    ssockman->add(schan);
+    thread ct([csockman]() { csockman->run(); });
+    thread st([ssockman]() { ssockman->run(); });
+
+    // Each thread records the latency of each of its calls
+    vector<vector<bench_clock::duration>> latencies(threadCount);
+    vector<thread> threads;
+    auto start = bench_clock::now();
+    for (int i = 0; i < threadCount; i++) {
+        threads.emplace_back([&, i]() {
+            auto& lat = latencies[i];
+            lat.reserve(callCount);
+            for (int j = 0; j < callCount; j++) {
+                auto t0 = bench_clock::now();
+                cchan->call(
+                    client.get(), 1,
+                    [](XdrSink* xdrs) { uint32_t v = 123; xdr(v, xdrs); },
+                    [](XdrSource* xdrs) { uint32_t v; xdr(v, xdrs); });
+                lat.push_back(bench_clock::now() - t0);
+            }
+        });
+    }
+    for (auto& t: threads)
+        t.join();
+    auto elapsed = bench_clock::now() - start;
+
+    vector<bench_clock::duration> all;
+    for (auto& lat: latencies)
+        all.insert(all.end(), lat.begin(), lat.end());
+    sort(all.begin(), all.end());
+    auto percentile = [&](double p) {
+        return chrono::duration_cast<chrono::microseconds>(
+            all[size_t(p * (all.size() - 1))]).count();
+    };
+
+    cout << "mode: " << (dispatch ? "dispatch" : "leader")
+         << ", threads: " << threadCount;
+    if (dispatch)
+        cout << ", spin: " << spin << "us";
+    cout << endl;
+    report("fanin calls", elapsed, long(threadCount) * callCount, "call");
+    cout << "latency p50: " << percentile(0.5) << "us, p99: "
+         << percentile(0.99) << "us, max: " << percentile(1.0) << "us"
+         << endl;
+
+    csockman->stop();
+    ssockman->stop();
+    ct.join();
+    st.join();
+    return 0;
+}
+
+/// Encode and decode an array one element at a time, as xdr did for
+/// all arrays before arrays of words were converted in bulk
+template <typename T>
+static void
+encodeLoop(const vector<T>& v, XdrSink* xdrs)
+{
+    uint32_t sz = v.size();
+    xdr(sz, xdrs);
+    for (const auto& e : v)
+        xdr(e, xdrs);
+}
+
+template <typename T>
+static void
+decodeLoop(vector<T>& v, XdrSource* xdrs)
+{
+    uint32_t sz;
+    xdr(sz, xdrs);
+    v.clear();
+    v.reserve(sz);
+    for (uint32_t i = 0; i < sz; i++) {
+        T e;
+        xdr(e, xdrs);
+        v.emplace_back(e);
+    }
+}
+
+template <typename T>
+static int
+bench_xdr_type(const string& type, int count, int rounds)
+{
+    vector<T> v(count), res;
+    for (int i = 0; i < count; i++)
+        v[i] = T(i);
+    XdrMemory xdrs(sizeof(uint32_t) + count * sizeof(T));
+    long elements = long(count) * rounds;
+
+    auto time = [&](const string& name, auto op) {
+        auto start = bench_clock::now();
+        for (int i = 0; i < rounds; i++) {
+            xdrs.rewind();
+            op();
+        }
+        report(name, bench_clock::now() - start, elements, "element");
+    };
+
+    cout << type << "[" << count << "]" << endl;
+    time("loop encode", [&]() { encodeLoop(v, &xdrs); });
+    time("bulk encode", [&]() { xdr(v, static_cast<XdrSink*>(&xdrs)); });
+    time("loop decode", [&]() { decodeLoop(res, &xdrs); });
+    time("bulk decode", [&]() { xdr(res, static_cast<XdrSource*>(&xdrs)); });
+    if (res != v) {
+        cerr << "rpcbench: decoded array does not match" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+/// Compare encoding and decoding large arrays of primitive types one
+/// element at a time with converting them in bulk
+int bench_xdr(const vector<string>& args)
+{
+    if (args.size() > 4)
+        usage();
+    string type = args.size() > 1 ? args[1] : "int";
+    int count = intArg(args, 2, 250000);
+    int rounds = intArg(args, 3, 100);
+
+    if (type == "int")
+        return bench_xdr_type<int32_t>(type, count, rounds);
+    else if (type == "hyper")
+        return bench_xdr_type<uint64_t>(type, count, rounds);
+    else if (type == "float")
+        return bench_xdr_type<float>(type, count, rounds);
+    else if (type == "double")
+        return bench_xdr_type<double>(type, count, rounds);
+    usage();
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2)
+        usage();
+
+    vector<string> args;
+    for (int i = 1; i < argc; i++)
+        args.push_back(argv[i]);
+
+    if (args[0] == "sockman")
+        return bench_sockman(args);
+    else if (args[0] == "stream")
+        return bench_stream(args);
+    else if (args[0] == "fanin")
+        return bench_fanin(args);
+    else if (args[0] == "xdr")
+        return bench_xdr(args);
+    else
+        usage();
+
+    return 0;
+}
@@ -109,6 +109,18 @@ public:
              << "    xdr(reinterpret_cast<oncrpc::RefType<std::uint32_t, XDR>>(v)"
              << ", xdrs);" << endl;
         str_ << "}" << endl << endl;
+
+        str_ << "static inline constexpr std::size_t xdr_fixed_size(const "
+             << def->name() << "*)" << endl
+             << "{" << endl
+             << "    return sizeof(std::uint32_t);" << endl
+             << "}" << endl << endl;
+
+        str_ << "static inline constexpr std::size_t xdr_size(const "
+             << def->name() << ")" << endl
+             << "{" << endl
+             << "    return sizeof(std::uint32_t);" << endl
+             << "}" << endl << endl;
     }
 
     void visit(StructDefinition* def) override
@@ -122,6 +134,31 @@ public:
             str_ << "    xdr(v." << field.first << ", xdrs);" << endl;
         }
         str_ << "}" << endl << endl;
+
+        // The fixed size is zero unless all the fields are fixed size
+        str_ << "static inline constexpr std::size_t xdr_fixed_size(const "
+             << def->name() << "*)" << endl
+             << "{" << endl
+             << "    using oncrpc::xdr_fixed_size;" << endl
+             << "    return oncrpc::xdr_fixed_sum({" << endl;
+        for (const auto& field: *def->body()) {
+            str_ << "        xdr_fixed_size(static_cast<const ";
+            field.second->print(Indent(), str_);
+            str_ << "*>(nullptr))," << endl;
+        }
+        str_ << "    });" << endl
+             << "}" << endl << endl;
+
+        str_ << "static inline std::size_t xdr_size(const "
+             << def->name() << "& v)" << endl
+             << "{" << endl
+             << "    std::size_t sz = 0;" << endl;
+        for (const auto& field: *def->body()) {
+            str_ << "    sz += oncrpc::XdrSizeof(v." << field.first << ");"
+                 << endl;
+        }
+        str_ << "    return sz;" << endl
+             << "}" << endl << endl;
     }
 
     void visit(UnionDefinition* def) override
@@ -163,14 +200,34 @@ public:
             });
         --indent;
         str_ << "}" << endl << endl;
+
+        str_ << "static inline std::size_t xdr_size(const "
+             << def->name() << "& v)" << endl
+             << "{" << endl;
+        ++indent;
+        str_ << indent << "std::size_t sz = oncrpc::XdrSizeof(v."
+             << def->body()->discriminant().first << ");" << endl;
+        def->body()->printSwitch(
+            indent, str_, "v.",
+            [this](Indent indent, auto name, auto type)
+            {
+                if (name.size() == 0)
+                    return;
+                str_ << indent << "sz += oncrpc::XdrSizeof(v." << name
+                     << "());" << endl;
+            });
+        str_ << indent << "return sz;" << endl;
+        --indent;
+        str_ << "}" << endl << endl;
     }
 };
 
 class GenerateInterface: public GenerateBase
 {
 public:
-    GenerateInterface(ostream& str)
-        : GenerateBase(str)
+    GenerateInterface(ostream& str, bool awaitable = false)
+        : GenerateBase(str),
+          awaitable_(awaitable)
     {
     }
 
@@ -181,41 +238,52 @@ public:
         str_ << endl;
 
         for (const auto& ver: *def) {
-            ver->printInterface(Indent(), def, str_);
+            ver->printInterface(Indent(), def, awaitable_, str_);
         }
     }
+
+private:
+    bool awaitable_;
 };
 
 class GenerateClient: public GenerateBase
 {
 public:
-    GenerateClient(ostream& str)
-        : GenerateBase(str)
+    GenerateClient(ostream& str, bool awaitable = false)
+        : GenerateBase(str),
+          awaitable_(awaitable)
     {
     }
 
     void visit(ProgramDefinition* def) override
     {
         for (const auto& ver: *def) {
-            ver->printClientStubs(Indent(), def, str_);
+            ver->printClientStubs(Indent(), def, awaitable_, str_);
         }
     }
+
+private:
+    bool awaitable_;
 };
 
 class GenerateServer: public GenerateBase
 {
 public:
-    GenerateServer(ostream& str)
-        : GenerateBase(str)
+    GenerateServer(ostream& str, bool awaitable = false)
+        : GenerateBase(str),
+          awaitable_(awaitable)
     {
     }
 
     void visit(ProgramDefinition* def) override
     {
         for (const auto& ver: *def) {
-            ver->printServerStubs(Indent(), def, str_);
+            ver->printServerStubs(Indent(), def, awaitable_, str_);
         }
     }
+
+private:
+    bool awaitable_;
 };
 
 }
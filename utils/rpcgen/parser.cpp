@@ -421,13 +421,13 @@ Parser::parseDeclaration()
             nextToken();
             if (tok_.type() == '>') {
                 nextToken();
-                return make_pair(move(name), make_shared<OpaqueType>());
+                return make_pair(move(name), make_shared<OpaqueType>(views_));
             }
             auto value = parseValue();
             expectToken('>');
             return make_pair(
                 move(name),
-                make_shared<OpaqueType>(move(value), false));
+                make_shared<OpaqueType>(move(value), false, views_));
         }
         unexpected();
     }
@@ -457,13 +457,13 @@ Parser::parseDeclaration()
             nextToken();
             if (tok_.type() == '>') {
                 nextToken();
-                return make_pair(move(name), make_shared<StringType>());
+                return make_pair(move(name), make_shared<StringType>(views_));
             }
             auto value = parseValue();
             expectToken('>');
             return make_pair(
                 move(name),
-                make_shared<StringType>(move(value)));
+                make_shared<StringType>(move(value), views_));
         }
         unexpected();
     }
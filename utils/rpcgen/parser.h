@@ -258,7 +258,7 @@ public:
 
     void print(Indent indent, ostream& str) const;
 
-    string methodName(int namePrefixLen)
+    string methodName(int namePrefixLen) const
     {
         return formatIdentifier(
             LCAMEL, parseIdentifier(name_.substr(namePrefixLen)));
@@ -269,9 +269,25 @@ public:
         int namePrefixLen,
         const string& methodPrefix,
         const string& methodSuffix,
+        bool awaitable,
         ostream& str);
 
-    void printClientBody(Indent indent, ostream& str) const;
+    void printClientBody(
+        Indent indent, int namePrefixLen, const string& local,
+        ostream& str) const;
+
+    void printAwaitableClientBody(
+        Indent indent, int namePrefixLen, const string& local,
+        ostream& str) const;
+
+    /// Print a call to the typed service implementation returned by the
+    /// expression local, if there is one
+    void printLocalCall(
+        Indent indent, int namePrefixLen, const string& local,
+        bool awaitable, ostream& str) const;
+
+    void printAwaitableServerStub(
+        Indent indent, int namePrefixLen, ostream& str);
 
     vector<shared_ptr<Type>>::const_iterator
     begin() const { return argTypes_.begin(); }
@@ -304,13 +320,16 @@ public:
     void print(Indent indent, ostream& str) const;
 
     void printInterface(
-        Indent indent, ProgramDefinition* def, ostream& str) const;
+        Indent indent, ProgramDefinition* def, bool awaitable,
+        ostream& str) const;
 
     void printClientStubs(
-        Indent indent, ProgramDefinition* def, ostream& str) const;
+        Indent indent, ProgramDefinition* def, bool awaitable,
+        ostream& str) const;
 
     void printServerStubs(
-        Indent indent, ProgramDefinition* def, ostream& str) const;
+        Indent indent, ProgramDefinition* def, bool awaitable,
+        ostream& str) const;
 
     int operator==(const ProgramVersion& other) const
     {
@@ -571,6 +590,13 @@ public:
     static shared_ptr<Type> voidType();
     static shared_ptr<Type> onewayType();
 
+    /// If views is true, variable length strings and opaque data are
+    /// declared as views of the receive buffer rather than copies
+    void setViews(bool views)
+    {
+        views_ = views;
+    }
+
     shared_ptr<Specification> parse();
     shared_ptr<ConstantDefinition> parseConstantDefinition();
     shared_ptr<Value> parseValue();
@@ -593,6 +619,7 @@ private:
     Lexer lexer_;
     Token tok_;
     shared_ptr<Specification> spec_;
+    bool views_ = false;
 
     static unordered_map<int, shared_ptr<Type>> signedIntTypes_;
     static unordered_map<int, shared_ptr<Type>> unsignedIntTypes_;
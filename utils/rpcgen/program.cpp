@@ -47,10 +47,15 @@ void Procedure::printDeclaration(
     int namePrefixLen,
     const string& methodPrefix,
     const string& methodSuffix,
+    bool awaitable,
     ostream& str)
 {
-    str << indent << methodPrefix
-         << *retType_ << " " << methodName(namePrefixLen);
+    str << indent << methodPrefix;
+    if (awaitable)
+        str << "oncrpc::Task<" << *retType_ << ">";
+    else
+        str << *retType_;
+    str << " " << methodName(namePrefixLen);
     str << "(";
     string sep = "";
     int i = 0;
@@ -64,10 +69,32 @@ void Procedure::printDeclaration(
     str << ")" << methodSuffix << endl;
 }
 
-void Procedure::printClientBody(Indent indent, ostream& str) const
+void Procedure::printLocalCall(
+    Indent indent, int namePrefixLen, const string& local, bool awaitable,
+    ostream& str) const
+{
+    str << indent << "if (auto _local = " << local << ")" << endl;
+    ++indent;
+    str << indent << (awaitable ? "co_return co_await " : "return ")
+        << "_local->" << methodName(namePrefixLen) << "(";
+    int i = 0;
+    for (const auto& argType: *this) {
+        if (argType->isVoid())
+            continue;
+        if (i > 0) str << ", ";
+        str << "_arg" << i;
+        i++;
+    }
+    str << ");" << endl;
+}
+
+void Procedure::printClientBody(
+    Indent indent, int namePrefixLen, const string& local,
+    ostream& str) const
 {
     str << indent << "{" << endl;
     ++indent;
+    printLocalCall(indent, namePrefixLen, local, false, str);
     if (retType_->isOneway()) {
         str << indent << "channel_->send(" << endl;
         ++indent;
@@ -120,6 +147,142 @@ void Procedure::printClientBody(Indent indent, ostream& str) const
     }
 }
 
+void Procedure::printAwaitableClientBody(
+    Indent indent, int namePrefixLen, const string& local,
+    ostream& str) const
+{
+    str << indent << "{" << endl;
+    ++indent;
+    printLocalCall(indent, namePrefixLen, local, true, str);
+    if (retType_->isOneway()) {
+        str << indent << "channel_->send(" << endl;
+    }
+    else {
+        if (!retType_->isVoid())
+            str << indent << *retType() << " _res;" << endl;
+        str << indent << "co_await oncrpc::CallAwaiter(" << endl;
+    }
+    ++indent;
+    if (!retType_->isOneway())
+        str << indent << "channel_, ";
+    else
+        str << indent;
+    str << "client_.get(), " << name() << "," << endl
+        << indent << "[&](oncrpc::XdrSink* xdrs) {" << endl;
+    ++indent;
+    int i = 0;
+    for (const auto& argType: *this) {
+        if (argType->isVoid())
+            continue;
+        str << indent << "xdr(_arg" << i << ", xdrs);" << endl;
+        i++;
+    }
+    --indent;
+    if (retType_->isOneway()) {
+        str << indent << "});" << endl;
+        --indent;
+        str << indent << "co_return;" << endl;
+    }
+    else {
+        str << indent << "}," << endl;
+        str << indent << "[&](oncrpc::XdrSource* xdrs) {" << endl;
+        ++indent;
+        if (!retType_->isVoid())
+            str << indent << "xdr(_res, xdrs);" << endl;
+        --indent;
+        str << indent << "});" << endl;
+        --indent;
+        if (!retType_->isVoid())
+            str << indent << "co_return _res;" << endl;
+    }
+    --indent;
+    str << indent << "}" << endl;
+}
+
+void Procedure::printAwaitableServerStub(
+    Indent indent, int namePrefixLen, ostream& str)
+{
+    str << indent << "oncrpc::Task<void> dispatch_" << name_
+        << "(oncrpc::CallContext ctx)" << endl
+        << indent << "{" << endl;
+    ++indent;
+    int i = 0;
+    for (auto argType: *this) {
+        if (!argType->isVoid()) {
+            str << indent << *argType << " " << "_arg" << i << ";" << endl;
+            ++i;
+        }
+    }
+    if (i > 0) {
+        str << indent << "try {" << endl;
+        ++indent;
+        str << indent << "ctx.getArgs([&](oncrpc::XdrSource* xdrs) {"
+            << endl;
+        ++indent;
+        i = 0;
+        for (auto argType: *this) {
+            if (!argType->isVoid()) {
+                str << indent << "xdr(_arg" << i << ", xdrs);" << endl;
+                ++i;
+            }
+        }
+        --indent;
+        str << indent << "});" << endl;
+        --indent;
+        str << indent << "}" << endl;
+        str << indent << "catch (oncrpc::XdrError&) {" << endl;
+        ++indent;
+        str << indent << "ctx.garbageArgs();" << endl;
+        str << indent << "co_return;" << endl;
+        --indent;
+        str << indent << "}" << endl;
+    }
+
+    // The handler may complete in some other thread so any exception
+    // it throws is turned into a reply here rather than propagating to
+    // the caller of dispatch
+    str << indent << "try {" << endl;
+    ++indent;
+    str << indent;
+    if (!retType_->isVoid())
+        str << *retType_ << " _ret = ";
+    str << "co_await " << methodName(namePrefixLen) << "(";
+    i = 0;
+    for (auto argType: *this) {
+        if (!argType->isVoid()) {
+            if (i > 0) str << ", ";
+            str << "std::move(_arg" << i << ")";
+            i++;
+        }
+    }
+    str << ");" << endl;
+    if (!retType_->isOneway()) {
+        if (!retType_->isVoid()) {
+            str << indent << "ctx.sendReply([&](oncrpc::XdrSink* xdrs) {"
+                << endl;
+            ++indent;
+            str << indent << "xdr(_ret, xdrs);" << endl;
+            --indent;
+            str << indent << "});" << endl;
+        }
+        else {
+            str << indent << "ctx.sendReply([](oncrpc::XdrSink*){});" << endl;
+        }
+    }
+    --indent;
+    str << indent << "}" << endl;
+    str << indent << "catch (oncrpc::NoReply&) {" << endl;
+    str << indent << "}" << endl;
+    str << indent << "catch (std::exception&) {" << endl;
+    ++indent;
+    if (!retType_->isOneway())
+        str << indent << "ctx.systemError();" << endl;
+    --indent;
+    str << indent << "}" << endl;
+    --indent;
+    str << indent << "}" << endl;
+}
+
 void ProgramVersion::print(Indent indent, ostream& str) const
 {
     str << indent << "//version " << name_ << " {" << endl;
@@ -131,7 +294,8 @@ void ProgramVersion::print(Indent indent, ostream& str) const
 }
 
 void ProgramVersion::printInterface(
-    Indent indent, ProgramDefinition* def, ostream& str) const
+    Indent indent, ProgramDefinition* def, bool awaitable,
+    ostream& str) const
 {
     str << "constexpr int " << name_ << " = " << vers_ << ";" << endl;
     vector<string> methods;
@@ -155,7 +319,7 @@ void ProgramVersion::printInterface(
 
     for (const auto& proc: *this) {
         proc->printDeclaration(
-            indent, prefixlen, "virtual ", " = 0;", str);
+            indent, prefixlen, "virtual ", " = 0;", awaitable, str);
     }
     --indent;
 
@@ -163,7 +327,8 @@ void ProgramVersion::printInterface(
 }
 
 void ProgramVersion::printClientStubs(
-    Indent indent, ProgramDefinition* def, ostream& str) const
+    Indent indent, ProgramDefinition* def, bool awaitable,
+    ostream& str) const
 {
     vector<string> methods;
     for (const auto& proc: *this) {
@@ -225,11 +390,16 @@ void ProgramVersion::printClientStubs(
     str << indent << "auto channel() const { return channel_; }" << endl;
     str << indent << "auto client() const { return client_; }" << endl;
 
+    // If the service is in the same process, call it directly
+    string local = "channel_->localService<I" + className + ">("
+        + def->name() + ", " + name_ + ")";
     for (const auto& proc: *this) {
         proc->printDeclaration(
-            indent, prefixlen, "", " override", str);
-        proc->printClientBody(
-            indent, str);
+            indent, prefixlen, "", " override", awaitable, str);
+        if (awaitable)
+            proc->printAwaitableClientBody(indent, prefixlen, local, str);
+        else
+            proc->printClientBody(indent, prefixlen, local, str);
     }
     --indent;
 
@@ -244,7 +414,8 @@ void ProgramVersion::printClientStubs(
 }
 
 void ProgramVersion::printServerStubs(
-    Indent indent, ProgramDefinition* def, ostream& str) const
+    Indent indent, ProgramDefinition* def, bool awaitable,
+    ostream& str) const
 {
     vector<string> methods;
     for (const auto& proc: *this) {
@@ -264,6 +435,15 @@ void ProgramVersion::printServerStubs(
     ++indent;
     str << indent << "switch (ctx.proc()) {" << endl;
     for (auto proc: *this) {
+        if (awaitable) {
+            str << indent << "case " << proc->name() << ":" << endl;
+            ++indent;
+            str << indent << "oncrpc::spawn(dispatch_" << proc->name()
+                << "(std::move(ctx)));" << endl;
+            str << indent << "break;" << endl;
+            --indent;
+            continue;
+        }
         str << indent << "case " << proc->name() << ": {" << endl;
         ++indent;
         int i = 0;
@@ -333,6 +513,8 @@ void ProgramVersion::printServerStubs(
     str << indent << "svcreg->add(" << def->name() << ", " << name_ << ", "
         << "std::bind(&" << className << "Service::dispatch, this, "
         << "std::placeholders::_1));" << endl;
+    str << indent << "svcreg->addLocal<I" << className << ">("
+        << def->name() << ", " << name_ << ", this);" << endl;
     --indent;
     str << indent << "}" << endl << endl;
 
@@ -345,6 +527,17 @@ void ProgramVersion::printServerStubs(
     --indent;
     str << indent << "}" << endl;
 
+    if (awaitable) {
+        // Each call runs in its own coroutine which owns the call context
+        // until the reply is sent
+        --indent;
+        str << endl << indent << "private:" << endl;
+        ++indent;
+        for (auto proc: *this) {
+            proc->printAwaitableServerStub(indent, prefixlen, str);
+        }
+    }
+
     --indent;
     str << indent << "};" << endl << endl;
 }
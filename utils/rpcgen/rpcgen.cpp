@@ -41,7 +41,8 @@ using namespace std;
 
 [[noreturn]] void usage()
 {
-    cerr << "usage: rpcgen [-t] [-x] [-i] [-c] [-n namespace] file.x" << endl;
+    cerr << "usage: rpcgen [-t] [-x] [-i] [-c] [-s] [-a] [-v] [-n namespace]"
+         << " file.x" << endl;
     exit(1);
 }
 
@@ -53,10 +54,12 @@ main(int argc, char* const argv[])
     bool generateInterface = false;
     bool generateClient = false;
     bool generateServer = false;
+    bool awaitable = false;
+    bool views = false;
     vector<string> namespaces;
     int opt;
 
-    while ((opt = getopt(argc, argv, "txicsn:")) != -1) {
+    while ((opt = getopt(argc, argv, "txicsavn:")) != -1) {
         switch (opt) {
         case 't':
             generateTypes = true;
@@ -78,6 +81,14 @@ main(int argc, char* const argv[])
             generateServer = true;
             break;
 
+        case 'a':
+            awaitable = true;
+            break;
+
+        case 'v':
+            views = true;
+            break;
+
         case 'n':
             try {
                 namespaces = parseNamespaces(optarg);
@@ -111,6 +122,7 @@ main(int argc, char* const argv[])
     ostream& str = cout;
 
     Parser parser(argv[0], file, str);
+    parser.setViews(views);
     try {
         auto spec = parser.parse();
 
@@ -131,6 +143,9 @@ main(int argc, char* const argv[])
         if (generateServer) {
             str << "#include <rpc++/server.h>" << endl;
         }
+        if (awaitable) {
+            str << "#include <rpc++/coroutine.h>" << endl;
+        }
 
         for (const auto& ns: namespaces)
             str << "namespace " << ns << " {" << endl;
@@ -146,15 +161,15 @@ main(int argc, char* const argv[])
             spec->visit(&gen);
         }
         if (generateInterface) {
-            GenerateInterface gen(str);
+            GenerateInterface gen(str, awaitable);
             spec->visit(&gen);
         }
         if (generateClient) {
-            GenerateClient gen(str);
+            GenerateClient gen(str, awaitable);
             spec->visit(&gen);
         }
         if (generateServer) {
-            GenerateServer gen(str);
+            GenerateServer gen(str, awaitable);
             spec->visit(&gen);
         }
 
@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include <rpc++/client.h>
+#include <rpc++/coroutine.h>
+#include <rpc++/errors.h>
+#include <rpc++/server.h>
+
+#include "utils/rpcgen/test/test_coroutine.h"
+
+using namespace oncrpc;
+using namespace std;
+
+namespace {
+
+/// Suspends the awaiting coroutine until resume is called
+class Gate
+{
+public:
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) { handle_ = h; }
+    void await_resume() {}
+
+    bool waiting() const { return bool(handle_); }
+    void resume() { exchange(handle_, nullptr).resume(); }
+
+private:
+    coroutine_handle<> handle_;
+};
+
+class Test1Impl: public Test1Service
+{
+public:
+    Task<void> null() override
+    {
+        co_return;
+    }
+
+    Task<int32_t> echo(const int32_t& val) override
+    {
+        if (gate)
+            co_await *gate;
+        if (val < 0)
+            throw runtime_error("negative");
+        co_return val;
+    }
+
+    Task<foolist> list() override
+    {
+        co_return nullptr;
+    }
+
+    Task<bar> getbar() override
+    {
+        co_return bar(1, 2);
+    }
+
+    Task<int32_t> write(const writereq& req) override
+    {
+        int sum = 0;
+        auto p = req.buf->data();
+        auto sz = int(req.buf->size());
+        for (auto i = 0; i < sz; i++)
+            sum += p[i];
+        co_return sum;
+    }
+
+    Gate* gate = nullptr;
+};
+
+Task<void> echo(Test1<>& client, int32_t val, int32_t& res)
+{
+    res = co_await client.echo(val);
+}
+
+Task<void> echoError(Test1<>& client, int32_t val, exception_ptr& res)
+{
+    try {
+        co_await client.echo(val);
+    }
+    catch (...) {
+        res = current_exception();
+    }
+}
+
+class CoroutineTest: public ::testing::Test
+{
+public:
+    CoroutineTest()
+    {
+        svcreg = make_shared<ServiceRegistry>();
+        chan = make_shared<LocalChannel>(svcreg);
+        srv.bind(svcreg);
+    }
+
+    shared_ptr<ServiceRegistry> svcreg;
+    shared_ptr<LocalChannel> chan;
+    Test1Impl srv;
+};
+
+TEST_F(CoroutineTest, Call)
+{
+    Test1<> client(chan);
+    int32_t res = 0;
+    spawn(echo(client, 1234, res));
+    EXPECT_EQ(0, res);
+    chan->processReply();
+    EXPECT_EQ(1234, res);
+}
+
+TEST_F(CoroutineTest, DirectCall)
+{
+    // With direct calls, the stub awaits the handler without sending
+    // a message so there is no reply to process
+    chan->setDirectCalls(true);
+    Test1<> client(chan);
+    int32_t res = 0;
+    spawn(echo(client, 1234, res));
+    EXPECT_EQ(1234, res);
+}
+
+TEST_F(CoroutineTest, DeferredReply)
+{
+    // The handler suspends and replies later from another thread
+    Gate gate;
+    srv.gate = &gate;
+    Test1<> client(chan);
+    int32_t res = 0;
+    spawn(echo(client, 99, res));
+    ASSERT_TRUE(gate.waiting());
+    chan->processReply();
+    EXPECT_EQ(0, res);
+
+    thread t([&]() { gate.resume(); });
+    t.join();
+    chan->processReply();
+    EXPECT_EQ(99, res);
+}
+
+TEST_F(CoroutineTest, HandlerError)
+{
+    Test1<> client(chan);
+    exception_ptr res;
+    spawn(echoError(client, -1, res));
+    chan->processReply();
+    ASSERT_TRUE(bool(res));
+    EXPECT_THROW(rethrow_exception(res), SystemError);
+}
+
+}
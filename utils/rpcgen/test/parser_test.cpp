@@ -201,5 +201,36 @@ TEST_F(ParserTest, BasicTypes)
                     make_pair("h", Parser::boolType())))),
         *Parser(str, cerr).parse().get());
 }
+TEST_F(ParserTest, Views)
+{
+    istringstream str(
+        "struct foo { string a<>; string b<8>; opaque c<>; opaque d[4]; };");
+    Parser parser(str, cerr);
+    parser.setViews(true);
+    EXPECT_EQ(
+        Specification(
+            make_shared<StructDefinition>(
+                "foo",
+                make_shared<StructType>(
+                    make_pair("a", make_shared<StringType>(true)),
+                    make_pair(
+                        "b",
+                        make_shared<StringType>(
+                            make_shared<ConstantValue>(8), true)),
+                    make_pair("c", make_shared<OpaqueType>(true)),
+                    make_pair(
+                        "d",
+                        make_shared<OpaqueType>(
+                            make_shared<ConstantValue>(4), true))))),
+        *parser.parse().get());
+
+    ostringstream out;
+    make_shared<StringType>(true)->print(Indent(), out);
+    out << " ";
+    make_shared<OpaqueType>(make_shared<ConstantValue>(8), false, true)
+        ->print(Indent(), out);
+    EXPECT_EQ("oncrpc::xdr_string_view oncrpc::bounded_opaque_span<8>",
+              out.str());
+}
 
 }
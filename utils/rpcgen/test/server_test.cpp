@@ -96,6 +96,37 @@ TEST_F(ServerTest, Call)
     EXPECT_THROW(client.null(), ProgramUnavailable);
 }
 
+class RecordingImpl: public Test1Impl
+{
+public:
+    int32_t write(const writereq& req) override
+    {
+        lastBuf = req.buf.get();
+        return Test1Impl::write(req);
+    }
+
+    Buffer* lastBuf = nullptr;
+};
+
+TEST_F(ServerTest, CallLocal)
+{
+    // A LocalChannel should encode calls unless direct calls were
+    // requested, in which case arguments go straight to the service
+    auto chan = make_shared<LocalChannel>(svcreg);
+    auto srv = make_shared<RecordingImpl>();
+    srv->bind(svcreg);
+    Test1<> client(chan);
+
+    uint8_t buf[] = {1, 2, 3, 4};
+    writereq req{make_shared<Buffer>(4, buf)};
+    EXPECT_EQ(10, client.write(req));
+    EXPECT_NE(req.buf.get(), srv->lastBuf);
+
+    chan->setDirectCalls(true);
+    EXPECT_EQ(10, client.write(req));
+    EXPECT_EQ(req.buf.get(), srv->lastBuf);
+}
+
 TEST_F(ServerTest, CallRef)
 {
     auto chan = make_shared<LocalChannel>(svcreg);
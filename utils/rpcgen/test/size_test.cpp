@@ -0,0 +1,98 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <rpc++/xdr.h>
+
+#include "utils/rpcgen/test/test.h"
+
+using namespace oncrpc;
+using namespace std;
+
+namespace {
+
+static_assert(xdr_fixed_size(static_cast<const color*>(nullptr)) == 4,
+              "enums are one word");
+static_assert(xdr_fixed_size(static_cast<const point*>(nullptr)) == 20,
+              "point is fixed size");
+static_assert(xdr_fixed_size(static_cast<const shape*>(nullptr)) == 0,
+              "shape is variable sized");
+static_assert(xdr_fixed_size(static_cast<const foo*>(nullptr)) == 0,
+              "foo is variable sized");
+
+template <typename T>
+size_t encodedSize(const T& v)
+{
+    XdrMemory xm(4096);
+    xdr(v, static_cast<XdrSink*>(&xm));
+    return xm.writePos();
+}
+
+class SizeTest: public ::testing::Test
+{
+};
+
+TEST_F(SizeTest, Struct)
+{
+    point p{1, 2, GREEN, {{1, 2, 3}}};
+    EXPECT_EQ(20, xdr_size(p));
+    EXPECT_EQ(encodedSize(p), xdr_size(p));
+
+    foo f;
+    f.bar = "hello";
+    f.next = make_unique<foo>();
+    f.next->bar = "world!";
+    EXPECT_EQ(encodedSize(f), xdr_size(f));
+    EXPECT_EQ(encodedSize(f), XdrSizeof(f));
+}
+
+TEST_F(SizeTest, Union)
+{
+    bar b0(0, foo());
+    b0.x().bar = "xyz";
+    EXPECT_EQ(encodedSize(b0), xdr_size(b0));
+    bar b1(1, 42);
+    EXPECT_EQ(8, xdr_size(b1));
+    bar b2(2);
+    EXPECT_EQ(4, xdr_size(b2));
+}
+
+TEST_F(SizeTest, Nested)
+{
+    shape s;
+    s.points.resize(3);
+    s.name = "triangle";
+    s.label = bar(1, 99);
+    EXPECT_EQ(4 + 3 * 20 + 12 + 8, xdr_size(s));
+    EXPECT_EQ(encodedSize(s), xdr_size(s));
+
+    writereq w;
+    w.buf = make_shared<Buffer>(13);
+    EXPECT_EQ(20, xdr_size(w));
+}
+
+}
@@ -17,6 +17,25 @@ struct writereq {
     opaqueref buf<>;
 };
 
+enum color {
+    RED = 0,
+    GREEN = 1,
+    BLUE = 2
+};
+
+struct point {
+    int x;
+    unsigned hyper y;
+    color c;
+    opaque tag[3];
+};
+
+struct shape {
+    point points<>;
+    string name<16>;
+    bar label;
+};
+
 program TEST {
     version TEST_1 {
         void TEST_NULL(void) = 0;
@@ -0,0 +1,73 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <rpc++/xdr.h>
+
+#include "utils/rpcgen/test/test_views.h"
+
+using namespace oncrpc;
+using namespace std;
+
+namespace {
+
+class ViewsTest: public ::testing::Test
+{
+};
+
+TEST_F(ViewsTest, Decode)
+{
+    auto xm = make_unique<XdrMemory>(512);
+    shape s0;
+    s0.points.push_back(point{1, 2, GREEN, {{1, 2, 3}}});
+    s0.name = "triangle";
+    s0.label = bar(0, foo());
+    s0.label.x().bar = "a label";
+    xdr(s0, static_cast<XdrSink*>(xm.get()));
+    EXPECT_EQ(xdr_size(s0), xm->writePos());
+
+    shape s1;
+    xdr(s1, static_cast<XdrSource*>(xm.get()));
+    ASSERT_EQ(1, s1.points.size());
+    EXPECT_EQ(GREEN, s1.points[0].c);
+    EXPECT_EQ(s0.name, s1.name);
+    EXPECT_EQ(s0.label.x().bar, s1.label.x().bar);
+
+    // The strings should be views of the decode buffer
+    auto buf = xm->buf();
+    EXPECT_GE(s1.name.data(), reinterpret_cast<const char*>(buf));
+    EXPECT_LT(s1.name.data(), reinterpret_cast<const char*>(buf + 512));
+
+    // and should keep it alive after the decoder is reused or destroyed
+    xm->rewind();
+    EXPECT_NE(buf, xm->buf());
+    xm.reset();
+    EXPECT_EQ("triangle", s1.name.str());
+    EXPECT_EQ("a label", s1.label.x().bar.str());
+}
+
+}
@@ -386,14 +386,18 @@ public:
 class OpaqueType: public Type
 {
 public:
-    OpaqueType()
-        : isFixed_(false)
+    /// If isView is true, variable length opaque data is decoded into
+    /// an oncrpc::xdr_opaque_span instead of being copied
+    explicit OpaqueType(bool isView = false)
+        : isFixed_(false),
+          isView_(isView)
     {
     }
 
-    OpaqueType(shared_ptr<Value>&& size, bool isFixed)
+    OpaqueType(shared_ptr<Value>&& size, bool isFixed, bool isView = false)
         : size_(move(size)),
-          isFixed_(isFixed)
+          isFixed_(isFixed),
+          isView_(isView && !isFixed)
     {
     }
 
@@ -406,6 +410,10 @@ public:
     {
         if (isFixed_)
             str << "std::array<std::uint8_t, " << *size_ << ">";
+        else if (isView_ && size_)
+            str << "oncrpc::bounded_opaque_span<" << *size_ << ">";
+        else if (isView_)
+            str << "oncrpc::xdr_opaque_span";
         else if (size_)
             str << "oncrpc::bounded_vector<std::uint8_t, " << *size_ << ">";
         else
@@ -418,13 +426,15 @@ public:
         if (p)
             return (((size_ == nullptr && p->size_ == nullptr)
 		     || *size_.get() == *p->size_.get())
-		    && isFixed_ == p->isFixed_);
+		    && isFixed_ == p->isFixed_
+		    && isView_ == p->isView_);
         return false;
     }
 
 private:
     shared_ptr<Value> size_;
     bool isFixed_;
+    bool isView_;
 };
 
 class OpaqueRefType: public Type
@@ -465,12 +475,16 @@ private:
 class StringType: public Type
 {
 public:
-    StringType()
+    /// If isView is true, the string is decoded into an
+    /// oncrpc::xdr_string_view instead of being copied
+    explicit StringType(bool isView = false)
+        : isView_(isView)
     {
     }
 
-    StringType(shared_ptr<Value>&& size)
-        : size_(move(size))
+    StringType(shared_ptr<Value>&& size, bool isView = false)
+        : size_(move(size)),
+          isView_(isView)
     {
     }
 
@@ -481,7 +495,11 @@ public:
 
     void print(Indent indent, ostream& str) const override
     {
-        if (size_)
+        if (isView_ && size_)
+            str << "oncrpc::bounded_string_view<" << *size_ << ">";
+        else if (isView_)
+            str << "oncrpc::xdr_string_view";
+        else if (size_)
             str << "oncrpc::bounded_string<" << *size_ << ">";
         else
             str << "std::string";
@@ -491,12 +509,15 @@ public:
     {
         auto p = dynamic_cast<const StringType*>(&other);
         if (p)
-            return *size_.get() == *p->size_.get();
+            return ((size_ == nullptr && p->size_ == nullptr)
+                    || (size_ && p->size_ && *size_ == *p->size_))
+                && isView_ == p->isView_;
         return false;
     }
 
 private:
     shared_ptr<Value> size_;
+    bool isView_;
 };
 
 class ArrayType: public Type